@@ -22,7 +22,11 @@
 
 #include "allocationprofiler.h"
 
-#ifdef _WIN32
+#if defined(_WIN32) || __has_include(<execinfo.h>)
+#define TRIMJA_HAS_ALLOCATIONPROFILER
+#endif
+
+#ifdef TRIMJA_HAS_ALLOCATIONPROFILER
 #include <boost/boost_unordered.hpp>
 
 #include <algorithm>
@@ -32,6 +36,7 @@
 #include <stdexcept>
 #include <vector>
 
+#ifdef _WIN32
 // <windows.h> must be included before <dbghelp.h>.
 #include <windows.h>
 
@@ -40,6 +45,24 @@
 #include <stdio.h>
 
 #pragma comment(lib, "dbghelp.lib")
+#else
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <new>
+
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+
+#ifdef __APPLE__
+#include <malloc/malloc.h>
+#else
+#include <malloc.h>
+#endif
+#endif
 
 namespace trimja {
 
@@ -65,6 +88,11 @@ struct StackEq {
   }
 };
 
+using StackCounts = boost::unordered_flat_map<std::vector<const void*>,
+                                              std::size_t,
+                                              StackHash,
+                                              StackEq>;
+
 void printBytes(std::ostream& out, std::size_t bytes) {
   const std::string_view suffixes[] = {
       "B", "KiB", "MiB", "GiB", "TiB", "PiB", "EiB", "ZiB",
@@ -86,12 +114,34 @@ void printBytes(std::ostream& out, std::size_t bytes) {
   }
 }
 
+// Print the `top` stacks in `allocations` with the most allocations, calling
+// `printFrame` to print each frame
+template <typename PRINT_FRAME>
+void printTop(std::ostream& out,
+              const StackCounts& allocations,
+              std::size_t top,
+              PRINT_FRAME&& printFrame) {
+  std::vector<std::pair<std::span<const void* const>, std::size_t>>
+      topAllocations(allocations.size());
+  std::copy(allocations.cbegin(), allocations.cend(), topAllocations.begin());
+  const auto topEnd =
+      topAllocations.begin() + std::min(top, allocations.size());
+  std::partial_sort(
+      topAllocations.begin(), topEnd, topAllocations.end(),
+      [](const auto& lhs, const auto& rhs) { return lhs.second > rhs.second; });
+
+  for (auto it = topAllocations.begin(); it != topEnd; ++it) {
+    out << it->second << " allocations\n";
+    for (const void* frame : it->first) {
+      printFrame(frame);
+    }
+    out << '\n';
+  }
+}
+
+#ifdef _WIN32
 bool s_collect = false;
-boost::unordered_flat_map<std::vector<const void*>,
-                          std::size_t,
-                          StackHash,
-                          StackEq>
-    s_allocations;
+StackCounts s_allocations;
 std::vector<const void*> s_tmp(62);
 std::size_t s_totalAllocated = 0;
 
@@ -116,9 +166,125 @@ int hook([[maybe_unused]] int allocType,
 
   return TRUE;
 }
+#else
+// Allocations are recorded from any thread through the replacement
+// `operator new` below, so the state is either atomic or guarded by
+// `s_mutex`.  `t_inHook` stops us recording allocations made while
+// recording, such as those by `s_allocations` or the first `backtrace`.
+std::atomic<bool> s_collect = false;
+std::mutex s_mutex;
+StackCounts* s_allocations = nullptr;
+std::vector<const void*>* s_tmp = nullptr;
+std::atomic<std::size_t> s_totalAllocated = 0;
+std::atomic<std::int64_t> s_liveBytes = 0;
+std::atomic<std::int64_t> s_peakLiveBytes = 0;
+thread_local bool t_inHook = false;
+
+// Return the number of bytes reserved by `malloc` for `ptr`, which is used
+// to track live bytes as global `operator delete` isn't always given a size
+std::size_t usableSize(void* ptr) {
+#ifdef __APPLE__
+  return malloc_size(ptr);
+#else
+  return malloc_usable_size(ptr);
+#endif
+}
+
+// Record the allocation of `size` bytes at `ptr`
+void recordAllocation(void* ptr, std::size_t size) {
+  if (!s_collect.load(std::memory_order_relaxed) || t_inHook) {
+    return;
+  }
+  t_inHook = true;
+
+  s_totalAllocated.fetch_add(size, std::memory_order_relaxed);
+  const std::int64_t live =
+      s_liveBytes.fetch_add(usableSize(ptr), std::memory_order_relaxed) +
+      static_cast<std::int64_t>(usableSize(ptr));
+  std::int64_t peak = s_peakLiveBytes.load(std::memory_order_relaxed);
+  while (live > peak && !s_peakLiveBytes.compare_exchange_weak(
+                            peak, live, std::memory_order_relaxed)) {
+  }
+
+  void* stack[62];
+  const int count = backtrace(stack, 62);
+  {
+    // Skip the frame for this function, which is the same for every stack
+    const std::lock_guard lock{s_mutex};
+    s_tmp->assign(stack + std::min(count, 1), stack + count);
+    s_allocations->try_emplace(*s_tmp, 0).first->second++;
+  }
+  t_inHook = false;
+}
+
+// Record the deallocation of `ptr`
+void recordDeallocation(void* ptr) {
+  if (ptr && s_collect.load(std::memory_order_relaxed) && !t_inHook) {
+    s_liveBytes.fetch_sub(usableSize(ptr), std::memory_order_relaxed);
+  }
+}
+
+// Return `size` bytes aligned to `alignment` in the same way as the default
+// `operator new`, or nullptr if allocation failed and `nothrow` is set
+void* allocate(std::size_t size, std::size_t alignment, bool nothrow) {
+  size = std::max<std::size_t>(size, 1);
+  for (;;) {
+    void* ptr = nullptr;
+    if (alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+      ptr = std::malloc(size);
+    } else if (posix_memalign(&ptr, std::max(alignment, sizeof(void*)),
+                              size) != 0) {
+      ptr = nullptr;
+    }
+
+    if (ptr) {
+      recordAllocation(ptr, size);
+      return ptr;
+    }
+
+    const std::new_handler handler = std::get_new_handler();
+    if (!handler) {
+      if (nothrow) {
+        return nullptr;
+      }
+      throw std::bad_alloc{};
+    }
+    handler();
+  }
+}
+
+void deallocate(void* ptr) noexcept {
+  recordDeallocation(ptr);
+  std::free(ptr);
+}
+
+// Print the function containing `frame` along with its offset in the module
+// containing it, which can be passed to `addr2line` to get the line number
+void printFrame(std::ostream& out, const void* frame) {
+  Dl_info info;
+  if (dladdr(frame, &info) == 0) {
+    out << "  - " << frame << "\n";
+    return;
+  }
+
+  out << "  - ";
+  if (info.dli_sname) {
+    int status = 0;
+    const std::unique_ptr<char, decltype(&std::free)> demangled{
+        abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status),
+        &std::free};
+    out << (status == 0 ? demangled.get() : info.dli_sname) << " in ";
+  }
+  out << (info.dli_fname ? info.dli_fname : "???") << "+0x" << std::hex
+      << (static_cast<const char*>(frame) -
+          static_cast<const char*>(info.dli_fbase))
+      << std::dec << "\n";
+}
+#endif
 
 }  // namespace
 
+#ifdef _WIN32
 void AllocationProfiler::start() {
   if (SymInitialize(GetCurrentProcess(), nullptr, TRUE) == FALSE) {
     throw std::runtime_error("Failed to call SymInitialize.");
@@ -137,42 +303,157 @@ void AllocationProfiler::print(std::ostream& out, std::size_t top) {
     return;
   }
 
-  std::vector<std::pair<std::span<const void* const>, std::size_t>>
-      topAllocations(s_allocations.size());
-  std::copy(s_allocations.cbegin(), s_allocations.cend(),
-            topAllocations.begin());
-  const auto topEnd =
-      topAllocations.begin() + std::min(top, s_allocations.size());
-  std::partial_sort(
-      topAllocations.begin(), topEnd, topAllocations.end(),
-      [](const auto& lhs, const auto& rhs) { return lhs.second > rhs.second; });
-
   const HANDLE process = GetCurrentProcess();
-  for (auto it = topAllocations.begin(); it != topEnd; ++it) {
-    out << it->second << " allocations\n";
-    for (const void* frame : it->first) {
-      const DWORD64 address = std::bit_cast<DWORD64>(frame);
-      char buffer[sizeof(SYMBOL_INFO) + MAX_SYM_NAME * sizeof(TCHAR)];
-      PSYMBOL_INFO symbol = reinterpret_cast<PSYMBOL_INFO>(buffer);
-      symbol->SizeOfStruct = sizeof(SYMBOL_INFO);
-      symbol->MaxNameLen = MAX_SYM_NAME;
-
-      if (SymFromAddr(process, address, nullptr, symbol) == TRUE) {
-        IMAGEHLP_LINE64 line;
-        DWORD displacement;
-        if (SymGetLineFromAddr64(process, address, &displacement, &line) ==
-            TRUE) {
-          out << "  - " << &symbol->Name[0] << " at " << line.FileName << ":"
-              << line.LineNumber << "\n";
-        }
+  printTop(out, s_allocations, top, [&](const void* frame) {
+    const DWORD64 address = std::bit_cast<DWORD64>(frame);
+    char buffer[sizeof(SYMBOL_INFO) + MAX_SYM_NAME * sizeof(TCHAR)];
+    PSYMBOL_INFO symbol = reinterpret_cast<PSYMBOL_INFO>(buffer);
+    symbol->SizeOfStruct = sizeof(SYMBOL_INFO);
+    symbol->MaxNameLen = MAX_SYM_NAME;
+
+    if (SymFromAddr(process, address, nullptr, symbol) == TRUE) {
+      IMAGEHLP_LINE64 line;
+      DWORD displacement;
+      if (SymGetLineFromAddr64(process, address, &displacement, &line) ==
+          TRUE) {
+        out << "  - " << &symbol->Name[0] << " at " << line.FileName << ":"
+            << line.LineNumber << "\n";
       }
     }
-    out << '\n';
+  });
+  s_collect = true;
+}
+#else
+void AllocationProfiler::start() {
+  if (s_collect) {
+    return;
+  }
+
+  // Create our state and call `backtrace` once before collecting, as the
+  // first call may load the unwinder and allocate
+  t_inHook = true;
+  if (!s_allocations) {
+    s_allocations = new StackCounts;
+    s_tmp = new std::vector<const void*>(62);
   }
+  void* stack[1];
+  backtrace(stack, 1);
+  t_inHook = false;
   s_collect = true;
 }
 
+void AllocationProfiler::print(std::ostream& out, std::size_t top) {
+  s_collect = false;
+  out << "Total allocated: ";
+  printBytes(out, s_totalAllocated);
+  out << "\nPeak live: ";
+  printBytes(out, static_cast<std::size_t>(std::max<std::int64_t>(
+                      s_peakLiveBytes.load(), 0)));
+  out << "\n\n";
+  if (top != 0 && s_allocations) {
+    const std::lock_guard lock{s_mutex};
+    printTop(out, *s_allocations, top,
+             [&](const void* frame) { printFrame(out, frame); });
+  }
+  s_collect = true;
+}
+#endif
+
 }  // namespace trimja
+
+#ifndef _WIN32
+// Replace the global allocation functions so that we can record allocations
+// when `AllocationProfiler` has been started.  While it hasn't been started
+// these only cost an extra branch over the default implementations.
+
+void* operator new(std::size_t size) {
+  return trimja::allocate(size, 0, false);
+}
+
+void* operator new[](std::size_t size) {
+  return trimja::allocate(size, 0, false);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+  return trimja::allocate(size, 0, true);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+  return trimja::allocate(size, 0, true);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment) {
+  return trimja::allocate(size, static_cast<std::size_t>(alignment), false);
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+  return trimja::allocate(size, static_cast<std::size_t>(alignment), false);
+}
+
+void* operator new(std::size_t size,
+                   std::align_val_t alignment,
+                   const std::nothrow_t&) noexcept {
+  return trimja::allocate(size, static_cast<std::size_t>(alignment), true);
+}
+
+void* operator new[](std::size_t size,
+                     std::align_val_t alignment,
+                     const std::nothrow_t&) noexcept {
+  return trimja::allocate(size, static_cast<std::size_t>(alignment), true);
+}
+
+void operator delete(void* ptr) noexcept {
+  trimja::deallocate(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+  trimja::deallocate(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+  trimja::deallocate(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept {
+  trimja::deallocate(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+  trimja::deallocate(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+  trimja::deallocate(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept {
+  trimja::deallocate(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+  trimja::deallocate(ptr);
+}
+
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept {
+  trimja::deallocate(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept {
+  trimja::deallocate(ptr);
+}
+
+void operator delete(void* ptr,
+                     std::align_val_t,
+                     const std::nothrow_t&) noexcept {
+  trimja::deallocate(ptr);
+}
+
+void operator delete[](void* ptr,
+                       std::align_val_t,
+                       const std::nothrow_t&) noexcept {
+  trimja::deallocate(ptr);
+}
+#endif
 #else
 
 #include <stdexcept>
@@ -32,8 +32,11 @@ namespace trimja {
  * @brief The AllocationProfiler class provides functionality to start
  *        and print allocation profiling information.
  *
- * Note that AllocationProfiler will not work in a multi-threaded environment
- * and only has implementation inside Windows.
+ * On Windows this uses the debug CRT allocation hook and will not work in a
+ * multi-threaded environment.  Elsewhere this replaces the global
+ * `operator new` and `operator delete`, records allocations from any thread,
+ * and also tracks the peak number of live bytes.  It is not supported on
+ * platforms without `<execinfo.h>`.
  */
 struct AllocationProfiler {
   /**
@@ -42,7 +45,8 @@ struct AllocationProfiler {
    * This function initializes the symbol handler and sets the allocation hook
    * to start collecting allocation data.
    *
-   * @throws std::runtime_error if SymInitialize fails.
+   * @throws std::runtime_error if SymInitialize fails or memory profiling is
+   * not supported on this platform.
    */
   static void start();
 
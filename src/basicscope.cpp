@@ -28,35 +28,23 @@ BasicScope::BasicScope() = default;
 
 BasicScope::BasicScope(BasicScope&&) noexcept = default;
 
-BasicScope::BasicScope(const BasicScope& other) {
-  for (const auto& [name, value] : other.m_variables) {
-    m_variables.emplace(name.view(), value);
-  }
-}
+BasicScope::BasicScope(const BasicScope&) = default;
 
 BasicScope& BasicScope::operator=(BasicScope&&) noexcept = default;
 
-BasicScope& BasicScope::operator=(const BasicScope& rhs) {
-  BasicScope tmp{rhs};
-  using std::swap;
-  swap(m_variables, tmp.m_variables);
-  return *this;
-}
+BasicScope& BasicScope::operator=(const BasicScope&) = default;
 
-std::string_view BasicScope::set(std::string_view key, std::string&& value) {
-  // By design to avoid accidental copies, `fixed_string` does not have a copy
-  // constructor so we cannot use `operator[]`.  Instead we can use `emplace` to
-  // achieve basically the same performance.
+std::string_view BasicScope::set(VariableName key, std::string&& value) {
   return m_variables.try_emplace(key, std::move(value)).first->second;
 }
 
-std::string& BasicScope::resetValue(std::string_view key) {
+std::string& BasicScope::resetValue(VariableName key) {
   std::string& value = m_variables.try_emplace(key, "").first->second;
   value.clear();
   return value;
 }
 
-bool BasicScope::appendValue(std::string& output, std::string_view name) const {
+bool BasicScope::appendValue(std::string& output, VariableName name) const {
   const auto it = m_variables.find(name);
   if (it == m_variables.end()) {
     return false;
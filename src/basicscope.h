@@ -23,7 +23,7 @@
 #ifndef TRIMJA_BASICSCOPE
 #define TRIMJA_BASICSCOPE
 
-#include "fixed_string.h"
+#include "variablename.h"
 
 #include <boost/boost_unordered.hpp>
 
@@ -37,10 +37,7 @@ namespace trimja {
  * @brief Manages a scope of variables for evaluation and substitution.
  */
 class BasicScope {
-  boost::unordered_flat_map<fixed_string,
-                            std::string,
-                            std::hash<trimja::fixed_string>>
-      m_variables;
+  boost::unordered_flat_map<VariableName, std::string> m_variables;
 
  public:
   /**
@@ -80,7 +77,7 @@ class BasicScope {
    * @param value The value of the variable.
    * @return A reference to the inserted value.
    */
-  std::string_view set(std::string_view key, std::string&& value);
+  std::string_view set(VariableName key, std::string&& value);
 
   /**
    * @brief Resets the value of a variable in the scope.
@@ -91,7 +88,7 @@ class BasicScope {
    * @param key The name of the variable to reset.
    * @return A reference to the reset value.
    */
-  std::string& resetValue(std::string_view key);
+  std::string& resetValue(VariableName key);
 
   /**
    * @brief Appends the value of a variable to the output string.
@@ -99,7 +96,7 @@ class BasicScope {
    * @param name The name of the variable.
    * @return Whether the variable was found in this scope.
    */
-  bool appendValue(std::string& output, std::string_view name) const;
+  bool appendValue(std::string& output, VariableName name) const;
 
   /**
    * @brief Returns an iterator to the beginning of the variables.
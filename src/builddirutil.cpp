@@ -25,9 +25,8 @@
 #include "basicscope.h"
 #include "cpuprofiler.h"
 #include "manifestparser.h"
+#include "mappedfile.h"
 
-#include <fstream>
-#include <sstream>
 #include <variant>
 
 namespace trimja {
@@ -46,10 +45,41 @@ class BuildDirContext {
     }
   }
 
+  // Only top-level variables and `include` can change `builddir`, so skip
+  // every other statement line by line without lexing it, along with the
+  // indented variables of `build`, `rule` and `pool`
   void parse(const std::filesystem::path& ninjaFile,
-             const std::string& ninjaFileContents) {
-    for (auto&& part : ManifestReader(ninjaFile, ninjaFileContents)) {
+             std::string_view ninjaFileContents) {
+    const char* const begin = ninjaFileContents.data();
+    const char* const end = begin + ninjaFileContents.size();
+    const char* line = begin;
+    while (line != end) {
+      const char* first = line;
+      while (first != end && *first == ' ') {
+        ++first;
+      }
+      const bool isComment = first != end && *first == '#';
+      const bool isBlank = first == end || *first == '\n' || *first == '\r';
+      if (isComment || isBlank || first != line ||
+          startsWithKeyword(line, end, "build") ||
+          startsWithKeyword(line, end, "rule") ||
+          startsWithKeyword(line, end, "default") ||
+          startsWithKeyword(line, end, "pool") ||
+          startsWithKeyword(line, end, "subninja")) {
+        line = endOfLine(line, end, isComment);
+        continue;
+      }
+
+      ManifestReader reader{ninjaFile, ninjaFileContents,
+                            static_cast<std::size_t>(line - begin)};
+      auto it = reader.begin();
+      if (it == reader.end()) {
+        break;
+      }
+      auto part = *it;
       std::visit(*this, part);
+      line = std::visit(
+          [](const auto& r) { return r.start() + r.bytesParsed(); }, part);
     }
   }
 
@@ -71,7 +101,8 @@ class BuildDirContext {
   void operator()(DefaultReader& r) const { consume(r.readPaths()); }
 
   void operator()(const VariableReader& r) {
-    evaluate(fileScope.resetValue(r.name()), r.value(), fileScope);
+    evaluate(fileScope.resetValue(VariableName::intern(r.name())), r.value(),
+             fileScope);
   }
 
   void operator()(const IncludeReader& r) {
@@ -89,10 +120,8 @@ class BuildDirContext {
       msg += "!";
       throw std::runtime_error(msg);
     }
-    std::stringstream ninjaCopy;
-    std::ifstream ninja(file);
-    ninjaCopy << ninja.rdbuf();
-    parse(file, ninjaCopy.str());
+    const MappedFile ninja{file};
+    parse(file, ninja.contents());
   }
 
   void operator()(const SubninjaReader&) const {
@@ -109,7 +138,7 @@ BuildDirUtil::~BuildDirUtil() = default;
 
 std::filesystem::path BuildDirUtil::builddir(
     const std::filesystem::path& ninjaFile,
-    const std::string& ninjaFileContents) {
+    std::string_view ninjaFileContents) {
   // Keep our state inside `m_imp` so that we defer cleanup until the destructor
   // of `BuildDirUtil`. This allows the calling code to skip all destructors
   // when calling `std::_Exit`.
@@ -119,7 +148,7 @@ std::filesystem::path BuildDirUtil::builddir(
     m_imp->parse(ninjaFile, ninjaFileContents);
   }
   std::string builddir;
-  m_imp->fileScope.appendValue(builddir, "builddir");
+  m_imp->fileScope.appendValue(builddir, VariableName::Builddir);
   return std::filesystem::path(ninjaFile).remove_filename() / builddir;
 }
 
@@ -24,7 +24,8 @@
 #define TRIMJA_BUILDDIRUTIL
 
 #include <filesystem>
-#include <string>
+#include <memory>
+#include <string_view>
 
 namespace trimja {
 
@@ -54,11 +55,12 @@ class BuildDirUtil {
    * @brief Determines the build directory from the given Ninja file and its
    * contents.
    * @param ninjaFile The path to the Ninja file.
-   * @param ninjaFileContents The contents of the Ninja file.
+   * @param ninjaFileContents The contents of the Ninja file, which must be
+   * followed by a null character.
    * @return The path to the build directory.
    */
   std::filesystem::path builddir(const std::filesystem::path& ninjaFile,
-                                 const std::string& ninjaFileContents);
+                                 std::string_view ninjaFileContents);
 };
 
 }  // namespace trimja
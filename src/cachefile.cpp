@@ -0,0 +1,104 @@
+// MIT License
+//
+// Copyright (c) 2024 Elliot Goodrich
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "cachefile.h"
+
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+namespace trimja {
+
+namespace {
+
+[[noreturn]] void throwTruncated() {
+  throw std::runtime_error("Unexpected end of cache file");
+}
+
+}  // namespace
+
+CacheWriter::CacheWriter() = default;
+
+void CacheWriter::writeWord(std::uint64_t value) {
+  const std::size_t size = m_buffer.size();
+  m_buffer.resize(size + sizeof(value));
+  std::memcpy(m_buffer.data() + size, &value, sizeof(value));
+}
+
+void CacheWriter::writeString(std::string_view value) {
+  writeWord(value.size());
+  m_buffer.append(value);
+}
+
+void CacheWriter::save(const std::filesystem::path& file) const {
+  std::filesystem::path temporary = file;
+  temporary += ".tmp";
+  {
+    std::ofstream out{temporary, std::ios_base::binary};
+    out.write(m_buffer.data(), m_buffer.size());
+    out.flush();
+    if (!out) {
+      throw std::runtime_error{"Unable to write to " + temporary.string()};
+    }
+  }
+  std::error_code ec;
+  std::filesystem::rename(temporary, file, ec);
+  if (ec) {
+    std::string msg;
+    msg += "Unable to rename ";
+    msg += temporary.string();
+    msg += " to ";
+    msg += file.string();
+    msg += ": ";
+    msg += ec.message();
+    throw std::runtime_error(msg);
+  }
+}
+
+CacheReader::CacheReader(std::string_view contents)
+    : m_current{contents.data()}, m_end{contents.data() + contents.size()} {}
+
+std::uint64_t CacheReader::readWord() {
+  std::uint64_t value;
+  if (static_cast<std::size_t>(m_end - m_current) < sizeof(value)) {
+    throwTruncated();
+  }
+  std::memcpy(&value, m_current, sizeof(value));
+  m_current += sizeof(value);
+  return value;
+}
+
+std::string_view CacheReader::readString() {
+  const std::uint64_t size = readWord();
+  if (static_cast<std::uint64_t>(m_end - m_current) < size) {
+    throwTruncated();
+  }
+  const std::string_view value{m_current, static_cast<std::size_t>(size)};
+  m_current += size;
+  return value;
+}
+
+bool CacheReader::empty() const {
+  return m_current == m_end;
+}
+
+}  // namespace trimja
@@ -0,0 +1,111 @@
+// MIT License
+//
+// Copyright (c) 2024 Elliot Goodrich
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef TRIMJA_CACHEFILE
+#define TRIMJA_CACHEFILE
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+
+namespace trimja {
+
+/**
+ * @class CacheWriter
+ * @brief Builds up the contents of a binary cache file made up of 64-bit
+ * words and length-prefixed strings.
+ */
+class CacheWriter {
+  std::string m_buffer;
+
+ public:
+  /**
+   * @brief Constructs an empty CacheWriter.
+   */
+  CacheWriter();
+
+  /**
+   * @brief Appends a word.
+   * @param value The value to append.
+   */
+  void writeWord(std::uint64_t value);
+
+  /**
+   * @brief Appends a string, prefixed by its length.
+   * @param value The string to append.
+   */
+  void writeString(std::string_view value);
+
+  /**
+   * @brief Writes everything appended so far to the specified file.
+   *
+   * The contents are first written to a temporary file next to `file`, which
+   * is then renamed over `file` so that no reader sees a partial cache.
+   *
+   * @param file The path of the file to write.
+   * @throws std::runtime_error if the file cannot be written.
+   */
+  void save(const std::filesystem::path& file) const;
+};
+
+/**
+ * @class CacheReader
+ * @brief Reads the words and strings written by `CacheWriter`.
+ *
+ * All strings returned are views into the contents passed to the constructor.
+ */
+class CacheReader {
+  const char* m_current;
+  const char* m_end;
+
+ public:
+  /**
+   * @brief Constructs a CacheReader over the specified contents.
+   * @param contents The contents of a cache file.
+   */
+  explicit CacheReader(std::string_view contents);
+
+  /**
+   * @brief Reads the next word.
+   * @return The word read.
+   * @throws std::runtime_error if the contents are truncated.
+   */
+  std::uint64_t readWord();
+
+  /**
+   * @brief Reads the next length-prefixed string.
+   * @return A view of the string read.
+   * @throws std::runtime_error if the contents are truncated.
+   */
+  std::string_view readString();
+
+  /**
+   * @brief Returns whether all the contents have been read.
+   * @return Whether there is nothing left to read.
+   */
+  bool empty() const;
+};
+
+}  // namespace trimja
+
+#endif  // TRIMJA_CACHEFILE
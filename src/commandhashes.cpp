@@ -0,0 +1,110 @@
+// MIT License
+//
+// Copyright (c) 2024 Elliot Goodrich
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "commandhashes.h"
+
+#include "cachefile.h"
+
+#include <stdexcept>
+
+namespace trimja {
+
+namespace {
+
+// The first string in every sidecar file, which needs to be changed whenever
+// the layout or the way fingerprints are calculated changes
+const std::string_view SIDECAR_SIGNATURE = "trimja command hashes v1";
+
+}  // namespace
+
+CommandHashes::CommandHashes() : m_file{}, m_entries{} {}
+
+void CommandHashes::load(const std::filesystem::path& file,
+                         HashType hashType) {
+  m_entries.clear();
+  m_file.reset();
+  if (!std::filesystem::exists(file)) {
+    return;
+  }
+
+  try {
+    m_file = MappedFile{file};
+    CacheReader reader{m_file.contents()};
+    if (reader.readString() != SIDECAR_SIGNATURE ||
+        reader.readWord() != static_cast<std::uint64_t>(hashType)) {
+      return;
+    }
+    const std::size_t count = reader.readWord();
+    m_entries.reserve(count);
+    for (std::size_t i = 0; i < count; ++i) {
+      const std::string_view out = reader.readString();
+      const std::uint64_t fingerprint = reader.readWord();
+      const std::uint64_t hash = reader.readWord();
+      m_entries.insert_or_assign(out, Value{fingerprint, hash});
+    }
+    if (!reader.empty()) {
+      throw std::runtime_error("Inconsistent sidecar file");
+    }
+  } catch (const std::exception&) {
+    // Treat any corrupt file as if it did not exist
+    m_entries.clear();
+  }
+}
+
+std::optional<std::uint64_t> CommandHashes::find(
+    std::string_view out,
+    std::uint64_t fingerprint) const {
+  const auto it = m_entries.find(out);
+  if (it == m_entries.end() || it->second.fingerprint != fingerprint) {
+    return std::nullopt;
+  }
+  return it->second.hash;
+}
+
+std::size_t CommandHashes::size() const {
+  return m_entries.size();
+}
+
+void CommandHashes::save(const std::filesystem::path& file,
+                         HashType hashType,
+                         std::span<const Entry> entries) {
+  CacheWriter writer;
+  writer.writeString(SIDECAR_SIGNATURE);
+  writer.writeWord(static_cast<std::uint64_t>(hashType));
+  writer.writeWord(entries.size());
+  for (const Entry& entry : entries) {
+    writer.writeString(entry.out);
+    writer.writeWord(entry.fingerprint);
+    writer.writeWord(entry.hash);
+  }
+  writer.save(file);
+}
+
+std::filesystem::path CommandHashes::sidecarFor(
+    const std::filesystem::path& ninjaLog) {
+  std::filesystem::path file = ninjaLog;
+  file += ".trimja";
+  return file;
+}
+
+}  // namespace trimja
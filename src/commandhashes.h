@@ -0,0 +1,130 @@
+// MIT License
+//
+// Copyright (c) 2024 Elliot Goodrich
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef TRIMJA_COMMANDHASHES
+#define TRIMJA_COMMANDHASHES
+
+#include "logreader.h"
+#include "mappedfile.h"
+
+#include <boost/boost_unordered.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <string_view>
+
+namespace trimja {
+
+/**
+ * @class CommandHashes
+ * @brief The hashes of build commands from an earlier run, stored in a
+ * sidecar file next to `.ninja_log`, so that unchanged build commands do not
+ * need to be evaluated and hashed again.
+ *
+ * Each output is stored with a fingerprint of everything that its build
+ * command is evaluated from, i.e. the text of its build statement, its rule
+ * and all variable declarations in scope.  If the fingerprint of an output is
+ * the same as before then so is its build command and its hash.
+ */
+class CommandHashes {
+ public:
+  /**
+   * @brief The hash of the build command for an output.
+   */
+  struct Entry {
+    std::string_view out;
+    std::uint64_t fingerprint;
+    std::uint64_t hash;
+  };
+
+ private:
+  struct Value {
+    std::uint64_t fingerprint;
+    std::uint64_t hash;
+  };
+
+  MappedFile m_file;
+  boost::unordered_flat_map<std::string_view,
+                            Value,
+                            std::hash<std::string_view>>
+      m_entries;
+
+ public:
+  /**
+   * @brief Constructs an empty CommandHashes.
+   */
+  CommandHashes();
+
+  CommandHashes(const CommandHashes&) = delete;
+  CommandHashes& operator=(const CommandHashes&) = delete;
+
+  /**
+   * @brief Loads the hashes saved in `file`, which is left empty if the file
+   * does not exist, is corrupt or was saved for a different `hashType`.
+   * @param file The sidecar file written by `save`.
+   * @param hashType The type of hash that is expected.
+   */
+  void load(const std::filesystem::path& file, HashType hashType);
+
+  /**
+   * @brief Finds the hash of the build command for `out`.
+   * @param out The normalized path of an output.
+   * @param fingerprint The fingerprint of the build command for `out`.
+   * @return The hash of the build command if `out` was saved with the same
+   * fingerprint, otherwise std::nullopt.
+   */
+  std::optional<std::uint64_t> find(std::string_view out,
+                                    std::uint64_t fingerprint) const;
+
+  /**
+   * @brief Returns the number of outputs loaded.
+   * @return The number of outputs.
+   */
+  std::size_t size() const;
+
+  /**
+   * @brief Saves the hashes of build commands to a sidecar file.
+   * @param file The path of the file to write.
+   * @param hashType The type of hash used for all entries.
+   * @param entries The hash of each output.
+   * @throws std::runtime_error if the file cannot be written.
+   */
+  static void save(const std::filesystem::path& file,
+                   HashType hashType,
+                   std::span<const Entry> entries);
+
+  /**
+   * @brief Returns the path of the sidecar file for a `.ninja_log`.
+   * @param ninjaLog The path of the `.ninja_log` file.
+   * @return The path of the sidecar file next to `ninjaLog`.
+   */
+  static std::filesystem::path sidecarFor(
+      const std::filesystem::path& ninjaLog);
+};
+
+}  // namespace trimja
+
+#endif  // TRIMJA_COMMANDHASHES
@@ -22,56 +22,384 @@
 
 #include "cpuprofiler.h"
 
+#include "jsonutil.h"
+
+#include <algorithm>
+#include <atomic>
 #include <list>
+#include <mutex>
 #include <ostream>
+#include <stdexcept>
 #include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 namespace trimja {
 
 namespace {
 
-std::list<std::pair<std::string, std::chrono::steady_clock::duration>>
-    g_cpuMetrics;
+// A timer started with `CPUProfiler::start`
+struct Metric {
+  std::string name;
+  std::chrono::steady_clock::time_point start;
+  std::chrono::steady_clock::duration duration;
+
+  // The number of timers running on the same thread when this one started
+  std::size_t depth;
+
+  // The index of the thread that started this timer
+  std::size_t thread;
+
+  // The hardware counters measured while running, if enabled
+  HardwareCounters counters;
+};
+
+// A change to a counter, where `total` is its value afterwards
+struct CounterUpdate {
+  std::string name;
+  std::chrono::steady_clock::time_point time;
+  std::uint64_t total;
+  std::size_t thread;
+};
+
+std::list<Metric> g_cpuMetrics;
+std::list<CounterUpdate> g_cpuCounters;
+std::mutex g_cpuMetricsMutex;
 bool g_cpuEnabled = false;
+bool g_countersEnabled = false;
+std::chrono::steady_clock::time_point g_cpuEnabledTime;
+
+std::atomic<std::size_t> g_nextThread = 0;
+thread_local const std::size_t t_thread = g_nextThread++;
+thread_local std::size_t t_depth = 0;
+
+#ifdef __linux__
+// The performance counters of the calling thread, which are opened on first
+// use and closed when the thread exits.  Counters are inherited by threads
+// started afterwards, whose counts are added to ours when they exit, so that
+// a timer around starting and joining workers counts all of their work.
+class ThreadCounters {
+  // The file descriptor for each `HardwareCounters::Event`, or -1 if the
+  // event could not be opened
+  std::array<int, HardwareCounters::eventCount> m_fds;
+
+ public:
+  ThreadCounters() {
+    constexpr std::array<std::pair<std::uint32_t, std::uint64_t>,
+                         HardwareCounters::eventCount>
+        events = {{
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+            {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+        }};
+    for (std::size_t i = 0; i < events.size(); ++i) {
+      perf_event_attr attr{};
+      attr.size = sizeof(attr);
+      attr.type = events[i].first;
+      attr.config = events[i].second;
+
+      // Only count user space so that we work with the default
+      // `perf_event_paranoid` setting
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.inherit = 1;
+      m_fds[i] = static_cast<int>(
+          syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+  }
+
+  ThreadCounters(const ThreadCounters&) = delete;
+  ThreadCounters& operator=(const ThreadCounters&) = delete;
+
+  ~ThreadCounters() {
+    for (const int fd : m_fds) {
+      if (fd != -1) {
+        close(fd);
+      }
+    }
+  }
+
+  // Return whether any counter could be opened
+  bool any() const {
+    return std::any_of(m_fds.begin(), m_fds.end(),
+                       [](int fd) { return fd != -1; });
+  }
+
+  // Return the current value of each counter
+  HardwareCounters read() const {
+    HardwareCounters counters;
+    for (std::size_t i = 0; i < m_fds.size(); ++i) {
+      std::uint64_t value = 0;
+      if (m_fds[i] != -1 &&
+          ::read(m_fds[i], &value, sizeof(value)) == sizeof(value)) {
+        counters.values[i] = value;
+      }
+    }
+    return counters;
+  }
+};
+
+thread_local const ThreadCounters t_counters;
+#endif
+
+// Return the number of microseconds in `duration`
+std::int64_t toMicroseconds(std::chrono::steady_clock::duration duration) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(duration)
+      .count();
+}
 
 }  // namespace
 
-Timer::Timer(std::chrono::steady_clock::duration* output) : m_output{output} {
+HardwareCounters HardwareCounters::read() {
+#ifdef __linux__
+  if (g_countersEnabled) {
+    return t_counters.read();
+  }
+#endif
+  return {};
+}
+
+std::string_view HardwareCounters::name(Event event) {
+  switch (event) {
+    case cycles:
+      return "cycles";
+    case instructions:
+      return "instructions";
+    case cacheMisses:
+      return "LLC misses";
+    case branchMisses:
+      return "branch misses";
+    case pageFaults:
+      return "page faults";
+    default:
+      return "unknown";
+  }
+}
+
+Timer::Timer(std::chrono::steady_clock::duration* output)
+    : m_output{output}, m_counters{nullptr} {
   if (m_output) {
     m_start = std::chrono::steady_clock::now();
   }
 }
 
+Timer::Timer(std::chrono::steady_clock::duration* output,
+             std::chrono::steady_clock::time_point start,
+             HardwareCounters* counters)
+    : m_output{output},
+      m_start{start},
+      m_counters{counters},
+      m_startCounters{counters ? HardwareCounters::read()
+                               : HardwareCounters{}} {}
+
 Timer::~Timer() {
   stop();
 }
 
-void Timer::stop() {  // NOLINT(readability-make-member-function-const)
+void Timer::stop() {
   if (m_output) {
     *m_output = std::chrono::steady_clock::now() - m_start;
+    m_output = nullptr;
+    --t_depth;
+  }
+  if (m_counters) {
+    const HardwareCounters end = HardwareCounters::read();
+    for (std::size_t i = 0; i < end.values.size(); ++i) {
+      if (end.values[i] && m_startCounters.values[i]) {
+        m_counters->values[i] = *end.values[i] - *m_startCounters.values[i];
+      }
+    }
+    m_counters = nullptr;
   }
 }
 
 void CPUProfiler::enable() {
+  if (!g_cpuEnabled) {
+    g_cpuEnabledTime = std::chrono::steady_clock::now();
+  }
   g_cpuEnabled = true;
 }
 
+void CPUProfiler::enableHardwareCounters() {
+#ifdef __linux__
+  if (!t_counters.any()) {
+    throw std::runtime_error{
+        "Unable to open any hardware counters, check "
+        "/proc/sys/kernel/perf_event_paranoid."};
+  }
+  g_countersEnabled = true;
+  enable();
+#else
+  throw std::runtime_error{
+      "Hardware counters are not supported on this platform."};
+#endif
+}
+
 bool CPUProfiler::isEnabled() {
   return g_cpuEnabled;
 }
 
 Timer CPUProfiler::start(std::string_view name) {
-  return Timer{g_cpuEnabled ? &g_cpuMetrics.emplace_back(name, 0).second
-                            : nullptr};
+  if (!g_cpuEnabled) {
+    return Timer{nullptr};
+  }
+
+  // Timers may be started from multiple threads when trimming in parallel
+  const std::lock_guard lock{g_cpuMetricsMutex};
+  Metric& metric = g_cpuMetrics.emplace_back(
+      Metric{std::string{name}, std::chrono::steady_clock::time_point{},
+             std::chrono::steady_clock::duration{0}, t_depth++, t_thread,
+             HardwareCounters{}});
+  metric.start = std::chrono::steady_clock::now();
+  return Timer{&metric.duration, metric.start,
+               g_countersEnabled ? &metric.counters : nullptr};
+}
+
+Timer CPUProfiler::start(std::string_view kind,
+                         const std::filesystem::path& file) {
+  if (!g_cpuEnabled) {
+    return Timer{nullptr};
+  }
+
+  std::string name;
+  name += kind;
+  name += ' ';
+  name += file.string();
+  return start(name);
+}
+
+void CPUProfiler::count(std::string_view name, std::uint64_t amount) {
+  if (!g_cpuEnabled) {
+    return;
+  }
+
+  const std::lock_guard lock{g_cpuMetricsMutex};
+  std::uint64_t total = amount;
+  for (auto it = g_cpuCounters.rbegin(); it != g_cpuCounters.rend(); ++it) {
+    if (it->name == name) {
+      total += it->total;
+      break;
+    }
+  }
+  g_cpuCounters.emplace_back(CounterUpdate{
+      std::string{name}, std::chrono::steady_clock::now(), total, t_thread});
 }
 
 void CPUProfiler::print(std::ostream& out) {
-  for (const auto& [name, duration] : g_cpuMetrics) {
-    out << name << ": "
-        << std::chrono::duration_cast<std::chrono::microseconds>(duration)
-               .count()
-        << "us\n";
+  // Group timers by thread so that nesting is shown correctly, labelling any
+  // that are not on the thread that started the first timer
+  std::vector<const Metric*> metrics;
+  for (const Metric& metric : g_cpuMetrics) {
+    metrics.push_back(&metric);
+  }
+  std::stable_sort(metrics.begin(), metrics.end(),
+                   [](const Metric* lhs, const Metric* rhs) {
+                     return lhs->thread < rhs->thread;
+                   });
+  for (const Metric* metric : metrics) {
+    if (metric->thread != metrics.front()->thread) {
+      out << "[thread " << metric->thread << "] ";
+    }
+    for (std::size_t i = 0; i < metric->depth; ++i) {
+      out << "  ";
+    }
+    out << metric->name << ": " << toMicroseconds(metric->duration) << "us";
+    const char* separator = " (";
+    for (std::size_t i = 0; i < metric->counters.values.size(); ++i) {
+      if (const std::optional<std::uint64_t>& value =
+              metric->counters.values[i]) {
+        out << separator
+            << HardwareCounters::name(static_cast<HardwareCounters::Event>(i))
+            << ' ' << *value;
+        separator = ", ";
+      }
+    }
+    out << (*separator == ',' ? ")\n" : "\n");
+  }
+
+  // Print the final value of each counter in the order they were first used
+  for (auto it = g_cpuCounters.begin(); it != g_cpuCounters.end(); ++it) {
+    const bool isFirst =
+        std::find_if(g_cpuCounters.begin(), it, [&](const CounterUpdate& c) {
+          return c.name == it->name;
+        }) == it;
+    if (isFirst) {
+      const auto last = std::find_if(
+          g_cpuCounters.rbegin(), g_cpuCounters.rend(),
+          [&](const CounterUpdate& c) { return c.name == it->name; });
+      out << it->name << ": " << last->total << "\n";
+    }
+  }
+}
+
+void CPUProfiler::writeTrace(std::ostream& out) {
+  // Use complete events ("X") for timers and counter events ("C") for each
+  // change to a counter, all within a single process
+  std::string json;
+  const auto writeJSONString = [&](std::string_view value) {
+    json.clear();
+    JSONUtil::appendString(json, value);
+    out << json;
+  };
+
+  out << "{\"traceEvents\":[";
+  const char* separator = "\n";
+  for (const Metric& metric : g_cpuMetrics) {
+    out << separator << "{\"name\":";
+    writeJSONString(metric.name);
+    out << ",\"ph\":\"X\",\"ts\":"
+        << toMicroseconds(metric.start - g_cpuEnabledTime)
+        << ",\"dur\":" << toMicroseconds(metric.duration)
+        << ",\"pid\":1,\"tid\":" << metric.thread;
+    const char* const argStart = ",\"args\":{";
+    const char* argSeparator = argStart;
+    for (std::size_t i = 0; i < metric.counters.values.size(); ++i) {
+      if (const std::optional<std::uint64_t>& value =
+              metric.counters.values[i]) {
+        out << argSeparator;
+        writeJSONString(
+            HardwareCounters::name(static_cast<HardwareCounters::Event>(i)));
+        out << ':' << *value;
+        argSeparator = ",";
+      }
+    }
+    out << (argSeparator == argStart ? "}" : "}}");
+    separator = ",\n";
+  }
+  for (const CounterUpdate& counter : g_cpuCounters) {
+    out << separator << "{\"name\":";
+    writeJSONString(counter.name);
+    out << ",\"ph\":\"C\",\"ts\":"
+        << toMicroseconds(counter.time - g_cpuEnabledTime)
+        << ",\"pid\":1,\"tid\":" << counter.thread
+        << ",\"args\":{\"value\":" << counter.total << "}}";
+    separator = ",\n";
   }
+  out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+}
+
+std::chrono::steady_clock::duration CPUProfiler::total(std::string_view name) {
+  const std::lock_guard lock{g_cpuMetricsMutex};
+  std::chrono::steady_clock::duration sum{0};
+  for (const Metric& metric : g_cpuMetrics) {
+    if (metric.name == name) {
+      sum += metric.duration;
+    }
+  }
+  return sum;
+}
+
+void CPUProfiler::reset() {
+  const std::lock_guard lock{g_cpuMetricsMutex};
+  g_cpuMetrics.clear();
+  g_cpuCounters.clear();
 }
 
 }  // namespace trimja
@@ -23,18 +23,63 @@
 #ifndef TRIMJA_CPUPROFILER
 #define TRIMJA_CPUPROFILER
 
+#include <array>
 #include <chrono>
+#include <cstdint>
+#include <filesystem>
 #include <iosfwd>
+#include <optional>
 #include <string_view>
 
 namespace trimja {
 
+/**
+ * @brief The number of hardware and software events that occurred on a
+ * thread, as counted by the kernel.
+ */
+struct HardwareCounters {
+  /**
+   * @brief The events that are counted, each being an index into `values`.
+   */
+  enum Event {
+    cycles,
+    instructions,
+    cacheMisses,
+    branchMisses,
+    pageFaults,
+    eventCount,
+  };
+
+  // The count of each `Event`, which is empty if it could not be counted
+  std::array<std::optional<std::uint64_t>, eventCount> values;
+
+  /**
+   * @brief Returns the current counters for the calling thread, including
+   * those of every thread it started after its counters were opened that has
+   * since exited.
+   *
+   * @return The counters, which are all empty unless
+   * `CPUProfiler::enableHardwareCounters` has been called.
+   */
+  static HardwareCounters read();
+
+  /**
+   * @brief Returns the name of `event` as shown by `CPUProfiler::print`.
+   *
+   * @param event The event to name.
+   * @return The name of `event`.
+   */
+  static std::string_view name(Event event);
+};
+
 /**
  * @brief Timer class to measure the duration of code execution.
  */
 struct Timer {
   std::chrono::steady_clock::duration* m_output;
   std::chrono::steady_clock::time_point m_start;
+  HardwareCounters* m_counters;
+  HardwareCounters m_startCounters;
 
   /**
    * @brief Constructs a Timer and optionally starts timing.
@@ -44,13 +89,31 @@ struct Timer {
    */
   Timer(std::chrono::steady_clock::duration* output);
 
+  /**
+   * @brief Constructs a Timer that started timing at `start`.
+   *
+   * @param output Pointer to a duration object where the elapsed time will be
+   * stored.
+   * @param start The time that timing started.
+   * @param counters Optional pointer to where the difference in the hardware
+   * counters of the calling thread will be stored if it is not nullptr.
+   */
+  Timer(std::chrono::steady_clock::duration* output,
+        std::chrono::steady_clock::time_point start,
+        HardwareCounters* counters = nullptr);
+
+  Timer(const Timer&) = delete;
+  Timer& operator=(const Timer&) = delete;
+
   /**
    * @brief Destroys the Timer and stops timing if not already stopped.
    */
   ~Timer();
 
   /**
-   * @brief Stops the timer and writes the elapsed time.
+   * @brief Stops the timer and writes the elapsed time, and the hardware
+   * counters if requested, if not already stopped.  This must be called on
+   * the thread that started the timer.
    */
   void stop();
 };
@@ -64,6 +127,17 @@ struct CPUProfiler {
    */
   static void enable();
 
+  /**
+   * @brief Enables the CPU profiler and has every timer also measure the
+   * hardware counters of its thread, such as cycles and cache misses.  Threads
+   * started afterwards are counted by the thread that started them once they
+   * exit, so a timer around joining workers includes all of their work.
+   *
+   * @throws std::runtime_error if hardware counters are not supported on this
+   * platform or none of them can be opened.
+   */
+  static void enableHardwareCounters();
+
   /**
    * @brief Checks if the CPU profiler is enabled.
    *
@@ -74,17 +148,62 @@ struct CPUProfiler {
   /**
    * @brief Starts a new timer for profiling a specific code section.
    *
+   * Timers started on the same thread while this one is running are nested
+   * inside it.
+   *
    * @param name The name of the code section being profiled.
    * @return A Timer object that measures the duration of the code section.
    */
   static Timer start(std::string_view name);
 
   /**
-   * @brief Prints the profiling results to the provided output stream.
+   * @brief Starts a new timer for profiling work done on a file.
+   *
+   * @param kind The kind of work done, which prefixes the name.
+   * @param file The file being worked on, which is only converted to a string
+   * if the profiler is enabled.
+   * @return A Timer object that measures the duration of the code section.
+   */
+  static Timer start(std::string_view kind, const std::filesystem::path& file);
+
+  /**
+   * @brief Adds to the counter called `name` if the profiler is enabled.
+   *
+   * @param name The name of the counter.
+   * @param amount The amount to add to the counter.
+   */
+  static void count(std::string_view name, std::uint64_t amount);
+
+  /**
+   * @brief Prints the profiling results to the provided output stream, with
+   * nested timers indented below the timer they were started in and followed
+   * by the total of each counter.
    *
    * @param out The output stream to print the profiling results.
    */
   static void print(std::ostream& out);
+
+  /**
+   * @brief Writes the profiling results as Chrome trace event JSON, which can
+   * be viewed in Perfetto or chrome://tracing.
+   *
+   * @param out The output stream to write the trace to.
+   */
+  static void writeTrace(std::ostream& out);
+
+  /**
+   * @brief Returns the total time recorded by timers for a code section.
+   *
+   * @param name The name of the code section passed to `start`.
+   * @return The sum of the durations of all timers started with `name`.
+   */
+  static std::chrono::steady_clock::duration total(std::string_view name);
+
+  /**
+   * @brief Discards all timers and counters, which must only be called when
+   * no timers are running.
+   */
+  static void reset();
 };
 
 }  // namespace trimja
@@ -24,10 +24,11 @@
 #include "graph.h"
 
 #include <algorithm>
-#include <ios>
-#include <istream>
+#include <cstdint>
+#include <cstring>
 #include <span>
-#include <vector>
+#include <stdexcept>
+#include <string>
 
 namespace trimja {
 namespace {
@@ -35,13 +36,29 @@ namespace {
 // Ninja's maximum record size, we will try and respect it
 const std::size_t NINJA_MAX_RECORD_SIZE = 0b11'1111'1111'1111'1111;
 
+const std::string_view NINJA_DEPS_SIGNATURE = "# ninjadeps\n";
+
+// Records are written as a sequence of 4-byte words, so as long as the
+// mapping is suitably aligned we can view the dependencies in place
+const std::size_t WORD_SIZE = sizeof(std::int32_t);
+
 template <typename TYPE>
-TYPE readFromStream(std::istream& in) {
+TYPE readWord(const char* data) {
   TYPE value;
-  in.read(reinterpret_cast<char*>(&value), sizeof(value));
+  std::memcpy(&value, data, sizeof(value));
   return value;
 }
 
+[[noreturn]] void throwReadError(const std::filesystem::path& file,
+                                 std::string_view reason) {
+  std::string msg;
+  msg += "Error reading ";
+  msg += file.string();
+  msg += ": ";
+  msg += reason;
+  throw std::runtime_error(msg);
+}
+
 }  // namespace
 
 static_assert(std::input_iterator<DepsReader::iterator>);
@@ -76,63 +93,82 @@ bool operator!=(const DepsReader::iterator& iter, DepsReader::sentinel) {
 }
 
 DepsReader::DepsReader(const std::filesystem::path& ninja_deps)
-    : m_deps(ninja_deps, std::ios_base::binary),
-      m_storage(),
-      m_depsStorage(),
+    : m_deps(ninja_deps),
+      m_current(m_deps.contents().data()),
+      m_end(m_deps.contents().data() + m_deps.contents().size()),
       m_filePath(ninja_deps) {
-  m_deps.exceptions(std::ios_base::failbit | std::ios_base::badbit);
-  std::getline(m_deps, m_storage);
-  if (m_storage != "# ninjadeps") {
+  const std::string_view contents = m_deps.contents();
+  if (!contents.starts_with(NINJA_DEPS_SIGNATURE)) {
     throw std::runtime_error("Unable to find ninjadeps signature");
   }
+  m_current += NINJA_DEPS_SIGNATURE.size();
 
-  const auto header = readFromStream<std::int32_t>(m_deps);
-  if (header != 4) {
+  if (m_end - m_current < static_cast<std::ptrdiff_t>(WORD_SIZE) ||
+      readWord<std::int32_t>(m_current) != 4) {
     throw std::runtime_error("Only version 4 supported of ninjadeps");
   }
+  m_current += WORD_SIZE;
+
+  if (reinterpret_cast<std::uintptr_t>(m_current) % alignof(std::int32_t) !=
+      0) {
+    throwReadError(m_filePath, "misaligned records");
+  }
 }
 
 bool DepsReader::read(std::variant<PathRecordView, DepsRecordView>* output) {
-  try {
-    if (m_deps.peek() == EOF) {
-      return false;
-    }
-    const auto rawRecordSize = readFromStream<std::uint32_t>(m_deps);
-    const std::uint32_t recordSize = rawRecordSize & 0x7FFFFFFF;
-    if (recordSize > NINJA_MAX_RECORD_SIZE) {
-      throw std::runtime_error("Record exceeding the maximum size found");
+  const std::size_t remaining = m_end - m_current;
+  if (remaining == 0) {
+    return false;
+  }
+
+  // Validate the size of the whole record up front so that we can decode its
+  // contents without any further bounds checking
+  if (remaining < WORD_SIZE) {
+    throwReadError(m_filePath, "unexpected end of file");
+  }
+  const auto rawRecordSize = readWord<std::uint32_t>(m_current);
+  const std::uint32_t recordSize = rawRecordSize & 0x7FFFFFFF;
+  if (recordSize > NINJA_MAX_RECORD_SIZE) {
+    throw std::runtime_error("Record exceeding the maximum size found");
+  }
+  if (recordSize > remaining - WORD_SIZE) {
+    throwReadError(m_filePath, "unexpected end of file");
+  }
+  if (recordSize % WORD_SIZE != 0) {
+    throwReadError(m_filePath, "record size is not a multiple of 4");
+  }
+  const char* const record = m_current + WORD_SIZE;
+
+  if (const bool isPathRecord = (rawRecordSize >> 31) == 0) {
+    if (recordSize < WORD_SIZE) {
+      throwReadError(m_filePath, "path record too small");
     }
-    if (const bool isPathRecord = (rawRecordSize >> 31) == 0) {
-      const std::uint32_t pathSize = recordSize - sizeof(std::uint32_t);
-      m_storage.resize(pathSize);
-      m_deps.read(m_storage.data(), pathSize);
-      const auto end = m_storage.end();
-      const std::size_t padding =
-          (end[-1] == '\0') + (end[-2] == '\0') + (end[-3] == '\0');
-      m_storage.erase(m_storage.size() - padding);
-      const auto checksum = readFromStream<std::uint32_t>(m_deps);
-      const std::int32_t id = ~checksum;
-      *output = PathRecordView{id, m_storage};
-    } else {
-      const auto outIndex = readFromStream<std::int32_t>(m_deps);
-      const auto mtime = readFromStream<ninja_clock::time_point>(m_deps);
-      const std::uint32_t numDependencies =
-          (recordSize - sizeof(std::int32_t) - 2 * sizeof(std::uint32_t)) /
-          sizeof(std::int32_t);
-      m_depsStorage.resize(numDependencies);
-      std::generate_n(m_depsStorage.begin(), numDependencies,
-                      [&] { return readFromStream<std::int32_t>(m_deps); });
-      *output = DepsRecordView{outIndex, mtime, m_depsStorage};
+    const std::uint32_t pathSize = recordSize - WORD_SIZE;
+    std::string_view path(record, pathSize);
+    const std::size_t padding = std::min<std::size_t>(
+        3, path.size() - path.find_last_not_of('\0') - 1);
+    path.remove_suffix(padding);
+    const auto checksum = readWord<std::uint32_t>(record + pathSize);
+    const std::int32_t id = ~checksum;
+    *output = PathRecordView{id, path};
+  } else {
+    const std::size_t headerSize =
+        sizeof(std::int32_t) + sizeof(ninja_clock::time_point);
+    if (recordSize < headerSize) {
+      throwReadError(m_filePath, "deps record too small");
     }
-  } catch (const std::ios_base::failure& e) {
-    std::string msg;
-    msg += "Error reading ";
-    msg += m_filePath.string();
-    msg += ": ";
-    msg += e.what();
-    throw std::runtime_error(msg);
+    const auto outIndex = readWord<std::int32_t>(record);
+    const auto mtime =
+        readWord<ninja_clock::time_point>(record + sizeof(std::int32_t));
+    const std::uint32_t numDependencies =
+        (recordSize - headerSize) / sizeof(std::int32_t);
+    const std::span<const std::int32_t> deps(
+        reinterpret_cast<const std::int32_t*>(record + headerSize),
+        numDependencies);
+    *output = DepsRecordView{outIndex, mtime, deps};
   }
 
+  m_current = record + recordSize;
   return true;
 }
 
@@ -23,13 +23,13 @@
 #ifndef TRIMJA_DEPSREADER
 #define TRIMJA_DEPSREADER
 
+#include "mappedfile.h"
 #include "ninja_clock.h"
 
 #include <filesystem>
-#include <fstream>
 #include <span>
+#include <string_view>
 #include <variant>
-#include <vector>
 
 namespace trimja {
 
@@ -57,11 +57,14 @@ struct DepsRecordView {
 /**
  * @class DepsReader
  * @brief Reads dependency records from a .ninja_deps file
+ *
+ * The file is memory-mapped and all records returned are views directly into
+ * the mapping, so they remain valid for the lifetime of the `DepsReader`.
  */
 class DepsReader {
-  std::ifstream m_deps;
-  std::string m_storage;
-  std::vector<std::int32_t> m_depsStorage;
+  MappedFile m_deps;
+  const char* m_current;
+  const char* m_end;
   std::filesystem::path m_filePath;
 
  public:
@@ -128,6 +131,8 @@ class DepsReader {
   /**
    * @brief Constructs a DepsReader for the given Ninja deps file.
    * @param ninja_deps The path to the Ninja .ninja_dep file.
+   * @throws std::runtime_error if the file cannot be opened or has an
+   * unsupported header.
    */
   explicit DepsReader(const std::filesystem::path& ninja_deps);
 
@@ -135,6 +140,7 @@ class DepsReader {
    * @brief Reads the next dependency record from the deps file.
    * @param output Pointer to the variant to store the read record.
    * @return Whether a record was successfully read.
+   * @throws std::runtime_error if the record is malformed or truncated.
    */
   bool read(std::variant<PathRecordView, DepsRecordView>* output);
 
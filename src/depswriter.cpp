@@ -25,6 +25,7 @@
 
 #include <cassert>
 #include <iostream>
+#include <stdexcept>
 
 namespace trimja {
 
@@ -76,7 +77,7 @@ void DepsWriter::recordDependencies(std::int32_t out,
   // Set the high-bit to indicate a dependency record
   writeBinary<std::uint32_t>(m_out, size | (1u << 31));
   writeBinary<std::int32_t>(m_out, out);
-  writeBinary(m_out, std::chrono::clock_cast<ninja_clock>(mtime));
+  writeBinary(m_out, ninja_clock::from_file_clock(mtime));
   m_out->write(reinterpret_cast<const char*>(nodes.data()),
                nodes.size() * sizeof(nodes[0]));
 }
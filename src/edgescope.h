@@ -85,7 +85,7 @@ class EdgeScope {
    * @param value The value to assign to the variable.
    * @return A string view of the stored value.
    */
-  std::string_view set(std::string_view key, std::string&& value) {
+  std::string_view set(VariableName key, std::string&& value) {
     return m_local.set(key, std::move(value));
   }
 
@@ -98,7 +98,7 @@ class EdgeScope {
    * @param key The name of the variable to reset.
    * @return A reference to the reset value.
    */
-  std::string& resetValue(std::string_view key) {
+  std::string& resetValue(VariableName key) {
     return m_local.resetValue(key);
   }
 
@@ -113,7 +113,7 @@ class EdgeScope {
    * @param name The name of the variable.
    * @return Whether the variable was found in this scope.
    */
-  bool appendValue(std::string& output, std::string_view name) const {
+  bool appendValue(std::string& output, VariableName name) const {
     // From https://ninja-build.org/manual.html#ref_scope
     // Variable declarations indented in a build block are scoped to the build
     // block. The full lookup order for a variable expanded in a build block (or
@@ -126,16 +126,19 @@ class EdgeScope {
     //   4. File-level variables from the file that the build line was in.
     //   5. Variables from the file that included that file using the subninja
     //      keyword.
-    if (name == "in") {
-      detail::appendPaths(output, m_ins, ' ');
-      return true;
-    } else if (name == "out") {
-      detail::appendPaths(output, m_outs, ' ');
-      return true;
-    } else if (name == "in_newline") {
-      detail::appendPaths(output, m_ins, '\n');
-      return true;
-    } else if (m_local.appendValue(output, name)) {
+    switch (name.id()) {
+      case VariableName::In:
+        detail::appendPaths(output, m_ins, ' ');
+        return true;
+      case VariableName::Out:
+        detail::appendPaths(output, m_outs, ' ');
+        return true;
+      case VariableName::InNewline:
+        detail::appendPaths(output, m_ins, '\n');
+        return true;
+    }
+
+    if (m_local.appendValue(output, name)) {
       return true;
     } else if (const EvalString* value = m_rule.lookupVar(name)) {
       evaluate(output, *value, *this);
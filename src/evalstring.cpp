@@ -23,15 +23,18 @@
 #include "evalstring.h"
 
 #include <algorithm>
+#include <cassert>
 #include <limits>
+#include <stdexcept>
 
 // The format of `EvalString` is a sequence of segments. Each segment is
-// prefixed with the length of the segment, stored as an `Offset` type.  The
-// leading bit of this is set to 1 if the segment is a variable, otherwise it is
-// 0 if the segment is text.  Additionally there is an extra member variable
-// `m_lastTextSegmentLength` that has the length of the last text section or 0
-// if the last section was not text.  This allows us to jump back to the last
-// segment to extend it.
+// prefixed with an `Offset`.  The leading bit of this is set to 1 if the
+// segment is a variable, in which case the remaining bits are the id of its
+// `VariableName` and there is nothing else in the segment.  Otherwise it is 0
+// and the segment is text of the length given by the remaining bits.
+// Additionally there is an extra member variable `m_lastTextSegmentLength` that
+// has the length of the last text section or 0 if the last section was not
+// text.  This allows us to jump back to the last segment to extend it.
 //
 // This has the benefit that `EvalString` if very cache-friendly when iterating
 // and requires only one allocation.  Moves and copies should be as cheap as
@@ -70,18 +73,20 @@ EvalString::const_iterator::const_iterator() : m_pos{nullptr} {}
 
 EvalString::const_iterator::const_iterator(const char* pos) : m_pos{pos} {}
 
-std::pair<std::string_view, EvalString::TokenType>
-EvalString::const_iterator::operator*() const {
+EvalString::Token EvalString::const_iterator::operator*() const {
   Offset length;
   std::copy_n(m_pos, sizeof(length), reinterpret_cast<char*>(&length));
-  return {{m_pos + sizeof(length), clearLeadingBit(length)},
-          static_cast<TokenType>(hasLeadingBit(length))};
+  if (hasLeadingBit(length)) {
+    return VariableName{static_cast<std::uint32_t>(clearLeadingBit(length))};
+  } else {
+    return std::string_view{m_pos + sizeof(length), length};
+  }
 }
 
 EvalString::const_iterator& EvalString::const_iterator::operator++() {
   Offset length;
   std::copy_n(m_pos, sizeof(length), reinterpret_cast<char*>(&length));
-  m_pos += sizeof(length) + clearLeadingBit(length);
+  m_pos += sizeof(length) + (hasLeadingBit(length) ? 0 : length);
   return *this;
 }
 
@@ -101,13 +106,15 @@ bool operator!=(EvalString::const_iterator lhs,
   return !(lhs == rhs);
 }
 
-EvalString::EvalString() : m_data{}, m_lastTextSegmentLength{0} {
+EvalString::EvalString()
+    : m_data{}, m_lastTextSegmentLength{0}, m_textSize{0} {
   assert(empty());
 }
 
 void EvalString::clear() {
   m_data.clear();
   m_lastTextSegmentLength = 0;
+  m_textSize = 0;
   assert(empty());
 }
 
@@ -115,6 +122,10 @@ bool EvalString::empty() const {
   return m_data.empty();
 }
 
+std::size_t EvalString::textSize() const {
+  return m_textSize;
+}
+
 EvalString::const_iterator EvalString::begin() const {
   return const_iterator{m_data.data()};
 }
@@ -125,16 +136,22 @@ EvalString::const_iterator EvalString::end() const {
 
 void EvalString::appendText(std::string_view text) {
   assert(!text.empty());
+  if (text.size() >= leadingBit - m_lastTextSegmentLength) {
+    throw std::runtime_error("Text is too long for EvalString");
+  }
+
+  m_textSize += text.size();
   if (m_lastTextSegmentLength > 0) {
     // If the last part was plain text we can extend it
-    const Offset newLength = m_lastTextSegmentLength + text.size();
+    const Offset newLength =
+        m_lastTextSegmentLength + static_cast<Offset>(text.size());
     std::copy_n(reinterpret_cast<const char*>(&newLength), sizeof(newLength),
                 m_data.end() - sizeof(Offset) - m_lastTextSegmentLength);
     m_data.append(text);
     m_lastTextSegmentLength = newLength;
   } else {
     // Otherwise write new segment
-    const Offset length = text.size();
+    const Offset length = static_cast<Offset>(text.size());
     m_data.append(reinterpret_cast<const char*>(&length), sizeof(length));
     m_data.append(text);
     m_lastTextSegmentLength = length;
@@ -143,9 +160,13 @@ void EvalString::appendText(std::string_view text) {
 
 void EvalString::appendVariable(std::string_view name) {
   assert(!name.empty());
-  const Offset length = setLeadingBit(name.size());
-  m_data.append(reinterpret_cast<const char*>(&length), sizeof(length));
-  m_data.append(name);
+  appendVariable(VariableName::intern(name));
+}
+
+void EvalString::appendVariable(VariableName name) {
+  assert(name.id() < leadingBit);
+  const Offset id = setLeadingBit(name.id());
+  m_data.append(reinterpret_cast<const char*>(&id), sizeof(id));
   m_lastTextSegmentLength = 0;
 }
 
@@ -23,9 +23,13 @@
 #ifndef TRIMJA_EVALSTRING
 #define TRIMJA_EVALSTRING
 
-#include <cassert>
+#include "variablename.h"
+
+#include <cstddef>
+#include <cstdint>
 #include <string>
 #include <string_view>
+#include <variant>
 
 namespace trimja {
 
@@ -36,23 +40,20 @@ namespace trimja {
  */
 class EvalString {
  public:
-  // For the moment use `std::size_t` as offset type but we can investigate
-  // later on if a smaller type help with memory or performance.
-  using Offset = std::size_t;
+  // The type of each segment header, which is large enough for any id of a
+  // `VariableName` and all text segments that we expect in a ninja file.
+  using Offset = std::uint32_t;
 
  private:
   std::string m_data;
   Offset m_lastTextSegmentLength;
+  std::size_t m_textSize;
 
  public:
   /**
-   * @enum TokenType
-   * @brief Enum to represent the type of token.
+   * @brief A token, which is either some text or the name of a variable.
    */
-  enum class TokenType {
-    Text = 0,      ///< Represents a text token.
-    Variable = 1,  ///< Represents a variable token.
-  };
+  using Token = std::variant<std::string_view, VariableName>;
 
   /**
    * @class const_iterator
@@ -63,11 +64,11 @@ class EvalString {
 
    public:
     using difference_type = std::ptrdiff_t;
-    using value_type = std::pair<std::string_view, TokenType>;
+    using value_type = Token;
 
     const_iterator();
     const_iterator(const char* pos);
-    std::pair<std::string_view, TokenType> operator*() const;
+    Token operator*() const;
     const_iterator& operator++();
     const_iterator operator++(int);
     friend bool operator==(const_iterator lhs, const_iterator rhs);
@@ -89,6 +90,12 @@ class EvalString {
    */
   bool empty() const;
 
+  /**
+   * @brief Gets the total length of all text tokens, which is a lower bound
+   * on the size of the evaluated string.
+   */
+  std::size_t textSize() const;
+
   /**
    * @brief Gets the beginning iterator.
    */
@@ -103,6 +110,7 @@ class EvalString {
    * @brief Appends text to the EvalString, consolidating consecutive text
    * sections.
    * @param text The text to append.  This must not be empty.
+   * @throws std::runtime_error if the text section becomes too long.
    */
   void appendText(std::string_view text);
 
@@ -111,6 +119,21 @@ class EvalString {
    * @param name The name of the variable to append.  This must not be empty.
    */
   void appendVariable(std::string_view name);
+
+  /**
+   * @brief Appends an interned variable to the EvalString.
+   * @param name The name of the variable to append.
+   */
+  void appendVariable(VariableName name);
+
+  /**
+   * @brief Compares two EvalStrings for equality.
+   * @param lhs The first EvalString to compare.
+   * @param rhs The second EvalString to compare.
+   * @return True if both EvalStrings have identical tokens.
+   */
+  friend bool operator==(const EvalString& lhs,
+                         const EvalString& rhs) = default;
 };
 
 /**
@@ -124,20 +147,12 @@ template <typename SCOPE>
 void evaluate(std::string& output,
               const EvalString& variable,
               const SCOPE& scope) {
-  const auto end = variable.end();
-  for (auto it = variable.begin(); it != end; ++it) {
-    switch ((*it).second) {
-      case EvalString::TokenType::Text:
-        output += (*it).first;
-        if (++it == end) {
-          return;
-        }
-        // As we consolidate consecutive text sections if we are not at the
-        // end then we must have a variable next
-        assert((*it).second == EvalString::TokenType::Variable);
-        [[fallthrough]];
-      case EvalString::TokenType::Variable:
-        scope.appendValue(output, (*it).first);
+  output.reserve(output.size() + variable.textSize());
+  for (const EvalString::Token token : variable) {
+    if (const std::string_view* text = std::get_if<std::string_view>(&token)) {
+      output += *text;
+    } else {
+      scope.appendValue(output, std::get<VariableName>(token));
     }
   }
 }
@@ -0,0 +1,169 @@
+// MIT License
+//
+// Copyright (c) 2024 Elliot Goodrich
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "explainlog.h"
+
+#include "graph.h"
+#include "jsonutil.h"
+
+#include <cassert>
+#include <ostream>
+#include <stdexcept>
+
+namespace trimja {
+
+namespace {
+
+// Return the name of `reason` used in the JSON output
+std::string_view reasonName(ExplainLog::Reason reason) {
+  switch (reason) {
+    case ExplainLog::Reason::userAffected:
+      return "user-affected";
+    case ExplainLog::Reason::userPattern:
+      return "user-pattern";
+    case ExplainLog::Reason::missingFromLog:
+      return "missing-from-log";
+    case ExplainLog::Reason::hashMismatch:
+      return "hash-mismatch";
+    case ExplainLog::Reason::missingLog:
+      return "missing-log";
+    case ExplainLog::Reason::affectedInput:
+      return "affected-input";
+    case ExplainLog::Reason::requiredInput:
+      return "required-input";
+    default:
+      assert(false);
+      return "unknown";
+  }
+}
+
+// Return whether `related` is a node index for `reason`
+bool isRelatedNode(ExplainLog::Reason reason) {
+  return reason == ExplainLog::Reason::affectedInput ||
+         reason == ExplainLog::Reason::requiredInput;
+}
+
+}  // namespace
+
+std::size_t ExplainLog::addText(std::string_view text) {
+  m_texts.emplace_back(text);
+  return m_texts.size() - 1;
+}
+
+void ExplainLog::add(Reason reason, std::size_t node, std::size_t related) {
+  assert(node <= none);
+  assert(related < std::numeric_limits<std::uint32_t>::max());
+  m_records.push_back({reason, static_cast<std::uint32_t>(node),
+                       static_cast<std::uint32_t>(related)});
+}
+
+bool ExplainLog::empty() const {
+  return m_records.empty();
+}
+
+void ExplainLog::write(std::ostream& output,
+                       const Graph& graph,
+                       Format format) const {
+  // Format everything first so that we make a single call to `output`
+  std::string buffer;
+  for (const Record& record : m_records) {
+    const std::string_view path =
+        record.node == none ? std::string_view{} : graph.path(record.node);
+    const std::string_view related = isRelatedNode(record.reason)
+                                         ? graph.path(record.related)
+                                         : m_texts[record.related];
+    if (format == Format::ndjson) {
+      buffer += "{\"reason\":\"";
+      buffer += reasonName(record.reason);
+      buffer += '"';
+      if (record.node != none) {
+        buffer += ",\"path\":";
+        JSONUtil::appendString(buffer, path);
+      }
+      buffer += ",\"related\":";
+      JSONUtil::appendString(buffer, related);
+      buffer += "}\n";
+      continue;
+    }
+
+    if (record.reason == Reason::missingLog) {
+      buffer += "Unable to find '";
+      buffer += related;
+      buffer += "', so including everything\n";
+      continue;
+    }
+
+    buffer += "Including '";
+    buffer += record.reason == Reason::userAffected ? related : path;
+    switch (record.reason) {
+      case Reason::userAffected:
+        buffer += "' as it was marked as affected by the user\n";
+        break;
+      case Reason::userPattern:
+        buffer += "' as it matches '";
+        buffer += related;
+        buffer += "' marked as affected by the user\n";
+        break;
+      case Reason::missingFromLog:
+        buffer += "' as it was not found in '";
+        buffer += related;
+        buffer += "'\n";
+        break;
+      case Reason::hashMismatch:
+        buffer += "' as the build command hash differs in '";
+        buffer += related;
+        buffer += "'\n";
+        break;
+      case Reason::missingLog:
+        assert(false);
+        break;
+      case Reason::affectedInput:
+        buffer += "' as it has the affected input '";
+        buffer += related;
+        buffer += "'\n";
+        break;
+      case Reason::requiredInput:
+        buffer += "' as it is a required input for the affected output '";
+        buffer += related;
+        buffer += "'\n";
+        break;
+    }
+  }
+  output.write(buffer.data(), buffer.size());
+}
+
+ExplainLog::Format ExplainLog::parseFormat(std::string_view name) {
+  if (name == "text") {
+    return Format::text;
+  }
+  if (name == "ndjson") {
+    return Format::ndjson;
+  }
+  std::string msg;
+  msg += "'";
+  msg += name;
+  msg += "' is an invalid value for --explain-format!";
+  throw std::runtime_error{msg};
+}
+
+}  // namespace trimja
@@ -0,0 +1,160 @@
+// MIT License
+//
+// Copyright (c) 2024 Elliot Goodrich
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef TRIMJA_EXPLAINLOG
+#define TRIMJA_EXPLAINLOG
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace trimja {
+
+class Graph;
+
+/**
+ * @class ExplainLog
+ * @brief A buffer of the reasons why each node of a `Graph` was kept, which
+ * is written out in one go once trimming has finished.
+ *
+ * Records only hold indices so that adding one is cheap, and the paths are
+ * looked up from the graph when writing.
+ */
+class ExplainLog {
+ public:
+  /**
+   * @brief Why a node was kept.
+   */
+  enum class Reason : std::uint8_t {
+    // The user marked the node as affected and `related` is the text given
+    userAffected,
+
+    // The node matched a pattern that the user marked as affected and
+    // `related` is the text of the pattern
+    userPattern,
+
+    // The log has no entry for the node and `related` is the path of the log
+    missingFromLog,
+
+    // The hash of the node's build command differs from the one in the log
+    // and `related` is the path of the log
+    hashMismatch,
+
+    // There is no log so everything is kept, `related` is the path of the
+    // log and there is no node
+    missingLog,
+
+    // The node has an affected input and `related` is that input
+    affectedInput,
+
+    // The node is needed by an affected output and `related` is that output
+    requiredInput,
+  };
+
+  /**
+   * @brief How to write the records.
+   */
+  enum class Format {
+    // One English sentence per line
+    text,
+
+    // One JSON object per line with the keys "reason", "path" and "related"
+    ndjson,
+  };
+
+  /**
+   * @brief The value of `node` for records that are not about a single node.
+   */
+  static constexpr std::size_t none = std::numeric_limits<std::uint32_t>::max();
+
+ private:
+  struct Record {
+    Reason reason;
+    std::uint32_t node;
+
+    // An index into the graph for `affectedInput` and `requiredInput`,
+    // otherwise an index into `m_texts`
+    std::uint32_t related;
+  };
+
+  std::vector<Record> m_records;
+  std::vector<std::string> m_texts;
+
+ public:
+  /**
+   * @brief Stores `text` so that it can be referred to by later records.
+   * @param text The text to store, such as a line given by the user.
+   * @return The index to pass as `related` to `add`.
+   */
+  std::size_t addText(std::string_view text);
+
+  /**
+   * @brief Records why `node` was kept.
+   * @param reason Why `node` was kept.
+   * @param node The index of the node in the graph, or `none`.
+   * @param related The related node index or text index, see `Reason`.
+   */
+  void add(Reason reason, std::size_t node, std::size_t related);
+
+  /**
+   * @brief Removes the records about every node for which `predicate`
+   * returns true, keeping the rest in order.
+   * @param predicate Called with the index of each node with a record.
+   */
+  template <typename PREDICATE>
+  void removeIf(PREDICATE&& predicate) {
+    std::erase_if(m_records, [&](const Record& record) {
+      return record.node != none && predicate(record.node);
+    });
+  }
+
+  /**
+   * @brief Checks whether there are no records.
+   * @return Whether nothing has been recorded.
+   */
+  bool empty() const;
+
+  /**
+   * @brief Writes all records in the order they were added.
+   * @param output The stream to write to.
+   * @param graph The graph that all node indices refer to.
+   * @param format How to write each record.
+   */
+  void write(std::ostream& output, const Graph& graph, Format format) const;
+
+  /**
+   * @brief Parses the name of a format as given on the command line.
+   * @param name Either "text" or "ndjson".
+   * @return The format called `name`.
+   * @throws std::runtime_error if `name` is not a known format.
+   */
+  static Format parseFormat(std::string_view name);
+};
+
+}  // namespace trimja
+
+#endif  // TRIMJA_EXPLAINLOG
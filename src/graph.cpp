@@ -23,80 +23,127 @@
 #include "graph.h"
 
 #include <ninja/util.h>
+#include <rapidhash/rapidhash.h>
 
+#include <algorithm>
 #include <cassert>
+#include <stdexcept>
 
 namespace trimja {
 
-std::size_t Graph::PathHash::operator()(const fixed_string& v) const {
-  return (*this)(v.view());
-}
-
 std::size_t Graph::PathHash::operator()(std::string_view v) const {
-  // FNV-1a hash algorithm but on Windows we swap all backslashes with forward
-  // slashes
-  std::size_t hash = 14695981039346656037ULL;
-  for (const char ch : v) {
-#ifdef _WIN32
-    hash ^= ch == '\\' ? '/' : ch;
-#else
-    hash ^= ch;
-#endif
-    hash *= 1099511628211ULL;
-  }
-  return hash;
-}
-
-bool Graph::PathEqual::operator()(const fixed_string& left,
-                                  const fixed_string& right) const {
-  return (*this)(left.view(), right);
+  return hashPath(v);
 }
 
 bool Graph::PathEqual::operator()(std::string_view left,
-                                  const fixed_string& right) const {
+                                  std::string_view right) const {
 #ifdef _WIN32
-  return std::equal(left.begin(), left.end(), right.view().begin(),
-                    right.view().end(), [](char l, char r) {
+  return std::equal(left.begin(), left.end(), right.begin(), right.end(),
+                    [](char l, char r) {
                       return (l == '\\' ? '/' : l) == (r == '\\' ? '/' : r);
                     });
 #else
-  return left == right.view();
+  return left == right;
 #endif
 }
 
+namespace {
+
+template <typename EdgeList>
+void pack(std::vector<std::uint32_t>& offsets,
+          std::vector<std::uint32_t>& targets,
+          std::vector<EdgeList>& lists) {
+  std::size_t total = 0;
+  for (const EdgeList& list : lists) {
+    total += list.size();
+  }
+  if (total > std::numeric_limits<std::uint32_t>::max()) {
+    throw std::runtime_error("Too many edges in the build graph");
+  }
+
+  offsets.clear();
+  offsets.reserve(lists.size() + 1);
+  targets.clear();
+  targets.reserve(total);
+  offsets.push_back(0);
+  for (const EdgeList& list : lists) {
+    targets.insert(targets.end(), list.begin(), list.end());
+    offsets.push_back(static_cast<std::uint32_t>(targets.size()));
+  }
+
+  // Release the memory rather than just clearing
+  lists = {};
+}
+
+std::uint32_t toIndex(std::size_t index) {
+  assert(index <= std::numeric_limits<std::uint32_t>::max());
+  return static_cast<std::uint32_t>(index);
+}
+
+}  // namespace
+
 Graph::Graph() = default;
 
+std::size_t Graph::addNode(std::string_view path) {
+  assert(!m_finalized);
+  const std::size_t nextIndex = m_path.size();
+  if (nextIndex == std::numeric_limits<std::uint32_t>::max()) {
+    std::string msg;
+    msg += "Too many paths in the build graph to add '";
+    msg += path;
+    msg += "'";
+    throw std::runtime_error(msg);
+  }
+  m_inputToOutput.emplace_back();
+  m_outputToInput.emplace_back();
+  m_path.emplace_back(path);
+  return nextIndex;
+}
+
 std::size_t Graph::addPath(std::string& path) {
-  const std::size_t nextIndex = m_inputToOutput.size();
   CanonicalizePath(&path);
-  const auto [it, inserted] = m_pathToIndex.try_emplace(path, nextIndex);
-  if (inserted) {
-    m_inputToOutput.emplace_back();
-    m_outputToInput.emplace_back();
-    m_path.emplace_back(it->first);
-  }
+  const std::size_t index = insertPath(HashedPath{path, hashPath(path)});
 #ifdef _WIN32
-  else {
-    // On windows paths may differ so update `path` here with the canonical
-    // one, which may differ by path separators
-    path = it->first;
-  }
+  // On windows paths may differ so update `path` here with the canonical
+  // one, which may differ by path separators
+  path = m_path[index];
 #endif
-  return it->second;
+  return index;
 }
 
 std::size_t Graph::addNormalizedPath(std::string_view path) {
-  const std::size_t nextIndex = m_inputToOutput.size();
+  return addNormalizedPath(HashedPath{path, hashPath(path)});
+}
+
+std::size_t Graph::addNormalizedPath(const HashedPath& path) {
 #ifndef NDEBUG
-  std::string copy{path};
+  std::string copy{path.path};
   CanonicalizePath(&copy);
-  assert(copy == path);
+  assert(copy == path.path);
+  assert(path.hash == hashPath(path.path));
 #endif
-  const auto [it, inserted] = m_pathToIndex.try_emplace(path, nextIndex);
+  return insertPath(path);
+}
+
+void Graph::addNormalizedPaths(std::span<const std::string_view> paths,
+                               std::span<std::size_t> indices) {
+  assert(paths.size() == indices.size());
+  std::transform(paths.begin(), paths.end(), indices.begin(), hashPath);
+  for (std::size_t i = 0; i < paths.size(); ++i) {
+    indices[i] = addNormalizedPath(HashedPath{paths[i], indices[i]});
+  }
+}
+
+std::size_t Graph::insertPath(const HashedPath& path) {
+  // Optimistically copy `path` so that a new key refers to stable storage,
+  // which we can cheaply give back if `path` already exists
+  const std::string_view stored = m_pathStorage.store(path.path);
+  const auto [it, inserted] = m_pathToIndex.try_emplace(
+      HashedPath{stored, path.hash}, m_path.size());
   if (inserted) {
-    m_inputToOutput.emplace_back();
-    m_outputToInput.emplace_back();
-    m_path.emplace_back(it->first);
+    addNode(stored);
+  } else {
+    m_pathStorage.release(stored);
   }
   return it->second;
 }
@@ -112,13 +159,18 @@ std::optional<std::size_t> Graph::findPath(std::string& path) const {
     // one
     path = it->first;
 #endif
-    assert(it->first.view() == path);
+    assert(it->first == path);
     return it->second;
   }
 }
 
 std::optional<std::size_t> Graph::findNormalizedPath(
     std::string_view path) const {
+  return findNormalizedPath(HashedPath{path, hashPath(path)});
+}
+
+std::optional<std::size_t> Graph::findNormalizedPath(
+    const HashedPath& path) const {
   const auto it = m_pathToIndex.find(path);
   if (it == m_pathToIndex.end()) {
     return std::nullopt;
@@ -127,25 +179,66 @@ std::optional<std::size_t> Graph::findNormalizedPath(
   }
 }
 
+void Graph::findNormalizedPaths(
+    std::span<const std::string_view> paths,
+    std::span<std::optional<std::size_t>> indices) const {
+  assert(paths.size() == indices.size());
+  // Hash everything first, which has no dependencies between paths, and store
+  // the hashes in `indices` until we probe
+  for (std::size_t i = 0; i < paths.size(); ++i) {
+    indices[i] = hashPath(paths[i]);
+  }
+  for (std::size_t i = 0; i < paths.size(); ++i) {
+    indices[i] = findNormalizedPath(HashedPath{paths[i], *indices[i]});
+  }
+}
+
+std::size_t Graph::hashPath(std::string_view path) {
+#ifdef _WIN32
+  // Paths that differ only by their separators are the same on Windows, so
+  // hash backslashes as forward slashes
+  if (path.find('\\') != std::string_view::npos) {
+    std::string copy{path};
+    std::replace(copy.begin(), copy.end(), '\\', '/');
+    return rapidhash(copy.data(), copy.size());
+  }
+#endif
+  return rapidhash(path.data(), path.size());
+}
+
 std::size_t Graph::addDefault() {
   assert(m_defaultIndex == std::numeric_limits<std::size_t>::max());
-  const std::size_t nextIndex = m_inputToOutput.size();
-  m_inputToOutput.emplace_back();
-  m_outputToInput.emplace_back();
-  m_path.emplace_back("default");
-  m_defaultIndex = nextIndex;
-  return nextIndex;
+  m_defaultIndex = addNode("default");
+  return m_defaultIndex;
 }
 
 void Graph::addEdge(std::size_t in, std::size_t out) {
   assert(in != out);
-  m_inputToOutput[in].push_back(out);
-  m_outputToInput[out].push_back(in);
+  assert(!m_finalized);
+  m_inputToOutput[in].push_back(toIndex(out));
+  m_outputToInput[out].push_back(toIndex(in));
 }
 
 void Graph::addOneWayEdge(std::size_t in, std::size_t out) {
   assert(in != out);
-  m_inputToOutput[in].push_back(out);
+  assert(!m_finalized);
+  m_inputToOutput[in].push_back(toIndex(out));
+  m_outputToOrderOnlyInput[out].push_back(toIndex(in));
+}
+
+void Graph::setEdges(std::size_t pathIndex,
+                     std::span<const std::uint32_t> out,
+                     std::span<const std::uint32_t> in,
+                     std::span<const std::uint32_t> orderOnlyIn) {
+  assert(!m_finalized);
+  m_inputToOutput[pathIndex].assign(out.begin(), out.end());
+  m_outputToInput[pathIndex].assign(in.begin(), in.end());
+  if (orderOnlyIn.empty()) {
+    m_outputToOrderOnlyInput.erase(pathIndex);
+  } else {
+    m_outputToOrderOnlyInput[pathIndex].assign(orderOnlyIn.begin(),
+                                               orderOnlyIn.end());
+  }
 }
 
 bool Graph::isDefault(std::size_t pathIndex) const {
@@ -160,12 +253,84 @@ std::string_view Graph::path(std::size_t pathIndex) const {
   return m_path[pathIndex];
 }
 
-const gch::small_vector<std::size_t>& Graph::out(std::size_t pathIndex) const {
-  return m_inputToOutput[pathIndex];
+void Graph::finalize() {
+  if (m_finalized) {
+    return;
+  }
+
+  // Move the outputs that each node is only an order-only input of to the end
+  // of its output list, so that propagating through non-order-only edges
+  // never needs to search `in`
+  boost::unordered_flat_map<std::size_t, EdgeList> orderOnlyOutputs;
+  for (const auto& [out, ins] : m_outputToOrderOnlyInput) {
+    for (const std::uint32_t in : ins) {
+      orderOnlyOutputs[in].push_back(toIndex(out));
+    }
+  }
+  m_hasOrderOnlyOutput.assign(m_path.size(), false);
+  boost::unordered_flat_map<std::uint32_t, std::size_t> remaining;
+  for (const auto& [in, outs] : orderOnlyOutputs) {
+    remaining.clear();
+    for (const std::uint32_t out : outs) {
+      ++remaining[out];
+    }
+
+    // An output may have `in` as both a normal and an order-only input, in
+    // which case it appears once in each part
+    EdgeList& all = m_inputToOutput[in];
+    const auto orderOnlyStart =
+        std::stable_partition(all.begin(), all.end(), [&](std::uint32_t out) {
+          const auto it = remaining.find(out);
+          if (it == remaining.end() || it->second == 0) {
+            return true;
+          }
+          --it->second;
+          return false;
+        });
+    m_hasOrderOnlyOutput[in] = true;
+    m_orderOnlyOutputStart.emplace(in, orderOnlyStart - all.begin());
+  }
+
+  pack(m_outputs.offsets, m_outputs.targets, m_inputToOutput);
+  pack(m_inputs.offsets, m_inputs.targets, m_outputToInput);
+  m_finalized = true;
 }
 
-const gch::small_vector<std::size_t>& Graph::in(std::size_t pathIndex) const {
-  return m_outputToInput[pathIndex];
+std::span<const std::uint32_t> Graph::out(std::size_t pathIndex) const {
+  if (m_finalized) {
+    const std::uint32_t* offset = &m_outputs.offsets[pathIndex];
+    return {m_outputs.targets.data() + offset[0], offset[1] - offset[0]};
+  } else {
+    return m_inputToOutput[pathIndex];
+  }
+}
+
+std::span<const std::uint32_t> Graph::outExcludingOrderOnly(
+    std::size_t pathIndex) const {
+  assert(m_finalized);
+  const std::span<const std::uint32_t> outputs = out(pathIndex);
+  if (!m_hasOrderOnlyOutput[pathIndex]) {
+    return outputs;
+  }
+  return outputs.first(m_orderOnlyOutputStart.find(pathIndex)->second);
+}
+
+std::span<const std::uint32_t> Graph::in(std::size_t pathIndex) const {
+  if (m_finalized) {
+    const std::uint32_t* offset = &m_inputs.offsets[pathIndex];
+    return {m_inputs.targets.data() + offset[0], offset[1] - offset[0]};
+  } else {
+    return m_outputToInput[pathIndex];
+  }
+}
+
+std::span<const std::uint32_t> Graph::orderOnlyIn(std::size_t pathIndex) const {
+  const auto it = m_outputToOrderOnlyInput.find(pathIndex);
+  if (it == m_outputToOrderOnlyInput.end()) {
+    return {};
+  } else {
+    return it->second;
+  }
 }
 
 std::size_t Graph::getPath(std::string_view path) const {
@@ -173,7 +338,7 @@ std::size_t Graph::getPath(std::string_view path) const {
 }
 
 std::size_t Graph::size() const {
-  return m_inputToOutput.size();
+  return m_path.size();
 }
 
 }  // namespace trimja
@@ -23,13 +23,15 @@
 #ifndef TRIMJA_GRAPH
 #define TRIMJA_GRAPH
 
-#include "fixed_string.h"
+#include "stringarena.h"
 
 #include <boost/boost_unordered.hpp>
 #include <gch/small_vector.hpp>
 
+#include <cstdint>
 #include <numeric>
 #include <optional>
+#include <span>
 #include <string>
 #include <string_view>
 #include <vector>
@@ -40,16 +42,41 @@ namespace trimja {
  * @class Graph
  * @brief Represents a directed graph where nodes are file paths and edges
  * represent dependencies.
+ *
+ * Edges are added to per-node lists while the graph is being built.  Once
+ * all edges are known, `finalize` packs them into compressed sparse row
+ * arrays, which use less memory and are faster to traverse.
  */
 class Graph {
+ public:
+  /**
+   * @struct HashedPath
+   * @brief A normalized path along with its hash from `Graph::hashPath`, which
+   * lets a path be hashed once, possibly on another thread, and then looked
+   * up without hashing it again.
+   */
+  struct HashedPath {
+    std::string_view path;
+    std::size_t hash;
+
+    /**
+     * @brief Returns `path`, which is used when `path` becomes a new key.
+     */
+    explicit operator std::string_view() const { return path; }
+  };
+
+ private:
   struct PathHash {
     using is_transparent = void;
 
+    // `rapidhash` mixes all bits so there is no need for `boost` to do it
+    using is_avalanching = void;
+
     // We need `PathHash` to have some size, otherwise we hit a compilation
     // issue with `boost::unordered_flat_map`.
     void* _;
-    std::size_t operator()(const fixed_string& v) const;
     std::size_t operator()(std::string_view v) const;
+    std::size_t operator()(const HashedPath& v) const { return v.hash; }
   };
 
   struct PathEqual {
@@ -58,28 +85,70 @@ class Graph {
     // We need `PathEqual` to have some size, otherwise we hit a compilation
     // issue with `boost::unordered_flat_map`.
     void* _;
-    bool operator()(const fixed_string& left, const fixed_string& right) const;
-    bool operator()(std::string_view left, const fixed_string& right) const;
+    bool operator()(std::string_view left, std::string_view right) const;
+    bool operator()(const HashedPath& left, std::string_view right) const {
+      return (*this)(left.path, right);
+    }
+    bool operator()(std::string_view left, const HashedPath& right) const {
+      return (*this)(left, right.path);
+    }
   };
 
  private:
-  // A look up from path to vertex index.
-  boost::unordered_flat_map<fixed_string, std::size_t, PathHash, PathEqual>
+  // The characters of all paths, which are never freed while the graph exists
+  StringArena m_pathStorage;
+
+  // A look up from path to vertex index, where all keys point into
+  // `m_pathStorage`.
+  boost::unordered_flat_map<std::string_view, std::size_t, PathHash, PathEqual>
       m_pathToIndex;
 
-  // An adjacency list of input -> output
-  std::vector<gch::small_vector<std::size_t>> m_inputToOutput;
+  // The edges of a node while the graph is being built, where most nodes
+  // have few enough edges to avoid a heap allocation
+  using EdgeList = gch::small_vector<std::uint32_t, 4>;
+
+  // The edges of all nodes in compressed sparse row format, where the edges
+  // of node `i` are [`offsets[i]`, `offsets[i + 1]`) within `targets`.  Both
+  // use 32 bits as `finalize` checks that there are fewer edges than that.
+  struct Adjacency {
+    std::vector<std::uint32_t> offsets;
+    std::vector<std::uint32_t> targets;
+  };
+
+  // An adjacency list of input -> output, which is moved to `m_outputs` by
+  // `finalize`
+  std::vector<EdgeList> m_inputToOutput;
+
+  // An adjacency list of output -> Input, which is moved to `m_inputs` by
+  // `finalize`
+  std::vector<EdgeList> m_outputToInput;
 
-  // An adjacency list of output -> Input
-  std::vector<gch::small_vector<std::size_t>> m_outputToInput;
+  // The finalized versions of `m_inputToOutput` and `m_outputToInput`
+  Adjacency m_outputs;
+  Adjacency m_inputs;
+  bool m_finalized = false;
 
-  // Names of paths (this points to the keys in `m_pathToIndex`, which is always
-  // valid since `fixed_string` has no small-string optimization and always
-  // allocates on the heap.
+  // An adjacency list of output -> order-only input, which only has entries
+  // for outputs with at least one order-only input since these are rare
+  boost::unordered_flat_map<std::size_t, EdgeList> m_outputToOrderOnlyInput;
+
+  // Whether each node is an order-only input of anything, in which case
+  // `finalize` moves those outputs to the end of its `out` list and records
+  // where they start in `m_orderOnlyOutputStart`
+  std::vector<bool> m_hasOrderOnlyOutput;
+  boost::unordered_flat_map<std::size_t, std::size_t> m_orderOnlyOutputStart;
+
+  // Names of paths, which are the same views as the keys in `m_pathToIndex`
   std::vector<std::string_view> m_path;
 
   std::size_t m_defaultIndex = std::numeric_limits<std::size_t>::max();
 
+  // Add a node without any edges called `path` and return its index
+  std::size_t addNode(std::string_view path);
+
+  // Return the index of the canonical `path`, adding it if necessary
+  std::size_t insertPath(const HashedPath& path);
+
  public:
   /**
    * @brief Constructs an empty Graph.
@@ -107,6 +176,24 @@ class Graph {
    */
   std::size_t addNormalizedPath(std::string_view path);
 
+  /**
+   * @brief Adds a normalized path that has already been hashed to the graph if
+   * it isn't already present and returns the corresponding index.
+   * @param path The normalized path to be added and its hash.
+   * @return The index corresponding to the added path.
+   */
+  std::size_t addNormalizedPath(const HashedPath& path);
+
+  /**
+   * @brief Adds each normalized path in order as if by `addNormalizedPath`,
+   * but hashes all of them before probing the graph.
+   * @param paths The normalized paths to be added.
+   * @param indices Set to the index of each path in `paths`, which must have
+   * the same size as `paths`.
+   */
+  void addNormalizedPaths(std::span<const std::string_view> paths,
+                          std::span<std::size_t> indices);
+
   /**
    * @brief Finds the index of the specified path if it exists.
    * @param path The path to be found. It will be normalized.
@@ -121,6 +208,33 @@ class Graph {
    */
   std::optional<std::size_t> findNormalizedPath(std::string_view path) const;
 
+  /**
+   * @brief Finds the index of the specified normalized path that has already
+   * been hashed if it exists.
+   * @param path The normalized path to be found and its hash.
+   * @return The index of the path if found, otherwise std::nullopt.
+   */
+  std::optional<std::size_t> findNormalizedPath(const HashedPath& path) const;
+
+  /**
+   * @brief Finds each normalized path as if by `findNormalizedPath`, but
+   * hashes all of them before probing the graph.
+   * @param paths The normalized paths to be found.
+   * @param indices Set to the index of each path in `paths` if found,
+   * otherwise std::nullopt, which must have the same size as `paths`.
+   */
+  void findNormalizedPaths(std::span<const std::string_view> paths,
+                           std::span<std::optional<std::size_t>> indices) const;
+
+  /**
+   * @brief Returns the hash of a normalized path that is used when looking it
+   * up in the graph.  This does not depend on the graph and so it is safe to
+   * call from any thread.
+   * @param path The normalized path to hash.
+   * @return The hash of `path`.
+   */
+  static std::size_t hashPath(std::string_view path);
+
   /**
    * @brief Adds a default node to the graph.
    * @return The index of the default node.
@@ -136,12 +250,32 @@ class Graph {
   void addEdge(std::size_t in, std::size_t out);
 
   /**
-   * @brief Adds an one-way edge from the specified input to output node.
+   * @brief Adds an one-way edge from the specified input to output node.  The
+   * input is not included in `in`, but is available from `orderOnlyIn`.
    * @param in The index of the input node.
    * @param out The index of the output node.
    */
   void addOneWayEdge(std::size_t in, std::size_t out);
 
+  /**
+   * @brief Replaces the output and input nodes of the specified path index.
+   * This is used to restore a graph from the results of `out` and `in`.
+   * @param pathIndex The index of the path.
+   * @param out The output nodes of the path.
+   * @param in The input nodes of the path.
+   * @param orderOnlyIn The order-only input nodes of the path.
+   */
+  void setEdges(std::size_t pathIndex,
+                std::span<const std::uint32_t> out,
+                std::span<const std::uint32_t> in,
+                std::span<const std::uint32_t> orderOnlyIn);
+
+  /**
+   * @brief Packs all edges into contiguous arrays.  No more paths or edges
+   * can be added afterwards.
+   */
+  void finalize();
+
   /**
    * @brief Checks if the specified path index is the default node.
    * @param pathIndex The index of the path to check.
@@ -163,19 +297,40 @@ class Graph {
   std::string_view path(std::size_t pathIndex) const;
 
   /**
-   * @brief Gets the vector of output nodes for the specified path index.
+   * @brief Gets the output nodes for the specified path index.
+   * @param pathIndex The index of the path.
+   * @return The output nodes, which are valid until the next modification of
+   * the graph.
+   */
+  std::span<const std::uint32_t> out(std::size_t pathIndex) const;
+
+  /**
+   * @brief Gets the output nodes for the specified path index that have it in
+   * `in`, which is `out` without the outputs that only have it as an
+   * order-only dependency.  The graph must be finalized.
+   * @param pathIndex The index of the path.
+   * @return The output nodes, which are a prefix of `out`.
+   */
+  std::span<const std::uint32_t> outExcludingOrderOnly(
+      std::size_t pathIndex) const;
+
+  /**
+   * @brief Gets the input nodes for the specified path index.  Note that this
+   * does not include order-only dependencies.
    * @param pathIndex The index of the path.
-   * @return The vector of output nodes.
+   * @return The input nodes, which are valid until the next modification of
+   * the graph.
    */
-  const gch::small_vector<std::size_t>& out(std::size_t pathIndex) const;
+  std::span<const std::uint32_t> in(std::size_t pathIndex) const;
 
   /**
-   * @brief Gets the vector of input nodes for the specified path index.  Note
-   * that this does not include order-only dependencies.
+   * @brief Gets the order-only input nodes for the specified path index, which
+   * are those added with `addOneWayEdge`.
    * @param pathIndex The index of the path.
-   * @return The vector of input nodes.
+   * @return The order-only input nodes, which are valid until the next
+   * modification of the graph.
    */
-  const gch::small_vector<std::size_t>& in(std::size_t pathIndex) const;
+  std::span<const std::uint32_t> orderOnlyIn(std::size_t pathIndex) const;
 
   /**
    * @brief Gets the index of the specified path.
@@ -0,0 +1,47 @@
+// MIT License
+//
+// Copyright (c) 2024 Elliot Goodrich
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef TRIMJA_JSONUTIL
+#define TRIMJA_JSONUTIL
+
+#include <string>
+#include <string_view>
+
+namespace trimja {
+
+/**
+ * @struct JSONUtil
+ * @brief Provides static methods to help write JSON.
+ */
+struct JSONUtil {
+  /**
+   * @brief Appends `value` to `out` as a quoted and escaped JSON string.
+   *
+   * @param out The string to append to.
+   * @param value The text to escape.
+   */
+  static void appendString(std::string& out, std::string_view value);
+};
+
+}  // namespace trimja
+
+#endif  // TRIMJA_JSONUTIL
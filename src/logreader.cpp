@@ -23,31 +23,109 @@
 #include "logreader.h"
 #include "ninja_clock.h"
 
+#include <algorithm>
 #include <array>
+#include <bit>
 #include <cassert>
 #include <charconv>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define TRIMJA_LOGREADER_SSE2 1
+#include <emmintrin.h>
+#endif
 
 namespace trimja {
 namespace {
 
+// Return a pointer to the first `c` in [`begin`, `end`), or `end` if there is
+// none.
+const char* findFirst(const char* begin, const char* end, char c) {
+#ifdef TRIMJA_LOGREADER_SSE2
+  const __m128i needle = _mm_set1_epi8(c);
+  for (; end - begin >= 16; begin += 16) {
+    const __m128i chunk =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+    const auto mask = static_cast<unsigned>(
+        _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle)));
+    if (mask != 0) {
+      return begin + std::countr_zero(mask);
+    }
+  }
+#endif
+  return std::find(begin, end, c);
+}
+
+// Return a pointer to the last `c` in [`begin`, `end`), or `nullptr` if there
+// is none.
+const char* findLast(const char* begin, const char* end, char c) {
+#ifdef TRIMJA_LOGREADER_SSE2
+  const __m128i needle = _mm_set1_epi8(c);
+  for (; end - begin >= 16; end -= 16) {
+    const __m128i chunk =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(end - 16));
+    const auto mask = static_cast<unsigned>(
+        _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle)));
+    if (mask != 0) {
+      return end - 1 - (std::countl_zero(mask) - 16);
+    }
+  }
+#endif
+  while (end != begin) {
+    if (*--end == c) {
+      return end;
+    }
+  }
+  return nullptr;
+}
+
+// Split `in` on tabs and fill in the first `count` elements of `parts`
 template <std::size_t N>
-std::array<std::string_view, N> splitOnTab(std::string_view in) {
-  std::array<std::string_view, N> parts = {};
-  auto it = in.begin();
-  const auto end = in.end();
-  for (std::string_view& part : parts) {
-    const auto tab = std::find(it, end, '\t');
-    part = std::string_view{&*it, static_cast<std::size_t>(tab - it)};
-    it = tab + std::min<std::size_t>(sizeof('\t'), end - tab);
+void splitOnTab(std::string_view in,
+                std::size_t count,
+                std::array<std::string_view, N>& parts) {
+  const char* it = in.data();
+  const char* const end = in.data() + in.size();
+  for (std::size_t i = 0; i < std::min(count, N); ++i) {
+    const char* const tab = findFirst(it, end, '\t');
+    parts[i] = std::string_view{it, static_cast<std::size_t>(tab - it)};
+    it = tab + (tab != end);
+  }
+}
+
+// Return the hash type used by a log file with the first line `header`
+HashType parseHeader(std::string_view header) {
+  const std::string_view prefix = "# ninja log v";
+  if (!header.starts_with(prefix)) {
+    throw std::runtime_error{"Unable to find log file signature"};
+  }
+
+  const std::string_view versionStr = header.substr(prefix.size());
+  // We support the following versions of the log file format:
+  // * 5 has high-resolution timestamps
+  // * 6 is identical https://github.com/ninja-build/ninja/pull/2240
+  // * 7 only changes the hash function
+  //   https://github.com/ninja-build/ninja/pull/2519
+  if (versionStr != "5" && versionStr != "6" && versionStr != "7") {
+    std::string msg;
+    msg += "Unsupported log file version (";
+    msg += versionStr;
+    msg += ") found";
+    throw std::runtime_error{msg};
   }
-  return parts;
+
+  assert(versionStr.size() == 1);
+  return versionStr[0] == '7' ? HashType::rapidhash : HashType::murmur;
 }
 
 }  // namespace
 
 static_assert(std::input_iterator<LogReader::iterator>);
 
-LogReader::iterator::iterator(LogReader* reader) : m_reader(reader), m_entry() {
+LogReader::iterator::iterator(LogReader* reader, bool reversed)
+    : m_reader(reader), m_entry(), m_reversed(reversed) {
   ++(*this);
 }
 
@@ -56,7 +134,9 @@ const LogEntry& LogReader::iterator::operator*() const {
 }
 
 LogReader::iterator& LogReader::iterator::operator++() {
-  if (!m_reader->read(&m_entry)) {
+  const bool hasEntry = m_reversed ? m_reader->readPrevious(&m_entry)
+                                   : m_reader->read(&m_entry);
+  if (!hasEntry) {
     m_reader = nullptr;
   }
   return *this;
@@ -74,58 +154,106 @@ bool operator!=(const LogReader::iterator& iter, LogReader::sentinel) {
   return iter.m_reader != nullptr;
 }
 
-LogReader::LogReader(std::istream& logs, int fields)
-    : m_logs{&logs},
-      m_nextLine{},
+LogReader::reversed_range::reversed_range(LogReader* reader)
+    : m_reader(reader) {}
+
+LogReader::iterator LogReader::reversed_range::begin() {
+  return iterator(m_reader, true);
+}
+
+LogReader::sentinel LogReader::reversed_range::end() {
+  return sentinel();
+}
+
+LogReader::LogReader(const std::filesystem::path& ninja_log, int fields)
+    : m_logs{ninja_log},
+      m_begin{},
+      m_end{},
+      m_next{},
+      m_previous{},
       m_hashType{static_cast<HashType>(-1)},
       m_fields{fields} {
-  std::getline(*m_logs, m_nextLine, '\n');
-  const std::string_view prefix = "# ninja log v";
-  if (!m_nextLine.starts_with(prefix)) {
+  const std::string_view contents = m_logs.contents();
+  const std::size_t headerEnd = contents.find('\n');
+  m_hashType = parseHeader(contents.substr(0, headerEnd));
+
+  // Entries finish at the first empty line, so that iterating in either
+  // direction will see the same entries
+  std::string_view entries = headerEnd == std::string_view::npos
+                                 ? std::string_view{}
+                                 : contents.substr(headerEnd + 1);
+  if (entries.starts_with('\n')) {
+    entries = {};
+  } else if (const std::size_t emptyLine = entries.find("\n\n");
+             emptyLine != std::string_view::npos) {
+    entries = entries.substr(0, emptyLine + 1);
+  }
+
+  m_begin = entries.data();
+  m_end = entries.data() + entries.size();
+  m_next = m_begin;
+  m_previous = m_end;
+}
+
+HashType LogReader::readHashType(const std::filesystem::path& ninja_log) {
+  std::ifstream log{ninja_log, std::ios_base::binary};
+  std::string header;
+  if (!std::getline(log, header)) {
     throw std::runtime_error{"Unable to find log file signature"};
   }
+  return parseHeader(header);
+}
 
-  const std::string_view versionStr =
-      std::string_view{m_nextLine}.substr(prefix.size());
-  // We support the following versions of the log file format:
-  // * 5 has high-resolution timestamps
-  // * 6 is identical https://github.com/ninja-build/ninja/pull/2240
-  // * 7 only changes the hash function
-  //   https://github.com/ninja-build/ninja/pull/2519
-  if (versionStr != "5" && versionStr != "6" && versionStr != "7") {
-    std::string msg;
-    msg += "Unsupported log file version (";
-    msg += versionStr;
-    msg += ") found";
-    throw std::runtime_error{msg};
+bool LogReader::read(LogEntry* output) {
+  if (m_next == m_end) {
+    return false;
   }
 
-  assert(versionStr.size() == 1);
-  m_hashType = versionStr[0] == '7' ? HashType::rapidhash : HashType::murmur;
+  const char* const newline = findFirst(m_next, m_end, '\n');
+  const std::string_view line{m_next,
+                              static_cast<std::size_t>(newline - m_next)};
+  m_next = newline + (newline != m_end);
+  parse(line, output);
+  return true;
 }
 
-bool LogReader::read(LogEntry* output) {
-  std::getline(*m_logs, m_nextLine, '\n');
-  if (m_nextLine.empty()) {
+bool LogReader::readPrevious(LogEntry* output) {
+  if (m_previous == m_begin) {
     return false;
   }
 
-  std::array<std::string_view, 5> parts = splitOnTab<5>(m_nextLine);
+  const char* lineEnd = m_previous;
+  if (lineEnd[-1] == '\n') {
+    --lineEnd;
+  }
+  const char* const newline = findLast(m_begin, lineEnd, '\n');
+  m_previous = newline ? newline + 1 : m_begin;
+  parse(std::string_view{m_previous,
+                         static_cast<std::size_t>(lineEnd - m_previous)},
+        output);
+  return true;
+}
+
+void LogReader::parse(std::string_view line, LogEntry* output) const {
+  // Only split as far as the last field that we need
+  std::array<std::string_view, 5> parts;
+  const int lastField = std::bit_width(static_cast<unsigned>(m_fields));
+  splitOnTab(line, lastField > 0 ? lastField - 1 : 0, parts);
 
   if (m_fields & LogEntry::Fields::startTime) {
-    std::int32_t ticks;
+    std::int32_t ticks = 0;
     std::from_chars(parts[0].data(), parts[0].data() + parts[0].size(), ticks);
     output->startTime = std::chrono::duration<std::int32_t, std::milli>{ticks};
   }
 
   if (m_fields & LogEntry::Fields::endTime) {
-    std::int32_t ticks;
+    std::int32_t ticks = 0;
     std::from_chars(parts[1].data(), parts[1].data() + parts[1].size(), ticks);
     output->endTime = std::chrono::duration<std::int32_t, std::milli>{ticks};
   }
 
   if (m_fields & LogEntry::Fields::mtime) {
-    ninja_clock::rep ticks;
+    ninja_clock::rep ticks = 0;
     std::from_chars(parts[2].data(), parts[2].data() + parts[2].size(), ticks);
     output->mtime = ninja_clock::to_file_clock(
         ninja_clock::time_point{ninja_clock::duration{ticks}});
@@ -140,7 +268,6 @@ bool LogReader::read(LogEntry* output) {
                     output->hash, 16);
     output->hashType = m_hashType;
   }
-  return true;
 }
 
 LogReader::iterator LogReader::begin() {
@@ -151,4 +278,8 @@ LogReader::sentinel LogReader::end() {
   return sentinel();
 }
 
+LogReader::reversed_range LogReader::reversed() {
+  return reversed_range(this);
+}
+
 }  // namespace trimja
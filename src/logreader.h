@@ -23,11 +23,12 @@
 #ifndef TRIMJA_LOGREADER
 #define TRIMJA_LOGREADER
 
+#include "mappedfile.h"
+
 #include <chrono>
 #include <cstddef>
-#include <iosfwd>
+#include <filesystem>
 #include <iterator>
-#include <string>
 #include <string_view>
 
 namespace trimja {
@@ -74,17 +75,25 @@ struct LogEntry {
 
 /**
  * @class LogReader
- * @brief Reads and parses log entries from an input stream.
+ * @brief Reads and parses log entries from a .ninja_log file.
  *
  * The LogReader class provides functionality to read and parse log entries
- * from a given input stream. It supports iteration over the log entries.
+ * from a memory-mapped .ninja_log file. It supports iteration over the log
+ * entries both from the start and, with `reversed()`, from the end of the
+ * file.  Iterating from the end allows callers to see the most recent entry
+ * for each output first and skip over those that have been superseded.
  */
 class LogReader {
-  std::istream* m_logs;
-  std::string m_nextLine;
+  MappedFile m_logs;
+  const char* m_begin;
+  const char* m_end;
+  const char* m_next;
+  const char* m_previous;
   HashType m_hashType;
   int m_fields;
 
+  void parse(std::string_view line, LogEntry* output) const;
+
  public:
   /**
    * @struct sentinel
@@ -102,6 +111,7 @@ class LogReader {
   class iterator {
     LogReader* m_reader;
     LogEntry m_entry;
+    bool m_reversed;
 
    public:
     using difference_type = std::ptrdiff_t;
@@ -110,8 +120,9 @@ class LogReader {
     /**
      * @brief Constructs an iterator for the given LogReader.
      * @param reader Pointer to the LogReader.
+     * @param reversed Whether to iterate from the end of the file.
      */
-    iterator(LogReader* reader);
+    iterator(LogReader* reader, bool reversed = false);
 
     /**
      * @brief Dereferences the iterator to access the current log entry.
@@ -148,13 +159,42 @@ class LogReader {
     friend bool operator!=(const iterator& iter, sentinel s);
   };
 
+  /**
+   * @class reversed_range
+   * @brief A range over the log entries starting from the end of the file.
+   */
+  class reversed_range {
+    LogReader* m_reader;
+
+   public:
+    /**
+     * @brief Constructs a reversed range for the given LogReader.
+     * @param reader Pointer to the LogReader.
+     */
+    explicit reversed_range(LogReader* reader);
+
+    /**
+     * @brief Returns an iterator to the last log entry.
+     * @return An iterator to the last log entry.
+     */
+    iterator begin();
+
+    /**
+     * @brief Returns a sentinel representing the start of the log entries.
+     * @return A sentinel representing the start of the log entries.
+     */
+    sentinel end();
+  };
+
  public:
   /**
-   * @brief Constructs a LogReader with the given input stream.
-   * @param logs The input stream to read log entries from.
+   * @brief Constructs a LogReader for the given .ninja_log file.
+   * @param ninja_log The path to the .ninja_log file.
    * @param fields The fields to read from the log entries.
+   * @throws std::runtime_error if the file cannot be opened or has an
+   * unsupported header.
    */
-  explicit LogReader(std::istream& logs,
+  explicit LogReader(const std::filesystem::path& ninja_log,
                      int fields = LogEntry::Fields::startTime |
                                   LogEntry::Fields::endTime |
                                   LogEntry::Fields::mtime |
@@ -162,13 +202,34 @@ class LogReader {
                                   LogEntry::Fields::hash);
 
   /**
-   * @brief Reads the next log entry from the input stream.
+   * @brief Reads only the header of the given .ninja_log file to find the hash
+   * type used by all of its entries.
+   * @param ninja_log The path to the .ninja_log file.
+   * @return The hash type used by the log file.
+   * @throws std::runtime_error if the file cannot be opened or has an
+   * unsupported header.
+   */
+  static HashType readHashType(const std::filesystem::path& ninja_log);
+
+  /**
+   * @brief Reads the next log entry from the file.
    * @param output Pointer to the LogEntry to store the read data.
    * @return Return true if an entry was successfully read and false if we are
    * at the end of the file.
    */
   bool read(LogEntry* output);
 
+  /**
+   * @brief Reads the previous log entry, starting from the end of the file.
+   *
+   * This is independent of the position used by `read`.
+   *
+   * @param output Pointer to the LogEntry to store the read data.
+   * @return Return true if an entry was successfully read and false if we are
+   * at the start of the file.
+   */
+  bool readPrevious(LogEntry* output);
+
   /**
    * @brief Returns an iterator to the beginning of the log entries.
    * @return An iterator to the beginning of the log entries.
@@ -180,6 +241,12 @@ class LogReader {
    * @return A sentinel representing the end of the log entries.
    */
   sentinel end();
+
+  /**
+   * @brief Returns a range over the log entries starting from the end.
+   * @return A range over the log entries in reverse order.
+   */
+  reversed_range reversed();
 };
 
 }  // namespace trimja
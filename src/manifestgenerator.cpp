@@ -0,0 +1,220 @@
+// MIT License
+//
+// Copyright (c) 2024 Elliot Goodrich
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "manifestgenerator.h"
+
+#include "depswriter.h"
+
+#include <rapidhash/rapidhash.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string_view>
+
+namespace trimja {
+
+namespace {
+
+// Write `contents` to `file`, throwing if anything fails
+void writeFile(const std::filesystem::path& file, std::string_view contents) {
+  std::ofstream out{file, std::ios_base::binary};
+  out.write(contents.data(), contents.size());
+  out.flush();
+  if (!out) {
+    throw std::runtime_error{"Unable to write to " + file.string()};
+  }
+}
+
+// Return the name of the `subninja` file at `level` below the top-level
+// `subninja` file `index`
+std::string subninjaName(std::size_t index, std::size_t level) {
+  std::string name = "sub" + std::to_string(index);
+  if (level > 0) {
+    name += '_';
+    name += std::to_string(level);
+  }
+  return name;
+}
+
+// Append a `.ninja_log` entry for `out` to `log`
+void appendLogEntry(std::string& log,
+                    std::string_view out,
+                    std::string_view command,
+                    bool stale) {
+  std::uint64_t hash = rapidhash(command.data(), command.size());
+  if (stale) {
+    hash ^= 1;
+  }
+  std::ostringstream hex;
+  hex << std::hex << hash;
+  log += "0\t1\t1\t";
+  log += out;
+  log += '\t';
+  log += hex.view();
+  log += '\n';
+}
+
+}  // namespace
+
+ManifestGenerator::Summary ManifestGenerator::generate(
+    const std::filesystem::path& dir,
+    const Options& options) {
+  std::filesystem::create_directories(dir);
+
+  Summary summary;
+  summary.ninjaFile = dir / "build.ninja";
+
+  std::mt19937_64 random{options.seed};
+  std::bernoulli_distribution isStale{options.staleFraction};
+  const std::size_t fanIn = std::max<std::size_t>(options.fanIn, 1);
+  const std::size_t headerCount =
+      std::max<std::size_t>(fanIn * 4, options.edges / 16);
+  std::uniform_int_distribution<std::size_t> chooseHeader{0, headerCount - 1};
+
+  std::ofstream depsFile{dir / ".ninja_deps", std::ios_base::binary};
+  DepsWriter deps{depsFile};
+  std::vector<std::int32_t> headerIds(headerCount, -1);
+  std::vector<std::int32_t> dependencies;
+  const auto now = std::chrono::file_clock::now();
+
+  std::string log = "# ninja log v7\n";
+  std::string top;
+  top += "# A synthetic build generated by trimja_bench\n";
+  top += "cc = c++\n";
+  top += "\n";
+  top += "rule cc\n";
+  top += "  command = $cc $cflags -c $in -o $out\n";
+  top += "  deps = gcc\n";
+  top += "  depfile = $out.d\n";
+  top += "  description = CC $out\n";
+  top += "\n";
+  top += "rule link\n";
+  top += "  command = $cc -shared $in -o $out\n";
+  top += "  description = LINK $out\n";
+  top += "\n";
+
+  std::vector<std::string> libraries;
+  const std::size_t subninjas = std::max<std::size_t>(options.subninjas, 1);
+  const std::size_t depth = std::max<std::size_t>(options.depth, 1);
+  const std::size_t fileCount = subninjas * depth;
+  for (std::size_t index = 0; index < subninjas; ++index) {
+    top += "subninja " + subninjaName(index, 0) + ".ninja\n";
+    for (std::size_t level = 0; level < depth; ++level) {
+      const std::string name = subninjaName(index, level);
+      const std::size_t file = index * depth + level;
+      const std::size_t first = file * options.edges / fileCount;
+      const std::size_t last = (file + 1) * options.edges / fileCount;
+
+      // Pad `cflags` so that compile commands have roughly the requested
+      // length, assuming the paths are as long as those of the first edge
+      std::string cflags = "-DUNIT=" + name;
+      const std::size_t fixedLength =
+          std::string_view{"c++ "}.size() + std::string_view{" -c "}.size() +
+          std::string_view{" -o "}.size() +
+          2 * (name.size() + std::to_string(first).size() + 10);
+      for (std::size_t i = 0;
+           cflags.size() + fixedLength < options.commandLength; ++i) {
+        cflags += " -Iinclude/pkg" + std::to_string(i);
+      }
+
+      std::string contents;
+      contents += "cflags = " + cflags + "\n";
+      std::vector<std::string> objects;
+      for (std::size_t edge = first; edge < last; ++edge) {
+        const std::string source =
+            "src/" + name + "/f" + std::to_string(edge) + ".cc";
+        const std::string object =
+            "obj/" + name + "/f" + std::to_string(edge) + ".o";
+        contents += "build " + object + ": cc " + source + "\n";
+        appendLogEntry(log, object,
+                       "c++ " + cflags + " -c " + source + " -o " + object,
+                       isStale(random));
+
+        dependencies.clear();
+        const std::int32_t objectId = deps.recordPath(object);
+        dependencies.push_back(deps.recordPath(source));
+        for (std::size_t i = 0; i < fanIn; ++i) {
+          const std::size_t header = chooseHeader(random);
+          if (headerIds[header] == -1) {
+            headerIds[header] =
+                deps.recordPath("include/h" + std::to_string(header) + ".h");
+          }
+          dependencies.push_back(headerIds[header]);
+        }
+        deps.recordDependencies(objectId, now, dependencies);
+
+        summary.sources.push_back(source);
+        objects.push_back(object);
+        ++summary.buildEdges;
+        ++summary.depsRecords;
+        ++summary.logEntries;
+      }
+
+      // Link every `fanIn` objects into a library
+      for (std::size_t i = 0; i < objects.size(); i += fanIn) {
+        std::string inputs;
+        for (std::size_t j = i; j < std::min(i + fanIn, objects.size()); ++j) {
+          inputs += j == i ? "" : " ";
+          inputs += objects[j];
+        }
+        const std::string library =
+            "lib/" + name + "_" + std::to_string(i / fanIn) + ".so";
+        contents += "build " + library + ": link " + inputs + "\n";
+        appendLogEntry(log, library,
+                       "c++ -shared " + inputs + " -o " + library,
+                       isStale(random));
+        libraries.push_back(library);
+        ++summary.buildEdges;
+        ++summary.logEntries;
+      }
+
+      if (level + 1 < depth) {
+        contents += "subninja " + subninjaName(index, level + 1) + ".ninja\n";
+      }
+      writeFile(dir / (name + ".ninja"), contents);
+      summary.manifestBytes += contents.size();
+    }
+  }
+
+  top += "\nbuild all: phony";
+  for (const std::string& library : libraries) {
+    top += ' ';
+    top += library;
+  }
+  top += "\ndefault all\n";
+  writeFile(summary.ninjaFile, top);
+  summary.manifestBytes += top.size();
+
+  writeFile(dir / ".ninja_log", log);
+  depsFile.flush();
+  if (!depsFile) {
+    throw std::runtime_error{"Unable to write to " +
+                             (dir / ".ninja_deps").string()};
+  }
+  return summary;
+}
+
+}  // namespace trimja
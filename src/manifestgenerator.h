@@ -0,0 +1,108 @@
+// MIT License
+//
+// Copyright (c) 2024 Elliot Goodrich
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef TRIMJA_MANIFESTGENERATOR
+#define TRIMJA_MANIFESTGENERATOR
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace trimja {
+
+/**
+ * @brief Utility to generate a synthetic ninja build, along with its
+ * `.ninja_deps` and `.ninja_log`, in order to benchmark trimja.
+ *
+ * The build compiles one source file per compile edge, where each object
+ * depends on a number of headers through `.ninja_deps`, and links groups of
+ * objects into libraries.  Edges are split between `subninja` files, which
+ * can be nested, to mimic the layout of large generated builds.
+ */
+struct ManifestGenerator {
+  /**
+   * @brief The shape of the generated build.
+   */
+  struct Options {
+    // The number of compile edges
+    std::size_t edges = 100'000;
+
+    // The number of top-level `subninja` files
+    std::size_t subninjas = 8;
+
+    // The number of nested `subninja` files below each top-level one
+    std::size_t depth = 1;
+
+    // The number of headers of each object and objects of each library
+    std::size_t fanIn = 8;
+
+    // The approximate length of each compile command
+    std::size_t commandLength = 200;
+
+    // The fraction of commands whose hash in `.ninja_log` is out of date
+    double staleFraction = 0.01;
+
+    // The seed for the random choice of headers and stale commands
+    std::uint64_t seed = 1;
+  };
+
+  /**
+   * @brief A description of what was generated.
+   */
+  struct Summary {
+    // The path of the top-level ninja file
+    std::filesystem::path ninjaFile;
+
+    // The total size of all ninja files in bytes
+    std::size_t manifestBytes = 0;
+
+    // The number of build edges, including links
+    std::size_t buildEdges = 0;
+
+    // The number of dependency records in `.ninja_deps`
+    std::size_t depsRecords = 0;
+
+    // The number of entries in `.ninja_log`
+    std::size_t logEntries = 0;
+
+    // All source files, which are suitable as affected paths
+    std::vector<std::string> sources;
+  };
+
+  /**
+   * @brief Generates a build inside a directory.
+   *
+   * @param dir The directory to write to, which is created if necessary and
+   * has any existing ninja state in it overwritten.
+   * @param options The shape of the build.
+   * @return A description of the generated build.
+   * @throws std::runtime_error if any file cannot be written.
+   */
+  static Summary generate(const std::filesystem::path& dir,
+                          const Options& options);
+};
+
+}  // namespace trimja
+
+#endif  // TRIMJA_MANIFESTGENERATOR
@@ -24,6 +24,9 @@
 
 #include <ninja/lexer.h>
 
+#include <cassert>
+#include <cctype>
+#include <cstring>
 #include <stdexcept>
 
 namespace trimja {
@@ -393,10 +396,54 @@ bool operator!=(const ManifestReader::iterator& iter,
   return !(iter == s);
 }
 
+const char* endOfLine(const char* line, const char* end, bool isComment) {
+  const char* p = line;
+  while (true) {
+    const char* const newline =
+        static_cast<const char*>(std::memchr(p, '\n', end - p));
+    if (!newline) {
+      return end;
+    }
+    const char* last = newline;
+    if (last != line && *(last - 1) == '\r') {
+      --last;
+    }
+    std::size_t dollars = 0;
+    while (last != line && *(last - 1) == '$') {
+      --last;
+      ++dollars;
+    }
+    if (isComment || dollars % 2 == 0) {
+      return newline + 1;
+    }
+    p = newline + 1;
+  }
+}
+
+bool startsWithKeyword(const char* line,
+                       const char* end,
+                       std::string_view word) {
+  if (static_cast<std::size_t>(end - line) <= word.size() ||
+      std::string_view{line, word.size()} != word) {
+    return false;
+  }
+  // Keywords are only recognized when they are not part of a longer name
+  const char next = line[word.size()];
+  return !std::isalnum(static_cast<unsigned char>(next)) && next != '_' &&
+         next != '.' && next != '-';
+}
+
+ManifestReader::ManifestReader(const std::filesystem::path& ninjaFile,
+                               std::string_view ninjaFileContents)
+    : ManifestReader(ninjaFile, ninjaFileContents, 0) {}
+
 ManifestReader::ManifestReader(const std::filesystem::path& ninjaFile,
-                               const std::string& ninjaFileContents)
+                               std::string_view ninjaFileContents,
+                               std::size_t offset)
     : m_lexer(), m_storage() {
-  m_lexer.Start(ninjaFile, ninjaFileContents);
+  assert(ninjaFileContents.data()[ninjaFileContents.size()] == '\0');
+  assert(offset <= ninjaFileContents.size());
+  m_lexer.Start(ninjaFile, ninjaFileContents, offset);
 }
 
 ManifestReader::iterator ManifestReader::begin() {
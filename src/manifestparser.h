@@ -240,6 +240,27 @@ class SubninjaReader : public detail::BaseReaderWithStart {
   const std::filesystem::path& parent() const;
 };
 
+/**
+ * @brief Finds the end of a line in a Ninja build file without lexing it.
+ * @param line The start of the line.
+ * @param end The end of the contents containing `line`.
+ * @param isComment Whether the line is a comment, where a `$` before the
+ * newline does not continue it onto the next line.
+ * @return The start of the next line, or `end` if this is the last line.
+ */
+const char* endOfLine(const char* line, const char* end, bool isComment);
+
+/**
+ * @brief Checks whether a line in a Ninja build file starts with a keyword.
+ * @param line The start of the line.
+ * @param end The end of the contents containing `line`.
+ * @param word The keyword, such as `build`.
+ * @return Whether `line` starts with `word` and not a longer name.
+ */
+bool startsWithKeyword(const char* line,
+                       const char* end,
+                       std::string_view word);
+
 /**
  * @class ManifestReader
  * @brief Class for parsing a Ninja build file.
@@ -275,8 +296,31 @@ class ManifestReader {
     friend bool operator!=(const iterator& iter, sentinel s);
   };
 
+  /**
+   * @brief Constructs a ManifestReader over the contents of a ninja file.
+   * @param ninjaFile The path of the ninja file, used for error messages and
+   * for resolving `include` and `subninja` paths.
+   * @param ninjaFileContents The contents of the ninja file, which must be
+   * followed by a null character (e.g. from `std::string` or `MappedFile`).
+   */
   ManifestReader(const std::filesystem::path& ninjaFile,
-                 const std::string& ninjaFileContents);
+                 std::string_view ninjaFileContents);
+
+  /**
+   * @brief Constructs a ManifestReader that starts part way through the
+   * contents of a ninja file.
+   * @param ninjaFile The path of the ninja file, used for error messages and
+   * for resolving `include` and `subninja` paths.
+   * @param ninjaFileContents The contents of the ninja file, which must be
+   * followed by a null character (e.g. from `std::string` or `MappedFile`).
+   * @param offset The offset into `ninjaFileContents` to start reading from,
+   * which must be the start of a top-level statement.  Line numbers in error
+   * messages are still counted from the start of `ninjaFileContents`.
+   */
+  ManifestReader(const std::filesystem::path& ninjaFile,
+                 std::string_view ninjaFileContents,
+                 std::size_t offset);
+
   iterator begin();
   sentinel end();
 };
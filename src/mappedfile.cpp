@@ -0,0 +1,180 @@
+// MIT License
+//
+// Copyright (c) 2024 Elliot Goodrich
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "mappedfile.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace trimja {
+
+namespace {
+
+[[noreturn]] void throwUnableToOpen(const std::filesystem::path& file) {
+  std::string msg;
+  msg += "Unable to open ";
+  msg += file.string();
+  msg += "!";
+  throw std::runtime_error{msg};
+}
+
+std::size_t pageSize() {
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwPageSize;
+#else
+  return static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+#endif
+}
+
+// Return whether mapping a file of `size` bytes guarantees a null character
+// directly after the contents.  This is the case when the last page of the
+// mapping is only partially filled by the file, since the remainder of the
+// page is zeroed by the operating system.
+bool isNullTerminatedWhenMapped(std::uint64_t size) {
+  static const std::size_t page = pageSize();
+  return size % page != 0 && size <= std::numeric_limits<std::size_t>::max();
+}
+
+}  // namespace
+
+MappedFile::MappedFile()
+    : m_contents{""}, m_mapping{nullptr}, m_mappingSize{0}, m_buffer{} {}
+
+MappedFile::MappedFile(const std::filesystem::path& file) : MappedFile{} {
+#ifdef _WIN32
+  const HANDLE handle = CreateFileW(
+      file.c_str(), GENERIC_READ,
+      FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+      OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+      nullptr);
+  if (handle == INVALID_HANDLE_VALUE) {
+    throwUnableToOpen(file);
+  }
+
+  LARGE_INTEGER size;
+  if (GetFileSizeEx(handle, &size) &&
+      isNullTerminatedWhenMapped(size.QuadPart)) {
+    const HANDLE mapping =
+        CreateFileMappingW(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping != nullptr) {
+      // The view keeps the mapping alive so we can close the handle now
+      m_mapping = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+      m_mappingSize = static_cast<std::size_t>(size.QuadPart);
+      CloseHandle(mapping);
+    }
+  }
+  CloseHandle(handle);
+#else
+  const int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    throwUnableToOpen(file);
+  }
+
+  struct stat info = {};
+  if (::fstat(fd, &info) == 0 && S_ISREG(info.st_mode) &&
+      isNullTerminatedWhenMapped(info.st_size)) {
+    const std::size_t size = static_cast<std::size_t>(info.st_size);
+    void* const mapping = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping != MAP_FAILED) {
+      // We only ever lex files from start to finish
+      ::madvise(mapping, size, MADV_SEQUENTIAL);
+      m_mapping = mapping;
+      m_mappingSize = size;
+    }
+  }
+  ::close(fd);
+#endif
+
+  if (m_mapping != nullptr) {
+    m_contents = {static_cast<const char*>(m_mapping), m_mappingSize};
+    return;
+  }
+
+  // Otherwise fall back to reading the file into a zero-initialized buffer
+  // that has room for the null terminator
+  std::ifstream stream{file, std::ios_base::binary};
+  if (!stream) {
+    throwUnableToOpen(file);
+  }
+  const std::string contents{std::istreambuf_iterator<char>{stream},
+                             std::istreambuf_iterator<char>{}};
+  m_buffer = std::make_unique<char[]>(contents.size() + 1);
+  std::copy(contents.begin(), contents.end(), m_buffer.get());
+  m_contents = {m_buffer.get(), contents.size()};
+}
+
+MappedFile::~MappedFile() {
+  reset();
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept
+    : m_contents{std::exchange(other.m_contents, "")},
+      m_mapping{std::exchange(other.m_mapping, nullptr)},
+      m_mappingSize{std::exchange(other.m_mappingSize, 0)},
+      m_buffer{std::move(other.m_buffer)} {}
+
+MappedFile& MappedFile::operator=(MappedFile&& rhs) noexcept {
+  MappedFile tmp{std::move(rhs)};
+  using std::swap;
+  swap(m_contents, tmp.m_contents);
+  swap(m_mapping, tmp.m_mapping);
+  swap(m_mappingSize, tmp.m_mappingSize);
+  swap(m_buffer, tmp.m_buffer);
+  return *this;
+}
+
+void MappedFile::reset() {
+  if (m_mapping != nullptr) {
+#ifdef _WIN32
+    UnmapViewOfFile(m_mapping);
+#else
+    ::munmap(m_mapping, m_mappingSize);
+#endif
+  }
+  m_contents = "";
+  m_mapping = nullptr;
+  m_mappingSize = 0;
+  m_buffer.reset();
+}
+
+std::string_view MappedFile::contents() const {
+  return m_contents;
+}
+
+}  // namespace trimja
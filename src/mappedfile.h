@@ -0,0 +1,105 @@
+// MIT License
+//
+// Copyright (c) 2024 Elliot Goodrich
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef TRIMJA_MAPPEDFILE
+#define TRIMJA_MAPPEDFILE
+
+#include <filesystem>
+#include <memory>
+#include <string_view>
+
+namespace trimja {
+
+/**
+ * @class MappedFile
+ * @brief A read-only view of the contents of a file, which is memory-mapped
+ * where possible to avoid copying the file.
+ *
+ * The contents are always followed by a null character, which is required by
+ * ninja's lexer.  If the file cannot be mapped in a way that guarantees this
+ * (e.g. it is empty or its size is a multiple of the page size) then the
+ * contents are read into an internal buffer instead.
+ *
+ * All `std::string_view`s returned from `contents()` are valid until the
+ * `MappedFile` is destroyed or `reset()` is called, even if it is moved.
+ */
+class MappedFile {
+  std::string_view m_contents;
+  void* m_mapping;
+  std::size_t m_mappingSize;
+  std::unique_ptr<char[]> m_buffer;
+
+ public:
+  /**
+   * @brief Constructs an empty MappedFile.
+   */
+  MappedFile();
+
+  /**
+   * @brief Maps the contents of the specified file.
+   * @param file The path of the file to map.
+   * @throws std::runtime_error if the file cannot be opened.
+   */
+  explicit MappedFile(const std::filesystem::path& file);
+
+  /**
+   * @brief Unmaps the file.
+   */
+  ~MappedFile();
+
+  /**
+   * @brief Move construct from another MappedFile.
+   *
+   * `other` will be left empty.
+   *
+   * @param other The MappedFile to move from.
+   */
+  MappedFile(MappedFile&& other) noexcept;
+
+  /**
+   * @brief Move assign from another MappedFile.
+   *
+   * `rhs` will be left empty.
+   *
+   * @param rhs The MappedFile to move assign from.
+   * @return A reference to this.
+   */
+  MappedFile& operator=(MappedFile&& rhs) noexcept;
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  /**
+   * @brief Unmaps the file and leaves this MappedFile empty.
+   */
+  void reset();
+
+  /**
+   * @brief Gets the contents of the file.
+   * @return The contents of the file, which is followed by a null character.
+   */
+  std::string_view contents() const;
+};
+
+}  // namespace trimja
+
+#endif  // TRIMJA_MAPPEDFILE
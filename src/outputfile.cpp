@@ -0,0 +1,208 @@
+// MIT License
+//
+// Copyright (c) 2024 Elliot Goodrich
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "outputfile.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+namespace trimja {
+
+namespace {
+
+// The size of each block that is written or compared at once
+const std::size_t BLOCK_SIZE = 64 * 1024;
+
+// The most symlinks we follow before giving up on a cycle
+const int MAX_SYMLINK_DEPTH = 40;
+
+[[noreturn]] void throwUnableToWrite(const std::filesystem::path& file) {
+  throw std::runtime_error{"Unable to write to " + file.string()};
+}
+
+}  // namespace
+
+OutputFile::OutputFile(const std::filesystem::path& file)
+    : m_file{file},
+      m_temp{},
+      m_existing{},
+      m_output{},
+      m_matched{0},
+      m_direct{false},
+      m_diverged{false},
+      m_committed{false},
+      m_buffer(BLOCK_SIZE),
+      m_compare(BLOCK_SIZE),
+      m_stream{this} {
+  std::error_code ec;
+  const std::filesystem::file_status status =
+      std::filesystem::status(file, ec);
+  m_direct = std::filesystem::exists(status) &&
+             !std::filesystem::is_regular_file(status);
+  if (!m_direct) {
+    // Replace the file that any link points to rather than the link itself,
+    // even if that file does not exist yet
+    for (int depth = 0; std::filesystem::is_symlink(m_file, ec); ++depth) {
+      const std::filesystem::path target =
+          std::filesystem::read_symlink(m_file, ec);
+      if (ec || depth == MAX_SYMLINK_DEPTH) {
+        throwUnableToWrite(file);
+      }
+      m_file = m_file.parent_path() / target;
+    }
+  }
+
+  if (m_direct) {
+    m_output.open(m_file, std::ios_base::binary);
+  } else {
+    // Create the temporary file now so that we fail before doing any work if
+    // we are unable to replace `m_file` later
+    m_temp = m_file;
+    m_temp += ".trimja-tmp";
+    m_output.open(m_temp, std::ios_base::binary);
+    m_existing.open(m_file, std::ios_base::binary);
+  }
+  if (!m_output.is_open()) {
+    throwUnableToWrite(file);
+  }
+  setp(m_buffer.data(), m_buffer.data() + m_buffer.size());
+}
+
+OutputFile::~OutputFile() {
+  if (!m_committed && !m_temp.empty()) {
+    m_output.close();
+    std::error_code ec;
+    std::filesystem::remove(m_temp, ec);
+  }
+}
+
+std::ostream& OutputFile::stream() {
+  return m_stream;
+}
+
+void OutputFile::consume(const char* data, std::size_t size) {
+  if (!m_direct && !m_diverged) {
+    // Skip over everything that matches the existing file
+    while (size > 0) {
+      const std::size_t count = std::min(size, m_compare.size());
+      m_existing.read(m_compare.data(), static_cast<std::streamsize>(count));
+      if (static_cast<std::size_t>(m_existing.gcount()) != count ||
+          !std::equal(data, data + count, m_compare.data())) {
+        break;
+      }
+      m_matched += count;
+      data += count;
+      size -= count;
+    }
+    if (size == 0) {
+      return;
+    }
+    diverge();
+  }
+  m_output.write(data, static_cast<std::streamsize>(size));
+}
+
+void OutputFile::diverge() {
+  // Copy everything that matched so far into the temporary file
+  m_existing.clear();
+  m_existing.seekg(0);
+  std::uint64_t remaining = m_matched;
+  while (remaining > 0) {
+    const std::size_t count =
+        static_cast<std::size_t>(std::min<std::uint64_t>(remaining,
+                                                         m_compare.size()));
+    m_existing.read(m_compare.data(), static_cast<std::streamsize>(count));
+    if (static_cast<std::size_t>(m_existing.gcount()) != count) {
+      m_output.setstate(std::ios_base::badbit);
+      break;
+    }
+    m_output.write(m_compare.data(), static_cast<std::streamsize>(count));
+    remaining -= count;
+  }
+  m_existing.close();
+  m_diverged = true;
+}
+
+OutputFile::int_type OutputFile::overflow(int_type ch) {
+  if (sync() == -1) {
+    return traits_type::eof();
+  }
+  if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+    *pptr() = traits_type::to_char_type(ch);
+    pbump(1);
+  }
+  return traits_type::not_eof(ch);
+}
+
+int OutputFile::sync() {
+  consume(pbase(), static_cast<std::size_t>(pptr() - pbase()));
+  setp(m_buffer.data(), m_buffer.data() + m_buffer.size());
+  return m_output ? 0 : -1;
+}
+
+void OutputFile::commit() {
+  if (!m_stream.flush()) {
+    throwUnableToWrite(m_file);
+  }
+  m_committed = true;
+  if (m_direct) {
+    m_output.close();
+    if (m_output.fail()) {
+      throwUnableToWrite(m_file);
+    }
+    return;
+  }
+
+  // The file is unchanged if it has nothing after what we matched
+  if (!m_diverged && m_existing.is_open() &&
+      m_existing.peek() == std::ifstream::traits_type::eof()) {
+    m_output.close();
+    m_existing.close();
+    std::error_code ec;
+    std::filesystem::remove(m_temp, ec);
+    return;
+  }
+  if (!m_diverged) {
+    diverge();
+  }
+
+  m_output.close();
+  std::error_code ec;
+  if (m_output.fail()) {
+    std::filesystem::remove(m_temp, ec);
+    throwUnableToWrite(m_file);
+  }
+  if (const std::filesystem::file_status status =
+          std::filesystem::status(m_file, ec);
+      std::filesystem::exists(status)) {
+    std::filesystem::permissions(m_temp, status.permissions(), ec);
+  }
+  std::filesystem::rename(m_temp, m_file, ec);
+  if (ec) {
+    std::filesystem::remove(m_temp, ec);
+    throwUnableToWrite(m_file);
+  }
+}
+
+}  // namespace trimja
@@ -0,0 +1,99 @@
+// MIT License
+//
+// Copyright (c) 2024 Elliot Goodrich
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef TRIMJA_OUTPUTFILE
+#define TRIMJA_OUTPUTFILE
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <ostream>
+#include <streambuf>
+#include <vector>
+
+namespace trimja {
+
+/**
+ * @class OutputFile
+ * @brief A stream buffer that writes a file only if its contents change.
+ *
+ * Output to a regular file, or to a path that does not exist yet, is compared
+ * block by block against the existing file as it is written.  Only once they
+ * differ is it written to a temporary file next to it, which `commit` renames
+ * over the original with the same permissions, so that an unchanged file
+ * keeps its modification time and a changed file is never left partially
+ * written.  Symlinks are followed so that the file they point to is replaced
+ * instead of the link.  Anything else, such as `/dev/stdout` or a FIFO, is
+ * written to directly.
+ */
+class OutputFile : public std::streambuf {
+  std::filesystem::path m_file;
+  std::filesystem::path m_temp;
+  std::ifstream m_existing;
+  std::ofstream m_output;
+  std::uint64_t m_matched;
+  bool m_direct;
+  bool m_diverged;
+  bool m_committed;
+  std::vector<char> m_buffer;
+  std::vector<char> m_compare;
+  std::ostream m_stream;
+
+  void consume(const char* data, std::size_t size);
+  void diverge();
+
+ protected:
+  int_type overflow(int_type ch) override;
+  int sync() override;
+
+ public:
+  /**
+   * @brief Opens `file` for writing, creating its temporary file if needed.
+   * @param file The path of the file to write.
+   * @throws std::runtime_error if `file` cannot be written.
+   */
+  explicit OutputFile(const std::filesystem::path& file);
+
+  /**
+   * @brief Removes the temporary file unless `commit` was called.
+   */
+  ~OutputFile() override;
+
+  OutputFile(const OutputFile&) = delete;
+  OutputFile& operator=(const OutputFile&) = delete;
+
+  /**
+   * @brief Returns a stream that writes to this buffer.
+   * @return The output stream.
+   */
+  std::ostream& stream();
+
+  /**
+   * @brief Finishes writing and, if the contents changed, replaces the file.
+   * @throws std::runtime_error if the file cannot be written.
+   */
+  void commit();
+};
+
+}  // namespace trimja
+
+#endif  // TRIMJA_OUTPUTFILE
@@ -0,0 +1,150 @@
+// MIT License
+//
+// Copyright (c) 2024 Elliot Goodrich
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "pathindex.h"
+
+#include "graph.h"
+
+#include <algorithm>
+
+namespace trimja {
+
+namespace {
+
+// Return `ch` with path separators made consistent so that paths compare
+// in the same way as `Graph` looks them up
+char fold(char ch) {
+#ifdef _WIN32
+  return ch == '\\' ? '/' : ch;
+#else
+  return ch;
+#endif
+}
+
+bool isSeparator(char ch) {
+  return fold(ch) == '/';
+}
+
+bool lessPath(std::string_view left, std::string_view right) {
+  return std::lexicographical_compare(
+      left.begin(), left.end(), right.begin(), right.end(),
+      [](char l, char r) { return fold(l) < fold(r); });
+}
+
+bool startsWith(std::string_view path, std::string_view prefix) {
+  return path.size() >= prefix.size() &&
+         std::equal(prefix.begin(), prefix.end(), path.begin(),
+                    [](char l, char r) { return fold(l) == fold(r); });
+}
+
+}  // namespace
+
+PathIndex::PathIndex(const Graph& graph)
+    : m_graph{graph}, m_sortedFlag{}, m_sorted{} {}
+
+bool PathIndex::isPattern(std::string_view path) {
+  return path.find_first_of("*?") != std::string_view::npos;
+}
+
+bool PathIndex::matches(std::string_view pattern, std::string_view path) {
+  // Step through `pattern` once while tracking every position in `path` that
+  // the pattern so far can match up to, instead of backtracking on each `*`,
+  // so that this is O(pattern * path) however many wildcards there are
+  std::vector<bool> reached(path.size() + 1);
+  std::vector<bool> next(path.size() + 1);
+  reached[0] = true;
+  while (!pattern.empty()) {
+    bool any = false;
+    if (pattern.starts_with("**")) {
+      // Any number of characters, including separators
+      while (pattern.starts_with('*')) {
+        pattern.remove_prefix(1);
+      }
+      for (std::size_t i = 0; i <= path.size(); ++i) {
+        any = any || reached[i];
+        next[i] = any;
+      }
+    } else if (pattern.front() == '*') {
+      // Any number of characters within this component
+      pattern.remove_prefix(1);
+      bool inComponent = false;
+      for (std::size_t i = 0; i <= path.size(); ++i) {
+        inComponent = inComponent || reached[i];
+        next[i] = inComponent;
+        any = any || inComponent;
+        if (i < path.size() && isSeparator(path[i])) {
+          inComponent = false;
+        }
+      }
+    } else {
+      const char ch = pattern.front();
+      pattern.remove_prefix(1);
+      next[0] = false;
+      for (std::size_t i = 0; i < path.size(); ++i) {
+        next[i + 1] = reached[i] && (ch == '?' ? !isSeparator(path[i])
+                                               : fold(ch) == fold(path[i]));
+        any = any || next[i + 1];
+      }
+    }
+    if (!any) {
+      return false;
+    }
+    reached.swap(next);
+  }
+  return reached[path.size()];
+}
+
+void PathIndex::match(std::string_view pattern,
+                      std::vector<std::size_t>& indices) const {
+  std::call_once(m_sortedFlag, [&] {
+    m_sorted.reserve(m_graph.size());
+    for (std::size_t index = 0; index < m_graph.size(); ++index) {
+      if (!m_graph.isDefault(index)) {
+        m_sorted.push_back(static_cast<std::uint32_t>(index));
+      }
+    }
+    std::sort(m_sorted.begin(), m_sorted.end(),
+              [&](std::uint32_t left, std::uint32_t right) {
+                return lessPath(m_graph.path(left), m_graph.path(right));
+              });
+  });
+
+  // Only paths starting with the literal part of `pattern` can match, and
+  // these are all next to each other in `m_sorted`
+  const std::string_view prefix =
+      pattern.substr(0, pattern.find_first_of("*?"));
+  auto it = std::lower_bound(m_sorted.begin(), m_sorted.end(), prefix,
+                             [&](std::uint32_t index, std::string_view value) {
+                               return lessPath(m_graph.path(index), value);
+                             });
+  for (; it != m_sorted.end(); ++it) {
+    const std::string_view path = m_graph.path(*it);
+    if (!startsWith(path, prefix)) {
+      break;
+    }
+    if (matches(pattern, path)) {
+      indices.push_back(*it);
+    }
+  }
+}
+
+}  // namespace trimja
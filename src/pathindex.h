@@ -0,0 +1,88 @@
+// MIT License
+//
+// Copyright (c) 2024 Elliot Goodrich
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef TRIMJA_PATHINDEX
+#define TRIMJA_PATHINDEX
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string_view>
+#include <vector>
+
+namespace trimja {
+
+class Graph;
+
+/**
+ * @class PathIndex
+ * @brief A sorted index over the paths of a `Graph`, used to find all paths
+ * matching a glob pattern without checking every path.
+ *
+ * Patterns support `*` and `?`, which match any characters or a single
+ * character within one path component, and `**`, which matches any
+ * characters including path separators.  The index is built on first use,
+ * which is safe to do from multiple threads.
+ */
+class PathIndex {
+  const Graph& m_graph;
+  mutable std::once_flag m_sortedFlag;
+  mutable std::vector<std::uint32_t> m_sorted;
+
+ public:
+  /**
+   * @brief Constructs an index over `graph` without building it yet.
+   * @param graph The graph to index, which must outlive this object and must
+   * not have paths added while it is used.
+   */
+  explicit PathIndex(const Graph& graph);
+
+  PathIndex(const PathIndex&) = delete;
+  PathIndex& operator=(const PathIndex&) = delete;
+
+  /**
+   * @brief Checks whether `path` contains any glob characters.
+   * @param path The path to check.
+   * @return Whether `path` needs to be matched as a glob pattern.
+   */
+  static bool isPattern(std::string_view path);
+
+  /**
+   * @brief Checks whether `path` matches the glob `pattern`.
+   * @param pattern The normalized glob pattern.
+   * @param path The normalized path to check.
+   * @return Whether `path` matches `pattern` in its entirety.
+   */
+  static bool matches(std::string_view pattern, std::string_view path);
+
+  /**
+   * @brief Finds all paths in the graph that match a glob pattern.
+   * @param pattern The normalized glob pattern.
+   * @param indices Appended with the index of each matching path, in sorted
+   * order of their paths.
+   */
+  void match(std::string_view pattern, std::vector<std::size_t>& indices) const;
+};
+
+}  // namespace trimja
+
+#endif  // TRIMJA_PATHINDEX
@@ -22,48 +22,56 @@
 
 #include "rule.h"
 
-#include "evalstring.h"
-
-#include <algorithm>
+#include <utility>
 
 namespace trimja {
 
-Rule::Rule() = default;
+namespace {
 
-std::size_t Rule::getLookupIndex(std::string_view varName) {
-  return std::find(std::begin(reserved), std::end(reserved), varName) -
-         std::begin(reserved);
+// Return the slot of `varName` if it is reserved, otherwise a value that is at
+// least `Rule::reservedCount`
+std::uint32_t getSlot(VariableName varName) {
+  // Unsigned wrap-around makes this a single comparison for callers
+  return varName.id() - VariableName::Command;
 }
 
-bool Rule::add(std::string_view varName, EvalString value) {
-  const auto it = std::find_if(
-      m_bindings.begin(), m_bindings.end(),
-      [varName](const std::pair<const std::string_view*, EvalString>& binding) {
-        return *binding.first == varName;
-      });
-  if (it != m_bindings.end()) {
-    // If we already have this variable then it has already been verified as
-    // a reserved name so no need to check against `reserved`.
-    it->second = std::move(value);
-  } else {
-    // Otherwise we need to make sure it's actually supported
-    const std::size_t lookupIndex = getLookupIndex(varName);
-    if (lookupIndex == std::size(reserved)) {
-      return false;
-    }
+}  // namespace
+
+Rule::Rule() : m_bindings{}, m_isSet{0}, m_fingerprint{0} {}
+
+bool Rule::isReserved(VariableName varName) {
+  return getSlot(varName) < reservedCount;
+}
 
-    m_bindings.emplace_back(&reserved[lookupIndex], std::move(value));
+bool Rule::add(VariableName varName, EvalString value) {
+  const std::uint32_t slot = getSlot(varName);
+  if (slot >= reservedCount) {
+    return false;
   }
+
+  m_bindings[slot] = std::move(value);
+  m_isSet |= static_cast<std::uint16_t>(1U << slot);
   return true;
 }
 
-const EvalString* Rule::lookupVar(std::string_view varName) const {
-  const auto it = std::find_if(
-      m_bindings.cbegin(), m_bindings.cend(),
-      [varName](const std::pair<const std::string_view*, EvalString>& binding) {
-        return *binding.first == varName;
-      });
-  return it != m_bindings.cend() ? &it->second : nullptr;
+const EvalString* Rule::lookupVar(VariableName varName) const {
+  const std::uint32_t slot = getSlot(varName);
+  if (slot >= reservedCount || (m_isSet & (1U << slot)) == 0) {
+    return nullptr;
+  }
+  return &m_bindings[slot];
+}
+
+void Rule::setFingerprint(std::uint64_t fingerprint) {
+  m_fingerprint = fingerprint;
+}
+
+std::uint64_t Rule::fingerprint() const {
+  return m_fingerprint;
+}
+
+bool operator==(const Rule& lhs, const Rule& rhs) {
+  return lhs.m_isSet == rhs.m_isSet && lhs.m_bindings == rhs.m_bindings;
 }
 
 }  // namespace trimja
\ No newline at end of file
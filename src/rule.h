@@ -23,41 +23,51 @@
 #ifndef TRIMJA_RULE
 #define TRIMJA_RULE
 
-#include <string_view>
-#include <utility>
-#include <vector>
+#include "evalstring.h"
+#include "variablename.h"
 
-namespace trimja {
+#include <array>
+#include <cstddef>
+#include <cstdint>
 
-class EvalString;
+namespace trimja {
 
 /**
  * @class Rule
  * @brief Represents a build rule in the Ninja build system.
+ *
+ * Since rules can only contain reserved variables, which have consecutive
+ * ids, each variable is stored in a fixed slot of the rule.
  */
 class Rule {
  public:
   /**
-   * @brief List of reserved variable names in a rule.
+   * @brief The number of reserved variable names in a rule.
    */
-  inline static const std::string_view reserved[] = {
-      "command",          "depfile", "dyndep", "description", "deps",
-      "generator",        "pool",    "restat", "rspfile",     "rspfile_content",
-      "msvc_deps_prefix",
-  };
+  static constexpr std::size_t reservedCount =
+      VariableName::MsvcDepsPrefix - VariableName::Command + 1;
 
  private:
-  // The std::string_view* points to an element of reserved
-  std::vector<std::pair<const std::string_view*, EvalString>> m_bindings;
+  // The value of each reserved variable indexed by its id relative to
+  // `VariableName::Command`
+  std::array<EvalString, reservedCount> m_bindings;
+
+  // A bit set of which elements of `m_bindings` have been set
+  std::uint16_t m_isSet;
+
+  // A hash identifying the text that the rule was read from
+  std::uint64_t m_fingerprint;
+
+  static_assert(reservedCount <= 16);
 
  public:
   /**
-   * @brief Gets the lookup index for a given variable name.
+   * @brief Checks whether a variable name can be used in a rule.
    *
-   * @param varName The variable name to look up.
-   * @return The index of the variable name in the reserved list.
+   * @param varName The variable name to check.
+   * @return True if `varName` is a reserved rule binding.
    */
-  static std::size_t getLookupIndex(std::string_view varName);
+  static bool isReserved(VariableName varName);
 
   /**
    * @brief Constructs a Rule
@@ -71,7 +81,7 @@ class Rule {
    * @param value The value of the variable.
    * @return True if the variable was added successfully, false otherwise.
    */
-  bool add(std::string_view varName, EvalString value);
+  bool add(VariableName varName, EvalString value);
 
   /**
    * @brief Looks up the value of a variable in the rule.
@@ -80,7 +90,30 @@ class Rule {
    * @return A pointer to the EvalString value of the variable, or nullptr if
    * not found.
    */
-  const EvalString* lookupVar(std::string_view varName) const;
+  const EvalString* lookupVar(VariableName varName) const;
+
+  /**
+   * @brief Sets the fingerprint of the rule.
+   *
+   * @param fingerprint A hash of the text of the rule statement.
+   */
+  void setFingerprint(std::uint64_t fingerprint);
+
+  /**
+   * @brief Returns the fingerprint of the rule, which is 0 unless set.
+   *
+   * @return The value passed to `setFingerprint`.
+   */
+  std::uint64_t fingerprint() const;
+
+  /**
+   * @brief Compares two rules for equality, ignoring their fingerprints.
+   *
+   * @param lhs The first rule to compare.
+   * @param rhs The second rule to compare.
+   * @return True if both rules have identical variables.
+   */
+  friend bool operator==(const Rule& lhs, const Rule& rhs);
 };
 
 }  // namespace trimja
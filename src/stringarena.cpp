@@ -0,0 +1,110 @@
+// MIT License
+//
+// Copyright (c) 2024 Elliot Goodrich
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "stringarena.h"
+
+#include <algorithm>
+#include <iterator>
+#include <utility>
+
+namespace trimja {
+
+namespace {
+
+// The size of each block, which is large enough that allocating them is
+// infrequent but small enough that the unused end of the last block is
+// irrelevant
+const std::size_t BLOCK_SIZE = 64 * 1024;
+
+// Strings larger than this get their own block so that we don't waste the
+// remainder of the current block
+const std::size_t LARGE_SIZE = BLOCK_SIZE / 8;
+
+}  // namespace
+
+StringArena::StringArena() : m_blocks{}, m_next{nullptr}, m_end{nullptr} {}
+
+StringArena::StringArena(StringArena&& other) noexcept
+    : m_blocks{std::move(other.m_blocks)},
+      m_next{std::exchange(other.m_next, nullptr)},
+      m_end{std::exchange(other.m_end, nullptr)} {
+  other.m_blocks.clear();
+}
+
+StringArena& StringArena::operator=(StringArena&& rhs) noexcept {
+  StringArena tmp{std::move(rhs)};
+  std::swap(m_blocks, tmp.m_blocks);
+  std::swap(m_next, tmp.m_next);
+  std::swap(m_end, tmp.m_end);
+  return *this;
+}
+
+StringArena::~StringArena() = default;
+
+char* StringArena::allocate(std::size_t size) {
+  if (size <= static_cast<std::size_t>(m_end - m_next)) {
+    return std::exchange(m_next, m_next + size);
+  }
+
+  // Large strings get their own block and we continue to fill the current one
+  if (size > LARGE_SIZE) {
+    return m_blocks.emplace_back(std::make_unique_for_overwrite<char[]>(size))
+        .get();
+  }
+
+  m_next = m_blocks.emplace_back(std::make_unique_for_overwrite<char[]>(
+                                     BLOCK_SIZE))
+               .get();
+  m_end = m_next + BLOCK_SIZE;
+  return std::exchange(m_next, m_next + size);
+}
+
+std::string_view StringArena::store(std::string_view str) {
+  char* const data = allocate(str.size());
+  std::copy(str.begin(), str.end(), data);
+  return std::string_view{data, str.size()};
+}
+
+void StringArena::release(std::string_view str) {
+  // We can only reclaim strings at the end of the current block, and large
+  // strings in their own block are left until the arena is destroyed
+  if (str.size() <= LARGE_SIZE && str.data() + str.size() == m_next) {
+    m_next -= str.size();
+  }
+}
+
+void StringArena::splice(StringArena& other) {
+  m_blocks.insert(m_blocks.end(),
+                  std::make_move_iterator(other.m_blocks.begin()),
+                  std::make_move_iterator(other.m_blocks.end()));
+  other.m_blocks.clear();
+
+  // Continue filling whichever block has the most space left
+  if (other.m_end - other.m_next > m_end - m_next) {
+    m_next = other.m_next;
+    m_end = other.m_end;
+  }
+  other.m_next = nullptr;
+  other.m_end = nullptr;
+}
+
+}  // namespace trimja
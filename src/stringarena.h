@@ -0,0 +1,112 @@
+// MIT License
+//
+// Copyright (c) 2024 Elliot Goodrich
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef TRIMJA_STRINGARENA
+#define TRIMJA_STRINGARENA
+
+#include <cstddef>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+namespace trimja {
+
+/**
+ * @class StringArena
+ * @brief A bump allocator for strings that live as long as the arena.
+ *
+ * Strings are copied into large blocks so that storing many small strings
+ * only needs a handful of allocations.  Blocks are never moved or freed until
+ * the arena is destroyed, so views of stored strings are always valid, even
+ * if the arena itself is moved.
+ *
+ * `StringArena` is move-only to avoid accidental copies.
+ */
+class StringArena {
+  std::vector<std::unique_ptr<char[]>> m_blocks;
+  char* m_next;
+  char* m_end;
+
+ public:
+  /**
+   * @brief Constructs an empty StringArena without allocating.
+   */
+  StringArena();
+
+  /**
+   * @brief Move construct from another StringArena.
+   *
+   * `other` will be left empty and all views of its strings remain valid.
+   *
+   * @param other The StringArena to move from.
+   */
+  StringArena(StringArena&& other) noexcept;
+
+  /**
+   * @brief Move assign from another StringArena.
+   *
+   * All strings previously stored in this arena are freed.
+   *
+   * @param rhs The StringArena to move assign from.
+   * @return A reference to this.
+   */
+  StringArena& operator=(StringArena&& rhs) noexcept;
+
+  /**
+   * @brief Destructor for StringArena, which frees all stored strings.
+   */
+  ~StringArena();
+
+  /**
+   * @brief Allocates uninitialized storage for a string.
+   * @param size The number of characters to allocate.
+   * @return A pointer to `size` writable characters.
+   */
+  char* allocate(std::size_t size);
+
+  /**
+   * @brief Copies a string into the arena.
+   * @param str The string to copy.
+   * @return A view of the copy, which is valid for the lifetime of the arena.
+   */
+  std::string_view store(std::string_view str);
+
+  /**
+   * @brief Returns the memory of a string to the arena so it can be reused.
+   * @param str The most recent result of `store`, which must not be used
+   * afterwards.
+   */
+  void release(std::string_view str);
+
+  /**
+   * @brief Takes ownership of all strings stored in another arena.
+   *
+   * `other` will be left empty and all views of its strings remain valid.
+   *
+   * @param other The StringArena to take strings from.
+   */
+  void splice(StringArena& other);
+};
+
+}  // namespace trimja
+
+#endif  // TRIMJA_STRINGARENA
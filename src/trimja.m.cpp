@@ -23,6 +23,10 @@
 #include "allocationprofiler.h"
 #include "builddirutil.h"
 #include "cpuprofiler.h"
+#include "explainlog.h"
+#include "mappedfile.h"
+#include "outputfile.h"
+#include "trimserver.h"
 #include "trimutil.h"
 
 #ifdef WIN32
@@ -31,16 +35,28 @@
 #include <getopt.h>
 #endif
 
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
 #include <algorithm>
+#include <array>
 #include <cassert>
 #include <charconv>
+#include <cstdint>
 #include <cstring>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <optional>
-#include <sstream>
+#include <ranges>
+#include <stdexcept>
+#include <streambuf>
 #include <string>
+#include <string_view>
 #include <variant>
+#include <vector>
 
 namespace {
 
@@ -65,23 +81,83 @@ $ trimja --help
 $ trimja --builddir [-f FILE]
     Print out the $builddir path in the ninja build file relative to the cwd
 
-$ trimja [-f FILE] [--write | -o OUT] [--affected PATH | -] [--explain]
+$ trimja [-f FILE] [--write | -o OUT] [--affected PATH | -] [--explain] [-j N]
+         [--cache FILE | --low-memory] [--state FILE] [--targets PATH,...]
+         [--pruned-logs DIR] [--list-affected FILE [--list-rules RULE,...]
+         [--list-prefixes PATH,...] [--list-null]]
     Trim down the ninja build file to only required outputs and inputs
 
+$ trimja [-f FILE] (--affected PATH -o OUT)... [--explain] [-j N]
+         [--cache FILE | --low-memory] [--targets PATH,...]
+    Trim down the ninja build file once for each pair of PATH and OUT
+
+$ trimja [-f FILE] --affected PATH -o OUT --shards=N [--explain] [-j N]
+         [--cache FILE | --low-memory] [--targets PATH,...]
+    Trim down the ninja build file and split it into N files balanced by the
+    durations in '.ninja_log', writing 'OUT' with its extension preceded by
+    '.0' up to '.N-1' (e.g. 'out.0.ninja')
+
+$ trimja [-f FILE] [--affected PATH | -] --estimate[=N] [--explain] [-j N]
+         [--cache FILE | --low-memory] [--targets PATH,...]
+    Print how long the build commands that would be kept took according to
+    '.ninja_log', along with the N slowest of them [default=10]
+
+$ trimja --serve=SOCKET [-f FILE] [--explain] [-j N] [--cache FILE]
+    Keep the ninja build file loaded and trim it for each request on SOCKET
+
+$ trimja --connect=SOCKET [--write | -o OUT] [--affected PATH | -]
+    Trim down the ninja build file loaded by the server listening on SOCKET,
+    where --write overwrites build.ninja in the current directory
+
 Options:
   -f FILE, --file=FILE      path to input ninja build file [default=build.ninja]
-  -a PATH, --affected=PATH  path to file containing affected file paths
+  -a PATH, --affected=PATH  path to file containing affected file paths, which
+                            are also tried relative to the cwd if they are not
+                            in the build file, without resolving symlinks
   -                         read affected file paths from stdin
   -o OUT, --output=OUT      output file path [default=stdout]
   -w, --write               overwrite input ninja build file
-  --explain                 print why each part of the build file was kept
-  --builddir                print the $builddir variable relative to the cwd)HELP"
-#if WIN32
-    R"HELP(
-  --memory-stats=N          print memory stats and top N allocating functions)HELP"
-#endif
-    R"HELP(
+  --explain[=FILE]          print why each part of the build file was kept,
+                            writing to FILE instead of stderr if given
+  --explain-format=FORMAT   write --explain as 'text' or 'ndjson' [default=text]
+  -j N, --jobs=N            number of threads to use [default=1]
+  --cache=FILE              reuse the parsed ninja build file stored in FILE if
+                            it is up to date, otherwise update FILE
+  --low-memory              keep less of the ninja build file in memory and
+                            read it again to write the output, which cannot be
+                            used with --cache, --serve or --connect
+  --reuse-hashes            reuse the hashes of unchanged build commands from
+                            the last run, stored next to .ninja_log
+  --state=FILE              continue from the trim stored in FILE if the build
+                            is unchanged and PATH only adds affected files,
+                            then update FILE
+  --targets=PATH,...        only keep the affected build commands needed to
+                            build these outputs, which can be given more than
+                            once, and write the rest as phony
+  --estimate[=N]            print the total and critical path duration of the
+                            kept build commands instead of the ninja build
+                            file, and the N slowest of them [default=10]
+  --pruned-logs=DIR         write '.ninja_deps' and '.ninja_log' to DIR with
+                            only the records of kept build commands so that
+                            ninja starts faster, where DIR cannot be the
+                            $builddir of the input ninja build file
+  --list-affected=FILE      write the outputs of the kept build commands to
+                            FILE, one per line, for choosing which tests to run
+  --list-rules=RULE,...     only list outputs of build commands using these
+                            rules, which can be given more than once
+  --list-prefixes=PATH,...  only list outputs starting with these prefixes,
+                            which can be given more than once
+  --list-null               end each listed output with NUL instead of newline
+  --shards=N                split the trimmed build commands between N files
+                            that can be built on different machines
+  --serve=SOCKET            answer trim requests on the local socket SOCKET
+  --connect=SOCKET          send the trim request to the server on SOCKET
+  --builddir                print the $builddir variable relative to the cwd
+  --memory-stats=N          print memory stats and top N allocating functions
   --cpu-stats               print timing stats
+  --cpu-counters            print hardware counters with timing stats, which
+                            include the threads each timer waited on (Linux)
+  --trace=FILE              write timing stats to FILE as Chrome trace JSON
   -h, --help                print help
   -v, --version             print trimja version ()HELP" TRIMJA_VERSION
     R"HELP()
@@ -98,37 +174,181 @@ branch, note the lone '-' argument to specify we are reading from stdin,
   $ git diff main --name-only | trimja - --write
   $ ninja
 
+Build only those commands that relate to anything inside 'third_party/foo' or
+any '.proto' file directly inside 'api', as affected paths ending in a path
+separator match everything inside that directory and affected paths can use
+the globs '*', '?' and '**',
+  $ printf "third_party/foo/\napi/*.proto\n" | trimja - --write
+  $ ninja
+
 For more information visit the homepage https://github.com/elliotgoodrich/trimja)HELP";
 
 // NOLINTNEXTLINE(modernize-avoid-c-arrays)
 const option g_longOptions[] = {
     // TODO: Remove `--expected` and replace with comparing files within CTest
     {"builddir", no_argument, nullptr, 'b'},
-    {"explain", no_argument, nullptr, 'e'},
+    {"cache", required_argument, nullptr, 'c'},
+    {"estimate", optional_argument, nullptr, 'y'},
+    {"connect", required_argument, nullptr, 'n'},
+    {"explain", optional_argument, nullptr, 'e'},
+    {"explain-format", required_argument, nullptr, 'd'},
     {"expected", required_argument, nullptr, 'x'},
     {"file", required_argument, nullptr, 'f'},
     {"help", no_argument, nullptr, 'h'},
+    {"jobs", required_argument, nullptr, 'j'},
+    {"list-affected", required_argument, nullptr, 'z'},
+    {"list-null", no_argument, nullptr, 'N'},
+    {"list-prefixes", required_argument, nullptr, 'P'},
+    {"list-rules", required_argument, nullptr, 'R'},
+    {"low-memory", no_argument, nullptr, 'l'},
     {"output", required_argument, nullptr, 'o'},
+    {"pruned-logs", required_argument, nullptr, 'q'},
+    {"reuse-hashes", no_argument, nullptr, 'r'},
+    {"serve", required_argument, nullptr, 's'},
+    {"shards", required_argument, nullptr, 'k'},
+    {"state", required_argument, nullptr, 'i'},
+    {"targets", required_argument, nullptr, 'g'},
     {"affected", required_argument, nullptr, 'a'},
     {"version", no_argument, nullptr, 'v'},
     {"write", no_argument, nullptr, 'w'},
     {"memory-stats", required_argument, nullptr, 'm'},
     {"cpu-stats", no_argument, nullptr, 'u'},
+    {"cpu-counters", no_argument, nullptr, 'p'},
+    {"trace", required_argument, nullptr, 't'},
     {},
 };
 
 std::size_t topAllocatingStacks = 0;
 bool instrumentMemory = false;
+bool printCPUStats = false;
+std::optional<std::filesystem::path> traceFile;
+std::optional<std::filesystem::path> explainFile;
+std::ofstream explainStream;
+
+// Print `estimate` to `out` for `--estimate`
+void printEstimate(std::ostream& out,
+                   const trimja::TrimUtil::Estimate& estimate) {
+  const auto seconds = [](std::chrono::milliseconds duration) {
+    return std::chrono::duration<double>(duration).count();
+  };
+  out << std::fixed << std::setprecision(3);
+  out << "kept build commands: " << estimate.commandCount << " ("
+      << estimate.unknownCount << " without a duration)\n";
+  out << "total duration: " << seconds(estimate.totalDuration) << "s\n";
+  out << "critical path: " << seconds(estimate.criticalPath) << "s\n";
+  if (!estimate.slowest.empty()) {
+    out << "slowest build commands:\n";
+    for (const auto& [path, duration] : estimate.slowest) {
+      out << "  " << seconds(duration) << "s " << path << '\n';
+    }
+  }
+}
+
+// A stream buffer that compares everything written to it against the contents
+// of an expected file for `--expected`, keeping only the output from the first
+// difference onwards so that it can be reported.
+class ExpectedBuffer : public std::streambuf {
+  static constexpr std::size_t k_context = 1024;
+
+  std::ifstream m_expected;
+  std::uint64_t m_size = 0;
+  std::optional<std::uint64_t> m_position;
+  std::string m_actual;
+  std::string m_expectedText;
+
+ protected:
+  int_type overflow(int_type ch) override {
+    if (traits_type::eq_int_type(ch, traits_type::eof())) {
+      return traits_type::not_eof(ch);
+    }
+#if _WIN32
+    // Skip CR characters on Windows so that we can cleanly compare the output
+    // to the expected file on disk without worrying about line endings
+    if (ch == '\r') {
+      return ch;
+    }
+#endif
+    if (m_position.has_value()) {
+      if (m_actual.size() < k_context) {
+        m_actual.push_back(traits_type::to_char_type(ch));
+      }
+    } else {
+      const int_type expected = m_expected.get();
+      if (!traits_type::eq_int_type(ch, expected)) {
+        m_position = m_size;
+        m_actual.push_back(traits_type::to_char_type(ch));
+        if (!traits_type::eq_int_type(expected, traits_type::eof())) {
+          m_expectedText.push_back(traits_type::to_char_type(expected));
+        }
+      }
+    }
+    ++m_size;
+    return ch;
+  }
+
+ public:
+  struct Difference {
+    std::optional<std::uint64_t> position;
+    std::uint64_t actualSize;
+    std::uint64_t expectedSize;
+    std::string actual;
+    std::string expected;
+  };
+
+  explicit ExpectedBuffer(const std::string& expectedFile)
+      : m_expected{expectedFile} {
+    if (!m_expected) {
+      throw std::runtime_error("Unable to open " + expectedFile);
+    }
+  }
+
+  // Return where the output first differed from the expected file, if it did,
+  // along with the text of both from that position.
+  Difference finish() {
+    if (!m_position.has_value() &&
+        !traits_type::eq_int_type(m_expected.peek(), traits_type::eof())) {
+      m_position = m_size;
+    }
+    if (!m_position.has_value()) {
+      return {std::nullopt, m_size, m_size, {}, {}};
+    }
+    std::uint64_t expectedSize = *m_position + m_expectedText.size();
+    for (int_type ch = m_expected.get();
+         !traits_type::eq_int_type(ch, traits_type::eof());
+         ch = m_expected.get()) {
+      ++expectedSize;
+      if (m_expectedText.size() < k_context) {
+        m_expectedText.push_back(traits_type::to_char_type(ch));
+      }
+    }
+    return {m_position, m_size, expectedSize, std::move(m_actual),
+            std::move(m_expectedText)};
+  }
+};
 
 [[noreturn]] void leave(int rc) {
   if (instrumentMemory) {
     trimja::AllocationProfiler::print(std::cerr, topAllocatingStacks);
     std::cerr.flush();
   }
-  if (trimja::CPUProfiler::isEnabled()) {
+  if (printCPUStats) {
     trimja::CPUProfiler::print(std::cerr);
     std::cerr.flush();
   }
+  if (explainFile.has_value()) {
+    explainStream.flush();
+    if (!explainStream) {
+      std::cerr << "Unable to write to " << explainFile->string() << std::endl;
+    }
+  }
+  if (traceFile.has_value()) {
+    std::ofstream trace{*traceFile};
+    trimja::CPUProfiler::writeTrace(trace);
+    trace.flush();
+    if (!trace) {
+      std::cerr << "Unable to write to " << traceFile->string() << std::endl;
+    }
+  }
   std::_Exit(rc);
 };
 
@@ -165,16 +385,40 @@ bool instrumentMemory = false;
 
   std::optional<std::string> expectedFile;
   std::filesystem::path ninjaFile = "build.ninja";
+  bool hasNinjaFile = false;
   bool explain = false;
+  ExplainLog::Format explainFormat = ExplainLog::Format::text;
   bool builddir = false;
+  std::size_t jobs = 1;
+  std::optional<std::filesystem::path> cacheFile;
+  bool reuseHashes = false;
+  bool lowMemory = false;
+  std::optional<std::filesystem::path> stateFile;
+  std::vector<std::string> targets;
+  std::size_t shards = 0;
+  std::optional<std::size_t> estimateTop;
+  std::optional<std::filesystem::path> prunedLogsDir;
+  std::optional<std::filesystem::path> listAffectedFile;
+  std::vector<std::string> listRules;
+  std::vector<std::string> listPrefixes;
+  char listSeparator = '\n';
+  std::optional<std::filesystem::path> serveSocket;
+  std::optional<std::filesystem::path> connectSocket;
+
+  // Any `--affected` and `--output` paths after the first, which are trimmed
+  // in pairs
+  std::vector<std::filesystem::path> moreAffected;
+  std::vector<std::filesystem::path> moreOutputs;
 
   int ch = -1;
-  while ((ch = getopt_long(argc, argv, "a:f:ho:vw", g_longOptions, nullptr)) !=
-         -1) {
+  while ((ch = getopt_long(argc, argv, "a:f:hj:o:vw", g_longOptions,
+                           nullptr)) != -1) {
     switch (ch) {
       case 'a':
         if (std::get_if<std::monostate>(&affectedFile)) {
           affectedFile.emplace<std::filesystem::path>(optarg);
+        } else if (std::get_if<std::filesystem::path>(&affectedFile)) {
+          moreAffected.emplace_back(optarg);
         } else {
           std::cerr << "Cannot specify --affected when - was given"
                     << std::endl;
@@ -184,15 +428,75 @@ bool instrumentMemory = false;
       case 'b':
         builddir = true;
         break;
+      case 'c':
+        cacheFile = optarg;
+        break;
+      case 'd':
+        explainFormat = ExplainLog::parseFormat(optarg);
+        break;
       case 'e':
         explain = true;
+        if (optarg) {
+          explainFile = optarg;
+        }
         break;
       case 'f':
         ninjaFile = optarg;
+        hasNinjaFile = true;
+        break;
+      case 'g':
+        for (const auto target : std::views::split(std::string_view{optarg},
+                                                   ',')) {
+          if (!target.empty()) {
+            targets.emplace_back(target.begin(), target.end());
+          }
+        }
         break;
       case 'h':
         std::cout << g_helpText << std::endl;
         leave(EXIT_SUCCESS);
+      case 'i':
+        stateFile = optarg;
+        break;
+      case 'j': {
+        const char* last = optarg + std::strlen(optarg);
+        auto [ptr, ec] = std::from_chars(optarg, last, jobs);
+        if (ec != std::errc{} || ptr != last || jobs == 0) {
+          std::string msg;
+          msg = "'";
+          msg += optarg;
+          msg += "' is an invalid value for --jobs!";
+          throw std::runtime_error{msg};
+        }
+      } break;
+      case 'k': {
+        const char* last = optarg + std::strlen(optarg);
+        auto [ptr, ec] = std::from_chars(optarg, last, shards);
+        if (ec != std::errc{} || ptr != last || shards == 0) {
+          std::string msg;
+          msg = "'";
+          msg += optarg;
+          msg += "' is an invalid value for --shards!";
+          throw std::runtime_error{msg};
+        }
+      } break;
+      case 'y':
+        estimateTop = 10;
+        if (optarg) {
+          const char* last = optarg + std::strlen(optarg);
+          auto [ptr, ec] = std::from_chars(optarg, last, *estimateTop);
+          if (ec != std::errc{} || ptr != last) {
+            std::string msg;
+            msg = "'";
+            msg += optarg;
+            msg += "' is an invalid value for --estimate!";
+            throw std::runtime_error{msg};
+          }
+        }
+        break;
+      case 'l':
+        lowMemory = true;
+        break;
       case 'm': {
         const char* last = optarg + std::strlen(optarg);
         auto [ptr, ec] = std::from_chars(optarg, last, topAllocatingStacks);
@@ -206,9 +510,14 @@ bool instrumentMemory = false;
         instrumentMemory = true;
         AllocationProfiler::start();
       } break;
+      case 'n':
+        connectSocket = optarg;
+        break;
       case 'o':
         if (std::get_if<Stdout>(&outputFile)) {
           outputFile.emplace<std::filesystem::path>(optarg);
+        } else if (std::get_if<std::filesystem::path>(&outputFile)) {
+          moreOutputs.emplace_back(optarg);
         } else if (std::get_if<Write>(&outputFile)) {
           std::cerr << "Cannot specify --output when --write was given"
                     << std::endl;
@@ -222,6 +531,37 @@ bool instrumentMemory = false;
           leave(EXIT_FAILURE);
         }
         break;
+      case 'q':
+        prunedLogsDir = optarg;
+        break;
+      case 'z':
+        listAffectedFile = optarg;
+        break;
+      case 'N':
+        listSeparator = '\0';
+        break;
+      case 'P':
+        for (const auto prefix : std::views::split(std::string_view{optarg},
+                                                   ',')) {
+          if (!prefix.empty()) {
+            listPrefixes.emplace_back(prefix.begin(), prefix.end());
+          }
+        }
+        break;
+      case 'R':
+        for (const auto rule : std::views::split(std::string_view{optarg},
+                                                 ',')) {
+          if (!rule.empty()) {
+            listRules.emplace_back(rule.begin(), rule.end());
+          }
+        }
+        break;
+      case 'r':
+        reuseHashes = true;
+        break;
+      case 's':
+        serveSocket = optarg;
+        break;
       case 'v':
         std::cout << TRIMJA_VERSION << "" << std::endl;
         leave(EXIT_SUCCESS);
@@ -258,9 +598,18 @@ bool instrumentMemory = false;
           leave(EXIT_FAILURE);
         }
         break;
+      case 't':
+        traceFile = optarg;
+        CPUProfiler::enable();
+        break;
       case 'u':
+        printCPUStats = true;
         CPUProfiler::enable();
         break;
+      case 'p':
+        printCPUStats = true;
+        CPUProfiler::enableHardwareCounters();
+        break;
       case '?':
         std::cerr << "Unknown option" << std::endl;
         leave(EXIT_FAILURE);
@@ -270,24 +619,307 @@ bool instrumentMemory = false;
     }
   }
 
-  // Copy everything from the ninja into a stringstream in case we
-  // are overwriting the same input file
-  const std::string ninjaFileContents = [&] {
+  if (serveSocket.has_value() && connectSocket.has_value()) {
+    std::cerr << "Cannot specify --serve when --connect was given"
+              << std::endl;
+    leave(EXIT_FAILURE);
+  }
+
+  // The server trims the ninja build file that it loaded, so any other file
+  // would be silently ignored
+  if (hasNinjaFile && connectSocket.has_value() && !builddir) {
+    std::cerr << "Cannot specify -f when --connect was given" << std::endl;
+    leave(EXIT_FAILURE);
+  }
+
+  if (stateFile.has_value() &&
+      (serveSocket.has_value() || connectSocket.has_value())) {
+    std::cerr << "Cannot specify --state when --serve or --connect was given"
+              << std::endl;
+    leave(EXIT_FAILURE);
+  }
+
+  if (!targets.empty() &&
+      (serveSocket.has_value() || connectSocket.has_value())) {
+    std::cerr << "Cannot specify --targets when --serve or --connect was given"
+              << std::endl;
+    leave(EXIT_FAILURE);
+  }
+
+  if (shards > 0 && (serveSocket.has_value() || connectSocket.has_value())) {
+    std::cerr << "Cannot specify --shards when --serve or --connect was given"
+              << std::endl;
+    leave(EXIT_FAILURE);
+  }
+
+  if (shards > 0 && stateFile.has_value()) {
+    std::cerr << "Cannot specify --shards when --state was given" << std::endl;
+    leave(EXIT_FAILURE);
+  }
+
+  if (estimateTop.has_value() &&
+      (serveSocket.has_value() || connectSocket.has_value())) {
+    std::cerr << "Cannot specify --estimate when --serve or --connect was "
+                 "given"
+              << std::endl;
+    leave(EXIT_FAILURE);
+  }
+
+  if (estimateTop.has_value() &&
+      (stateFile.has_value() || shards > 0 || !moreAffected.empty() ||
+       !std::get_if<Stdout>(&outputFile))) {
+    std::cerr << "Cannot specify --estimate with --state, --shards, more than "
+                 "one --affected or an output file"
+              << std::endl;
+    leave(EXIT_FAILURE);
+  }
+
+  if (prunedLogsDir.has_value() &&
+      (serveSocket.has_value() || connectSocket.has_value() || shards > 0 ||
+       estimateTop.has_value() || !moreAffected.empty())) {
+    std::cerr << "Cannot specify --pruned-logs with --serve, --connect, "
+                 "--shards, --estimate or more than one --affected"
+              << std::endl;
+    leave(EXIT_FAILURE);
+  }
+
+  if (listAffectedFile.has_value() &&
+      (serveSocket.has_value() || connectSocket.has_value() || shards > 0 ||
+       estimateTop.has_value() || !moreAffected.empty())) {
+    std::cerr << "Cannot specify --list-affected with --serve, --connect, "
+                 "--shards, --estimate or more than one --affected"
+              << std::endl;
+    leave(EXIT_FAILURE);
+  }
+
+  if (!listAffectedFile.has_value() &&
+      (!listRules.empty() || !listPrefixes.empty() || listSeparator != '\n')) {
+    std::cerr << "Cannot specify --list-rules, --list-prefixes or --list-null "
+                 "without --list-affected"
+              << std::endl;
+    leave(EXIT_FAILURE);
+  }
+
+  if (lowMemory && cacheFile.has_value()) {
+    std::cerr << "Cannot specify --low-memory when --cache was given"
+              << std::endl;
+    leave(EXIT_FAILURE);
+  }
+
+  if (lowMemory && (serveSocket.has_value() || connectSocket.has_value())) {
+    std::cerr << "Cannot specify --low-memory when --serve or --connect was "
+                 "given"
+              << std::endl;
+    leave(EXIT_FAILURE);
+  }
+
+  const TrimUtil::Options options{explain, jobs, cacheFile, reuseHashes,
+                                  lowMemory};
+
+  // If we have `--serve` then answer requests until we are killed, which
+  // loads the ninja file itself so it can reload it when it changes
+  if (serveSocket.has_value() && !builddir) {
+    if (explainFile.has_value() ||
+        explainFormat != ExplainLog::Format::text) {
+      std::cerr << "Cannot specify a file or format for --explain when "
+                   "--serve was given"
+                << std::endl;
+      leave(EXIT_FAILURE);
+    }
+    TrimServer::serve(*serveSocket, ninjaFile, options);
+  }
+
+  // Map the ninja file into memory instead of copying it.  Since all parts of
+  // the output reference this mapping, we need to hold off writing to the
+  // input file until we have finished with it.  With `--connect` the server
+  // has its own mapping so we only need the path.
+  MappedFile ninjaFileContents = [&] {
+    if (connectSocket.has_value() && !builddir) {
+      return MappedFile{};
+    }
     const Timer ninjaRead = CPUProfiler::start(".ninja read");
-    std::stringstream ninjaCopy;
-    std::ifstream ninja(ninjaFile);
-    ninjaCopy << ninja.rdbuf();
-    return ninjaCopy.str();
+    return MappedFile{ninjaFile};
   }();
 
   // If we have `--builddir` then ignore all other flags other than -f
   if (builddir) {
     BuildDirUtil util;
-    std::cout << util.builddir(ninjaFile, ninjaFileContents).string()
-              << std::endl;
+    std::cout
+        << util.builddir(ninjaFile, ninjaFileContents.contents()).string()
+        << std::endl;
+    leave(EXIT_SUCCESS);
+  }
+
+  // Writing the pruned logs over the ones that we read would lose the records
+  // of everything that was trimmed for the next run
+  if (prunedLogsDir.has_value()) {
+    BuildDirUtil util;
+    std::filesystem::path dir =
+        util.builddir(ninjaFile, ninjaFileContents.contents());
+    if (dir.empty()) {
+      dir = ".";
+    }
+    std::error_code ec;
+    if (std::filesystem::equivalent(*prunedLogsDir, dir, ec)) {
+      std::cerr << "Cannot write --pruned-logs to the $builddir of "
+                << ninjaFile.string() << std::endl;
+      leave(EXIT_FAILURE);
+    }
+  }
+
+  // Explanations are collected and written in one go, so only open the file
+  // once we know we are trimming
+  std::ostream* explainOutput = &std::cerr;
+  if (explainFile.has_value()) {
+    explainStream.open(*explainFile, std::ios_base::binary);
+    if (!explainStream) {
+      throw std::runtime_error{"Unable to write to " + explainFile->string()};
+    }
+    explainOutput = &explainStream;
+  }
+
+  // With more than one `--affected` trim once for each pair of `--affected`
+  // and `--output`, loading the ninja file only once
+  if (!moreAffected.empty() || !moreOutputs.empty()) {
+    if (!std::get_if<std::filesystem::path>(&affectedFile) ||
+        !std::get_if<std::filesystem::path>(&outputFile) ||
+        moreAffected.size() != moreOutputs.size()) {
+      std::cerr << "Each --affected needs a matching --output when more "
+                   "than one is given"
+                << std::endl;
+      leave(EXIT_FAILURE);
+    }
+    if (connectSocket.has_value()) {
+      std::cerr << "Cannot specify more than one --affected when --connect "
+                   "was given"
+                << std::endl;
+      leave(EXIT_FAILURE);
+    }
+    if (stateFile.has_value()) {
+      std::cerr << "Cannot specify more than one --affected when --state "
+                   "was given"
+                << std::endl;
+      leave(EXIT_FAILURE);
+    }
+    if (shards > 0) {
+      std::cerr << "Cannot specify more than one --affected when --shards "
+                   "was given"
+                << std::endl;
+      leave(EXIT_FAILURE);
+    }
+    moreAffected.insert(moreAffected.begin(),
+                        std::get<std::filesystem::path>(affectedFile));
+    moreOutputs.insert(moreOutputs.begin(),
+                       std::get<std::filesystem::path>(outputFile));
+
+    std::vector<std::ifstream> affectedStreams(moreAffected.size());
+    std::vector<std::unique_ptr<OutputFile>> outputFiles;
+    std::vector<TrimUtil::Request> requests;
+    for (std::size_t i = 0; i < moreAffected.size(); ++i) {
+      std::error_code ec;
+      if (std::filesystem::equivalent(moreOutputs[i], ninjaFile, ec)) {
+        std::cerr << "Cannot overwrite the input ninja build file when more "
+                     "than one --affected is given"
+                  << std::endl;
+        leave(EXIT_FAILURE);
+      }
+      affectedStreams[i].open(moreAffected[i]);
+      outputFiles.push_back(std::make_unique<OutputFile>(moreOutputs[i]));
+      requests.push_back({
+          .affected = &affectedStreams[i],
+          .output = &outputFiles[i]->stream(),
+          .targets = targets,
+      });
+    }
+
+    TrimUtil util;
+    util.explainTo(*explainOutput, explainFormat);
+    util.load(ninjaFile, ninjaFileContents.contents(), options);
+    util.trim(requests, explain, jobs);
+    for (const std::unique_ptr<OutputFile>& outputFile : outputFiles) {
+      outputFile->commit();
+    }
     leave(EXIT_SUCCESS);
   }
 
+  // With `--estimate` print the report instead of the trimmed ninja file
+  if (estimateTop.has_value()) {
+    std::ifstream affectedStream;
+    std::istream* affected = &std::cin;
+    if (const std::filesystem::path* affectedPath =
+            std::get_if<std::filesystem::path>(&affectedFile)) {
+      affectedStream.open(*affectedPath);
+      affected = &affectedStream;
+    } else if (std::get_if<std::monostate>(&affectedFile)) {
+      std::cerr << "A list of affected files needs to be supplied with "
+                   "either --affected [FILE] or - to read from stdin"
+                << std::endl;
+      leave(EXIT_FAILURE);
+    }
+
+    TrimUtil util;
+    util.explainTo(*explainOutput, explainFormat);
+    util.load(ninjaFile, ninjaFileContents.contents(), options);
+    printEstimate(std::cout,
+                  util.estimate(*affected, targets, explain, *estimateTop));
+    std::cout.flush();
+    leave(EXIT_SUCCESS);
+  }
+
+  // With `--shards` write each shard next to `--output`, which cannot be the
+  // input file as that is needed to build everything else
+  if (shards > 0) {
+    const std::filesystem::path* path =
+        std::get_if<std::filesystem::path>(&outputFile);
+    std::error_code ec;
+    if (!path || std::filesystem::equivalent(*path, ninjaFile, ec)) {
+      std::cerr << "--shards needs an --output other than the input ninja "
+                   "build file"
+                << std::endl;
+      leave(EXIT_FAILURE);
+    }
+    std::ifstream affectedStream;
+    std::istream* affected = &std::cin;
+    if (const std::filesystem::path* affectedPath =
+            std::get_if<std::filesystem::path>(&affectedFile)) {
+      affectedStream.open(*affectedPath);
+      affected = &affectedStream;
+    } else if (std::get_if<std::monostate>(&affectedFile)) {
+      std::cerr << "A list of affected files needs to be supplied with "
+                   "either --affected [FILE] or - to read from stdin"
+                << std::endl;
+      leave(EXIT_FAILURE);
+    }
+
+    std::vector<std::unique_ptr<OutputFile>> outputFiles;
+    std::vector<std::ostream*> outputs;
+    for (std::size_t i = 0; i < shards; ++i) {
+      std::filesystem::path shardPath = *path;
+      shardPath.replace_filename(path->stem().string() + '.' +
+                                 std::to_string(i) +
+                                 path->extension().string());
+      outputFiles.push_back(std::make_unique<OutputFile>(shardPath));
+      outputs.push_back(&outputFiles.back()->stream());
+    }
+    TrimUtil util;
+    util.explainTo(*explainOutput, explainFormat);
+    util.load(ninjaFile, ninjaFileContents.contents(), options);
+    util.trimShards(outputs, *affected, targets, explain);
+    for (const std::unique_ptr<OutputFile>& outputFile : outputFiles) {
+      outputFile->commit();
+    }
+    leave(EXIT_SUCCESS);
+  }
+
+  // Writing to the input file with `--output` is the same as `--write`
+  if (const std::filesystem::path* path =
+          std::get_if<std::filesystem::path>(&outputFile)) {
+    std::error_code ec;
+    if (std::filesystem::equivalent(*path, ninjaFile, ec)) {
+      outputFile.emplace<Write>();
+    }
+  }
+
   std::ifstream affectedFileStream;
   std::istream& affected = std::visit(
       [&](auto&& arg) -> std::istream& {
@@ -306,59 +938,97 @@ bool instrumentMemory = false;
       },
       affectedFile);
 
-  std::variant<std::monostate, std::ofstream, std::stringstream> outStream;
+  // Open every output before trimming so that we fail straight away if any of
+  // them cannot be written.  Files are only replaced once we are finished, as
+  // the input file is still needed until then.
+  std::optional<OutputFile> outFile;
+  std::optional<ExpectedBuffer> expectedBuffer;
+  std::optional<std::ostream> expectedStream;
   std::ostream& output = std::visit(
       [&](auto&& arg) -> std::ostream& {
         using T = std::decay_t<decltype(arg)>;
         if constexpr (std::is_same_v<T, Stdout>) {
           return std::cout;
         } else if constexpr (std::is_same_v<T, Write>) {
-          return outStream.emplace<std::ofstream>(ninjaFile);
+          return outFile.emplace(ninjaFile).stream();
         } else if constexpr (std::is_same_v<T, Expected>) {
-          return outStream.emplace<std::stringstream>();
+          return expectedStream.emplace(&expectedBuffer.emplace(*expectedFile));
         } else if constexpr (std::is_same_v<T, std::filesystem::path>) {
-          return outStream.emplace<std::ofstream>(arg);
+          return outFile.emplace(arg).stream();
         }
       },
       outputFile);
 
-  TrimUtil util;
-  util.trim(output, ninjaFile, ninjaFileContents, affected, explain);
+#ifdef _WIN32
+  // Parts of the output are copied verbatim from the input files, which may
+  // already contain CRLF line endings, so avoid any newline translation
+  _setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+  if (connectSocket.has_value()) {
+    TrimServer::request(*connectSocket, affected, output);
+  } else {
+    std::optional<OutputFile> depsOutput;
+    std::optional<OutputFile> logOutput;
+    if (prunedLogsDir.has_value()) {
+      std::filesystem::create_directories(*prunedLogsDir);
+      depsOutput.emplace(*prunedLogsDir / ".ninja_deps");
+      logOutput.emplace(*prunedLogsDir / ".ninja_log");
+    }
+    std::optional<OutputFile> listOutput;
+    if (listAffectedFile.has_value()) {
+      listOutput.emplace(*listAffectedFile);
+    }
+    const TrimUtil::AffectedList affectedList{
+        .output = listOutput.has_value() ? &listOutput->stream() : nullptr,
+        .rules = listRules,
+        .prefixes = listPrefixes,
+        .separator = listSeparator,
+    };
+    const TrimUtil::Request request{
+        .affected = &affected,
+        .output = &output,
+        .stateFile = stateFile.has_value() ? &*stateFile : nullptr,
+        .targets = targets,
+        .depsOutput = depsOutput.has_value() ? &depsOutput->stream() : nullptr,
+        .logOutput = logOutput.has_value() ? &logOutput->stream() : nullptr,
+        .affectedList = listOutput.has_value() ? &affectedList : nullptr,
+    };
+    TrimUtil util;
+    util.explainTo(*explainOutput, explainFormat);
+    util.trim(ninjaFile, ninjaFileContents.contents(), request, options);
+    for (std::optional<OutputFile>* file :
+         {&depsOutput, &logOutput, &listOutput}) {
+      if (file->has_value()) {
+        (*file)->commit();
+      }
+    }
+  }
   output.flush();
 
+  if (outFile.has_value()) {
+    // Release our mapping as some platforms do not allow replacing a file
+    // that is mapped
+    ninjaFileContents.reset();
+    outFile->commit();
+  }
+
   if (!expectedFile.has_value()) {
     leave(EXIT_SUCCESS);
   }
 
-  // Remove CR characters on Windows from the output so that we can cleanly
-  // compare the output to the expected file on disk without worrying about
-  // different line endings
-  std::string actual = std::get<std::stringstream>(outStream).str();
-#if _WIN32
-  actual.erase(std::remove(actual.begin(), actual.end(), '\r'), actual.end());
-#endif
-
-  std::ifstream expectedStream(*expectedFile);
-  std::stringstream expectedBuffer;
-  expectedBuffer << expectedStream.rdbuf();
-  const std::string expected = expectedBuffer.str();
-  if (actual != expected) {
-    const std::ptrdiff_t pos = std::mismatch(actual.begin(), actual.end(),
-                                             expected.begin(), expected.end())
-                                   .first -
-                               actual.begin();
-    std::cout << "Output is different to expected at position " << pos << "\n"
-              << "actual (size " << actual.size() << "):\n"
-              << actual << "---\n"
-              << "expected (size " << expected.size() << "):\n"
-              << expected << std::endl;
+  const ExpectedBuffer::Difference difference = expectedBuffer->finish();
+  if (difference.position.has_value()) {
+    std::cout << "Output is different to expected at position "
+              << *difference.position << "\n"
+              << "actual (size " << difference.actualSize << ") from there:\n"
+              << difference.actual << "---\n"
+              << "expected (size " << difference.expectedSize
+              << ") from there:\n"
+              << difference.expected << std::endl;
     leave(EXIT_FAILURE);
   } else {
-    std::cout << "Files are equal!\n"
-              << "actual:\n"
-              << actual << "---\n"
-              << "expected:\n"
-              << expected << std::endl;
+    std::cout << "Files are equal!" << std::endl;
     leave(EXIT_SUCCESS);
   }
 } catch (const std::exception& e) {
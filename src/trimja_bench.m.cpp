@@ -0,0 +1,289 @@
+// MIT License
+//
+// Copyright (c) 2024 Elliot Goodrich
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "cpuprofiler.h"
+#include "manifestgenerator.h"
+#include "mappedfile.h"
+#include "trimutil.h"
+
+#ifdef WIN32
+#include <ninja/getopt.h>
+#else
+#include <getopt.h>
+#endif
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace {
+
+const std::string_view g_helpText =
+    R"HELP(trimja_bench generates a synthetic ninja build with its
+'.ninja_deps' and '.ninja_log', then times each phase of trimming it.
+
+Usage:
+$ trimja_bench [--dir DIR] [--edges N] [--subninjas N] [--depth N]
+               [--fan-in N] [--command-length N] [--affected N]
+               [--iterations N] [-j N]
+
+Options:
+  --dir=DIR                 directory to generate the build in
+                            [default=trimja_bench in the temp directory]
+  --edges=N                 number of compile edges [default=100000]
+  --subninjas=N             number of top-level subninja files [default=8]
+  --depth=N                 subninja nesting depth of each file [default=1]
+  --fan-in=N                number of headers of each object and objects of
+                            each library [default=8]
+  --command-length=N        approximate length of compile commands
+                            [default=200]
+  --affected=N              number of affected source files [default=10]
+  --iterations=N            number of times to load and trim [default=5]
+  -j N, --jobs=N            number of threads to parse with [default=1]
+  -h, --help                print help)HELP";
+
+// NOLINTNEXTLINE(modernize-avoid-c-arrays)
+const option g_longOptions[] = {
+    {"affected", required_argument, nullptr, 'a'},
+    {"command-length", required_argument, nullptr, 'c'},
+    {"depth", required_argument, nullptr, 'd'},
+    {"dir", required_argument, nullptr, 'o'},
+    {"edges", required_argument, nullptr, 'e'},
+    {"fan-in", required_argument, nullptr, 'f'},
+    {"help", no_argument, nullptr, 'h'},
+    {"iterations", required_argument, nullptr, 'i'},
+    {"jobs", required_argument, nullptr, 'j'},
+    {"subninjas", required_argument, nullptr, 's'},
+    {},
+};
+
+// Return `text` parsed as a positive number for the option `name`
+std::size_t parseCount(const char* text, std::string_view name) {
+  const char* last = text + std::strlen(text);
+  std::size_t value = 0;
+  auto [ptr, ec] = std::from_chars(text, last, value);
+  if (ec != std::errc{} || ptr != last || value == 0) {
+    std::string msg;
+    msg = "'";
+    msg += text;
+    msg += "' is an invalid value for --";
+    msg += name;
+    msg += "!";
+    throw std::runtime_error{msg};
+  }
+  return value;
+}
+
+// A stream buffer that counts and discards everything written to it, so
+// that we time only how long trimja takes to produce its output
+class CountingBuffer : public std::streambuf {
+  std::size_t m_count = 0;
+
+ protected:
+  int_type overflow(int_type ch) override {
+    m_count += !traits_type::eq_int_type(ch, traits_type::eof());
+    return traits_type::not_eof(ch);
+  }
+
+  std::streamsize xsputn(const char*, std::streamsize count) override {
+    m_count += static_cast<std::size_t>(count);
+    return count;
+  }
+
+ public:
+  std::size_t count() const { return m_count; }
+};
+
+// The timings of one phase of trimming over all iterations
+struct Phase {
+  std::string_view label;
+  std::string_view timer;
+  std::vector<std::chrono::steady_clock::duration> times;
+};
+
+double toSeconds(std::chrono::steady_clock::duration duration) {
+  return std::chrono::duration<double>(duration).count();
+}
+
+double toMilliseconds(std::chrono::steady_clock::duration duration) {
+  return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) try {
+  using namespace trimja;
+
+  std::ios_base::sync_with_stdio(false);
+
+  ManifestGenerator::Options options;
+  std::optional<std::filesystem::path> dir;
+  std::size_t affectedCount = 10;
+  std::size_t iterations = 5;
+  std::size_t jobs = 1;
+
+  int ch = -1;
+  while ((ch = getopt_long(argc, argv, "hj:", g_longOptions, nullptr)) != -1) {
+    switch (ch) {
+      case 'a':
+        affectedCount = parseCount(optarg, "affected");
+        break;
+      case 'c':
+        options.commandLength = parseCount(optarg, "command-length");
+        break;
+      case 'd':
+        options.depth = parseCount(optarg, "depth");
+        break;
+      case 'e':
+        options.edges = parseCount(optarg, "edges");
+        break;
+      case 'f':
+        options.fanIn = parseCount(optarg, "fan-in");
+        break;
+      case 'h':
+        std::cout << g_helpText << std::endl;
+        return EXIT_SUCCESS;
+      case 'i':
+        iterations = parseCount(optarg, "iterations");
+        break;
+      case 'j':
+        jobs = parseCount(optarg, "jobs");
+        break;
+      case 'o':
+        dir = optarg;
+        break;
+      case 's':
+        options.subninjas = parseCount(optarg, "subninjas");
+        break;
+      case '?':
+        std::cerr << "Unknown option" << std::endl;
+        return EXIT_FAILURE;
+      default:
+        std::cerr << "Unknown command line parsing error" << std::endl;
+        return EXIT_FAILURE;
+    }
+  }
+
+  if (!dir.has_value()) {
+    dir = std::filesystem::temp_directory_path() / "trimja_bench";
+  }
+
+  // Generate the build and move into its directory, since `subninja` paths
+  // are relative to the working directory in the same way as for ninja
+  const auto generateStart = std::chrono::steady_clock::now();
+  const ManifestGenerator::Summary summary =
+      ManifestGenerator::generate(*dir, options);
+  const auto generateTime = std::chrono::steady_clock::now() - generateStart;
+  std::filesystem::current_path(*dir);
+  const std::filesystem::path ninjaFile = summary.ninjaFile.filename();
+
+  std::cout << "Generated " << summary.buildEdges << " build edges ("
+            << summary.manifestBytes / (1024 * 1024)
+            << " MiB of ninja files) in " << *dir << " in " << std::fixed
+            << std::setprecision(2) << toSeconds(generateTime) << "s\n";
+
+  // Choose affected sources spread evenly throughout the build
+  std::string affected;
+  const std::size_t step =
+      std::max<std::size_t>(summary.sources.size() / affectedCount, 1);
+  for (std::size_t i = 0;
+       i < summary.sources.size() && i / step < affectedCount; i += step) {
+    affected += summary.sources[i];
+    affected += '\n';
+  }
+
+  std::vector<Phase> phases = {
+      {"parse", ".ninja parse", {}},
+      {"deps", ".ninja_deps parse", {}},
+      {"log", ".ninja_log parse", {}},
+      {"propagation", "trim time", {}},
+      {"output", "output time", {}},
+  };
+  std::size_t outputBytes = 0;
+  CPUProfiler::enable();
+  for (std::size_t iteration = 0; iteration < iterations; ++iteration) {
+    CPUProfiler::reset();
+    {
+      const MappedFile contents{ninjaFile};
+      TrimUtil util;
+      util.load(ninjaFile, contents.contents(),
+                {false, jobs, std::nullopt, false, false});
+      std::istringstream affectedStream{affected};
+      CountingBuffer buffer;
+      std::ostream output{&buffer};
+      util.trim(output, affectedStream, {}, false, std::nullopt);
+      outputBytes = buffer.count();
+    }
+    for (Phase& phase : phases) {
+      phase.times.push_back(CPUProfiler::total(phase.timer));
+    }
+  }
+
+  // Report the throughput of each phase using the fastest iteration
+  const auto perSecond = [](double amount,
+                            std::chrono::steady_clock::duration time) {
+    return time.count() == 0 ? 0.0 : amount / toSeconds(time);
+  };
+  const double mebibyte = 1024.0 * 1024.0;
+  std::cout << std::left << std::setw(14) << "phase" << std::right
+            << std::setw(12) << "min ms" << std::setw(12) << "median ms"
+            << "  throughput\n";
+  for (Phase& phase : phases) {
+    std::sort(phase.times.begin(), phase.times.end());
+    const auto fastest = phase.times.front();
+    std::cout << std::left << std::setw(14) << phase.label << std::right
+              << std::setw(12) << toMilliseconds(fastest) << std::setw(12)
+              << toMilliseconds(phase.times[phase.times.size() / 2]) << "  ";
+    if (phase.label == "parse") {
+      std::cout << perSecond(summary.manifestBytes / mebibyte, fastest)
+                << " MiB/s";
+    } else if (phase.label == "deps") {
+      std::cout << static_cast<std::size_t>(
+                       perSecond(summary.depsRecords, fastest))
+                << " records/s";
+    } else if (phase.label == "log") {
+      std::cout << static_cast<std::size_t>(
+                       perSecond(summary.logEntries, fastest))
+                << " entries/s";
+    } else if (phase.label == "propagation") {
+      std::cout << static_cast<std::size_t>(
+                       perSecond(summary.buildEdges, fastest))
+                << " edges/s";
+    } else {
+      std::cout << perSecond(outputBytes / mebibyte, fastest) << " MiB/s";
+    }
+    std::cout << '\n';
+  }
+  return EXIT_SUCCESS;
+} catch (const std::exception& e) {
+  std::cerr << e.what() << std::endl;
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,329 @@
+// MIT License
+//
+// Copyright (c) 2024 Elliot Goodrich
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "trimserver.h"
+
+#include "mappedfile.h"
+#include "trimutil.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <span>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <csignal>
+#include <unistd.h>
+#endif
+
+namespace trimja {
+
+namespace {
+
+#ifdef _WIN32
+
+[[noreturn]] void throwUnsupported() {
+  throw std::runtime_error("Serving is not supported on this platform.");
+}
+
+#else
+
+// The first byte of every response
+const char SUCCESS = '0';
+const char FAILURE = '1';
+
+[[noreturn]] void throwSocketError(std::string_view what,
+                                   const std::filesystem::path& socket) {
+  std::string msg;
+  msg += what;
+  msg += " '";
+  msg += socket.string();
+  msg += "': ";
+  msg += std::strerror(errno);
+  throw std::runtime_error{msg};
+}
+
+// An owned socket file descriptor
+class Socket {
+  int m_fd;
+
+ public:
+  explicit Socket(int fd) : m_fd{fd} {}
+  ~Socket() {
+    if (m_fd != -1) {
+      ::close(m_fd);
+    }
+  }
+  Socket(const Socket&) = delete;
+  Socket& operator=(const Socket&) = delete;
+
+  int get() const { return m_fd; }
+};
+
+sockaddr_un makeAddress(const std::filesystem::path& socket) {
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  const std::string path = socket.string();
+  if (path.size() >= sizeof(address.sun_path)) {
+    std::string msg;
+    msg += "Socket path '";
+    msg += path;
+    msg += "' is too long";
+    throw std::runtime_error{msg};
+  }
+  std::copy(path.begin(), path.end(), address.sun_path);
+  return address;
+}
+
+// Write all of `data` to `fd`
+void writeAll(int fd, std::string_view data) {
+  while (!data.empty()) {
+    const ssize_t written = ::write(fd, data.data(), data.size());
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::system_error{errno, std::generic_category(), "write"};
+    }
+    data.remove_prefix(static_cast<std::size_t>(written));
+  }
+}
+
+// Read from `fd` until the other end stops writing
+std::string readAll(int fd) {
+  std::string result;
+  char buffer[64 * 1024];
+  for (;;) {
+    const ssize_t count = ::read(fd, buffer, sizeof(buffer));
+    if (count == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::system_error{errno, std::generic_category(), "read"};
+    }
+    if (count == 0) {
+      return result;
+    }
+    result.append(buffer, static_cast<std::size_t>(count));
+  }
+}
+
+// The modification time and size of a file, which are both default values if
+// the file does not exist
+struct FileState {
+  std::filesystem::file_time_type time;
+  std::uintmax_t size = 0;
+
+  explicit FileState(const std::filesystem::path& file) {
+    std::error_code ec;
+    time = std::filesystem::last_write_time(file, ec);
+    if (ec) {
+      time = {};
+      return;
+    }
+    size = std::filesystem::file_size(file, ec);
+    if (ec) {
+      size = 0;
+    }
+  }
+
+  friend bool operator==(const FileState&, const FileState&) = default;
+};
+
+// A loaded Ninja build file along with the state of every file it was loaded
+// from
+class LoadedBuild {
+  MappedFile m_contents;
+  TrimUtil m_util;
+  std::vector<std::pair<std::filesystem::path, FileState>> m_inputs;
+
+ public:
+  LoadedBuild(const std::filesystem::path& ninjaFile,
+              const TrimUtil::Options& options)
+      : m_contents{ninjaFile}, m_util{}, m_inputs{} {
+    // The build files may change before a request, so we cannot read them
+    // again to write its output
+    TrimUtil::Options loadOptions = options;
+    loadOptions.lowMemory = false;
+    m_util.load(ninjaFile, m_contents.contents(), loadOptions);
+    for (std::filesystem::path& file : m_util.inputFiles()) {
+      FileState state{file};
+      m_inputs.emplace_back(std::move(file), state);
+    }
+  }
+
+  // Return whether any of the files we loaded have changed since
+  bool isOutOfDate() const {
+    return std::any_of(m_inputs.begin(), m_inputs.end(), [](const auto& input) {
+      return FileState{input.first} != input.second;
+    });
+  }
+
+  const TrimUtil& util() const { return m_util; }
+};
+
+#endif
+
+}  // namespace
+
+void TrimServer::serve(const std::filesystem::path& socket,
+                       const std::filesystem::path& ninjaFile,
+                       const TrimUtil::Options& options) {
+#ifdef _WIN32
+  (void)socket;
+  (void)ninjaFile;
+  (void)options;
+  throwUnsupported();
+#else
+  // Clients that disconnect early should not kill the server
+  std::signal(SIGPIPE, SIG_IGN);
+
+  // Load before listening so that the first request is fast and any errors
+  // in the initial build file are reported straight away
+  std::unique_ptr<LoadedBuild> build =
+      std::make_unique<LoadedBuild>(ninjaFile, options);
+
+  // Remove any socket left behind by an earlier server, but nothing else
+  if (std::error_code ec; std::filesystem::is_socket(socket, ec)) {
+    std::filesystem::remove(socket);
+  }
+
+  const Socket listener{::socket(AF_UNIX, SOCK_STREAM, 0)};
+  if (listener.get() == -1) {
+    throwSocketError("Unable to create socket", socket);
+  }
+  const sockaddr_un address = makeAddress(socket);
+  if (::bind(listener.get(), reinterpret_cast<const sockaddr*>(&address),
+             sizeof(address)) == -1) {
+    throwSocketError("Unable to bind to", socket);
+  }
+  if (::listen(listener.get(), SOMAXCONN) == -1) {
+    throwSocketError("Unable to listen on", socket);
+  }
+
+  for (;;) {
+    const Socket client{::accept(listener.get(), nullptr, nullptr)};
+    if (client.get() == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throwSocketError("Unable to accept on", socket);
+    }
+
+    std::string response;
+    try {
+      std::istringstream affected{readAll(client.get())};
+      std::string line;
+      if (!std::getline(affected, line)) {
+        throw std::runtime_error{"Missing working directory in request"};
+      }
+      const std::filesystem::path workingDirectory{line};
+      if (build && build->isOutOfDate()) {
+        // Free the old graph before loading the new one
+        build.reset();
+      }
+      if (!build) {
+        build = std::make_unique<LoadedBuild>(ninjaFile, options);
+      }
+      std::ostringstream output;
+      output << SUCCESS;
+      const TrimUtil::Request request{
+          .affected = &affected,
+          .output = &output,
+          .workingDirectory = &workingDirectory,
+      };
+      build->util().trim(std::span{&request, 1}, options.explain,
+                         options.jobs);
+      response = std::move(output).str();
+    } catch (const std::exception& e) {
+      response.clear();
+      response += FAILURE;
+      response += e.what();
+    }
+
+    // A failure to respond only affects this client
+    try {
+      writeAll(client.get(), response);
+    } catch (const std::exception& e) {
+      std::cerr << e.what() << std::endl;
+    }
+  }
+#endif
+}
+
+void TrimServer::request(const std::filesystem::path& socket,
+                         std::istream& affected,
+                         std::ostream& output) {
+#ifdef _WIN32
+  (void)socket;
+  (void)affected;
+  (void)output;
+  throwUnsupported();
+#else
+  const Socket server{::socket(AF_UNIX, SOCK_STREAM, 0)};
+  if (server.get() == -1) {
+    throwSocketError("Unable to create socket", socket);
+  }
+  const sockaddr_un address = makeAddress(socket);
+  if (::connect(server.get(), reinterpret_cast<const sockaddr*>(&address),
+                sizeof(address)) == -1) {
+    throwSocketError("Unable to connect to", socket);
+  }
+
+  // Send our working directory first so that the server resolves relative
+  // paths in the same way as a local trim
+  std::ostringstream lines;
+  lines << std::filesystem::current_path().string() << '\n';
+  lines << affected.rdbuf();
+  std::signal(SIGPIPE, SIG_IGN);
+  writeAll(server.get(), std::move(lines).str());
+  ::shutdown(server.get(), SHUT_WR);
+
+  const std::string response = readAll(server.get());
+  if (response.empty()) {
+    std::string msg;
+    msg += "No response from '";
+    msg += socket.string();
+    msg += "'";
+    throw std::runtime_error{msg};
+  }
+  if (response.front() != SUCCESS) {
+    throw std::runtime_error{response.substr(1)};
+  }
+  output << std::string_view{response}.substr(1);
+#endif
+}
+
+}  // namespace trimja
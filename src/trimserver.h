@@ -0,0 +1,81 @@
+// MIT License
+//
+// Copyright (c) 2024 Elliot Goodrich
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef TRIMJA_TRIMSERVER
+#define TRIMJA_TRIMSERVER
+
+#include "trimutil.h"
+
+#include <filesystem>
+#include <iosfwd>
+
+namespace trimja {
+
+/**
+ * @brief Utility to keep a Ninja build file loaded between trims and answer
+ * requests for them over a local socket.
+ *
+ * A request is the working directory of the client followed by the list of
+ * affected files, one per line, and the response is the trimmed Ninja build
+ * file.  Affected files are resolved against the client's working directory
+ * in the same way as a local trim resolves them against the current one.  The
+ * server reloads the build file before a request if it, any of its `include`
+ * or `subninja` files, `.ninja_deps` or `.ninja_log` has been modified since
+ * it was last loaded.
+ */
+struct TrimServer {
+  /**
+   * @brief Loads the Ninja build file and answers requests on `socket` until
+   * an unrecoverable error occurs.
+   *
+   * @param socket The path of the socket to listen on, which must not exist
+   * unless it is a socket left behind by an earlier server.
+   * @param ninjaFile The path to the Ninja build file.
+   * @param options How to load and trim the Ninja build file, see
+   * `TrimUtil::load`, where `options.lowMemory` is overridden to false, as
+   * every request trims the same loaded build, and explanations are printed
+   * to stderr.
+   * @throws std::runtime_error if the build file cannot be loaded initially,
+   * the socket cannot be created, or this platform is not supported.
+   */
+  [[noreturn]] static void serve(const std::filesystem::path& socket,
+                                 const std::filesystem::path& ninjaFile,
+                                 const TrimUtil::Options& options);
+
+  /**
+   * @brief Sends the affected files and the current directory to the server
+   * listening on `socket` and writes the trimmed Ninja build file to `output`.
+   *
+   * @param socket The path of the socket the server is listening on.
+   * @param affected The input stream containing the list of affected files.
+   * @param output The output stream to write the trimmed Ninja file to.
+   * @throws std::runtime_error if the server cannot be reached, it failed to
+   * trim the build file, or this platform is not supported.
+   */
+  static void request(const std::filesystem::path& socket,
+                      std::istream& affected,
+                      std::ostream& output);
+};
+
+}  // namespace trimja
+
+#endif  // TRIMJA_TRIMSERVER
@@ -0,0 +1,112 @@
+// MIT License
+//
+// Copyright (c) 2024 Elliot Goodrich
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "trimstate.h"
+
+#include "cachefile.h"
+#include "mappedfile.h"
+
+#include <cstddef>
+#include <stdexcept>
+#include <string_view>
+
+namespace trimja {
+
+namespace {
+
+// The first string in every state file, which needs to be changed whenever
+// the layout changes.  Node indices depend on how trimja parses, so states
+// from other versions are never reused.
+const std::string_view STATE_SIGNATURE = "trimja state v1 " TRIMJA_VERSION;
+
+// Write `bits` as a count followed by 64 bits per word
+void writeBits(CacheWriter& writer, const std::vector<bool>& bits) {
+  writer.writeWord(bits.size());
+  std::uint64_t word = 0;
+  for (std::size_t i = 0; i < bits.size(); ++i) {
+    word |= static_cast<std::uint64_t>(bits[i]) << (i % 64);
+    if (i % 64 == 63) {
+      writer.writeWord(word);
+      word = 0;
+    }
+  }
+  if (bits.size() % 64 != 0) {
+    writer.writeWord(word);
+  }
+}
+
+// Read the bits written by `writeBits` into `bits`
+void readBits(CacheReader& reader, std::vector<bool>& bits) {
+  const std::size_t size = reader.readWord();
+  bits.assign(size, false);
+  std::uint64_t word = 0;
+  for (std::size_t i = 0; i < size; ++i) {
+    if (i % 64 == 0) {
+      word = reader.readWord();
+    }
+    bits[i] = (word >> (i % 64)) & 1;
+  }
+}
+
+}  // namespace
+
+bool TrimState::load(const std::filesystem::path& file) {
+  if (!std::filesystem::exists(file)) {
+    return false;
+  }
+
+  try {
+    const MappedFile contents{file};
+    CacheReader reader{contents.contents()};
+    if (reader.readString() != STATE_SIGNATURE) {
+      return false;
+    }
+    fingerprint = reader.readWord();
+    readBits(reader, isSeed);
+    readBits(reader, isOutdated);
+    readBits(reader, isAffected);
+    readBits(reader, needsAllInputs);
+    const std::size_t size = isSeed.size();
+    if (!reader.empty() || isOutdated.size() != size ||
+        isAffected.size() != size || needsAllInputs.size() != size) {
+      throw std::runtime_error("Inconsistent state file");
+    }
+  } catch (const std::exception&) {
+    // Treat any corrupt file as if it did not exist
+    return false;
+  }
+  return true;
+}
+
+void TrimState::save(const std::filesystem::path& file) const {
+  CacheWriter writer;
+  writer.writeString(STATE_SIGNATURE);
+  writer.writeWord(fingerprint);
+  writeBits(writer, isSeed);
+  writeBits(writer, isOutdated);
+  writeBits(writer, isAffected);
+  writeBits(writer, needsAllInputs);
+  writer.save(file);
+}
+
+}  // namespace trimja
@@ -0,0 +1,88 @@
+// MIT License
+//
+// Copyright (c) 2024 Elliot Goodrich
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef TRIMJA_TRIMSTATE
+#define TRIMJA_TRIMSTATE
+
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+namespace trimja {
+
+/**
+ * @struct TrimState
+ * @brief The nodes marked by a trim, which is saved so that a later trim of
+ * the same build graph with a superset of the affected files only needs to
+ * continue from the newly affected files.
+ *
+ * All vectors are indexed by the node of each path in the build graph.
+ */
+struct TrimState {
+  /**
+   * @brief A fingerprint of the build graph and `.ninja_log` that this state
+   * was calculated from, which must match before it is reused.
+   */
+  std::uint64_t fingerprint = 0;
+
+  /**
+   * @brief Whether each node was named directly by the affected files.
+   */
+  std::vector<bool> isSeed;
+
+  /**
+   * @brief Whether each node is affected by a seed or by `.ninja_log`,
+   * directly or through its inputs.
+   */
+  std::vector<bool> isOutdated;
+
+  /**
+   * @brief Whether each node is kept in the trimmed build file, which is
+   * every outdated node along with the inputs required to build them.
+   */
+  std::vector<bool> isAffected;
+
+  /**
+   * @brief Whether all the inputs of each node have been marked as required.
+   */
+  std::vector<bool> needsAllInputs;
+
+  /**
+   * @brief Loads the state saved in `file`.
+   * @param file The file written by `save`.
+   * @return Whether the state was loaded, which is false if the file does
+   * not exist, is corrupt, or was written by another version of trimja.
+   */
+  bool load(const std::filesystem::path& file);
+
+  /**
+   * @brief Saves this state to `file`.
+   * @param file The path of the file to write.
+   * @throws std::runtime_error if the file cannot be written.
+   */
+  void save(const std::filesystem::path& file) const;
+};
+
+}  // namespace trimja
+
+#endif  // TRIMJA_TRIMSTATE
@@ -23,27 +23,48 @@
 #include "trimutil.h"
 
 #include "basicscope.h"
+#include "builddirutil.h"
+#include "cachefile.h"
+#include "commandhashes.h"
 #include "cpuprofiler.h"
 #include "depsreader.h"
+#include "depswriter.h"
 #include "edgescope.h"
 #include "evalstring.h"
+#include "explainlog.h"
 #include "fixed_string.h"
 #include "graph.h"
 #include "logreader.h"
 #include "manifestparser.h"
+#include "mappedfile.h"
 #include "murmur_hash.h"
+#include "ninja_clock.h"
+#include "pathindex.h"
 #include "rule.h"
+#include "stringarena.h"
+#include "trimstate.h"
 
 #include <ninja/util.h>
 #include <rapidhash/rapidhash.h>
 #include <boost/boost_unordered.hpp>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
+#include <cctype>
+#include <cstring>
+#include <deque>
+#include <exception>
 #include <forward_list>
-#include <fstream>
 #include <iostream>
-#include <numeric>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <span>
 #include <sstream>
+#include <thread>
+#include <variant>
 
 namespace trimja {
 
@@ -91,31 +112,84 @@ class PathVector {
   bool empty() const { return m_size == 0; }
 };
 
+// Return `text` without any leading blank or comment lines, which the lexer
+// includes at the start of the next statement depending on what came before
+std::string_view withoutComments(std::string_view text) {
+  std::size_t pos = 0;
+  while (true) {
+    const std::size_t first = text.find_first_not_of(' ', pos);
+    if (first == std::string_view::npos ||
+        (text[first] != '#' && text[first] != '\r' && text[first] != '\n')) {
+      return text.substr(pos);
+    }
+    const std::size_t newline = text.find('\n', first);
+    if (newline == std::string_view::npos) {
+      return text.substr(text.size());
+    }
+    pos = newline + 1;
+  }
+}
+
+// A stack of scopes for nested `subninja` files, where each scope only holds
+// the variables assigned in that file and all others are looked up in the
+// parent scopes
 class NestedScope {
+  // An optional scope shared with other threads that is searched after
+  // `m_scopes` and is never modified
+  std::shared_ptr<const BasicScope> m_root;
+
   std::vector<BasicScope> m_scopes;
 
+  // The variables assigned in each scope in the order they were assigned,
+  // which may contain duplicates
+  std::vector<std::vector<VariableName>> m_assigned;
+
+  // A hash of the text of every variable declaration visible from each scope,
+  // in the order they were declared, see `fingerprint`
+  std::vector<std::uint64_t> m_fingerprints;
+
  public:
-  NestedScope() : m_scopes{1} {}
+  NestedScope() : m_root{}, m_scopes{1}, m_assigned{1}, m_fingerprints{0} {}
+
+  NestedScope(std::shared_ptr<const BasicScope> root,
+              std::uint64_t rootFingerprint)
+      : m_root{std::move(root)},
+        m_scopes{1},
+        m_assigned{1},
+        m_fingerprints{rootFingerprint} {}
 
   void push() {
-    BasicScope last = m_scopes.back();
-    m_scopes.push_back(std::move(last));
+    m_scopes.emplace_back();
+    m_assigned.emplace_back();
+    m_fingerprints.push_back(m_fingerprints.back());
   }
 
   [[nodiscard]] std::string pop() {
-    // Take all variables defined in the latest scope and if their value differs
-    // from the value in the previous scope then generate some Ninja variable
-    // statements to set this variable back to the parent's value.
-    BasicScope last = std::move(m_scopes.back());
+    // Take all variables assigned in the latest scope and if their value
+    // differs from the value in the parent scope then generate some Ninja
+    // variable statements to set this variable back to the parent's value.  We
+    // do this in the order they were first assigned to keep our output
+    // deterministic.
+    const BasicScope last = std::move(m_scopes.back());
     m_scopes.pop_back();
+    const std::vector<VariableName> assigned = std::move(m_assigned.back());
+    m_assigned.pop_back();
+    m_fingerprints.pop_back();
 
     std::string ninja;
+    std::string value;
     std::string previousValue;
-    for (const auto& [name, value] : last) {
+    boost::unordered_flat_set<VariableName> seen;
+    for (const VariableName name : assigned) {
+      if (!seen.insert(name).second) {
+        continue;
+      }
+      value.clear();
+      last.appendValue(value, name);
       previousValue.clear();
-      m_scopes.back().appendValue(previousValue, name);
+      appendValue(previousValue, name);
       if (value != previousValue) {
-        ninja += name;
+        ninja += name.view();
         if (previousValue.empty()) {
           ninja += " =";
         } else {
@@ -129,16 +203,34 @@ class NestedScope {
     return ninja;
   }
 
-  std::string_view set(std::string_view key, std::string&& value) {
+  std::string_view set(VariableName key, std::string&& value) {
+    m_assigned.back().push_back(key);
     return m_scopes.back().set(key, std::move(value));
   }
 
-  std::string& resetValue(std::string_view key) {
+  std::string& resetValue(VariableName key) {
+    m_assigned.back().push_back(key);
     return m_scopes.back().resetValue(key);
   }
 
-  bool appendValue(std::string& output, std::string_view name) const {
-    return m_scopes.back().appendValue(output, name);
+  // Mix the text of a variable declaration, ignoring any comments, into the
+  // fingerprint of the current scope
+  void declare(std::string_view text) {
+    text = withoutComments(text);
+    m_fingerprints.back() =
+        rapidhash_withSeed(text.data(), text.size(), m_fingerprints.back());
+  }
+
+  // Return a hash that identifies the values of all variables in scope, as
+  // these only depend on the variable declarations seen so far
+  std::uint64_t fingerprint() const { return m_fingerprints.back(); }
+
+  bool appendValue(std::string& output, VariableName name) const {
+    return std::any_of(m_scopes.rbegin(), m_scopes.rend(),
+                       [&](const BasicScope& scope) {
+                         return scope.appendValue(output, name);
+                       }) ||
+           (m_root && m_root->appendValue(output, name));
   }
 };
 
@@ -153,12 +245,24 @@ struct BuildCommand {
 
   Resolution resolution = Phony;
 
+  // The hash of the build command (+ rspfile_content) using
+  // `BuildContext::hashType`, which is compared against `.ninja_log`
+  std::uint64_t hash = 0;
+
+  // A hash of everything the build command was evaluated from, see
+  // `CommandHashes`
+  std::uint64_t fingerprint = 0;
+
+  // The index of the rule into `BuildContext::rules`
+  std::size_t ruleIndex = std::numeric_limits<std::size_t>::max();
+};
+
+// The text of a `BuildCommand`, which is kept apart from it as it is only
+// needed to write out the trimmed build file from `BuildContext::parts`
+struct BuildCommandParts {
   // The location of our entire build command inside `BuildContext::parts`
   gch::small_vector<std::size_t, 3> partsIndices;
 
-  // The build command (+ rspfile_content) that gets hashed by ninja
-  std::string hashTarget;
-
   // Map each output index to the string containing the
   // "build out1 out$ 2 | implicitOut3" (note no newline and no trailing `|`
   // or `:`)
@@ -168,9 +272,6 @@ struct BuildCommand {
   // e.g. "|@ validation1 validation2" (note no newline and no leading
   // space)
   std::string_view validationStr;
-
-  // The index of the rule into `BuildContext::rules`
-  std::size_t ruleIndex = std::numeric_limits<std::size_t>::max();
 };
 
 struct RuleCommand {
@@ -193,139 +294,471 @@ struct RuleCommand {
   RuleCommand(std::string_view name) : name{name} {}
 };
 
-}  // namespace
+template <typename RANGE>
+void consume(RANGE&& range) {
+  for ([[maybe_unused]] auto&& _ : range) {
+  }
+}
 
-namespace detail {
+// Return the path of the file referenced by the `include` or `subninja`
+// statement `r`, evaluated using `scope`
+template <typename READER, typename SCOPE>
+std::filesystem::path getPath(const READER& r, const SCOPE& scope) {
+  std::string path;
+  evaluate(path, r.path(), scope);
+  return std::filesystem::path{r.parent()}.remove_filename() / path;
+}
+
+// Throw if `file` does not exist
+void checkExists(const std::filesystem::path& file) {
+  if (!std::filesystem::exists(file)) {
+    std::string msg;
+    msg += "Unable to find ";
+    msg += file.string();
+    msg += "!";
+    throw std::runtime_error{msg};
+  }
+}
+
+// A file loaded through `include` or `subninja`
+struct LoadedFile {
+  std::filesystem::path path;
+  MappedFile file;
+
+  explicit LoadedFile(const std::filesystem::path& path)
+      : path{path}, file{path} {}
+};
+
+// The files loaded through `include` and `subninja`, where each file is only
+// mapped once however many times it is loaded, which is safe to use from
+// multiple threads.  Iterating visits each file in the order it was first
+// loaded.
+class FileCache {
+  std::mutex m_mutex;
+  std::forward_list<LoadedFile> m_files;
+  std::forward_list<LoadedFile>::iterator m_last;
+
+  // The contents of each file by its canonical path, so that the different
+  // relative paths used by `include` and `subninja` from other directories
+  // find the same file
+  boost::unordered_flat_map<std::string, std::string_view> m_contents;
 
-class BuildContext {
  public:
-  // The indexes of the built-in rules within `rules`
-  static const std::size_t phonyIndex = 0;
-  static const std::size_t defaultIndex = 1;
+  FileCache() : m_mutex{}, m_files{}, m_last{m_files.before_begin()} {}
+
+  // Return the contents of `file`, mapping it if it has not been loaded, and
+  // throw if it does not exist
+  std::string_view load(const std::filesystem::path& file) {
+    std::error_code ec;
+    std::string key = std::filesystem::weakly_canonical(file, ec).string();
+    if (ec) {
+      key = file.string();
+    }
+    const std::lock_guard lock{m_mutex};
+    if (const auto it = m_contents.find(key); it != m_contents.end()) {
+      return it->second;
+    }
+    checkExists(file);
+    m_last = m_files.emplace_after(m_last, file);
+    return m_contents.emplace(std::move(key), m_last->file.contents())
+        .first->second;
+  }
 
-  // An optional storage for any generated strings or strings whose lifetime
-  // needs extending. e.g. This is useful when processing `include` and
-  // `subninja` and we need to extend the lifetime of the file contents until
-  // all parsing has finished.  We use a `std::forward_list` so that we get
-  // stable references to the contents.
-  std::forward_list<std::string> stringStorage;
+  std::forward_list<LoadedFile>::const_iterator begin() const {
+    return m_files.begin();
+  }
 
-  // A place to hold numbers as strings that can be put into `parts` if we have
-  // duplicate rules and need a suffix.
-  std::vector<fixed_string> numbers;
+  std::forward_list<LoadedFile>::const_iterator end() const {
+    return m_files.end();
+  }
+};
 
-  // All parts of the input build file, possibly indexing into an element of
-  // `stringStorage`.  Note that we may swap out build command sections with
-  // phony commands.
-  std::vector<std::string_view> parts;
+// Return the hash of `command` in the same way as ninja does for `hashType`
+std::uint64_t hashCommand(HashType hashType, std::string_view command) {
+  switch (hashType) {
+    case HashType::murmur:
+      return murmur_hash::hash(command.data(), command.size());
+    case HashType::rapidhash:
+      return rapidhash(command.data(), command.size());
+    default:
+      assert(false);  // TODO: `std::unreachable` in C++23
+      return 0;
+  }
+}
 
-  // All build commands and default statements mentioned
-  std::vector<BuildCommand> commands;
+// Return the hash type used by `ninjaLog`, or `fallback` if it does not exist
+// or cannot be read, since any errors are reported when reading it later
+HashType logHashType(const std::filesystem::path& ninjaLog,
+                     HashType fallback) {
+  try {
+    if (std::filesystem::exists(ninjaLog)) {
+      return LogReader::readHashType(ninjaLog);
+    }
+  } catch (const std::exception&) {
+  }
+  return fallback;
+}
 
-  // Map each output index to the index within `command`.  Use -1 for a
-  // value that isn't an output to a build command (i.e. a source file)
-  std::vector<std::size_t> nodeToCommand;
+// The text of a build statement, which will be referenced by `parts`
+struct BuildStatement {
+  // The entire build statement
+  std::string_view text;
 
-  // Our list of rules
-  std::vector<RuleCommand> rules;
+  // See `BuildCommandParts::outStr`
+  std::string_view outStr;
 
-  struct RuleBits {
-    // The index of the rule in `rules`
-    std::size_t ruleIndex;
+  // The name of the rule, which points inside `text`
+  std::string_view ruleName;
 
-    // How many rules have this name
-    std::size_t duplicates;
+  // See `BuildCommandParts::validationStr`
+  std::string_view validationStr;
+};
 
-    explicit RuleBits(std::size_t ruleIndex)
-        : ruleIndex{ruleIndex}, duplicates{1} {}
-  };
+// A build statement that has had all of its paths evaluated
+struct ParsedBuild {
+  BuildStatement statement;
 
-  // Our rules keyed by name
-  boost::unordered_flat_map<fixed_string,
-                            RuleBits,
-                            std::hash<trimja::fixed_string>>
-      ruleLookup;
+  // The explicit outputs followed by the implicit outputs
+  PathVector outs;
+  std::size_t outSize = 0;
 
-  // A stack of rules that have shadowed rules in their parent file.
-  std::vector<std::vector<std::size_t>> shadowedRules;
+  // The explicit inputs followed by the implicit inputs
+  PathVector ins;
+  std::size_t inSize = 0;
 
-  // When entering into subninja files we keep a stack of the file ids
-  // that are generated from an incremental counter.
-  std::size_t nextFileId = 0;
-  std::vector<std::size_t> fileIds;
+  PathVector orderOnlyDeps;
 
-  // Our top-level variables
-  NestedScope fileScope;
+  // The build command (+ rspfile_content) that gets hashed by ninja
+  std::string hashTarget;
 
-  // Our graph
-  Graph graph;
+  // See `BuildCommand::fingerprint`
+  std::uint64_t fingerprint = 0;
 
-  // Variables to be reused to avoid reallocations
-  struct {
-    PathVector outs;
-    PathVector ins;
-    PathVector orderOnlyDeps;
-    std::vector<std::size_t> outIndices;
-  } tmp;
+  // The total size of every `hashTarget` hashed so far, and the number of
+  // hashes taken from `CommandHashes` instead, for profiling
+  std::uint64_t hashedBytes = 0;
+  std::uint64_t reusedHashes = 0;
+};
 
-  // Return whether `ruleIndex` is a built-in rule (i.e. `default` or `phony`)
-  static bool isBuiltInRule(std::size_t ruleIndex) {
-    static_assert(phonyIndex == 0);
-    static_assert(defaultIndex == 1);
-    return ruleIndex < 2;
+// Read the build statement `r` into `build` and evaluate its paths and
+// variables with `fileScope`.  `findRule` is called with the name of the rule
+// and must return its `Rule`.  After all paths are evaluated `addPaths` is
+// called with `build`, and it must canonicalize the paths in place and return
+// where to store the hash of the build command using `hashType`.  The hash is
+// taken from `commandHashes`, if it is not null, when the fingerprint of the
+// build command is unchanged.
+template <typename FIND_RULE, typename ADD_PATHS>
+void readBuild(BuildReader& r,
+               NestedScope& fileScope,
+               ParsedBuild& build,
+               HashType hashType,
+               const CommandHashes* commandHashes,
+               FIND_RULE&& findRule,
+               ADD_PATHS&& addPaths) {
+  PathVector& outs = build.outs;
+  outs.clear();
+  for (const EvalString& path : r.readOut()) {
+    evaluate(outs.emplace_back(), path, fileScope);
+  }
+  if (outs.empty()) {
+    throw std::runtime_error("Missing output paths in build command");
+  }
+  build.outSize = outs.size();
+  for (const EvalString& path : r.readImplicitOut()) {
+    evaluate(outs.emplace_back(), path, fileScope);
   }
 
-  template <typename RANGE>
-  static void consume(RANGE&& range) {
-    for ([[maybe_unused]] auto&& _ : range) {
-    }
+  // Mark the outputs for later
+  build.statement.outStr = std::string_view{r.start(), r.bytesParsed()};
+
+  build.statement.ruleName = r.readName();
+  const Rule& rule = findRule(build.statement.ruleName);
+
+  // Collect inputs
+  PathVector& ins = build.ins;
+  ins.clear();
+  for (const EvalString& path : r.readIn()) {
+    evaluate(ins.emplace_back(), path, fileScope);
   }
+  build.inSize = ins.size();
 
-  std::string_view to_string_view(std::size_t n) {
-    for (std::size_t i = numbers.size(); i <= n; ++i) {
-      numbers.emplace_back(std::to_string(i));
-    }
+  for (const EvalString& path : r.readImplicitIn()) {
+    evaluate(ins.emplace_back(), path, fileScope);
+  }
 
-    return numbers[n];
+  PathVector& orderOnlyDeps = build.orderOnlyDeps;
+  orderOnlyDeps.clear();
+  for (const EvalString& path : r.readOrderOnlyDeps()) {
+    evaluate(orderOnlyDeps.emplace_back(), path, fileScope);
   }
 
-  BuildContext() {
-    fileIds.push_back(nextFileId++);
+  // Collect validations but ignore what they are. If we include a build
+  // command it will include the validation.  If that validation has a
+  // required input then we include that, otherwise the validation is
+  // `phony`ed out.
+  const char* validationStart = r.position();
+  consume(r.readValidations());
+  build.statement.validationStr = std::string_view{
+      validationStart,
+      static_cast<std::size_t>(r.position() - validationStart)};
+
+  EdgeScope scope{fileScope, rule, std::span{ins.data(), build.inSize},
+                  std::span{outs.data(), build.outSize}};
+
+  for (const auto& [name, value] : r.readVariables()) {
+    evaluate(scope.resetValue(VariableName::intern(name)), value, scope);
+  }
 
-    rules.emplace_back(
-        ruleLookup.try_emplace("phony", rules.size()).first->first);
-    assert(rules[BuildContext::phonyIndex].name == "phony");
-    rules.emplace_back(
-        ruleLookup.try_emplace("default", rules.size()).first->first);
-    assert(rules[BuildContext::defaultIndex].name == "default");
+  build.statement.text = std::string_view{r.start(), r.bytesParsed()};
+
+  // The build command only depends on the text of the statement, the rule and
+  // the variables in scope
+  const std::array<std::uint64_t, 2> seeds = {rule.fingerprint(),
+                                              fileScope.fingerprint()};
+  build.fingerprint = rapidhash_withSeed(
+      build.statement.text.data(), build.statement.text.size(),
+      rapidhash(seeds.data(), sizeof(seeds)));
+
+  std::uint64_t& hash = addPaths(build);
+  if (commandHashes) {
+    if (const std::optional<std::uint64_t> previous =
+            commandHashes->find(outs[0], build.fingerprint)) {
+      hash = *previous;
+      ++build.reusedHashes;
+      return;
+    }
   }
 
-  std::size_t getPathIndex(std::string& path) {
-    const std::size_t index = graph.addPath(path);
-    if (index >= nodeToCommand.size()) {
-      nodeToCommand.resize(index + 1, std::numeric_limits<std::size_t>::max());
+  std::string& hashTarget = build.hashTarget;
+  hashTarget.clear();
+  scope.appendValue(hashTarget, VariableName::Command);
+  const std::size_t initialSize = hashTarget.size();
+  scope.appendValue(hashTarget, VariableName::RspfileContent);
+
+  // If `rspfile_content` is not empty we have to inject a separator
+  if (hashTarget.size() != initialSize) {
+    hashTarget.insert(initialSize, ";rspfile=");
+  }
+  hash = hashCommand(hashType, hashTarget);
+  build.hashedBytes += hashTarget.size();
+}
+
+// Read all variables of the rule `r` called `name` into `rule` and set its
+// fingerprint
+void readRuleVariables(RuleReader& r, std::string_view name, Rule& rule) {
+  for (const auto& [key, value] : r.readVariables()) {
+    if (!rule.add(VariableName::intern(key), value)) {
+      std::string msg;
+      msg += "Unexpected variable '";
+      msg += key;
+      msg += "' in rule '";
+      msg += name;
+      msg += "' found!";
+      throw std::runtime_error(msg);
     }
-    return index;
   }
+  rule.setFingerprint(rapidhash(r.start(), r.bytesParsed()));
+}
 
-  std::size_t getPathIndexForNormalized(std::string_view path) {
-    const std::size_t index = graph.addNormalizedPath(path);
-    if (index >= nodeToCommand.size()) {
-      nodeToCommand.resize(index + 1, std::numeric_limits<std::size_t>::max());
+// The `Pending*` types below are the statements of a `subninja` file that has
+// been parsed ahead of time by `SubninjaParser`.  They are later added to
+// `BuildContext` in order, as if the file had been parsed at that point.
+
+// A statement that is output verbatim
+struct PendingPart {
+  std::string_view text;
+};
+
+struct PendingRule {
+  std::string_view name;
+
+  // The entire rule statement
+  std::string_view text;
+
+  // The variables of the rule, owned by `SubninjaFragment::rules`
+  Rule* variables;
+};
+
+struct PendingBuild {
+  BuildStatement statement;
+
+  // All outputs, then all inputs, then all order-only dependencies, which
+  // have all been canonicalized, along with the `Graph::hashPath` of each
+  std::vector<std::string> paths;
+  std::vector<std::size_t> hashes;
+  std::size_t outCount = 0;
+  std::size_t inCount = 0;
+
+  // See `BuildCommand::hash` and `BuildCommand::fingerprint`
+  std::uint64_t hash = 0;
+  std::uint64_t fingerprint = 0;
+
+  // The rule that was used to evaluate `hash`
+  const Rule* rule = nullptr;
+};
+
+struct PendingDefault {
+  std::string_view text;
+
+  // The canonicalized paths and the `Graph::hashPath` of each
+  std::vector<std::string> paths;
+  std::vector<std::size_t> hashes;
+};
+
+struct PendingEnterSubninja {};
+
+struct PendingLeaveSubninja {
+  // The variable statements to reset the scope back to the parent's
+  std::string_view resetScope;
+};
+
+// A variable declared in the top-level file, which is only used by chunks
+struct PendingVariable {
+  std::string_view text;
+  VariableName name;
+
+  // The value evaluated in the scope of the top-level file
+  std::string value;
+};
+
+using PendingStatement = std::variant<PendingPart,
+                                      PendingRule,
+                                      PendingBuild,
+                                      PendingDefault,
+                                      PendingEnterSubninja,
+                                      PendingLeaveSubninja,
+                                      PendingVariable>;
+
+// A function object with the `operator()` of each of `Fs`, to `std::visit`
+// a variant with a separate lambda for each alternative
+template <typename... Fs>
+struct Overloaded : Fs... {
+  using Fs::operator()...;
+};
+
+template <typename... Fs>
+Overloaded(Fs...) -> Overloaded<Fs...>;
+
+// The variables of each rule keyed by the rule name
+using RuleLookup = boost::unordered_flat_map<std::string_view,
+                                             const Rule*,
+                                             std::hash<std::string_view>>;
+
+// A top-level `subninja` file, or a chunk of the top-level file, that is
+// parsed on a worker thread
+struct SubninjaFragment {
+  // The path to the `subninja` file
+  std::filesystem::path file;
+
+  // If `chunk` is not empty then this is not a `subninja` file, but the
+  // top-level statements that start inside `chunk`, which is part of the
+  // top-level file `file` whose contents are `contents`
+  std::string_view contents;
+  std::string_view chunk;
+
+  // A snapshot of the top-level variables and rules at the point of the
+  // `subninja` statement, where the variables may be shared with other
+  // fragments
+  std::shared_ptr<const BasicScope> scope;
+  std::uint64_t scopeFingerprint;
+  RuleLookup ruleLookup;
+
+  // The parsed statements and everything they reference, which can only be
+  // used once `ready` is set and if `succeeded` is true
+  std::vector<PendingStatement> statements;
+  std::forward_list<Rule> rules;
+  StringArena stringStorage;
+  bool succeeded = false;
+  std::atomic<bool> ready = false;
+
+  SubninjaFragment(std::filesystem::path file,
+                   std::shared_ptr<const BasicScope> scope,
+                   std::uint64_t scopeFingerprint,
+                   const RuleLookup& ruleLookup)
+      : file{std::move(file)},
+        scope{std::move(scope)},
+        scopeFingerprint{scopeFingerprint},
+        ruleLookup{ruleLookup} {}
+};
+
+// Visit each statement read by `reader` with `visitor`, stopping before the
+// first statement that starts at or after `end`
+template <typename VISITOR>
+void visitUntil(ManifestReader& reader, const char* end, VISITOR& visitor) {
+  for (auto&& part : reader) {
+    if (std::visit([](const auto& r) { return r.start(); }, part) >= end) {
+      return;
     }
-    return index;
+    std::visit(visitor, part);
   }
+}
 
-  std::size_t getDefault() {
-    const std::size_t index = graph.addDefault();
-    if (index >= nodeToCommand.size()) {
-      nodeToCommand.resize(index + 1, std::numeric_limits<std::size_t>::max());
+// Parses a `subninja` file into a `SubninjaFragment`.  This mirrors what
+// `BuildContext` does, but only records each statement instead of modifying
+// any shared state.
+class SubninjaParser {
+  SubninjaFragment& m_fragment;
+  FileCache& m_files;
+  HashType m_hashType;
+  const CommandHashes* m_commandHashes;
+  NestedScope m_fileScope;
+  RuleLookup m_ruleLookup;
+
+  // A stack of rules and the previous rule with the same name that they
+  // shadowed, which must be restored when leaving the `subninja` file
+  std::vector<std::vector<std::pair<std::string_view, const Rule*>>>
+      m_shadowedRules;
+
+  // Reused to avoid reallocations
+  ParsedBuild m_build;
+
+  // Return whether we are parsing statements of the top-level file, which is
+  // only the case for chunks outside of any `subninja` file
+  bool isTopLevel() const { return m_shadowedRules.empty(); }
+
+ public:
+  SubninjaParser(SubninjaFragment& fragment,
+                 FileCache& files,
+                 HashType hashType,
+                 const CommandHashes* commandHashes)
+      : m_fragment{fragment},
+        m_files{files},
+        m_hashType{hashType},
+        m_commandHashes{commandHashes},
+        m_fileScope{std::move(fragment.scope), fragment.scopeFingerprint},
+        m_ruleLookup{std::move(fragment.ruleLookup)},
+        m_shadowedRules{},
+        m_build{} {}
+
+  void parseSubninja(const std::filesystem::path& file) {
+    m_fileScope.push();
+    m_shadowedRules.emplace_back();
+    m_fragment.statements.emplace_back(PendingEnterSubninja{});
+
+    parse(file, m_files.load(file));
+
+    m_fragment.statements.emplace_back(PendingLeaveSubninja{
+        m_fragment.stringStorage.store(m_fileScope.pop())});
+    for (const auto& [name, shadowedRule] : m_shadowedRules.back()) {
+      m_ruleLookup.find(name)->second = shadowedRule;
     }
-    return index;
+    m_shadowedRules.pop_back();
+  }
+
+  // Parse the top-level statements that start inside `m_fragment.chunk`
+  void parseChunk() {
+    const std::string_view contents = m_fragment.contents;
+    const std::string_view chunk = m_fragment.chunk;
+    CPUProfiler::count("bytes lexed", chunk.size());
+    ManifestReader reader{m_fragment.file, contents,
+                          static_cast<std::size_t>(chunk.data() -
+                                                   contents.data())};
+    visitUntil(reader, chunk.data() + chunk.size(), *this);
   }
 
   void parse(const std::filesystem::path& ninjaFile,
-             const std::string& ninjaFileContents) {
+             std::string_view ninjaFileContents) {
+    CPUProfiler::count("bytes lexed", ninjaFileContents.size());
     for (auto&& part : ManifestReader(ninjaFile, ninjaFileContents)) {
       std::visit(*this, part);
     }
@@ -333,562 +766,3039 @@ class BuildContext {
 
   void operator()(PoolReader& r) {
     consume(r.readVariables());
-    parts.emplace_back(r.start(), r.bytesParsed());
+    m_fragment.statements.emplace_back(
+        PendingPart{{r.start(), r.bytesParsed()}});
   }
 
   void operator()(BuildReader& r) {
-    PathVector& outs = tmp.outs;
-    outs.clear();
-
-    for (const EvalString& path : r.readOut()) {
-      evaluate(outs.emplace_back(), path, fileScope);
-    }
-    if (outs.empty()) {
-      throw std::runtime_error("Missing output paths in build command");
-    }
-    const std::size_t outSize = outs.size();
-    for (const EvalString& path : r.readImplicitOut()) {
-      evaluate(outs.emplace_back(), path, fileScope);
-    }
-
-    // Mark the outputs for later
-    const std::string_view outStr(r.start(), r.bytesParsed());
+    const Rule* rule = nullptr;
+    readBuild(
+        r, m_fileScope, m_build, m_hashType, m_commandHashes,
+        [&](std::string_view ruleName) -> const Rule& {
+          const auto ruleIt = m_ruleLookup.find(ruleName);
+          if (ruleIt == m_ruleLookup.end()) {
+            throw std::runtime_error("Unable to find " +
+                                     std::string(ruleName) + " rule");
+          }
+          rule = ruleIt->second;
+          return *rule;
+        },
+        [&](ParsedBuild& build) -> std::uint64_t& {
+          PendingBuild& pending = std::get<PendingBuild>(
+              m_fragment.statements.emplace_back(
+                  std::in_place_type<PendingBuild>));
+          pending.statement = build.statement;
+          pending.outCount = build.outs.size();
+          pending.inCount = build.ins.size();
+          pending.rule = rule;
+          pending.fingerprint = build.fingerprint;
+          const std::size_t pathCount = build.outs.size() +
+                                        build.ins.size() +
+                                        build.orderOnlyDeps.size();
+          pending.paths.reserve(pathCount);
+          pending.hashes.reserve(pathCount);
+          for (PathVector* paths :
+               {&build.outs, &build.ins, &build.orderOnlyDeps}) {
+            for (std::string& path : *paths) {
+              CanonicalizePath(&path);
+              pending.hashes.push_back(Graph::hashPath(path));
+              pending.paths.push_back(path);
+            }
+          }
+          return pending.hash;
+        });
+  }
 
-    std::string_view ruleName = r.readName();
+  void operator()(RuleReader& r) {
+    const std::string_view name = r.name();
+    Rule& rule = m_fragment.rules.emplace_front();
+    readRuleVariables(r, name, rule);
 
-    const std::size_t ruleIndex = [&] {
-      const auto ruleIt = ruleLookup.find(ruleName);
-      if (ruleIt == ruleLookup.end()) {
-        throw std::runtime_error("Unable to find " + std::string(ruleName) +
-                                 " rule");
+    // As with `BuildContext` we only restore rules that were shadowed, which
+    // is never needed for the top-level file
+    const auto [ruleIt, isNew] = m_ruleLookup.try_emplace(name, &rule);
+    if (!isNew) {
+      if (!isTopLevel()) {
+        m_shadowedRules.back().emplace_back(name, ruleIt->second);
       }
-      return ruleIt->second.ruleIndex;
-    }();
+      ruleIt->second = &rule;
+    }
+
+    m_fragment.statements.emplace_back(
+        PendingRule{name, {r.start(), r.bytesParsed()}, &rule});
+  }
 
-    // Collect inputs
-    PathVector& ins = tmp.ins;
+  void operator()(DefaultReader& r) {
+    PathVector& ins = m_build.ins;
     ins.clear();
-    for (const EvalString& path : r.readIn()) {
-      evaluate(ins.emplace_back(), path, fileScope);
+    for (const EvalString& path : r.readPaths()) {
+      evaluate(ins.emplace_back(), path, m_fileScope);
     }
-    const std::size_t inSize = ins.size();
 
-    for (const EvalString& path : r.readImplicitIn()) {
-      evaluate(ins.emplace_back(), path, fileScope);
+    PendingDefault& pending =
+        std::get<PendingDefault>(m_fragment.statements.emplace_back(
+            std::in_place_type<PendingDefault>));
+    pending.text = std::string_view{r.start(), r.bytesParsed()};
+    pending.paths.reserve(ins.size());
+    pending.hashes.reserve(ins.size());
+    for (std::string& in : ins) {
+      CanonicalizePath(&in);
+      pending.hashes.push_back(Graph::hashPath(in));
+      pending.paths.push_back(in);
     }
+  }
 
-    PathVector& orderOnlyDeps = tmp.orderOnlyDeps;
-    orderOnlyDeps.clear();
-    for (const EvalString& path : r.readOrderOnlyDeps()) {
-      evaluate(orderOnlyDeps.emplace_back(), path, fileScope);
+  void operator()(const VariableReader& r) {
+    const VariableName name = VariableName::intern(r.name());
+    std::string& value = m_fileScope.resetValue(name);
+    evaluate(value, r.value(), m_fileScope);
+    const std::string_view text{r.start(), r.bytesParsed()};
+    m_fileScope.declare(text);
+
+    // Variables in the top-level file are needed by later statements
+    if (isTopLevel()) {
+      m_fragment.statements.emplace_back(PendingVariable{text, name, value});
+    } else {
+      m_fragment.statements.emplace_back(PendingPart{text});
     }
+  }
 
-    // Collect validations but ignore what they are. If we include a build
-    // command it will include the validation.  If that validation has a
-    // required input then we include that, otherwise the validation is
-    // `phony`ed out.
-    const char* validationStart = r.position();
-    consume(r.readValidations());
-    const std::string_view validationStr{
-        validationStart,
-        static_cast<std::size_t>(r.position() - validationStart)};
-
-    EdgeScope scope{fileScope, rules[ruleIndex].variables,
-                    std::span{ins.data(), inSize},
-                    std::span{outs.data(), outSize}};
+  void operator()(const IncludeReader& r) {
+    const std::filesystem::path file = getPath(r, m_fileScope);
+    const Timer t = CPUProfiler::start("include", file);
+    parse(file, m_files.load(file));
+  }
 
-    for (const auto& [name, value] : r.readVariables()) {
-      evaluate(scope.resetValue(name), value, scope);
-    }
+  void operator()(const SubninjaReader& r) {
+    const std::filesystem::path file = getPath(r, m_fileScope);
+    const Timer t = CPUProfiler::start("subninja", file);
+    parseSubninja(file);
+  }
 
-    // Add the build command
-    const std::size_t commandIndex = commands.size();
-    BuildCommand& buildCommand = commands.emplace_back();
+  // Return the total size of all build commands hashed so far
+  std::uint64_t hashedBytes() const {
+    return m_build.hashedBytes;
+  }
 
-    // Always print `phony` rules since it saves us time generating an
-    // identical `phony` rule later on.
-    buildCommand.resolution =
-        isBuiltInRule(ruleIndex) ? BuildCommand::Print : BuildCommand::Phony;
+  // Return the number of hashes taken from `CommandHashes` so far
+  std::uint64_t reusedHashes() const {
+    return m_build.reusedHashes;
+  }
+};
 
-    if (rules[ruleIndex].instance == 1) {
-      buildCommand.partsIndices.push_back(
-          parts.emplace(parts.end(), r.start(), r.bytesParsed()) -
-          parts.begin());
+// Parse `fragment` into its statements, loading files through `files` and
+// hashing build commands with `hashType` unless they are in `commandHashes`,
+// and then mark it as ready.
+// Errors are not reported here as an earlier statement may have failed first,
+// and so we leave it to `BuildContext` to parse the file again and report it.
+void parseFragment(SubninjaFragment& fragment,
+                   FileCache& files,
+                   HashType hashType,
+                   const CommandHashes* commandHashes) {
+  try {
+    SubninjaParser parser{fragment, files, hashType, commandHashes};
+    if (fragment.chunk.empty()) {
+      const Timer t = CPUProfiler::start("subninja", fragment.file);
+      parser.parseSubninja(fragment.file);
     } else {
-      const char* endOfName = ruleName.data() + ruleName.size();
-      buildCommand.partsIndices.push_back(
-          parts.emplace(parts.end(), r.start(), endOfName - r.start()) -
-          parts.begin());
-      buildCommand.partsIndices.push_back(
-          parts.emplace(parts.end(),
-                        to_string_view(rules[ruleIndex].instance)) -
-          parts.begin());
-      buildCommand.partsIndices.push_back(
-          parts.emplace(parts.end(), endOfName,
-                        r.bytesParsed() - (endOfName - r.start())) -
-          parts.begin());
+      const Timer t = CPUProfiler::start("chunk", fragment.file);
+      parser.parseChunk();
     }
-    // Check we aren't actually allocating
-    assert(buildCommand.partsIndices.size() <=
-           buildCommand.partsIndices.inline_capacity_v);
+    CPUProfiler::count("hash bytes", parser.hashedBytes());
+    CPUProfiler::count("reused hashes", parser.reusedHashes());
+    fragment.succeeded = true;
+  } catch (const std::exception&) {
+    fragment.succeeded = false;
+  }
+  fragment.ready.store(true, std::memory_order_release);
+  fragment.ready.notify_one();
+}
 
-    buildCommand.validationStr = validationStr;
-    buildCommand.outStr = outStr;
-    buildCommand.ruleIndex = ruleIndex;
+// The smallest chunk that the top-level ninja file is split into when parsing
+// it on multiple threads
+const std::size_t MIN_CHUNK_SIZE = 1 << 20;
 
-    // Add outputs to the graph and link to the build command
-    std::vector<std::size_t>& outIndices = tmp.outIndices;
-    outIndices.clear();
-    for (std::string& out : outs) {
-      const std::size_t outIndex = getPathIndex(out);
-      outIndices.push_back(outIndex);
-      nodeToCommand[outIndex] = commandIndex;
-    }
+// Walks the top-level ninja file and its includes to create a
+// `SubninjaFragment` for each `subninja` statement, which holds a snapshot of
+// the variables and rules at that point.  Note that this does not include any
+// rules added by `subninja` files, which `BuildContext` checks for later.
+class SubninjaCollector {
+  std::deque<SubninjaFragment>& m_fragments;
+  FileCache& m_files;
+  BasicScope m_fileScope;
 
-    // Add inputs to the graph and add the edges to the graph
-    for (std::string& in : ins) {
-      const std::size_t inIndex = getPathIndex(in);
-      for (const std::size_t outIndex : outIndices) {
-        graph.addEdge(inIndex, outIndex);
-      }
-    }
+  // A copy of `m_fileScope` shared by all fragments until a variable changes
+  std::shared_ptr<const BasicScope> m_snapshot;
 
-    // We only need to add an input to output edge and not a bidirectional
-    // one for order-only dependencies. This is because we only include a
-    // build edge if an input (implicit or not) is affected.
-    for (std::string& orderOnlyDep : orderOnlyDeps) {
-      const std::size_t inIndex = getPathIndex(orderOnlyDep);
-      for (const std::size_t outIndex : outIndices) {
-        graph.addOneWayEdge(inIndex, outIndex);
-      }
-    }
+  // The same as `NestedScope::fingerprint` would be for `m_fileScope`
+  std::uint64_t m_fingerprint;
 
-    scope.appendValue(buildCommand.hashTarget, "command");
-    const std::size_t initialSize = buildCommand.hashTarget.size();
-    scope.appendValue(buildCommand.hashTarget, "rspfile_content");
+  std::forward_list<Rule> m_rules;
+  RuleLookup m_ruleLookup;
 
-    // If `rspfile_content` is not empty we have to inject a separator
-    if (buildCommand.hashTarget.size() != initialSize) {
-      buildCommand.hashTarget.insert(initialSize, ";rspfile=");
-    }
+ public:
+  SubninjaCollector(std::deque<SubninjaFragment>& fragments, FileCache& files)
+      : m_fragments{fragments},
+        m_files{files},
+        m_fileScope{},
+        m_snapshot{},
+        m_fingerprint{0},
+        m_rules{},
+        m_ruleLookup{} {
+    m_ruleLookup.emplace("phony", &m_rules.emplace_front());
+    m_ruleLookup.emplace("default", &m_rules.emplace_front());
   }
 
-  void operator()(RuleReader& r) {
-    std::string_view name = r.name();
+  void parse(const std::filesystem::path& ninjaFile,
+             std::string_view ninjaFileContents) {
+    for (auto&& part : ManifestReader(ninjaFile, ninjaFileContents)) {
+      std::visit(*this, part);
+    }
+  }
+
+  // Split the top-level `ninjaFile` into `chunks` of at least `chunkSize`
+  // bytes, each with a snapshot of the variables and rules before it.  Chunks
+  // start on a top-level statement that is not preceded by a comment, since
+  // comments are lexed as part of the next statement.  Only the declarations
+  // that change the snapshot are lexed, so `build`, `default`, `pool` and
+  // `subninja` statements are skipped line by line and left to each chunk.
+  void parseChunks(const std::filesystem::path& ninjaFile,
+                   std::string_view ninjaFileContents,
+                   std::size_t chunkSize,
+                   std::deque<SubninjaFragment>& chunks) {
+    const char* const begin = ninjaFileContents.data();
+    const char* const end = begin + ninjaFileContents.size();
+    const char* chunkStart = begin;
+    const auto startChunk = [&](const char* start) {
+      if (!chunks.empty()) {
+        chunks.back().chunk = {chunkStart, start};
+      }
+      if (!m_snapshot) {
+        m_snapshot = std::make_shared<const BasicScope>(m_fileScope);
+      }
+      chunks.emplace_back(ninjaFile, m_snapshot, m_fingerprint, m_ruleLookup)
+          .contents = ninjaFileContents;
+      chunkStart = start;
+    };
+
+    startChunk(begin);
+    bool afterComment = false;
+    const char* line = begin;
+    while (line != end) {
+      const char* first = line;
+      while (first != end && *first == ' ') {
+        ++first;
+      }
+      const bool isComment = first != end && *first == '#';
+      const bool isBlank = first == end || *first == '\n' || *first == '\r';
+      if (isComment || isBlank || first != line) {
+        // Indented lines belong to the statement before
+        afterComment = isComment;
+        line = endOfLine(line, end, isComment);
+        continue;
+      }
+
+      if (!afterComment &&
+          static_cast<std::size_t>(line - chunkStart) >= chunkSize) {
+        startChunk(line);
+      }
+      afterComment = false;
+      if (startsWithKeyword(line, end, "build") ||
+          startsWithKeyword(line, end, "default") ||
+          startsWithKeyword(line, end, "pool") ||
+          startsWithKeyword(line, end, "subninja")) {
+        line = endOfLine(line, end, false);
+        continue;
+      }
+
+      ManifestReader reader{ninjaFile, ninjaFileContents,
+                            static_cast<std::size_t>(line - begin)};
+      auto it = reader.begin();
+      if (it == reader.end()) {
+        break;
+      }
+      auto part = *it;
+      std::visit(*this, part);
+      line = std::visit(
+          [](const auto& r) { return r.start() + r.bytesParsed(); }, part);
+    }
+    chunks.back().chunk = {chunkStart, end};
+  }
+
+  void operator()(PoolReader& r) { consume(r.readVariables()); }
+
+  void operator()(BuildReader& r) {
+    consume(r.readOut());
+    consume(r.readImplicitOut());
+    r.readName();
+    consume(r.readIn());
+    consume(r.readImplicitIn());
+    consume(r.readOrderOnlyDeps());
+    consume(r.readValidations());
+    consume(r.readVariables());
+  }
+
+  void operator()(RuleReader& r) {
+    const std::string_view name = r.name();
+    Rule& rule = m_rules.emplace_front();
+    readRuleVariables(r, name, rule);
+    m_ruleLookup.insert_or_assign(name, &rule);
+  }
+
+  void operator()(DefaultReader& r) { consume(r.readPaths()); }
+
+  void operator()(const VariableReader& r) {
+    evaluate(m_fileScope.resetValue(VariableName::intern(r.name())), r.value(),
+             m_fileScope);
+    const std::string_view text =
+        withoutComments({r.start(), r.bytesParsed()});
+    m_fingerprint =
+        rapidhash_withSeed(text.data(), text.size(), m_fingerprint);
+    m_snapshot.reset();
+  }
+
+  void operator()(const IncludeReader& r) {
+    const std::filesystem::path file = getPath(r, m_fileScope);
+    parse(file, m_files.load(file));
+  }
+
+  // Return the value of the top-level `builddir` variable, which is only
+  // correct once the top-level file has been parsed
+  std::string builddir() const {
+    std::string path;
+    m_fileScope.appendValue(path, VariableName::Builddir);
+    return path;
+  }
+
+  void operator()(const SubninjaReader& r) {
+    // Any missing files will be reported by `BuildContext`
+    if (!m_snapshot) {
+      m_snapshot = std::make_shared<const BasicScope>(m_fileScope);
+    }
+    m_fragments.emplace_back(getPath(r, m_fileScope), m_snapshot,
+                             m_fingerprint, m_ruleLookup);
+  }
+};
+
+// What we know about each node in the graph while trimming, which is packed
+// into a single byte per node so that multiple threads can update it with
+// one atomic operation
+enum NodeFlag : std::uint8_t {
+  // The node has inputs and so it is the output of a build command
+  BuildOutput = 1 << 0,
+
+  // The node is the output of a built-in rule
+  BuiltIn = 1 << 1,
+
+  // The node is kept in the trimmed build
+  Affected = 1 << 2,
+
+  // The node was given in the affected files
+  Seed = 1 << 3,
+
+  // All inputs of the node are kept in the trimmed build
+  NeedsAllInputs = 1 << 4,
+
+  // The node is needed to build one of the targets given to `trim`
+  Targeted = 1 << 5,
+};
+
+}  // namespace
+
+namespace detail {
+
+class BuildContext {
+ public:
+  // The indexes of the built-in rules within `rules`
+  static const std::size_t phonyIndex = 0;
+  static const std::size_t defaultIndex = 1;
+
+  // An optional storage for any generated strings or strings whose lifetime
+  // needs extending, which gives us stable references to the contents.
+  StringArena stringStorage;
+
+  // The contents of all files loaded through `include` and `subninja`, which
+  // need to outlive all parsing since `parts` references them directly.
+  FileCache fileStorage;
+
+  // The contents of the cache file if we loaded everything from it instead of
+  // parsing, which is referenced by `parts`
+  MappedFile cacheFile;
+
+  // A place to hold numbers as strings that can be put into `parts` if we have
+  // duplicate rules and need a suffix.
+  std::vector<fixed_string> numbers;
+
+  // All parts of the input build file, possibly indexing into an element of
+  // `stringStorage`.  Note that we may swap out build command sections with
+  // phony commands.
+  std::vector<std::string_view> parts;
+
+  // All build commands and default statements mentioned
+  std::vector<BuildCommand> commands;
+
+  // The parts of each element of `commands`, which is empty if `lowMemory`
+  std::vector<BuildCommandParts> commandParts;
+
+  // Map each output index to the index within `command`.  Use -1 for a
+  // value that isn't an output to a build command (i.e. a source file)
+  std::vector<std::size_t> nodeToCommand;
+
+  // Our list of rules
+  std::vector<RuleCommand> rules;
+
+  struct RuleBits {
+    // The index of the rule in `rules`
+    std::size_t ruleIndex;
+
+    // How many rules have this name
+    std::size_t duplicates;
+
+    explicit RuleBits(std::size_t ruleIndex)
+        : ruleIndex{ruleIndex}, duplicates{1} {}
+  };
+
+  // Our rules keyed by name
+  boost::unordered_flat_map<fixed_string,
+                            RuleBits,
+                            std::hash<trimja::fixed_string>>
+      ruleLookup;
+
+  // A stack of rules that have shadowed rules in their parent file.
+  std::vector<std::vector<std::size_t>> shadowedRules;
+
+  // When entering into subninja files we keep a stack of the file ids
+  // that are generated from an incremental counter.
+  std::size_t nextFileId = 0;
+  std::vector<std::size_t> fileIds;
+
+  // Our top-level variables
+  NestedScope fileScope;
+
+  // The value of the top-level `builddir` variable
+  std::string builddir;
+
+  // The directory containing the top-level ninja file
+  std::filesystem::path ninjaFileDir;
+
+  // How to hash build commands, which needs to match `.ninja_log`.  If this
+  // is not set before parsing, we use the log inside `builddir` as it is when
+  // we need it first, which is checked by `TrimUtil::load` afterwards.
+  std::optional<HashType> hashType;
+
+  // Whether to reuse the hashes of unchanged build commands from the sidecar
+  // of the `.ninja_log` inside `builddir`, which is loaded when we first need
+  // it in the same way as `hashType`
+  bool reuseHashes = false;
+  bool commandHashesLoaded = false;
+  CommandHashes commandHashes;
+
+  // Whether to skip everything only needed to write out the trimmed build
+  // file (`parts`, `commandParts` and the parts of each rule), which is
+  // written by lexing the files again instead (see `ManifestStreamer`)
+  bool lowMemory = false;
+
+  // Top-level `subninja` files, in order of appearance, that are being parsed
+  // ahead of time and the index of the next one to use
+  std::deque<SubninjaFragment> subninjaFragments;
+  std::size_t nextSubninjaFragment = 0;
+
+  // Chunks of the top-level file, in order, that are being parsed ahead of
+  // time instead of `subninjaFragments` when the top-level file is large
+  std::deque<SubninjaFragment> chunks;
+
+  // Our graph
+  Graph graph;
+
+  // An index over the paths of `graph` to match affected patterns, which is
+  // only built once `graph` is complete and a pattern needs it
+  PathIndex paths{graph};
+
+  // The path and contents given to `TrimUtil::load`, which are not saved in
+  // the cache
+  std::filesystem::path ninjaFile;
+  std::string_view ninjaFileContents;
+
+  // The `NodeFlag`s of each node after `TrimUtil::load`, where `Affected`
+  // marks the nodes affected by `.ninja_log`, which is also not saved in the
+  // cache
+  std::vector<std::uint8_t> nodeFlags;
+
+  // The number of threads given to `TrimUtil::load`
+  std::size_t jobs = 1;
+
+  // The duration in milliseconds of the last run of the build command of
+  // each node according to `.ninja_log`, or `UNKNOWN_DURATION` if there is
+  // none, which is read on first use by `getDurations`
+  mutable std::once_flag durationsRead;
+  mutable std::vector<std::uint32_t> durations;
+
+  // Variables to be reused to avoid reallocations
+  struct {
+    ParsedBuild build;
+    std::vector<std::size_t> outIndices;
+  } tmp;
+
+  // Return whether `ruleIndex` is a built-in rule (i.e. `default` or `phony`)
+  static bool isBuiltInRule(std::size_t ruleIndex) {
+    static_assert(phonyIndex == 0);
+    static_assert(defaultIndex == 1);
+    return ruleIndex < 2;
+  }
+
+  std::string_view to_string_view(std::size_t n) {
+    for (std::size_t i = numbers.size(); i <= n; ++i) {
+      numbers.emplace_back(std::to_string(i));
+    }
+
+    return numbers[n];
+  }
+
+  BuildContext() {
+    fileIds.push_back(nextFileId++);
+
+    rules.emplace_back(
+        ruleLookup.try_emplace("phony", rules.size()).first->first);
+    assert(rules[BuildContext::phonyIndex].name == "phony");
+    rules.emplace_back(
+        ruleLookup.try_emplace("default", rules.size()).first->first);
+    assert(rules[BuildContext::defaultIndex].name == "default");
+  }
+
+  std::size_t getPathIndex(std::string& path) {
+    const std::size_t index = graph.addPath(path);
+    if (index >= nodeToCommand.size()) {
+      nodeToCommand.resize(index + 1, std::numeric_limits<std::size_t>::max());
+    }
+    return index;
+  }
+
+  std::size_t getPathIndexForNormalized(std::string_view path) {
+    const std::size_t index = graph.addNormalizedPath(path);
+    if (index >= nodeToCommand.size()) {
+      nodeToCommand.resize(index + 1, std::numeric_limits<std::size_t>::max());
+    }
+    return index;
+  }
+
+  std::size_t getPathIndexForNormalized(const Graph::HashedPath& path) {
+    const std::size_t index = graph.addNormalizedPath(path);
+    if (index >= nodeToCommand.size()) {
+      nodeToCommand.resize(index + 1, std::numeric_limits<std::size_t>::max());
+    }
+    return index;
+  }
+
+  void getPathIndicesForNormalized(std::span<const std::string_view> paths,
+                                   std::span<std::size_t> indices) {
+    graph.addNormalizedPaths(paths, indices);
+    if (graph.size() > nodeToCommand.size()) {
+      nodeToCommand.resize(graph.size(),
+                           std::numeric_limits<std::size_t>::max());
+    }
+  }
+
+  std::size_t getDefault() {
+    const std::size_t index = graph.addDefault();
+    if (index >= nodeToCommand.size()) {
+      nodeToCommand.resize(index + 1, std::numeric_limits<std::size_t>::max());
+    }
+    return index;
+  }
+
+  // Return `hashType`, choosing it from the current `builddir` if necessary
+  HashType getHashType() {
+    if (!hashType.has_value()) {
+      std::string dir;
+      fileScope.appendValue(dir, VariableName::Builddir);
+      hashType = logHashType(ninjaFileDir / dir / ".ninja_log",
+                             HashType::murmur);
+    }
+    return *hashType;
+  }
+
+  // Return the hashes of build commands from the last run, loading them from
+  // the current `builddir` if necessary, or null if they are not reused
+  const CommandHashes* getCommandHashes() {
+    if (!reuseHashes) {
+      return nullptr;
+    }
+    if (!commandHashesLoaded) {
+      std::string dir;
+      fileScope.appendValue(dir, VariableName::Builddir);
+      loadCommandHashes(ninjaFileDir / dir);
+    }
+    return &commandHashes;
+  }
+
+  // Load `commandHashes` from the sidecar of the `.ninja_log` in `builddir`
+  void loadCommandHashes(const std::filesystem::path& builddir) {
+    const Timer t = CPUProfiler::start(".ninja_log sidecar read");
+    commandHashes.load(CommandHashes::sidecarFor(builddir / ".ninja_log"),
+                       getHashType());
+    commandHashesLoaded = true;
+    CPUProfiler::count("sidecar hashes", commandHashes.size());
+  }
+
+  // Append `part` to `parts` and return its index
+  std::size_t addPart(std::string_view part) {
+    parts.push_back(part);
+    return parts.size() - 1;
+  }
+
+  void parse(const std::filesystem::path& ninjaFile,
+             std::string_view ninjaFileContents) {
+    CPUProfiler::count("bytes lexed", ninjaFileContents.size());
+    for (auto&& part : ManifestReader(ninjaFile, ninjaFileContents)) {
+      std::visit(*this, part);
+    }
+  }
+
+  // Add the statements of each chunk of the top-level `ninjaFile` in order,
+  // parsing any chunk again if its statements cannot be replayed
+  void parseChunks(const std::filesystem::path& ninjaFile,
+                   std::string_view ninjaFileContents) {
+    for (SubninjaFragment& chunk : chunks) {
+      chunk.ready.wait(false, std::memory_order_acquire);
+      if (chunk.succeeded &&
+          chunk.scopeFingerprint == fileScope.fingerprint() &&
+          canReplay(chunk)) {
+        replay(chunk);
+        continue;
+      }
+
+      const Timer t = CPUProfiler::start("chunk", ninjaFile);
+      CPUProfiler::count("bytes lexed", chunk.chunk.size());
+      ManifestReader reader{
+          ninjaFile, ninjaFileContents,
+          static_cast<std::size_t>(chunk.chunk.data() -
+                                   ninjaFileContents.data())};
+      visitUntil(reader, chunk.chunk.data() + chunk.chunk.size(), *this);
+    }
+  }
+
+  // Parse `ninjaFile` in the same way as `parse`, but use `jobs` threads to
+  // parse the top-level `subninja` files, or chunks of `ninjaFile` if it is
+  // large enough, ahead of time
+  void parse(const std::filesystem::path& ninjaFile,
+             std::string_view ninjaFileContents,
+             std::size_t jobs) {
+#ifdef _WIN32
+    // On Windows `Graph::addPath` will replace paths with the first spelling
+    // seen, which affects `$in` and `$out`, so we cannot evaluate build
+    // commands before we have parsed all earlier files
+    jobs = 1;
+#endif
+    // Statements parsed ahead of time are held on to until they are added,
+    // which is what `lowMemory` is trying to avoid
+    if (lowMemory) {
+      jobs = 1;
+    }
+    ninjaFileDir = std::filesystem::path(ninjaFile).remove_filename();
+    if (jobs <= 1) {
+      parse(ninjaFile, ninjaFileContents);
+      getHashType();
+      CPUProfiler::count("hash bytes", tmp.build.hashedBytes);
+      CPUProfiler::count("reused hashes", tmp.build.reusedHashes);
+      return;
+    }
+
+    // `collector` owns the rules referenced by the snapshots so it must
+    // outlive `workers`
+    SubninjaCollector collector{subninjaFragments, fileStorage};
+    try {
+      if (ninjaFileContents.size() >= 2 * MIN_CHUNK_SIZE) {
+        // Aim for a few chunks per thread so that they balance out
+        const std::size_t chunkSize =
+            std::max(MIN_CHUNK_SIZE, ninjaFileContents.size() / (4 * jobs));
+        collector.parseChunks(ninjaFile, ninjaFileContents, chunkSize,
+                              chunks);
+
+        // Each chunk parses its own `subninja` files
+        subninjaFragments.clear();
+      } else {
+        collector.parse(ninjaFile, ninjaFileContents);
+      }
+    } catch (const std::exception&) {
+      // Parse everything serially so that the error is reported in order
+      subninjaFragments.clear();
+      chunks.clear();
+    }
+    std::deque<SubninjaFragment>& fragments =
+        chunks.empty() ? subninjaFragments : chunks;
+
+    // We know the final `builddir` now, so choose the hash type for workers
+    if (!fragments.empty() && !hashType.has_value()) {
+      hashType = logHashType(
+          ninjaFileDir / collector.builddir() / ".ninja_log", HashType::murmur);
+    }
+    if (!fragments.empty() && reuseHashes) {
+      loadCommandHashes(ninjaFileDir / collector.builddir());
+    }
+    const CommandHashes* const fragmentHashes =
+        reuseHashes ? &commandHashes : nullptr;
+
+    std::atomic<std::size_t> nextFragment = 0;
+    std::vector<std::jthread> workers;
+    const std::size_t workerCount = std::min(jobs, fragments.size());
+    for (std::size_t i = 0; i < workerCount; ++i) {
+      workers.emplace_back([&] {
+        for (std::size_t j = nextFragment++; j < fragments.size();
+             j = nextFragment++) {
+          parseFragment(fragments[j], fileStorage, *hashType,
+                        fragmentHashes);
+        }
+      });
+    }
+
+    if (chunks.empty()) {
+      parse(ninjaFile, ninjaFileContents);
+    } else {
+      parseChunks(ninjaFile, ninjaFileContents);
+    }
+    getHashType();
+    CPUProfiler::count("hash bytes", tmp.build.hashedBytes);
+    CPUProfiler::count("reused hashes", tmp.build.reusedHashes);
+  }
+
+  // Return the index of the rule called `name`
+  std::size_t findRule(std::string_view name) const {
+    const auto ruleIt = ruleLookup.find(name);
+    if (ruleIt == ruleLookup.end()) {
+      throw std::runtime_error("Unable to find " + std::string(name) + " rule");
+    }
+    return ruleIt->second.ruleIndex;
+  }
+
+  // Add a build command for `statement` that uses the rule at `ruleIndex`,
+  // calling `getIndex` to get the path index of each output and input
+  template <typename GET_PATH_INDEX>
+  BuildCommand& addBuild(const BuildStatement& statement,
+                         std::size_t ruleIndex,
+                         std::span<std::string> outs,
+                         std::span<std::string> ins,
+                         std::span<std::string> orderOnlyDeps,
+                         GET_PATH_INDEX&& getIndex) {
+    const std::size_t commandIndex = commands.size();
+    BuildCommand& buildCommand = commands.emplace_back();
+
+    // Always print `phony` rules since it saves us time generating an
+    // identical `phony` rule later on.
+    buildCommand.resolution =
+        isBuiltInRule(ruleIndex) ? BuildCommand::Print : BuildCommand::Phony;
+    buildCommand.ruleIndex = ruleIndex;
+
+    if (!lowMemory) {
+      BuildCommandParts& buildParts = commandParts.emplace_back();
+      if (rules[ruleIndex].instance == 1) {
+        buildParts.partsIndices.push_back(addPart(statement.text));
+      } else {
+        const char* endOfName =
+            statement.ruleName.data() + statement.ruleName.size();
+        const std::size_t bytesToEndOfName =
+            endOfName - statement.text.data();
+        buildParts.partsIndices.push_back(
+            addPart({statement.text.data(), bytesToEndOfName}));
+        buildParts.partsIndices.push_back(
+            addPart(to_string_view(rules[ruleIndex].instance)));
+        buildParts.partsIndices.push_back(
+            addPart({endOfName, statement.text.size() - bytesToEndOfName}));
+      }
+      // Check we aren't actually allocating
+      assert(buildParts.partsIndices.size() <=
+             buildParts.partsIndices.inline_capacity_v);
+
+      buildParts.validationStr = statement.validationStr;
+      buildParts.outStr = statement.outStr;
+    }
+
+    // Add outputs to the graph and link to the build command
+    std::vector<std::size_t>& outIndices = tmp.outIndices;
+    outIndices.clear();
+    for (std::string& out : outs) {
+      const std::size_t outIndex = getIndex(out);
+      outIndices.push_back(outIndex);
+      nodeToCommand[outIndex] = commandIndex;
+    }
+
+    // Add inputs to the graph and add the edges to the graph
+    for (std::string& in : ins) {
+      const std::size_t inIndex = getIndex(in);
+      for (const std::size_t outIndex : outIndices) {
+        graph.addEdge(inIndex, outIndex);
+      }
+    }
+
+    // We only need to add an input to output edge and not a bidirectional
+    // one for order-only dependencies. This is because we only include a
+    // build edge if an input (implicit or not) is affected.
+    for (std::string& orderOnlyDep : orderOnlyDeps) {
+      const std::size_t inIndex = getIndex(orderOnlyDep);
+      for (const std::size_t outIndex : outIndices) {
+        graph.addOneWayEdge(inIndex, outIndex);
+      }
+    }
+
+    return buildCommand;
+  }
+
+  // Add a new rule called `name`, which may shadow an existing rule
+  RuleCommand& declareRule(std::string_view name) {
     const auto [ruleIt, isNew] = ruleLookup.try_emplace(name, rules.size());
 
-    if (!isNew) {
-      if (isBuiltInRule(ruleIt->second.ruleIndex)) {
-        // We cannot shadow the built-in rules
-        std::string msg;
-        msg += "Cannot create a rule with the name '";
-        msg += name;
-        msg += "' as it is a built-in ninja rule!";
-        throw std::runtime_error{msg};
+    if (!isNew) {
+      if (isBuiltInRule(ruleIt->second.ruleIndex)) {
+        // We cannot shadow the built-in rules
+        std::string msg;
+        msg += "Cannot create a rule with the name '";
+        msg += name;
+        msg += "' as it is a built-in ninja rule!";
+        throw std::runtime_error{msg};
+      }
+
+      RuleCommand& ruleCommand = rules[ruleIt->second.ruleIndex];
+      if (ruleCommand.fileId == fileIds.back()) {
+        // Throw an exception if we have a duplicate rule in the same file
+        std::string msg;
+        msg += "Duplicate rule '";
+        msg += name;
+        msg += "' found!";
+        throw std::runtime_error{msg};
+      }
+
+      RuleBits& bits = ruleIt->second;
+      if (!shadowedRules.empty()) {
+        // The root ninja file may shadow existing rules added through
+        // subninja, but we never need to unshadow these
+        shadowedRules.back().push_back(bits.ruleIndex);
+      }
+      bits.ruleIndex = rules.size();
+      ++bits.duplicates;
+    }
+
+    RuleCommand& rule = rules.emplace_back(name);
+    rule.fileId = fileIds.back();
+    rule.instance = ruleIt->second.duplicates;
+    return rule;
+  }
+
+  // Add the parts for `rule`, where `text` is its entire rule statement
+  void addRuleParts(RuleCommand& rule, std::string_view text) {
+    if (lowMemory) {
+      return;
+    }
+
+    if (rule.instance == 1) {
+      // If we're not shadowed then we can include the whole rule
+      rule.partsIndices.push_back(addPart(text));
+      assert(rule.partsIndices.size() == 1);
+    } else {
+      // If shadowed we need to add the rule suffix to the list of parts to
+      // print
+      const char* endOfName = rule.name.data() + rule.name.size();
+      const std::size_t bytesToEndOfName = endOfName - text.data();
+      rule.partsIndices.push_back(addPart({text.data(), bytesToEndOfName}));
+      rule.partsIndices.push_back(addPart(to_string_view(rule.instance)));
+      rule.partsIndices.push_back(
+          addPart({endOfName, text.size() - bytesToEndOfName}));
+      assert(rule.partsIndices.size() == 3);
+    }
+    // Check we aren't actually allocating
+    assert(rule.partsIndices.size() <= rule.partsIndices.inline_capacity_v);
+  }
+
+  // Add a `default` statement with the text `text` and inputs `ins`
+  template <typename GET_PATH_INDEX>
+  void addDefault(std::string_view text,
+                  std::span<std::string> ins,
+                  GET_PATH_INDEX&& getIndex) {
+    const std::size_t commandIndex = commands.size();
+    BuildCommand& buildCommand = commands.emplace_back();
+    buildCommand.resolution = BuildCommand::Print;
+    buildCommand.ruleIndex = BuildContext::defaultIndex;
+    if (!lowMemory) {
+      commandParts.emplace_back().partsIndices.push_back(addPart(text));
+    }
+
+    const std::size_t outIndex = getDefault();
+    nodeToCommand[outIndex] = commandIndex;
+    for (std::string& in : ins) {
+      graph.addEdge(getIndex(in), outIndex);
+    }
+  }
+
+  void enterSubninja() {
+    shadowedRules.emplace_back();
+    fileIds.push_back(nextFileId++);
+  }
+
+  // Leave the current `subninja` file, where `resetScope` contains the
+  // variable statements to reset the scope to the parent's
+  void leaveSubninja(std::string_view resetScope) {
+    fileIds.pop_back();
+    if (!lowMemory) {
+      addPart(resetScope);
+    }
+
+    // For all the shadowed rules, set name to ruleIndex lookup back to the
+    // shadowed index.  We have to grab the name and then find since
+    // `unordered_flat_map` doesn't have iterator/reference stability by default
+    for (const std::size_t shadowedRuleIndex : shadowedRules.back()) {
+      const RuleCommand& shadowedRule = rules[shadowedRuleIndex];
+      ruleLookup.find(shadowedRule.name)->second.ruleIndex = shadowedRuleIndex;
+    }
+    shadowedRules.pop_back();
+  }
+
+  // Return whether adding the statements in `fragment` now gives the same
+  // result as parsing its file now.  `fragment` was created with a snapshot of
+  // the rules that is missing any rules added by earlier `subninja` files, so
+  // check that every build statement uses a rule with identical variables to
+  // the one it would use now.
+  bool canReplay(const SubninjaFragment& fragment) const {
+    // Follow the same shadowing logic as `declareRule` and `leaveSubninja`,
+    // but put rules from `fragment` in `overlay` instead of `ruleLookup`
+    RuleLookup overlay;
+    std::vector<std::vector<std::pair<std::string_view, const Rule*>>>
+        shadowed;
+    const auto lookup = [&](std::string_view name) -> const Rule* {
+      if (const auto it = overlay.find(name); it != overlay.end()) {
+        return it->second;
+      }
+      if (const auto it = ruleLookup.find(name); it != ruleLookup.end()) {
+        return &rules[it->second.ruleIndex].variables;
+      }
+      return nullptr;
+    };
+
+    for (const PendingStatement& statement : fragment.statements) {
+      if (const auto* rule = std::get_if<PendingRule>(&statement)) {
+        // Rules in the top-level file of a chunk are never restored
+        if (const Rule* previous = lookup(rule->name);
+            previous && !shadowed.empty()) {
+          shadowed.back().emplace_back(rule->name, previous);
+        }
+        overlay.insert_or_assign(rule->name, rule->variables);
+      } else if (const auto* build = std::get_if<PendingBuild>(&statement)) {
+        const Rule* rule = lookup(build->statement.ruleName);
+        if (!rule || (rule != build->rule && !(*rule == *build->rule))) {
+          return false;
+        }
+      } else if (std::holds_alternative<PendingEnterSubninja>(statement)) {
+        shadowed.emplace_back();
+      } else if (std::holds_alternative<PendingLeaveSubninja>(statement)) {
+        for (const auto& [name, previous] : shadowed.back()) {
+          overlay.insert_or_assign(name, previous);
+        }
+        shadowed.pop_back();
+      }
+    }
+    return true;
+  }
+
+  // Add all statements from `fragment` as if we had parsed its file now
+  void replay(SubninjaFragment& fragment) {
+    assert(!lowMemory);
+    // Return a function to get the index of a path within `paths`, using the
+    // hash at the same position in `hashes` that the worker thread took
+    const auto getHashedIndex = [&](const std::vector<std::string>& paths,
+                                    const std::vector<std::size_t>& hashes) {
+      return [this, &paths, &hashes](const std::string& path) {
+        const std::size_t hash = hashes[&path - paths.data()];
+        return getPathIndexForNormalized(Graph::HashedPath{path, hash});
+      };
+    };
+    const Overloaded replayStatement{
+        [&](PendingPart& pending) { parts.push_back(pending.text); },
+        [&](PendingRule& pending) {
+          RuleCommand& rule = declareRule(pending.name);
+          rule.variables = std::move(*pending.variables);
+          addRuleParts(rule, pending.text);
+        },
+        [&](PendingBuild& pending) {
+          const std::span<std::string> paths{pending.paths};
+          BuildCommand& buildCommand = addBuild(
+              pending.statement, findRule(pending.statement.ruleName),
+              paths.first(pending.outCount),
+              paths.subspan(pending.outCount, pending.inCount),
+              paths.subspan(pending.outCount + pending.inCount),
+              getHashedIndex(pending.paths, pending.hashes));
+          buildCommand.hash = pending.hash;
+          buildCommand.fingerprint = pending.fingerprint;
+        },
+        [&](PendingDefault& pending) {
+          addDefault(pending.text, pending.paths,
+                     getHashedIndex(pending.paths, pending.hashes));
+        },
+        [&](PendingEnterSubninja&) { enterSubninja(); },
+        [&](PendingLeaveSubninja& pending) {
+          leaveSubninja(pending.resetScope);
+        },
+        [&](PendingVariable& pending) {
+          fileScope.resetValue(pending.name) = std::move(pending.value);
+          fileScope.declare(pending.text);
+          parts.push_back(pending.text);
+        },
+    };
+    for (PendingStatement& statement : fragment.statements) {
+      std::visit(replayStatement, statement);
+    }
+
+    stringStorage.splice(fragment.stringStorage);
+  }
+
+  // Write everything needed by `TrimUtil::load` after parsing to `writer`.
+  // Any text inside of `files` is written as an offset into that file.
+  void save(CacheWriter& writer,
+            std::span<const std::string_view> files) const {
+    // Sort the files by address so that we can find which contains some text
+    const std::less<const char*> before;
+    std::vector<std::size_t> byAddress(files.size());
+    std::iota(byAddress.begin(), byAddress.end(), 0);
+    std::sort(byAddress.begin(), byAddress.end(),
+              [&](std::size_t left, std::size_t right) {
+                return before(files[left].data(), files[right].data());
+              });
+
+    const auto writeText = [&](std::string_view text) {
+      const auto it = std::upper_bound(
+          byAddress.begin(), byAddress.end(), text.data(),
+          [&](const char* data, std::size_t fileIndex) {
+            return before(data, files[fileIndex].data());
+          });
+      if (it != byAddress.begin()) {
+        const std::size_t fileIndex = *std::prev(it);
+        const std::string_view file = files[fileIndex];
+        const std::size_t offset = text.data() - file.data();
+        if (offset <= file.size() && text.size() <= file.size() - offset) {
+          writer.writeWord(fileIndex);
+          writer.writeWord(offset);
+          writer.writeWord(text.size());
+          return;
+        }
+      }
+      writer.writeWord(std::numeric_limits<std::uint64_t>::max());
+      writer.writeString(text);
+    };
+
+    const auto writeIndices = [&](const auto& indices) {
+      writer.writeWord(indices.size());
+      for (const std::size_t index : indices) {
+        writer.writeWord(index);
+      }
+    };
+
+    writer.writeString(builddir);
+    writer.writeWord(static_cast<std::uint64_t>(*hashType));
+
+    writer.writeWord(graph.size());
+    writer.writeWord(graph.defaultIndex());
+    for (std::size_t index = 0; index < graph.size(); ++index) {
+      writer.writeString(graph.path(index));
+      writeIndices(graph.out(index));
+      writeIndices(graph.in(index));
+      writeIndices(graph.orderOnlyIn(index));
+    }
+    writeIndices(nodeToCommand);
+
+    writer.writeWord(parts.size());
+    for (const std::string_view part : parts) {
+      writeText(part);
+    }
+
+    assert(commandParts.size() == commands.size());
+    writer.writeWord(commands.size());
+    for (std::size_t i = 0; i < commands.size(); ++i) {
+      const BuildCommand& command = commands[i];
+      writer.writeWord(command.resolution);
+      writeIndices(commandParts[i].partsIndices);
+      writer.writeWord(command.hash);
+      writer.writeWord(command.fingerprint);
+      writeText(commandParts[i].outStr);
+      writeText(commandParts[i].validationStr);
+      writer.writeWord(command.ruleIndex);
+    }
+
+    writer.writeWord(rules.size());
+    for (const RuleCommand& rule : rules) {
+      writer.writeString(rule.name);
+      writeIndices(rule.partsIndices);
+    }
+  }
+
+  // Restore everything written by `save` from `reader` and the same `files`,
+  // where all text references either `files` or the contents of `reader`
+  void load(CacheReader& reader, std::span<const std::string_view> files) {
+    const auto readText = [&]() -> std::string_view {
+      const std::uint64_t fileIndex = reader.readWord();
+      if (fileIndex == std::numeric_limits<std::uint64_t>::max()) {
+        return reader.readString();
+      }
+      const std::uint64_t offset = reader.readWord();
+      const std::uint64_t size = reader.readWord();
+      if (fileIndex >= files.size() || offset > files[fileIndex].size() ||
+          size > files[fileIndex].size() - offset) {
+        throw std::runtime_error("Inconsistent cache file");
+      }
+      return files[fileIndex].substr(offset, size);
+    };
+
+    // Every index read must be less than `limit`, so that a corrupt cache
+    // file is reported instead of indexing out of bounds later on
+    std::vector<std::uint32_t> out;
+    std::vector<std::uint32_t> in;
+    std::vector<std::uint32_t> orderOnlyIn;
+    const auto readIndices = [&](auto& indices, std::uint64_t limit) {
+      using Index = typename std::decay_t<decltype(indices)>::value_type;
+      indices.clear();
+      const std::size_t size = reader.readWord();
+      for (std::size_t i = 0; i < size; ++i) {
+        const std::uint64_t index = reader.readWord();
+        if (index > std::numeric_limits<Index>::max() || index >= limit) {
+          throw std::runtime_error("Inconsistent cache file");
+        }
+        indices.push_back(static_cast<Index>(index));
+      }
+    };
+
+    builddir = reader.readString();
+    const std::uint64_t hashTypeValue = reader.readWord();
+    if (hashTypeValue > static_cast<std::uint64_t>(HashType::rapidhash)) {
+      throw std::runtime_error("Inconsistent cache file");
+    }
+    hashType = static_cast<HashType>(hashTypeValue);
+
+    const std::size_t graphSize = reader.readWord();
+    const std::size_t defaultIndex = reader.readWord();
+    if (defaultIndex >= graphSize) {
+      throw std::runtime_error("Inconsistent cache file");
+    }
+    for (std::size_t index = 0; index < graphSize; ++index) {
+      const std::string_view path = reader.readString();
+      if (index == defaultIndex) {
+        getDefault();
+      } else if (getPathIndexForNormalized(path) != index) {
+        throw std::runtime_error("Duplicate path in cache file");
+      }
+      readIndices(out, graphSize);
+      readIndices(in, graphSize);
+      readIndices(orderOnlyIn, graphSize);
+      graph.setEdges(index, out, in, orderOnlyIn);
+    }
+
+    // Nodes without a build command are the only ones allowed to hold the
+    // maximum value, which is checked once we know the number of commands
+    readIndices(nodeToCommand, std::numeric_limits<std::uint64_t>::max());
+
+    parts.resize(reader.readWord());
+    for (std::string_view& part : parts) {
+      part = readText();
+    }
+
+    commands.resize(reader.readWord());
+    commandParts.resize(commands.size());
+    for (std::size_t i = 0; i < commands.size(); ++i) {
+      BuildCommand& command = commands[i];
+      const std::uint64_t resolution = reader.readWord();
+      if (resolution > BuildCommand::Phony) {
+        throw std::runtime_error("Inconsistent cache file");
+      }
+      command.resolution = static_cast<BuildCommand::Resolution>(resolution);
+      readIndices(commandParts[i].partsIndices, parts.size());
+      command.hash = reader.readWord();
+      command.fingerprint = reader.readWord();
+      commandParts[i].outStr = readText();
+      commandParts[i].validationStr = readText();
+      command.ruleIndex = reader.readWord();
+    }
+
+    const std::size_t ruleCount = reader.readWord();
+    for (std::size_t ruleIndex = 0; ruleIndex < ruleCount; ++ruleIndex) {
+      const std::string_view name = reader.readString();
+      if (ruleIndex >= rules.size()) {
+        rules.emplace_back(name);
+      } else if (rules[ruleIndex].name != name) {
+        throw std::runtime_error("Inconsistent cache file");
+      }
+      readIndices(rules[ruleIndex].partsIndices, parts.size());
+    }
+
+    if (!reader.empty() || nodeToCommand.size() != graph.size() ||
+        rules.size() != ruleCount) {
+      throw std::runtime_error("Inconsistent cache file");
+    }
+    for (const std::size_t commandIndex : nodeToCommand) {
+      if (commandIndex >= commands.size() &&
+          commandIndex != std::numeric_limits<std::size_t>::max()) {
+        throw std::runtime_error("Inconsistent cache file");
+      }
+    }
+    for (const BuildCommand& command : commands) {
+      if (command.ruleIndex >= rules.size()) {
+        throw std::runtime_error("Inconsistent cache file");
+      }
+    }
+  }
+
+  void operator()(PoolReader& r) {
+    consume(r.readVariables());
+    if (!lowMemory) {
+      addPart({r.start(), r.bytesParsed()});
+    }
+  }
+
+  void operator()(BuildReader& r) {
+    std::size_t ruleIndex = std::numeric_limits<std::size_t>::max();
+    readBuild(
+        r, fileScope, tmp.build, getHashType(), getCommandHashes(),
+        [&](std::string_view ruleName) -> const Rule& {
+          ruleIndex = findRule(ruleName);
+          return rules[ruleIndex].variables;
+        },
+        [&](ParsedBuild& build) -> std::uint64_t& {
+          BuildCommand& command = addBuild(
+              build.statement, ruleIndex,
+              {build.outs.begin(), build.outs.end()},
+              {build.ins.begin(), build.ins.end()},
+              {build.orderOnlyDeps.begin(), build.orderOnlyDeps.end()},
+              [&](std::string& path) { return getPathIndex(path); });
+          command.fingerprint = build.fingerprint;
+          return command.hash;
+        });
+  }
+
+  void operator()(RuleReader& r) {
+    const std::string_view name = r.name();
+    RuleCommand& rule = declareRule(name);
+    readRuleVariables(r, name, rule.variables);
+    addRuleParts(rule, {r.start(), r.bytesParsed()});
+  }
+
+  void operator()(DefaultReader& r) {
+    PathVector& ins = tmp.build.ins;
+    ins.clear();
+    for (const EvalString& path : r.readPaths()) {
+      evaluate(ins.emplace_back(), path, fileScope);
+    }
+
+    addDefault({r.start(), r.bytesParsed()}, {ins.begin(), ins.end()},
+               [&](std::string& path) { return getPathIndex(path); });
+  }
+
+  void operator()(const VariableReader& r) {
+    evaluate(fileScope.resetValue(VariableName::intern(r.name())), r.value(),
+             fileScope);
+    fileScope.declare({r.start(), r.bytesParsed()});
+    if (!lowMemory) {
+      addPart({r.start(), r.bytesParsed()});
+    }
+  }
+
+  void operator()(const IncludeReader& r) {
+    const std::filesystem::path file = getPath(r, fileScope);
+    const Timer t = CPUProfiler::start("include", file);
+    parse(file, fileStorage.load(file));
+  }
+
+  void operator()(const SubninjaReader& r) {
+    const std::filesystem::path file = getPath(r, fileScope);
+    checkExists(file);
+    const Timer t = CPUProfiler::start("subninja", file);
+
+    // Use the statements parsed ahead of time if they are still valid
+    if (fileIds.size() == 1 &&
+        nextSubninjaFragment < subninjaFragments.size()) {
+      SubninjaFragment& fragment = subninjaFragments[nextSubninjaFragment++];
+      fragment.ready.wait(false, std::memory_order_acquire);
+      if (fragment.succeeded && fragment.file == file && canReplay(fragment)) {
+        replay(fragment);
+        return;
+      }
+    }
+
+    fileScope.push();
+    enterSubninja();
+    parse(file, fileStorage.load(file));
+    leaveSubninja(stringStorage.store(fileScope.pop()));
+  }
+};
+
+}  // namespace detail
+
+namespace {
+
+// The first string in every cache file, which needs to be changed whenever the
+// layout written by `BuildContext::save` changes
+const std::string_view CACHE_SIGNATURE = "trimja cache v5 " TRIMJA_VERSION;
+
+// Return `ninjaFileContents` followed by the contents of `files`, which is the
+// order used by `writeCacheKey` and `readCacheKey`
+std::vector<std::string_view> allContents(
+    std::string_view ninjaFileContents,
+    const FileCache& files) {
+  std::vector<std::string_view> contents{ninjaFileContents};
+  for (const LoadedFile& file : files) {
+    contents.push_back(file.file.contents());
+  }
+  return contents;
+}
+
+// Write the signature and the path, size and hash of every parsed file, which
+// is checked by `readCacheKey` to see whether the cache is still valid
+void writeCacheKey(CacheWriter& writer,
+                   const std::filesystem::path& ninjaFile,
+                   std::string_view ninjaFileContents,
+                   const FileCache& files) {
+  const auto writeFile = [&](const std::filesystem::path& path,
+                             std::string_view contents) {
+    writer.writeString(path.string());
+    writer.writeWord(contents.size());
+    writer.writeWord(rapidhash(contents.data(), contents.size()));
+  };
+
+  writer.writeString(CACHE_SIGNATURE);
+  writer.writeWord(std::distance(files.begin(), files.end()) + 1);
+  writeFile(ninjaFile, ninjaFileContents);
+  for (const LoadedFile& file : files) {
+    writeFile(file.path, file.file.contents());
+  }
+}
+
+// Return whether the key written by `writeCacheKey` matches the contents of
+// `ninjaFile` and all other files it loaded, which are loaded into `files` in
+// the same order as they were written
+bool readCacheKey(CacheReader& reader,
+                  const std::filesystem::path& ninjaFile,
+                  std::string_view ninjaFileContents,
+                  FileCache& files) {
+  if (reader.readString() != CACHE_SIGNATURE) {
+    return false;
+  }
+
+  const auto matches = [&](std::string_view contents) {
+    return reader.readWord() == contents.size() &&
+           reader.readWord() == rapidhash(contents.data(), contents.size());
+  };
+
+  const std::size_t fileCount = reader.readWord();
+  if (fileCount == 0 || reader.readString() != ninjaFile.string() ||
+      !matches(ninjaFileContents)) {
+    return false;
+  }
+
+  for (std::size_t i = 1; i < fileCount; ++i) {
+    const std::filesystem::path file{reader.readString()};
+    if (!std::filesystem::exists(file)) {
+      return false;
+    }
+    if (!matches(files.load(file))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Return the `BuildContext` stored in `cacheFile` if it exists and is valid
+// for `ninjaFile`, otherwise return null
+std::unique_ptr<detail::BuildContext> loadCache(
+    const std::filesystem::path& cacheFile,
+    const std::filesystem::path& ninjaFile,
+    std::string_view ninjaFileContents) {
+  if (!std::filesystem::exists(cacheFile)) {
+    return nullptr;
+  }
+
+  auto ctx = std::make_unique<detail::BuildContext>();
+  ctx->cacheFile = MappedFile{cacheFile};
+  CacheReader reader{ctx->cacheFile.contents()};
+  try {
+    if (!readCacheKey(reader, ninjaFile, ninjaFileContents,
+                      ctx->fileStorage)) {
+      return nullptr;
+    }
+    ctx->load(reader, allContents(ninjaFileContents, ctx->fileStorage));
+  } catch (const std::exception&) {
+    // Treat any corrupt cache as out of date
+    return nullptr;
+  }
+  return ctx;
+}
+
+// Parse `ninjaFile` with `jobs` threads into a new `BuildContext`, which will
+// hash build commands with `hashType` if it is set, reuse the hashes from the
+// `.ninja_log` sidecar if `reuseHashes` is true and only keep what is needed
+// to stream the output if `lowMemory` is true
+std::unique_ptr<detail::BuildContext> parseManifest(
+    const std::filesystem::path& ninjaFile,
+    std::string_view ninjaFileContents,
+    std::size_t jobs,
+    std::optional<HashType> hashType,
+    bool reuseHashes,
+    bool lowMemory) {
+  auto ctx = std::make_unique<detail::BuildContext>();
+  ctx->hashType = hashType;
+  ctx->reuseHashes = reuseHashes;
+  ctx->lowMemory = lowMemory;
+  ctx->parse(ninjaFile, ninjaFileContents, jobs);
+  ctx->fileScope.appendValue(ctx->builddir, VariableName::Builddir);
+  return ctx;
+}
+
+// Save the hash of every logged build command in `ctx` to the sidecar of
+// `ninjaLog` so that the next parse can reuse them
+void saveCommandHashes(const std::filesystem::path& ninjaLog,
+                       const detail::BuildContext& ctx) {
+  const Graph& graph = ctx.graph;
+  std::vector<CommandHashes::Entry> entries;
+  for (std::size_t index = 0; index < graph.size(); ++index) {
+    const std::size_t commandIndex = ctx.nodeToCommand[index];
+    if (commandIndex == std::numeric_limits<std::size_t>::max() ||
+        graph.isDefault(index)) {
+      continue;
+    }
+    const BuildCommand& command = ctx.commands[commandIndex];
+    if (!detail::BuildContext::isBuiltInRule(command.ruleIndex)) {
+      entries.push_back({graph.path(index), command.fingerprint, command.hash});
+    }
+  }
+  CommandHashes::save(CommandHashes::sidecarFor(ninjaLog), *ctx.hashType,
+                      entries);
+}
+
+// The number of paths from `.ninja_deps` or `.ninja_log` that are hashed
+// together before looking them up in the graph
+const std::size_t PATH_BATCH_SIZE = 256;
+
+// `.ninja_deps` decoded into path strings that are already hashed, which can
+// be done on another thread before the graph exists and then joined against
+// it with `parseDepFile`
+struct StagedDeps {
+  std::filesystem::path file;
+  std::optional<DepsReader> reader;
+
+  // Path records in the order they appear along with their ids
+  std::vector<std::pair<std::size_t, Graph::HashedPath>> paths;
+
+  // The latest deps record of each output id, which are views into `reader`
+  std::vector<std::span<const std::int32_t>> latestDeps;
+  std::uint64_t recordCount = 0;
+};
+
+// Read `ninjaDeps` into `staged` if it exists
+void stageDepFile(const std::filesystem::path& ninjaDeps, StagedDeps& staged) {
+  staged.file = ninjaDeps;
+  if (!std::filesystem::exists(ninjaDeps)) {
+    return;
+  }
+
+  const Timer t = CPUProfiler::start(".ninja_deps read");
+  DepsReader& reader = staged.reader.emplace(ninjaDeps);
+  for (const std::variant<PathRecordView, DepsRecordView>& record : reader) {
+    ++staged.recordCount;
+    switch (record.index()) {
+      case 0: {
+        const auto& view = std::get<PathRecordView>(record);
+        if (view.index < 0) {
+          throw std::runtime_error("Invalid path index in " +
+                                   ninjaDeps.string());
+        }
+        // Entries in `.ninja_deps` are already normalized when written
+        staged.paths.emplace_back(
+            static_cast<std::size_t>(view.index),
+            Graph::HashedPath{view.path, Graph::hashPath(view.path)});
+        break;
+      }
+      case 1: {
+        // Later deps records override earlier ones for the same output
+        const auto& view = std::get<DepsRecordView>(record);
+        if (view.outIndex < 0) {
+          throw std::runtime_error("Invalid output index in " +
+                                   ninjaDeps.string());
+        }
+        const std::size_t id = static_cast<std::size_t>(view.outIndex);
+        if (id >= staged.latestDeps.size()) {
+          staged.latestDeps.resize(id + 1);
+        }
+        staged.latestDeps[id] = view.deps;
+        break;
+      }
+    }
+  }
+}
+
+// Add the paths and dependencies in `staged` to `graph`
+void parseDepFile(const StagedDeps& staged,
+                  Graph& graph,
+                  detail::BuildContext& ctx) {
+  const std::uint32_t unknown = std::numeric_limits<std::uint32_t>::max();
+  std::vector<std::uint32_t> lookup;
+  for (const auto& [id, path] : staged.paths) {
+    if (id >= lookup.size()) {
+      lookup.resize(id + 1, unknown);
+    }
+    lookup[id] = static_cast<std::uint32_t>(graph.addNormalizedPath(path));
+  }
+  if (graph.size() > ctx.nodeToCommand.size()) {
+    ctx.nodeToCommand.resize(graph.size(),
+                             std::numeric_limits<std::size_t>::max());
+  }
+  CPUProfiler::count("deps records", staged.recordCount);
+
+  // Ninja always writes the path record before any record that uses it
+  const auto toNode = [&](std::int32_t id) {
+    if (id < 0 || static_cast<std::size_t>(id) >= lookup.size() ||
+        lookup[id] == unknown) {
+      throw std::runtime_error("Unknown path index in " +
+                               staged.file.string());
+    }
+    return lookup[id];
+  };
+  for (std::size_t outId = 0; outId < staged.latestDeps.size(); ++outId) {
+    const std::span<const std::int32_t> deps = staged.latestDeps[outId];
+    if (deps.empty()) {
+      continue;
+    }
+    const std::uint32_t out = toNode(static_cast<std::int32_t>(outId));
+    for (const std::int32_t inId : deps) {
+      graph.addEdge(toNode(inId), out);
+    }
+  }
+}
+
+// `.ninja_log` opened and, if `decoded`, decoded into hashed paths from the
+// end of the file to the start, see `StagedDeps`
+struct StagedLog {
+  std::filesystem::path file;
+  std::optional<LogReader> reader;
+
+  // Whether `entries` holds every entry of `reader`, otherwise `parseLogFile`
+  // decodes them itself as it goes
+  bool decoded = false;
+
+  // Each entry's output, which is a view into `reader`, and its hash
+  std::vector<std::pair<Graph::HashedPath, std::uint64_t>> entries;
+  HashType hashType = HashType::murmur;
+};
+
+// Open `ninjaLog` into `staged` if it exists and, if `decode` is true, decode
+// all of its entries.  `parseLogFile` usually stops before the start of the
+// file, so this is only worth doing on another thread while we parse.
+void stageLogFile(const std::filesystem::path& ninjaLog,
+                  StagedLog& staged,
+                  bool decode) {
+  staged.file = ninjaLog;
+  if (!std::filesystem::exists(ninjaLog)) {
+    return;
+  }
+
+  const Timer t = CPUProfiler::start(".ninja_log read");
+  LogReader& reader = staged.reader.emplace(
+      ninjaLog, LogEntry::Fields::out | LogEntry::Fields::hash);
+  if (!decode) {
+    return;
+  }
+  for (const LogEntry& entry : reader.reversed()) {
+    // Entries in `.ninja_log` are already normalized when written
+    staged.entries.emplace_back(
+        Graph::HashedPath{entry.out, Graph::hashPath(entry.out)}, entry.hash);
+    staged.hashType = entry.hashType;
+  }
+  staged.decoded = true;
+}
+
+void parseLogFile(StagedLog& staged,
+                  const detail::BuildContext& ctx,
+                  std::vector<std::uint8_t>& flags,
+                  bool explain,
+                  ExplainLog& explanations) {
+  const Graph& graph = ctx.graph;
+
+  // Only build commands for non-built-in rules appear in the log, so count
+  // these so that we can stop as soon as we've seen all of them
+  const auto isLoggedCommand = [&](const std::size_t index) {
+    return (flags[index] & (BuildOutput | BuiltIn)) == BuildOutput;
+  };
+  std::size_t remaining = 0;
+  for (std::size_t index = 0; index < graph.size(); ++index) {
+    remaining += isLoggedCommand(index);
+  }
+
+  // As there can be duplicate entries and subsequent entries take precedence,
+  // the entries are staged from the end of the file and we ignore all but the
+  // first entry we see for each output
+  std::vector<bool> seen(graph.size());
+  std::vector<bool> hashMismatch(graph.size());
+  std::uint64_t entryCount = 0;
+  const auto visit = [&](const Graph::HashedPath& out, std::uint64_t hash) {
+    ++entryCount;
+    const std::optional<std::size_t> index = graph.findNormalizedPath(out);
+    if (!index || seen[*index]) {
+      // If we don't have the path then it was since removed from the ninja
+      // build file
+      return;
+    }
+    seen[*index] = true;
+
+    if (isLoggedCommand(*index)) {
+      // `TrimUtil::load` makes sure that we hashed in the same way as the log
+      assert(staged.hashType == ctx.hashType);
+      hashMismatch[*index] =
+          (hash != ctx.commands[ctx.nodeToCommand[*index]].hash);
+      --remaining;
+    }
+  };
+  if (staged.decoded) {
+    for (const auto& [out, hash] : staged.entries) {
+      if (remaining == 0) {
+        break;
+      }
+      visit(out, hash);
+    }
+  } else {
+    for (const LogEntry& entry : staged.reader->reversed()) {
+      if (remaining == 0) {
+        break;
+      }
+      // Entries in `.ninja_log` are already normalized when written
+      staged.hashType = entry.hashType;
+      visit(Graph::HashedPath{entry.out, Graph::hashPath(entry.out)},
+            entry.hash);
+    }
+  }
+
+  CPUProfiler::count("log entries", entryCount);
+
+  // Mark all build commands that are new or have been changed as required
+  const std::size_t logText =
+      explain ? explanations.addText(staged.file.string()) : 0;
+  for (std::size_t index = 0; index < seen.size(); ++index) {
+    if ((flags[index] & Affected) || !isLoggedCommand(index)) {
+      continue;
+    }
+
+    if (!seen[index]) {
+      flags[index] |= Affected;
+      if (explain) {
+        explanations.add(ExplainLog::Reason::missingFromLog, index, logText);
+      }
+    } else if (hashMismatch[index]) {
+      flags[index] |= Affected;
+      if (explain) {
+        explanations.add(ExplainLog::Reason::hashMismatch, index, logText);
       }
+    }
+  }
+}
 
-      RuleCommand& ruleCommand = rules[ruleIt->second.ruleIndex];
-      if (ruleCommand.fileId == fileIds.back()) {
-        // Throw an exception if we have a duplicate rule in the same file
-        std::string msg;
-        msg += "Duplicate rule '";
-        msg += name;
-        msg += "' found!";
-        throw std::runtime_error{msg};
+// The value of `BuildContext::durations` for nodes without a log entry
+const std::uint32_t UNKNOWN_DURATION =
+    std::numeric_limits<std::uint32_t>::max();
+
+// Return `ctx.durations`, reading them from `.ninja_log` on first use, which
+// is safe to call from multiple threads
+const std::vector<std::uint32_t>& getDurations(
+    const detail::BuildContext& ctx) {
+  std::call_once(ctx.durationsRead, [&] {
+    const Graph& graph = ctx.graph;
+    std::vector<std::uint32_t>& durations = ctx.durations;
+    durations.assign(graph.size(), UNKNOWN_DURATION);
+    const std::filesystem::path ninjaLog =
+        std::filesystem::path(ctx.ninjaFile).remove_filename() /
+        ctx.builddir / ".ninja_log";
+    if (!std::filesystem::exists(ninjaLog)) {
+      return;
+    }
+
+    const Timer t = CPUProfiler::start(".ninja_log durations");
+    LogReader reader{ninjaLog, LogEntry::Fields::startTime |
+                                   LogEntry::Fields::endTime |
+                                   LogEntry::Fields::out};
+    std::vector<LogEntry> batch;
+    std::vector<std::string_view> batchPaths;
+    std::vector<std::optional<std::size_t>> batchIndices;
+    batch.reserve(PATH_BATCH_SIZE);
+    batchPaths.reserve(PATH_BATCH_SIZE);
+    const auto flushEntries = [&] {
+      batchIndices.resize(batchPaths.size());
+      graph.findNormalizedPaths(batchPaths, batchIndices);
+      for (std::size_t i = 0; i < batch.size(); ++i) {
+        // Later entries take precedence and we read from the end of the file
+        const std::optional<std::size_t> index = batchIndices[i];
+        if (index && durations[*index] == UNKNOWN_DURATION) {
+          const std::int32_t duration =
+              (batch[i].endTime - batch[i].startTime).count();
+          durations[*index] =
+              static_cast<std::uint32_t>(std::max(duration, 0));
+        }
       }
+      batch.clear();
+      batchPaths.clear();
+    };
+    for (const LogEntry& entry : reader.reversed()) {
+      batch.push_back(entry);
+      batchPaths.push_back(entry.out);
+      if (batch.size() == PATH_BATCH_SIZE) {
+        flushEntries();
+      }
+    }
+    flushEntries();
+  });
+  return ctx.durations;
+}
 
-      RuleBits& bits = ruleIt->second;
-      if (!shadowedRules.empty()) {
-        // The root ninja file may shadow existing rules added through
-        // subninja, but we never need to unshadow these
-        shadowedRules.back().push_back(bits.ruleIndex);
+// The smallest number of nodes in a level of `forEachLevel` that we give to
+// each thread, since smaller levels are faster to visit on one thread
+const std::size_t MIN_NODES_PER_THREAD = 1 << 12;
+
+// Return the flags of a node in `flags`, which may be modified by other
+// threads if `concurrent` is true
+std::uint8_t loadFlags(std::uint8_t& flags, bool concurrent) {
+  return concurrent ? std::atomic_ref{flags}.load(std::memory_order_relaxed)
+                    : flags;
+}
+
+// Set `newFlags` on a node with the flags `flags`, which may be modified by
+// other threads if `concurrent` is true, and return its previous flags.  Only
+// one thread will see that a flag was not previously set.
+std::uint8_t setFlags(std::uint8_t& flags,
+                      std::uint8_t newFlags,
+                      bool concurrent) {
+  if (!concurrent) {
+    const std::uint8_t previous = flags;
+    flags |= newFlags;
+    return previous;
+  }
+  std::atomic_ref ref{flags};
+  const std::uint8_t previous = ref.load(std::memory_order_relaxed);
+  if ((previous & newFlags) == newFlags) {
+    return previous;
+  }
+  return ref.fetch_or(newFlags, std::memory_order_relaxed);
+}
+
+// Visit the graph breadth first one level at a time, starting with the nodes
+// in `frontier`, by calling `visit(index, next, concurrent)` on each node in
+// the current level, which appends nodes for the next level to `next`.  Large
+// levels are split across `jobs` threads, in which case `concurrent` is true
+// and `visit` must update the flags of nodes with `setFlags`.
+template <typename VISIT>
+void forEachLevel(std::vector<std::size_t>& frontier,
+                  std::size_t jobs,
+                  VISIT&& visit) {
+  std::vector<std::vector<std::size_t>> next(1);
+  while (!frontier.empty()) {
+    const std::size_t threads = std::max<std::size_t>(
+        std::min(jobs, frontier.size() / MIN_NODES_PER_THREAD), 1);
+    next.resize(std::max(next.size(), threads));
+    if (threads == 1) {
+      for (const std::size_t index : frontier) {
+        visit(index, next[0], false);
+      }
+    } else {
+      std::vector<std::jthread> workers;
+      for (std::size_t i = 0; i < threads; ++i) {
+        const std::span<const std::size_t> part =
+            std::span{frontier}.subspan(frontier.size() * i / threads,
+                                        frontier.size() * (i + 1) / threads -
+                                            frontier.size() * i / threads);
+        workers.emplace_back([&visit, part, &next = next[i]] {
+          for (const std::size_t index : part) {
+            visit(index, next, true);
+          }
+        });
       }
-      bits.ruleIndex = rules.size();
-      ++bits.duplicates;
     }
 
-    const char* endOfName = name.data() + name.size();
-    const std::size_t bytesToEndOfName = endOfName - r.start();
+    frontier.clear();
+    for (std::vector<std::size_t>& nodes : next) {
+      frontier.insert(frontier.end(), nodes.begin(), nodes.end());
+      nodes.clear();
+    }
+  }
+}
 
-    RuleCommand& rule = rules.emplace_back(name);
-    rule.fileId = fileIds.back();
-    rule.instance = ruleIt->second.duplicates;
-    if (!isNew) {
-      // If shadowed we need to add the rule suffix to the list of parts to
-      // print
-      rule.partsIndices.push_back(
-          parts.emplace(parts.end(), r.start(), bytesToEndOfName) -
-          parts.begin());
+// Return all nodes that are `Affected` in `flags` but not in `previous`,
+// which is used to explain nodes once they are all marked
+std::vector<std::size_t> newlyAffected(
+    const std::vector<std::uint8_t>& previous,
+    const std::vector<std::uint8_t>& flags) {
+  std::vector<std::size_t> marked;
+  for (std::size_t index = 0; index < flags.size(); ++index) {
+    if ((flags[index] & Affected) && !(previous[index] & Affected)) {
+      marked.push_back(index);
+    }
+  }
+  return marked;
+}
 
-      rule.partsIndices.push_back(
-          parts.emplace(parts.end(),
-                        to_string_view(ruleIt->second.duplicates)) -
-          parts.begin());
+// Mark as affected all outputs that have an affected input, directly or
+// indirectly, starting from the affected nodes in `worklist`, using up to
+// `jobs` threads and explaining to `explanations`
+void markAffectedOutputs(std::vector<std::uint8_t>& flags,
+                         std::vector<std::size_t>& worklist,
+                         const detail::BuildContext& ctx,
+                         std::size_t jobs,
+                         bool explain,
+                         ExplainLog& explanations) {
+  const Graph& graph = ctx.graph;
+  const std::vector<std::uint8_t> previous =
+      explain ? flags : std::vector<std::uint8_t>{};
+  forEachLevel(
+      worklist, jobs,
+      [&](std::size_t in, std::vector<std::size_t>& next, bool concurrent) {
+        // Skip order-only dependencies, which do not affect their outputs
+        for (const std::size_t out : graph.outExcludingOrderOnly(in)) {
+          if (loadFlags(flags[out], concurrent) & Affected) {
+            continue;
+          }
+          if (!(setFlags(flags[out], Affected, concurrent) & Affected)) {
+            next.push_back(out);
+          }
+        }
+      });
+
+  if (!explain) {
+    return;
+  }
+
+  // Explain once all inputs are final so that we mention the first affected
+  // input of each output
+  for (const std::size_t index : newlyAffected(previous, flags)) {
+    // Only mention user-defined rules since built-in rules are always kept
+    if (flags[index] & BuiltIn) {
+      continue;
     }
+    const auto& inIndices = graph.in(index);
+    const auto it = std::find_if(
+        inIndices.begin(), inIndices.end(),
+        [&](const std::size_t in) { return flags[in] & Affected; });
+    assert(it != inIndices.end());
+    explanations.add(ExplainLog::Reason::affectedInput, index, *it);
+  }
+}
 
-    for (const auto& [key, value] : r.readVariables()) {
-      if (!rule.variables.add(key, value)) {
-        std::string msg;
-        msg += "Unexpected variable '";
-        msg += key;
-        msg += "' in rule '";
-        msg += name;
-        msg += "' found!";
-        throw std::runtime_error(msg);
+// Mark as affected all inputs, including order-only dependencies, that are
+// required to run the affected build commands in `flags`, skipping those
+// that already have `NeedsAllInputs`, using up to `jobs` threads and
+// explaining to `explanations`
+void markRequiredInputs(std::vector<std::uint8_t>& flags,
+                        const detail::BuildContext& ctx,
+                        std::size_t jobs,
+                        bool explain,
+                        ExplainLog& explanations) {
+  const Graph& graph = ctx.graph;
+  const std::vector<std::uint8_t> previous =
+      explain ? flags : std::vector<std::uint8_t>{};
+
+  // Source files never need anything built, and affected `phony` commands
+  // only need their inputs if something affected requires them
+  std::vector<std::size_t> worklist;
+  for (std::size_t index = 0; index < graph.size(); ++index) {
+    if ((flags[index] &
+         (Affected | NeedsAllInputs | BuildOutput | BuiltIn)) ==
+        (Affected | BuildOutput)) {
+      flags[index] |= NeedsAllInputs;
+      worklist.push_back(index);
+    }
+  }
+
+  forEachLevel(
+      worklist, jobs,
+      [&](std::size_t out, std::vector<std::size_t>& next, bool concurrent) {
+        const auto markInput = [&](const std::size_t in) {
+          const std::uint8_t current = loadFlags(flags[in], concurrent);
+          if ((current & NeedsAllInputs) || !(current & BuildOutput)) {
+            return;
+          }
+          if (!(setFlags(flags[in], NeedsAllInputs | Affected, concurrent) &
+                NeedsAllInputs)) {
+            next.push_back(in);
+          }
+        };
+        const std::span<const std::uint32_t> in = graph.in(out);
+        std::for_each(in.begin(), in.end(), markInput);
+        const std::span<const std::uint32_t> orderOnlyIn =
+            graph.orderOnlyIn(out);
+        std::for_each(orderOnlyIn.begin(), orderOnlyIn.end(), markInput);
+      });
+
+  if (!explain) {
+    return;
+  }
+
+  // Explain once everything is final so that we mention the first output
+  // that required each input
+  for (const std::size_t index : newlyAffected(previous, flags)) {
+    const auto& outIndices = graph.out(index);
+    const auto it = std::find_if(
+        outIndices.begin(), outIndices.end(),
+        [&](const std::size_t out) { return flags[out] & NeedsAllInputs; });
+    assert(it != outIndices.end());
+    explanations.add(ExplainLog::Reason::requiredInput, index, *it);
+  }
+}
+
+// Mark every node in `flags` that is needed to build any of the nodes in
+// `targets`, i.e. everything that they transitively depend on, with
+// `Targeted` using up to `jobs` threads.  Then clear `Affected` and
+// `NeedsAllInputs` from all other nodes so that only the affected commands
+// needed by `targets` are kept, and drop their records from `explanations`.
+void markTargets(std::vector<std::uint8_t>& flags,
+                 std::span<const std::size_t> targets,
+                 const detail::BuildContext& ctx,
+                 std::size_t jobs,
+                 ExplainLog& explanations) {
+  const Graph& graph = ctx.graph;
+  std::vector<std::size_t> worklist;
+  for (const std::size_t target : targets) {
+    if (!(flags[target] & Targeted)) {
+      flags[target] |= Targeted;
+      worklist.push_back(target);
+    }
+  }
+
+  forEachLevel(
+      worklist, jobs,
+      [&](std::size_t out, std::vector<std::size_t>& next, bool concurrent) {
+        const auto markInput = [&](const std::size_t in) {
+          if (!(loadFlags(flags[in], concurrent) & Targeted) &&
+              !(setFlags(flags[in], Targeted, concurrent) & Targeted)) {
+            next.push_back(in);
+          }
+        };
+        const std::span<const std::uint32_t> in = graph.in(out);
+        std::for_each(in.begin(), in.end(), markInput);
+        const std::span<const std::uint32_t> orderOnlyIn =
+            graph.orderOnlyIn(out);
+        std::for_each(orderOnlyIn.begin(), orderOnlyIn.end(), markInput);
+      });
+
+  for (std::uint8_t& flag : flags) {
+    if (!(flag & Targeted)) {
+      flag &= static_cast<std::uint8_t>(~(Affected | NeedsAllInputs));
+    }
+  }
+  explanations.removeIf(
+      [&](std::size_t index) { return !(flags[index] & Targeted); });
+}
+
+// Collects small strings so that they are written to an output stream in
+// large blocks, which avoids the overhead of a stream call for every part of
+// the output
+class OutputBuffer {
+  static constexpr std::size_t CAPACITY = 64 * 1024;
+
+  std::ostream& m_output;
+  std::unique_ptr<char[]> m_buffer;
+  std::size_t m_size;
+
+ public:
+  explicit OutputBuffer(std::ostream& output)
+      : m_output{output},
+        m_buffer{std::make_unique_for_overwrite<char[]>(CAPACITY)},
+        m_size{0} {}
+
+  OutputBuffer(const OutputBuffer&) = delete;
+  OutputBuffer& operator=(const OutputBuffer&) = delete;
+
+  // Append `text` to the buffer, writing it straight to the output if it
+  // would not fit inside of an empty buffer
+  void append(std::string_view text) {
+    if (text.size() > CAPACITY - m_size) {
+      flush();
+      if (text.size() >= CAPACITY) {
+        m_output.write(text.data(), text.size());
+        return;
       }
     }
+    std::copy(text.begin(), text.end(), m_buffer.get() + m_size);
+    m_size += text.size();
+  }
 
-    if (!isNew) {
-      // Include the rest of the variables if we're shadowed
-      rule.partsIndices.push_back(
-          parts.emplace(parts.end(), endOfName,
-                        r.bytesParsed() - bytesToEndOfName) -
-          parts.begin());
-      assert(rule.partsIndices.size() == 3);
+  // Write everything in the buffer to the output
+  void flush() {
+    m_output.write(m_buffer.get(), m_size);
+    m_size = 0;
+  }
+};
+
+// Append the `phony` build statement that replaces a build statement with
+// outputs `outStr` and validations `validationStr` to `output`
+void appendPhony(OutputBuffer& output,
+                 std::string_view outStr,
+                 std::string_view validationStr) {
+  output.append(outStr);
+  output.append(validationStr.empty() ? ": phony" : ": phony ");
+  output.append(validationStr);
+  output.append("\n");
+}
+
+// Writes the trimmed build file for a `BuildContext` that was loaded with
+// `lowMemory`, and so has no `parts`, by lexing the files again in the same
+// order as they were parsed and writing each statement as soon as it is read
+class ManifestStreamer {
+  const detail::BuildContext& m_ctx;
+  std::span<const BuildCommand::Resolution> m_resolutions;
+  const std::vector<bool>& m_ruleReferenced;
+  OutputBuffer& m_output;
+
+  // Our top-level variables, which are needed to find `include` and
+  // `subninja` files and to reset the scope at the end of a `subninja`
+  NestedScope m_fileScope;
+
+  // The indices of the next command in `BuildContext::commands` and the next
+  // rule in `BuildContext::rules`, as both are in the order they were parsed
+  std::size_t m_nextCommand;
+  std::size_t m_nextRule;
+
+  // Write the statement `text` for `rule`, which has its name at the end of
+  // `name`, adding the instance of `rule` after the name if it is shadowed
+  void append(std::string_view text,
+              std::string_view name,
+              const RuleCommand& rule) {
+    if (rule.instance == 1) {
+      m_output.append(text);
     } else {
-      // If we're not shadowed then we can include the whole rule
-      rule.partsIndices.push_back(
-          parts.emplace(parts.end(), r.start(), r.bytesParsed()) -
-          parts.begin());
-      assert(rule.partsIndices.size() == 1);
+      const std::size_t bytesToEndOfName =
+          name.data() + name.size() - text.data();
+      m_output.append(text.substr(0, bytesToEndOfName));
+      m_output.append(std::to_string(rule.instance));
+      m_output.append(text.substr(bytesToEndOfName));
     }
-    // Check we aren't actually allocating
-    assert(rule.partsIndices.size() <= rule.partsIndices.inline_capacity_v);
   }
 
-  void operator()(DefaultReader& r) {
-    PathVector& ins = tmp.ins;
-    ins.clear();
-    for (const EvalString& path : r.readPaths()) {
-      evaluate(ins.emplace_back(), path, fileScope);
+  // Throw unless `unchanged`, which says whether the statements read so far
+  // match those that were loaded
+  static void checkUnchanged(bool unchanged) {
+    if (!unchanged) {
+      throw std::runtime_error("Ninja build file changed since it was loaded!");
     }
+  }
 
-    const std::size_t partsIndex = parts.size();
-    parts.emplace_back(r.start(), r.bytesParsed());
+ public:
+  ManifestStreamer(const detail::BuildContext& ctx,
+                   std::span<const BuildCommand::Resolution> resolutions,
+                   const std::vector<bool>& ruleReferenced,
+                   OutputBuffer& output)
+      : m_ctx{ctx},
+        m_resolutions{resolutions},
+        m_ruleReferenced{ruleReferenced},
+        m_output{output},
+        m_fileScope{},
+        m_nextCommand{0},
+        m_nextRule{detail::BuildContext::defaultIndex + 1} {}
 
-    const std::size_t commandIndex = commands.size();
-    BuildCommand& buildCommand = commands.emplace_back();
-    buildCommand.resolution = BuildCommand::Print;
-    buildCommand.partsIndices.push_back(partsIndex);
-    buildCommand.ruleIndex = BuildContext::defaultIndex;
+  void parse(const std::filesystem::path& ninjaFile,
+             std::string_view ninjaFileContents) {
+    for (auto&& part : ManifestReader(ninjaFile, ninjaFileContents)) {
+      std::visit(*this, part);
+    }
+  }
 
-    const std::size_t outIndex = getDefault();
-    nodeToCommand[outIndex] = commandIndex;
-    for (std::string& in : ins) {
-      graph.addEdge(getPathIndex(in), outIndex);
+  // Write the trimmed build file of the `ninjaFile` given to `TrimUtil::load`
+  void write() {
+    parse(m_ctx.ninjaFile, m_ctx.ninjaFileContents);
+    checkUnchanged(m_nextCommand == m_ctx.commands.size() &&
+                   m_nextRule == m_ctx.rules.size());
+  }
+
+  void operator()(PoolReader& r) {
+    consume(r.readVariables());
+    m_output.append({r.start(), r.bytesParsed()});
+  }
+
+  void operator()(BuildReader& r) {
+    consume(r.readOut());
+    consume(r.readImplicitOut());
+    const std::string_view outStr{r.start(), r.bytesParsed()};
+    const std::string_view ruleName = r.readName();
+    consume(r.readIn());
+    consume(r.readImplicitIn());
+    consume(r.readOrderOnlyDeps());
+    const char* validationStart = r.position();
+    consume(r.readValidations());
+    const std::string_view validationStr{
+        validationStart,
+        static_cast<std::size_t>(r.position() - validationStart)};
+    consume(r.readVariables());
+
+    checkUnchanged(m_nextCommand < m_ctx.commands.size());
+    const std::size_t commandIndex = m_nextCommand++;
+    if (m_resolutions[commandIndex] == BuildCommand::Phony) {
+      appendPhony(m_output, outStr, validationStr);
+    } else {
+      append({r.start(), r.bytesParsed()}, ruleName,
+             m_ctx.rules[m_ctx.commands[commandIndex].ruleIndex]);
+    }
+  }
+
+  void operator()(RuleReader& r) {
+    const std::string_view name = r.name();
+    consume(r.readVariables());
+    checkUnchanged(m_nextRule < m_ctx.rules.size());
+    const std::size_t ruleIndex = m_nextRule++;
+    if (m_ruleReferenced[ruleIndex]) {
+      append({r.start(), r.bytesParsed()}, name, m_ctx.rules[ruleIndex]);
     }
   }
 
+  void operator()(DefaultReader& r) {
+    consume(r.readPaths());
+    checkUnchanged(m_nextCommand < m_ctx.commands.size());
+    ++m_nextCommand;
+    m_output.append({r.start(), r.bytesParsed()});
+  }
+
   void operator()(const VariableReader& r) {
-    evaluate(fileScope.resetValue(r.name()), r.value(), fileScope);
-    parts.emplace_back(r.start(), r.bytesParsed());
+    evaluate(m_fileScope.resetValue(VariableName::intern(r.name())),
+             r.value(), m_fileScope);
+    m_output.append({r.start(), r.bytesParsed()});
   }
 
   void operator()(const IncludeReader& r) {
-    const std::filesystem::path file = [&] {
-      const EvalString& pathEval = r.path();
-      std::string path;
-      evaluate(path, pathEval, fileScope);
-      return std::filesystem::path(r.parent()).remove_filename() / path;
-    }();
+    const std::filesystem::path file = getPath(r, m_fileScope);
+    const MappedFile contents{file};
+    parse(file, contents.contents());
+  }
 
-    if (!std::filesystem::exists(file)) {
-      std::string msg;
-      msg += "Unable to find ";
-      msg += file.string();
-      msg += "!";
-      throw std::runtime_error(msg);
+  void operator()(const SubninjaReader& r) {
+    const std::filesystem::path file = getPath(r, m_fileScope);
+    const MappedFile contents{file};
+    m_fileScope.push();
+    parse(file, contents.contents());
+    m_output.append(m_fileScope.pop());
+  }
+};
+
+// Return a fingerprint of everything in `ctx` that decides which nodes are
+// marked by a trim, which is the path and inputs of each node, whether it is
+// built by a built-in rule, and whether `.ninja_log` affected it
+std::uint64_t trimFingerprint(const detail::BuildContext& ctx) {
+  const Graph& graph = ctx.graph;
+  std::uint64_t fingerprint = graph.size();
+  for (std::size_t index = 0; index < graph.size(); ++index) {
+    const std::uint8_t flags = ctx.nodeFlags[index] & (BuiltIn | Affected);
+    const std::string_view path = graph.path(index);
+    const std::span<const std::uint32_t> in = graph.in(index);
+    const std::span<const std::uint32_t> orderOnlyIn = graph.orderOnlyIn(index);
+    fingerprint = rapidhash_withSeed(&flags, sizeof(flags), fingerprint);
+    fingerprint = rapidhash_withSeed(path.data(), path.size(), fingerprint);
+    fingerprint = rapidhash_withSeed(in.data(), in.size_bytes(), fingerprint);
+    fingerprint = rapidhash_withSeed(orderOnlyIn.data(),
+                                     orderOnlyIn.size_bytes(), fingerprint);
+  }
+  return fingerprint;
+}
+
+// Mark the files in `affected`, which are the lines given to `trim`, as
+// affected in `flags`, where patterns are looked up in `ctx.paths`, printing
+// any that are not found to `log` and recording why each file was marked in
+// `explanations` if `explain` is true.  Paths that are not in the build are
+// also tried relative to `workingDirectory`, or the current directory if it
+// is null.
+void markAffectedFiles(std::vector<std::uint8_t>& flags,
+                       const detail::BuildContext& ctx,
+                       std::span<const std::string> affected,
+                       const std::filesystem::path* workingDirectory,
+                       bool explain,
+                       std::ostream& log,
+                       ExplainLog& explanations) {
+  const Graph& graph = ctx.graph;
+
+  // Alternative spellings of each path are computed lexically from the
+  // working directory, which we only look up once, so that each line needs no
+  // calls to the filesystem.
+  std::optional<std::filesystem::path> cwd;
+  const auto getCwd = [&]() -> const std::filesystem::path& {
+    if (!cwd.has_value() && workingDirectory) {
+      cwd = *workingDirectory;
+    } else if (!cwd.has_value()) {
+      std::error_code error;
+      cwd = std::filesystem::current_path(error);
+      if (error) {
+        cwd->clear();
+      }
+    }
+    return *cwd;
+  };
+  const auto markPath = [&](const std::string& line, std::string& path) {
+    const std::optional<std::size_t> index = graph.findPath(path);
+    if (!index.has_value()) {
+      return false;
+    }
+    if (explain && !(flags[*index] & Affected)) {
+      explanations.add(ExplainLog::Reason::userAffected, *index,
+                       explanations.addText(line));
+    }
+    flags[*index] |= Affected | Seed;
+    return true;
+  };
+
+  // Lines ending in a separator mark everything inside that directory and
+  // lines with glob characters mark every path they match
+  std::vector<std::size_t> matches;
+  const auto markPattern = [&](const std::string& line, std::string& pattern,
+                               bool isDirectory) {
+    CanonicalizePath(&pattern);
+    if (isDirectory) {
+      pattern = pattern == "." ? "**" : pattern + "/**";
+    }
+    matches.clear();
+    ctx.paths.match(pattern, matches);
+    std::optional<std::size_t> lineText;
+    for (const std::size_t index : matches) {
+      if (explain && !(flags[index] & Affected)) {
+        if (!lineText.has_value()) {
+          lineText = explanations.addText(line);
+        }
+        explanations.add(ExplainLog::Reason::userPattern, index, *lineText);
+      }
+      flags[index] |= Affected | Seed;
+    }
+    return !matches.empty();
+  };
+
+  std::vector<std::filesystem::path> attempted;
+  std::string candidate;
+  std::string line;
+  for (const std::string& text : affected) {
+    if (text.empty()) {
+      continue;
+    }
+
+    line = text;
+    attempted.clear();
+
+#ifdef _WIN32
+    const bool isDirectory = line.ends_with('/') || line.ends_with('\\');
+#else
+    const bool isDirectory = line.ends_with('/');
+#endif
+    const bool isPattern = isDirectory || PathIndex::isPattern(line);
+    const auto mark = [&](std::string& path) {
+      return isPattern ? markPattern(line, path, isDirectory)
+                       : markPath(line, path);
+    };
+
+    // First try the raw input, which is normalized in place unless we need
+    // the original spelling of a pattern below
+    std::string& raw = isPattern ? (candidate = line) : line;
+    if (mark(raw)) {
+      continue;
+    }
+
+    // If that does not indicate a path, try the absolute path
+    const std::filesystem::path p(line);
+    if (!p.is_absolute() && !getCwd().empty()) {
+      candidate = attempted.emplace_back(getCwd() / p).string();
+      if (mark(candidate)) {
+        continue;
+      }
+    }
+
+    // If neither indicates a path, then try the path relative to the working
+    // directory
+    if (!p.is_relative() && !getCwd().empty()) {
+      candidate = attempted
+                      .emplace_back(
+                          p.lexically_normal().lexically_relative(getCwd()))
+                      .string();
+      if (!candidate.empty() && mark(candidate)) {
+        continue;
+      }
+    }
+
+    log << "'" << line << "' not found in input file";
+    if (!attempted.empty()) {
+      log << " (also tried ";
+      const char* separator = "";
+      for (const std::filesystem::path& path : attempted) {
+        log << separator << "'" << path.string() << "'";
+        separator = ", ";
+      }
+      log << ')';
     }
-    std::stringstream ninjaCopy;
-    std::ifstream ninja(file);
-    ninjaCopy << ninja.rdbuf();
-    stringStorage.push_front(ninjaCopy.str());
-    parse(file, stringStorage.front());
+    log << '\n';
   }
+}
 
-  void operator()(const SubninjaReader& r) {
-    const std::filesystem::path file = [&] {
-      const EvalString& pathEval = r.path();
-      std::string path;
-      evaluate(path, pathEval, fileScope);
-      return std::filesystem::path{r.parent()}.remove_filename() / path;
-    }();
+// Return every line of `input`
+std::vector<std::string> readLines(std::istream& input) {
+  std::vector<std::string> lines;
+  for (std::string line; std::getline(input, line);) {
+    lines.push_back(std::move(line));
+  }
+  return lines;
+}
 
-    if (!std::filesystem::exists(file)) {
+// Return the index of each path in `targets` within `graph`, throwing if any
+// is not part of it
+std::vector<std::size_t> findTargets(const Graph& graph,
+                                     std::span<const std::string> targets) {
+  std::vector<std::size_t> indices;
+  for (const std::string& target : targets) {
+    std::string path = target;
+    const std::optional<std::size_t> index = graph.findPath(path);
+    if (!index.has_value()) {
       std::string msg;
-      msg += "Unable to find ";
-      msg += file.string();
-      msg += "!";
+      msg += "Unknown target '";
+      msg += target;
+      msg += "'!";
       throw std::runtime_error{msg};
     }
+    indices.push_back(*index);
+  }
+  return indices;
+}
 
-    fileScope.push();
-    shadowedRules.emplace_back();
+// Write the build file of `ctx` to `output`, keeping the build commands of
+// every node with `Affected` in `flags` and writing all others as `phony`.
+// `trimTimer` is stopped once only writing is left.
+void writeTrimmed(const detail::BuildContext& ctx,
+                  const std::vector<std::uint8_t>& flags,
+                  std::ostream& output,
+                  Timer& trimTimer) {
+  const Graph& graph = ctx.graph;
+
+  // Mark all affected `BuildCommands` as needing to print them out, leaving
+  // the loaded commands untouched so that we can trim again
+  std::vector<BuildCommand::Resolution> resolutions;
+  resolutions.reserve(ctx.commands.size());
+  for (const BuildCommand& command : ctx.commands) {
+    resolutions.push_back(command.resolution);
+  }
+  for (std::size_t index = 0; index < graph.size(); ++index) {
+    if (flags[index] & Affected) {
+      const std::size_t commandIndex = ctx.nodeToCommand[index];
+      if (commandIndex != std::numeric_limits<std::size_t>::max()) {
+        resolutions[commandIndex] = BuildCommand::Print;
+      }
+    }
+  }
 
-    std::stringstream ninjaCopy;
-    std::ifstream ninja{file};
-    ninjaCopy << ninja.rdbuf();
-    stringStorage.push_front(ninjaCopy.str());
+  // Keep a note of the rules that are needed
+  std::vector<bool> ruleReferenced(ctx.rules.size());
+  for (std::size_t commandIndex = 0; commandIndex < ctx.commands.size();
+       ++commandIndex) {
+    if (resolutions[commandIndex] == BuildCommand::Print) {
+      ruleReferenced[ctx.commands[commandIndex].ruleIndex] = true;
+    }
+  }
 
-    fileIds.push_back(nextFileId++);
-    parse(file, stringStorage.front());
-    fileIds.pop_back();
+  // Without `parts` we write each statement as we lex it again
+  if (ctx.lowMemory) {
+    trimTimer.stop();
+    const Timer writeTimer = CPUProfiler::start("output time");
+    OutputBuffer buffer{output};
+    ManifestStreamer{ctx, resolutions, ruleReferenced, buffer}.write();
+    buffer.flush();
+    return;
+  }
 
-    stringStorage.push_front(fileScope.pop());
-    parts.push_back(stringStorage.front());
+  // Go through all build commands and remember which build edges weren't
+  // affected so that we can write them as `phony` in place of their first
+  // part.
+  std::vector<bool> removed(ctx.parts.size());
+  std::vector<std::pair<std::size_t, std::size_t>> phonyParts;
+  for (std::size_t commandIndex = 0; commandIndex < ctx.commands.size();
+       ++commandIndex) {
+    if (resolutions[commandIndex] == BuildCommand::Phony) {
+      const BuildCommandParts& commandParts = ctx.commandParts[commandIndex];
+      assert(!commandParts.partsIndices.empty());
+      phonyParts.emplace_back(commandParts.partsIndices.front(),
+                              commandIndex);
+      std::for_each(commandParts.partsIndices.begin(),
+                    commandParts.partsIndices.end(),
+                    [&](std::size_t index) { removed[index] = true; });
+    }
+  }
 
-    // For all the shadowed rules, set name to ruleIndex lookup back to the
-    // shadowed index.  We have to grab the name and then find since
-    // `unordered_flat_map` doesn't have iterator/reference stability by default
-    for (const std::size_t shadowedRuleIndex : shadowedRules.back()) {
-      const RuleCommand& shadowedRule = rules[shadowedRuleIndex];
-      ruleLookup.find(shadowedRule.name)->second.ruleIndex = shadowedRuleIndex;
+  // Commands are almost always in the same order as their parts, but we need
+  // to be sure as we write them in a single pass
+  if (!std::is_sorted(phonyParts.begin(), phonyParts.end())) {
+    std::sort(phonyParts.begin(), phonyParts.end());
+  }
+
+  // Remove all rules that weren't referenced
+  for (std::size_t ruleIndex = 0; ruleIndex < ctx.rules.size(); ++ruleIndex) {
+    if (!ruleReferenced[ruleIndex]) {
+      const RuleCommand& rule = ctx.rules[ruleIndex];
+      std::for_each(rule.partsIndices.begin(), rule.partsIndices.end(),
+                    [&](std::size_t index) { removed[index] = true; });
+    }
+  }
+  trimTimer.stop();
+
+  const Timer writeTimer = CPUProfiler::start("output time");
+  OutputBuffer buffer{output};
+  auto phonyIt = phonyParts.begin();
+  for (std::size_t index = 0; index < ctx.parts.size(); ++index) {
+    if (phonyIt != phonyParts.end() && phonyIt->first == index) {
+      const BuildCommandParts& commandParts =
+          ctx.commandParts[phonyIt->second];
+      appendPhony(buffer, commandParts.outStr, commandParts.validationStr);
+      ++phonyIt;
+    } else if (!removed[index]) {
+      buffer.append(ctx.parts[index]);
     }
-    shadowedRules.pop_back();
   }
-};
+  assert(phonyIt == phonyParts.end());
+  buffer.flush();
+}
 
-}  // namespace detail
+// Return whether `index` is an output of a build command kept by `flags`
+// that runs something, as opposed to `phony` commands
+bool isKeptCommand(const detail::BuildContext& ctx,
+                   const std::vector<std::uint8_t>& flags,
+                   std::size_t index) {
+  return (flags[index] & (Affected | BuiltIn)) == Affected &&
+         ctx.nodeToCommand[index] != std::numeric_limits<std::size_t>::max() &&
+         !ctx.graph.isDefault(index);
+}
 
-namespace {
+// Write `.ninja_deps` to `depsOutput` and `.ninja_log` to `logOutput` with
+// only the latest records for the outputs of build commands kept by `flags`,
+// so that ninja does not load the records of everything that was trimmed.
+// Either output may be null to skip writing it.
+void writePrunedLogs(const detail::BuildContext& ctx,
+                     const std::vector<std::uint8_t>& flags,
+                     std::ostream* depsOutput,
+                     std::ostream* logOutput) {
+  const Graph& graph = ctx.graph;
+  const std::filesystem::path builddir =
+      std::filesystem::path(ctx.ninjaFile).remove_filename() / ctx.builddir;
+
+  // Return whether each of `paths` is an output of a kept build command,
+  // where `paths` are already normalized as ninja writes them that way
+  std::vector<std::optional<std::size_t>> indices;
+  const auto findKept = [&](std::span<const std::string_view> paths) {
+    indices.resize(paths.size());
+    graph.findNormalizedPaths(paths, indices);
+    std::vector<bool> isKept(paths.size());
+    for (std::size_t i = 0; i < paths.size(); ++i) {
+      isKept[i] = indices[i].has_value() &&
+                  (flags[*indices[i]] & (Affected | BuiltIn)) == Affected &&
+                  ctx.nodeToCommand[*indices[i]] !=
+                      std::numeric_limits<std::size_t>::max();
+    }
+    return isKept;
+  };
 
-void parseDepFile(const std::filesystem::path& ninjaDeps,
-                  Graph& graph,
-                  detail::BuildContext& ctx) {
-  // Later entries may override earlier entries so don't touch the graph until
-  // we have parsed the whole file
-  std::vector<std::string> paths;
-  std::vector<std::vector<std::int32_t>> deps;
-  for (const std::variant<PathRecordView, DepsRecordView>& record :
-       DepsReader(ninjaDeps)) {
-    switch (record.index()) {
-      case 0: {
-        const auto& view = std::get<PathRecordView>(record);
-        if (static_cast<std::size_t>(view.index) >= paths.size()) {
-          paths.resize(view.index + 1);
+  const std::filesystem::path ninjaDeps = builddir / ".ninja_deps";
+  if (depsOutput) {
+    const Timer t = CPUProfiler::start(".ninja_deps write");
+    DepsWriter writer{*depsOutput};
+    if (std::filesystem::exists(ninjaDeps)) {
+      // Only the latest record of each output is used by ninja
+      std::vector<std::string_view> paths;
+      std::vector<std::optional<DepsRecordView>> latest;
+      DepsReader reader{ninjaDeps};
+      for (const std::variant<PathRecordView, DepsRecordView>& record :
+           reader) {
+        if (const PathRecordView* path = std::get_if<PathRecordView>(&record)) {
+          if (path->index < 0) {
+            throw std::runtime_error("Invalid path index in " +
+                                     ninjaDeps.string());
+          }
+          const std::size_t id = static_cast<std::size_t>(path->index);
+          paths.resize(std::max(paths.size(), id + 1));
+          paths[id] = path->path;
+        } else {
+          const DepsRecordView& deps = std::get<DepsRecordView>(record);
+          if (deps.outIndex < 0) {
+            throw std::runtime_error("Invalid output index in " +
+                                     ninjaDeps.string());
+          }
+          const std::size_t id = static_cast<std::size_t>(deps.outIndex);
+          latest.resize(std::max(latest.size(), id + 1));
+          latest[id] = deps;
         }
-        // Entries in `.ninja_deps` are already normalized when written
-        paths[view.index] = view.path;
-        break;
       }
-      case 1: {
-        const auto& view = std::get<DepsRecordView>(record);
-        if (static_cast<std::size_t>(view.outIndex) >= deps.size()) {
-          deps.resize(view.outIndex + 1);
+
+      std::vector<std::string_view> outs;
+      for (std::size_t id = 0; id < latest.size(); ++id) {
+        if (latest[id].has_value()) {
+          outs.push_back(paths.at(id));
         }
-        deps[view.outIndex].assign(view.deps.begin(), view.deps.end());
-        break;
+      }
+      const std::vector<bool> isKept = findKept(outs);
+
+      // Path records are renumbered in the order that they are first needed
+      const std::int32_t unwritten = -1;
+      std::vector<std::int32_t> newIds(paths.size(), unwritten);
+      const auto recordPath = [&](std::int32_t id) {
+        if (id < 0 || static_cast<std::size_t>(id) >= paths.size()) {
+          throw std::runtime_error("Unknown path index in " +
+                                   ninjaDeps.string());
+        }
+        if (newIds[id] == unwritten) {
+          newIds[id] = writer.recordPath(paths[id]);
+        }
+        return newIds[id];
+      };
+      std::vector<std::int32_t> deps;
+      std::size_t keptIndex = 0;
+      for (std::size_t id = 0; id < latest.size(); ++id) {
+        if (!latest[id].has_value() || !isKept[keptIndex++]) {
+          continue;
+        }
+        const std::int32_t out = recordPath(static_cast<std::int32_t>(id));
+        deps.clear();
+        for (const std::int32_t dep : latest[id]->deps) {
+          deps.push_back(recordPath(dep));
+        }
+        writer.recordDependencies(
+            out, ninja_clock::to_file_clock(latest[id]->mtime), deps);
       }
     }
   }
 
-  std::vector<std::size_t> lookup(paths.size());
-  std::transform(paths.cbegin(), paths.cend(), lookup.begin(),
-                 [&](const std::string_view path) {
-                   return ctx.getPathIndexForNormalized(path);
-                 });
-
-  for (std::size_t outIndex = 0; outIndex < deps.size(); ++outIndex) {
-    for (const std::int32_t inIndex : deps[outIndex]) {
-      graph.addEdge(lookup[inIndex], lookup[outIndex]);
+  const std::filesystem::path ninjaLog = builddir / ".ninja_log";
+  if (logOutput && !std::filesystem::exists(ninjaLog)) {
+    // Write a log without any records, as `.ninja_deps` is above, using the
+    // version that ninja would create for our hash type
+    *logOutput << "# ninja log v"
+               << (ctx.hashType == HashType::rapidhash ? '7' : '5') << '\n';
+  } else if (logOutput) {
+    const Timer t = CPUProfiler::start(".ninja_log write");
+
+    // Copy the header and the latest line for each kept output verbatim, so
+    // that every version of the log is written back in the same format
+    const MappedFile log{ninjaLog};
+    std::string_view contents = log.contents();
+    const auto nextLine = [&] {
+      const std::size_t end = contents.find('\n');
+      const std::string_view line = contents.substr(
+          0, end == std::string_view::npos ? contents.size() : end + 1);
+      contents.remove_prefix(line.size());
+      return line;
+    };
+    const std::string_view header = nextLine();
+    logOutput->write(header.data(), header.size());
+
+    // Lines are `start\tend\tmtime\tout\thash`, and we skip any that are
+    // truncated as ninja does
+    std::vector<std::string_view> lines;
+    std::vector<std::string_view> outs;
+    while (!contents.empty()) {
+      const std::string_view line = nextLine();
+      std::size_t start = 0;
+      for (int field = 0; field < 3 && start != std::string_view::npos;
+           ++field) {
+        start = line.find('\t', start);
+        start = start == std::string_view::npos ? start : start + 1;
+      }
+      const std::size_t end = start == std::string_view::npos
+                                  ? start
+                                  : line.find('\t', start);
+      if (end != std::string_view::npos && line.back() == '\n') {
+        lines.push_back(line);
+        outs.push_back(line.substr(start, end - start));
+      }
+    }
+    const std::vector<bool> isKept = findKept(outs);
+    std::vector<std::size_t> latest(graph.size(), lines.size());
+    for (std::size_t i = 0; i < lines.size(); ++i) {
+      if (isKept[i]) {
+        latest[*indices[i]] = i;
+      }
+    }
+    std::sort(latest.begin(), latest.end());
+    for (const std::size_t i : latest) {
+      if (i == lines.size()) {
+        break;
+      }
+      logOutput->write(lines[i].data(), lines[i].size());
     }
   }
 }
 
-template <typename F>
-void parseLogFile(const std::filesystem::path& ninjaLog,
-                  const detail::BuildContext& ctx,
-                  std::vector<bool>& isAffected,
-                  F&& getBuildCommand,
-                  bool explain) {
-  std::ifstream deps(ninjaLog);
-
-  // As there can be duplicate entries and subsequent entries take precedence
-  // first record everything we care about and then update the graph
+// Write the outputs of the build commands kept by `flags` to `list.output`,
+// skipping those whose rule or path does not match its filters
+void writeAffectedList(const detail::BuildContext& ctx,
+                       const std::vector<std::uint8_t>& flags,
+                       const TrimUtil::AffectedList& list) {
+  const Timer t = CPUProfiler::start("affected list write");
   const Graph& graph = ctx.graph;
-  std::vector<bool> seen(graph.size());
-  std::vector<bool> hashMismatch(graph.size());
-  std::vector<std::optional<std::uint64_t>> cachedHashes(graph.size());
-  for (const LogEntry& entry :
-       LogReader{deps, LogEntry::Fields::out | LogEntry::Fields::hash}) {
-    // Entries in `.ninja_log` are already normalized when written
-    const std::optional<std::size_t> index =
-        graph.findNormalizedPath(entry.out);
-    if (!index) {
-      // If we don't have the path then it was since removed from the ninja
-      // build file
+  std::vector<bool> isListedRule(ctx.rules.size(), list.rules.empty());
+  for (std::size_t ruleIndex = 0; ruleIndex < ctx.rules.size(); ++ruleIndex) {
+    isListedRule[ruleIndex] =
+        isListedRule[ruleIndex] ||
+        std::ranges::find(list.rules, ctx.rules[ruleIndex].name) !=
+            list.rules.end();
+  }
+
+  for (std::size_t index = 0; index < graph.size(); ++index) {
+    if (!isKeptCommand(ctx, flags, index) ||
+        !isListedRule[ctx.commands[ctx.nodeToCommand[index]].ruleIndex]) {
       continue;
     }
+    const std::string_view path = graph.path(index);
+    if (list.prefixes.empty() ||
+        std::ranges::any_of(list.prefixes, [&](const std::string& prefix) {
+          return path.starts_with(prefix);
+        })) {
+      list.output->write(path.data(), path.size());
+      list.output->put(list.separator);
+    }
+  }
+}
 
-    seen[*index] = true;
-    std::optional<std::uint64_t>& cachedHash = cachedHashes[*index];
-    if (!cachedHash) {
-      const std::string_view command = getBuildCommand(*index);
-      switch (entry.hashType) {
-        case HashType::murmur:
-          cachedHash.emplace(murmur_hash::hash(command.data(), command.size()));
-          break;
-        case HashType::rapidhash:
-          cachedHash.emplace(rapidhash(command.data(), command.size()));
-          break;
-        default:
-          assert(false);  // TODO: `std::unreachable` in C++23
+// Trim `ctx` for `request` based on the files in `affected`, which are the
+// lines read from `request.affected` (see `markAffectedFiles`), using up to
+// `jobs` threads, printing all diagnostics to `log` and recording why each
+// part was kept in `explanations`.  See `TrimUtil::Request` for how each of
+// its other members changes the trim.
+void trimContext(const detail::BuildContext& ctx,
+                 const TrimUtil::Request& request,
+                 std::span<const std::string> affected,
+                 bool explain,
+                 std::size_t jobs,
+                 std::ostream& log,
+                 ExplainLog& explanations) {
+  const Graph& graph = ctx.graph;
+  const std::vector<std::size_t> targetIndices =
+      findTargets(graph, request.targets);
+  std::vector<std::uint8_t> flags = ctx.nodeFlags;
+  markAffectedFiles(flags, ctx, affected, request.workingDirectory, explain,
+                    log, explanations);
+
+  Timer trimTimer = CPUProfiler::start("trim time");
+
+  // Continue from the previous state if it was for the same graph and all of
+  // its seeds are still affected, since everything it marked is then marked
+  // again.  Explanations need every node to be marked from scratch.
+  TrimState state;
+  std::vector<std::size_t> worklist;
+
+  // Return whether each node has `flag`
+  const auto hasFlag = [&](NodeFlag flag) {
+    std::vector<bool> result(graph.size());
+    for (std::size_t index = 0; index < graph.size(); ++index) {
+      result[index] = flags[index] & flag;
+    }
+    return result;
+  };
+  const auto isSubsetOfSeeds = [&](const std::vector<bool>& seeds) {
+    for (std::size_t index = 0; index < seeds.size(); ++index) {
+      if (seeds[index] && !(flags[index] & Seed)) {
+        return false;
       }
     }
-    hashMismatch[*index] = (entry.hash != *cachedHash);
+    return true;
+  };
+  if (request.stateFile) {
+    state.fingerprint = trimFingerprint(ctx);
+
+    // What is kept depends on the targets, so a state can only be continued
+    // with the same ones
+    if (!targetIndices.empty()) {
+      state.fingerprint = rapidhash_withSeed(
+          targetIndices.data(), targetIndices.size() * sizeof(std::size_t),
+          state.fingerprint);
+    }
   }
-
-  // Mark all build commands that are new or have been changed as required
-  for (std::size_t index = 0; index < seen.size(); ++index) {
-    const bool isBuildCommand = !graph.in(index).empty();
-    if (isAffected[index] || !isBuildCommand) {
-      continue;
+  if (TrimState previous;
+      request.stateFile && !explain && previous.load(*request.stateFile) &&
+      previous.fingerprint == state.fingerprint &&
+      previous.isSeed.size() == graph.size() &&
+      isSubsetOfSeeds(previous.isSeed)) {
+    // Only propagate from the seeds that were not already outdated
+    for (std::size_t index = 0; index < graph.size(); ++index) {
+      if ((flags[index] & Affected) && !previous.isOutdated[index]) {
+        worklist.push_back(index);
+      }
     }
-
-    // buil-in rules don't appear in the build log so skip them
-    if (detail::BuildContext::isBuiltInRule(
-            ctx.commands[ctx.nodeToCommand[index]].ruleIndex)) {
-      continue;
+    CPUProfiler::count("new seeds", worklist.size());
+    for (std::size_t index = 0; index < graph.size(); ++index) {
+      if (previous.isOutdated[index]) {
+        flags[index] |= Affected;
+      }
     }
+    markAffectedOutputs(flags, worklist, ctx, jobs, explain, explanations);
+    state.isOutdated = hasFlag(Affected);
 
-    if (!seen[index]) {
-      isAffected[index] = true;
-      if (explain) {
-        std::cerr << "Including '" << graph.path(index)
-                  << "' as it was not found in '" << ninjaLog << "'"
-                  << std::endl;
+    // Everything previously required is still required
+    for (std::size_t index = 0; index < graph.size(); ++index) {
+      if (previous.isAffected[index]) {
+        flags[index] |= Affected;
       }
-    } else if (hashMismatch[index]) {
-      isAffected[index] = true;
-      if (explain) {
-        std::cerr << "Including '" << graph.path(index)
-                  << "' as the build command hash differs in '" << ninjaLog
-                  << "'" << std::endl;
+      if (previous.needsAllInputs[index]) {
+        flags[index] |= NeedsAllInputs;
+      }
+    }
+  } else {
+    // Mark all outputs that have an affected input as affected
+    for (std::size_t index = 0; index < graph.size(); ++index) {
+      if (flags[index] & Affected) {
+        worklist.push_back(index);
       }
     }
+    markAffectedOutputs(flags, worklist, ctx, jobs, explain, explanations);
+    if (request.stateFile) {
+      state.isOutdated = hasFlag(Affected);
+    }
+  }
+
+  // Drop everything that the targets do not need before any inputs are
+  // required
+  if (!targetIndices.empty()) {
+    markTargets(flags, targetIndices, ctx, jobs, explanations);
+  }
+
+  // Mark all inputs to affected outputs as affected (they technically
+  // aren't affected but they are required to be built in order to
+  // be inputs to affected outputs)
+  markRequiredInputs(flags, ctx, jobs, explain, explanations);
+
+  if (request.stateFile) {
+    state.isSeed = hasFlag(Seed);
+    state.isAffected = hasFlag(Affected);
+    state.needsAllInputs = hasFlag(NeedsAllInputs);
+    state.save(*request.stateFile);
+  }
+
+  writeTrimmed(ctx, flags, *request.output, trimTimer);
+  writePrunedLogs(ctx, flags, request.depsOutput, request.logOutput);
+  if (request.affectedList) {
+    writeAffectedList(ctx, flags, *request.affectedList);
   }
 }
 
-// If `index` has not been seen (using `seen`) then call
-// `markIfChildrenAffected` for all inputs to `index` and then set
-// `isAffected[index]` if any child is affected. Return whether this
-// NOLINTNEXTLINE(misc-no-recursion)
-void markIfChildrenAffected(std::size_t index,
-                            std::vector<bool>& seen,
-                            std::vector<bool>& isAffected,
-                            const detail::BuildContext& ctx,
-                            bool explain) {
-  if (seen[index]) {
-    return;
+// Return the duration in milliseconds of each build command kept by `flags`
+// from `.ninja_log`, and 0 for all others.  Commands with more than one output
+// take the longest of their durations and those without a duration are
+// assumed to take the average of the others, or 1 if there are none.  Set
+// `unknownCount` to the number of kept build commands without a duration.
+std::vector<std::uint64_t> commandDurations(
+    const detail::BuildContext& ctx,
+    const std::vector<std::uint8_t>& flags,
+    std::size_t& unknownCount) {
+  const Graph& graph = ctx.graph;
+  const std::vector<std::uint32_t>& durations = getDurations(ctx);
+  std::vector<std::uint64_t> cost(ctx.commands.size());
+  std::vector<bool> isKnown(ctx.commands.size());
+  std::uint64_t knownTotal = 0;
+  std::size_t knownCount = 0;
+  for (std::size_t index = 0; index < graph.size(); ++index) {
+    if (isKeptCommand(ctx, flags, index) &&
+        durations[index] != UNKNOWN_DURATION) {
+      const std::size_t command = ctx.nodeToCommand[index];
+      cost[command] = std::max<std::uint64_t>(cost[command], durations[index]);
+      isKnown[command] = true;
+      knownTotal += durations[index];
+      ++knownCount;
+    }
+  }
+  const std::uint64_t averageCost =
+      knownCount == 0 ? 1 : std::max<std::uint64_t>(knownTotal / knownCount, 1);
+  unknownCount = 0;
+  for (std::size_t index = 0; index < graph.size(); ++index) {
+    if (isKeptCommand(ctx, flags, index)) {
+      const std::size_t command = ctx.nodeToCommand[index];
+      if (!isKnown[command]) {
+        isKnown[command] = true;
+        cost[command] = averageCost;
+        ++unknownCount;
+      }
+    }
   }
-  seen[index] = true;
+  return cost;
+}
 
-  // Always process all our children so that `isAffected` is updated for them
+// Split the build commands kept by `flags` between `shardCount` shards and
+// return the targets of each shard, which are the kept outputs that are not
+// needed by any other kept build command.  Each target, from the one that
+// needs the longest total duration of build commands to the shortest, goes to
+// the shard that ends up with the shortest total duration after adding every
+// build command it needs that the shard does not already have.
+std::vector<std::vector<std::size_t>> partitionShards(
+    const detail::BuildContext& ctx,
+    const std::vector<std::uint8_t>& flags,
+    std::size_t shardCount) {
   const Graph& graph = ctx.graph;
-  const auto& inIndices = graph.in(index);
-  for (const std::size_t in : inIndices) {
-    markIfChildrenAffected(in, seen, isAffected, ctx, explain);
+  const std::size_t none = std::numeric_limits<std::size_t>::max();
+  const auto isKept = [&](std::size_t index) {
+    return isKeptCommand(ctx, flags, index);
+  };
+  std::size_t unknownCount = 0;
+  const std::vector<std::uint64_t> cost =
+      commandDurations(ctx, flags, unknownCount);
+
+  std::vector<std::size_t> targets;
+  for (std::size_t index = 0; index < graph.size(); ++index) {
+    const std::span<const std::uint32_t> out = graph.out(index);
+    if (isKept(index) &&
+        std::none_of(out.begin(), out.end(), isKept)) {
+      targets.push_back(index);
+    }
   }
 
-  if (isAffected[index]) {
-    return;
+  // Find the kept build commands needed by each target once, storing those
+  // of `targets[i]` in `commands[commandStart[i]]` up to
+  // `commands[commandStart[i + 1]]`
+  std::vector<std::size_t> commands;
+  std::vector<std::size_t> commandStart{0};
+  std::vector<std::size_t> visited(graph.size(), none);
+  std::vector<std::size_t> stack;
+  for (const std::size_t target : targets) {
+    stack.assign(1, target);
+    visited[target] = target;
+    while (!stack.empty()) {
+      const std::size_t index = stack.back();
+      stack.pop_back();
+      if (isKept(index)) {
+        commands.push_back(ctx.nodeToCommand[index]);
+      }
+      const auto visit = [&](std::size_t in) {
+        if ((flags[in] & Affected) && visited[in] != target) {
+          visited[in] = target;
+          stack.push_back(in);
+        }
+      };
+      const std::span<const std::uint32_t> in = graph.in(index);
+      std::for_each(in.begin(), in.end(), visit);
+      const std::span<const std::uint32_t> orderOnlyIn =
+          graph.orderOnlyIn(index);
+      std::for_each(orderOnlyIn.begin(), orderOnlyIn.end(), visit);
+    }
+    const auto first = commands.begin() + commandStart.back();
+    std::sort(first, commands.end());
+    commands.erase(std::unique(first, commands.end()), commands.end());
+    commandStart.push_back(commands.size());
+  }
+  const auto targetCommands = [&](std::size_t i) {
+    return std::span{commands}.subspan(
+        commandStart[i], commandStart[i + 1] - commandStart[i]);
+  };
+
+  std::vector<std::pair<std::uint64_t, std::size_t>> byCost;
+  for (std::size_t i = 0; i < targets.size(); ++i) {
+    std::uint64_t total = 0;
+    for (const std::size_t command : targetCommands(i)) {
+      total += cost[command];
+    }
+    byCost.emplace_back(total, i);
   }
 
-  // Otherwise, find out if at least one of our children is affected and if
-  // so, mark ourselves as affected
-  const auto it =
-      std::find_if(inIndices.begin(), inIndices.end(),
-                   [&](const std::size_t index) { return isAffected[index]; });
-  if (it != inIndices.end()) {
-    if (explain) {
-      // Only mention user-defined rules since built-in rules are always kept
-      if (!detail::BuildContext::isBuiltInRule(
-              ctx.commands[ctx.nodeToCommand[index]].ruleIndex)) {
-        std::cerr << "Including '" << graph.path(index)
-                  << "' as it has the affected input '" << graph.path(*it)
-                  << "'" << std::endl;
+  // Break ties by position in `targets`, which is the order of their indices
+  std::sort(byCost.begin(), byCost.end(), [](const auto& l, const auto& r) {
+    return l.first != r.first ? l.first > r.first : l.second < r.second;
+  });
+
+  std::vector<std::vector<std::size_t>> shards(shardCount);
+  std::vector<std::vector<bool>> hasCommand(
+      shardCount, std::vector<bool>(ctx.commands.size()));
+  std::vector<std::uint64_t> load(shardCount);
+  for (const auto& [total, i] : byCost) {
+    const std::span<const std::size_t> needed = targetCommands(i);
+    std::size_t best = 0;
+    std::uint64_t bestLoad = std::numeric_limits<std::uint64_t>::max();
+    for (std::size_t shard = 0; shard < shardCount; ++shard) {
+      std::uint64_t shardLoad = load[shard];
+      for (const std::size_t command : needed) {
+        if (!hasCommand[shard][command]) {
+          shardLoad += cost[command];
+        }
       }
+      if (shardLoad < bestLoad) {
+        best = shard;
+        bestLoad = shardLoad;
+      }
+    }
+    for (const std::size_t command : needed) {
+      hasCommand[best][command] = true;
     }
-    isAffected[index] = true;
+    load[best] = bestLoad;
+    shards[best].push_back(targets[i]);
   }
+  return shards;
 }
 
-// If `index` has not been seen (using `seen`) then call
-// `ifAffectedMarkAllChildren` for all outputs to `index` and then set
-// `isAffected[index]` if any child is affected.
-// NOLINTNEXTLINE(misc-no-recursion)
-void ifAffectedMarkAllChildren(std::size_t index,
-                               std::vector<bool>& seen,
-                               std::vector<bool>& isAffected,
-                               std::vector<bool>& needsAllInputs,
-                               const detail::BuildContext& ctx,
-                               bool explain) {
-  if (seen[index]) {
-    return;
+// Trim `ctx` in the same way as `trimContext` without a state, but split the
+// kept build commands between each of `outputs` (see `partitionShards`),
+// where each output keeps everything needed by the targets of its shard and
+// writes all other build commands as `phony`.  Only the affected outputs
+// are recorded in `explanations`, as the inputs they need differ by shard.
+void trimContextShards(const detail::BuildContext& ctx,
+                       std::span<std::ostream* const> outputs,
+                       std::span<const std::string> affected,
+                       std::span<const std::string> targets,
+                       bool explain,
+                       std::size_t jobs,
+                       std::ostream& log,
+                       ExplainLog& explanations) {
+  const Graph& graph = ctx.graph;
+  const std::vector<std::size_t> targetIndices = findTargets(graph, targets);
+  std::vector<std::uint8_t> flags = ctx.nodeFlags;
+  markAffectedFiles(flags, ctx, affected, nullptr, explain, log,
+                    explanations);
+
+  Timer trimTimer = CPUProfiler::start("trim time");
+  std::vector<std::size_t> worklist;
+  for (std::size_t index = 0; index < graph.size(); ++index) {
+    if (flags[index] & Affected) {
+      worklist.push_back(index);
+    }
   }
-  seen[index] = true;
+  markAffectedOutputs(flags, worklist, ctx, jobs, explain, explanations);
 
-  for (const std::size_t out : ctx.graph.out(index)) {
-    ifAffectedMarkAllChildren(out, seen, isAffected, needsAllInputs, ctx,
-                              explain);
+  // Work out what is kept without sharding in order to split it up, then
+  // mark each shard from the affected outputs in the same way as `--targets`
+  const std::vector<std::uint8_t> outdated = flags;
+  if (!targetIndices.empty()) {
+    markTargets(flags, targetIndices, ctx, jobs, explanations);
   }
+  ExplainLog ignored;
+  markRequiredInputs(flags, ctx, jobs, false, ignored);
+  const std::vector<std::vector<std::size_t>> shards =
+      partitionShards(ctx, flags, outputs.size());
+  trimTimer.stop();
 
-  // Nothing to do if we have no children
-  if (ctx.graph.in(index).empty()) {
-    return;
+  for (std::size_t shard = 0; shard < outputs.size(); ++shard) {
+    Timer shardTimer = CPUProfiler::start("trim time");
+    flags = outdated;
+    markTargets(flags, shards[shard], ctx, jobs, ignored);
+    markRequiredInputs(flags, ctx, jobs, false, ignored);
+    writeTrimmed(ctx, flags, *outputs[shard], shardTimer);
   }
+}
 
-  if (!detail::BuildContext::isBuiltInRule(
-          ctx.commands[ctx.nodeToCommand[index]].ruleIndex)) {
-    if (isAffected[index]) {
-      needsAllInputs[index] = true;
-      return;
+// Mark `ctx` in the same way as `trimContext` without a state and estimate
+// how long the kept build commands take to build, see `TrimUtil::estimate`
+TrimUtil::Estimate estimateContext(const detail::BuildContext& ctx,
+                                   std::span<const std::string> affected,
+                                   std::span<const std::string> targets,
+                                   bool explain,
+                                   std::size_t top,
+                                   std::size_t jobs,
+                                   std::ostream& log,
+                                   ExplainLog& explanations) {
+  const Graph& graph = ctx.graph;
+  const std::vector<std::size_t> targetIndices = findTargets(graph, targets);
+  std::vector<std::uint8_t> flags = ctx.nodeFlags;
+  markAffectedFiles(flags, ctx, affected, nullptr, explain, log,
+                    explanations);
+
+  Timer trimTimer = CPUProfiler::start("trim time");
+  std::vector<std::size_t> worklist;
+  for (std::size_t index = 0; index < graph.size(); ++index) {
+    if (flags[index] & Affected) {
+      worklist.push_back(index);
+    }
+  }
+  markAffectedOutputs(flags, worklist, ctx, jobs, explain, explanations);
+  if (!targetIndices.empty()) {
+    markTargets(flags, targetIndices, ctx, jobs, explanations);
+  }
+  markRequiredInputs(flags, ctx, jobs, explain, explanations);
+  trimTimer.stop();
+
+  const Timer estimateTimer = CPUProfiler::start("estimate time");
+  TrimUtil::Estimate estimate{};
+  const std::vector<std::uint64_t> cost =
+      commandDurations(ctx, flags, estimate.unknownCount);
+
+  // Find when each kept node finishes building in one depth-first pass over
+  // its inputs, as order-only inputs have no edge back to their outputs
+  enum : std::uint8_t { Unvisited, Visiting, Visited };
+  std::vector<std::uint8_t> state(graph.size(), Unvisited);
+  std::vector<std::uint64_t> finish(graph.size());
+  std::vector<std::pair<std::size_t, std::size_t>> stack;
+  for (std::size_t root = 0; root < graph.size(); ++root) {
+    if (!(flags[root] & Affected) || state[root] != Unvisited) {
+      continue;
+    }
+    state[root] = Visiting;
+    stack.emplace_back(root, 0);
+    while (!stack.empty()) {
+      const auto [index, next] = stack.back();
+      const std::span<const std::uint32_t> in = graph.in(index);
+      const std::span<const std::uint32_t> orderOnlyIn =
+          graph.orderOnlyIn(index);
+      if (next < in.size() + orderOnlyIn.size()) {
+        ++stack.back().second;
+        const std::size_t input =
+            next < in.size() ? in[next] : orderOnlyIn[next - in.size()];
+        if ((flags[input] & Affected) && state[input] == Unvisited) {
+          state[input] = Visiting;
+          stack.emplace_back(input, 0);
+        }
+        continue;
+      }
+
+      std::uint64_t start = 0;
+      for (const std::uint32_t input : in) {
+        start = std::max(start, finish[input]);
+      }
+      for (const std::uint32_t input : orderOnlyIn) {
+        start = std::max(start, finish[input]);
+      }
+      finish[index] =
+          start + (isKeptCommand(ctx, flags, index)
+                       ? cost[ctx.nodeToCommand[index]]
+                       : 0);
+      estimate.criticalPath = std::max(
+          estimate.criticalPath, std::chrono::milliseconds(finish[index]));
+      state[index] = Visited;
+      stack.pop_back();
     }
   }
 
-  // If any build commands requiring us are marked as needing all inputs then
-  // mark ourselves as affected and that we also need all our inputs.
-  const auto& outIndices = ctx.graph.out(index);
-  const auto it = std::find_if(
-      outIndices.begin(), outIndices.end(),
-      [&](const std::size_t index) { return needsAllInputs[index]; });
-  if (it != outIndices.end()) {
-    if (!isAffected[index]) {
-      if (explain) {
-        std::cerr << "Including '" << ctx.graph.path(index)
-                  << "' as it is a required input for the affected output '"
-                  << ctx.graph.path(*it) << "'" << std::endl;
+  // Name each build command after its first output
+  std::vector<bool> isCounted(ctx.commands.size());
+  std::vector<std::pair<std::uint64_t, std::size_t>> byCost;
+  for (std::size_t index = 0; index < graph.size(); ++index) {
+    if (isKeptCommand(ctx, flags, index)) {
+      const std::size_t command = ctx.nodeToCommand[index];
+      if (!isCounted[command]) {
+        isCounted[command] = true;
+        byCost.emplace_back(cost[command], index);
+        estimate.totalDuration += std::chrono::milliseconds(cost[command]);
       }
-      isAffected[index] = true;
     }
-    needsAllInputs[index] = true;
   }
+  estimate.commandCount = byCost.size();
+  const std::size_t slowestCount = std::min(top, byCost.size());
+  std::partial_sort(byCost.begin(), byCost.begin() + slowestCount,
+                    byCost.end(), [](const auto& l, const auto& r) {
+                      return l.first != r.first ? l.first > r.first
+                                                : l.second < r.second;
+                    });
+  for (std::size_t i = 0; i < slowestCount; ++i) {
+    estimate.slowest.emplace_back(graph.path(byCost[i].second),
+                                  std::chrono::milliseconds(byCost[i].first));
+  }
+  return estimate;
 }
+
 }  // namespace
 
-TrimUtil::TrimUtil() : m_imp{nullptr} {}
+TrimUtil::TrimUtil()
+    : m_imp{nullptr},
+      m_explainOutput{&std::cerr},
+      m_explainFormat{ExplainLog::Format::text} {}
 
 TrimUtil::~TrimUtil() = default;
 
-void TrimUtil::trim(std::ostream& output,
-                    const std::filesystem::path& ninjaFile,
-                    const std::string& ninjaFileContents,
-                    std::istream& affected,
-                    bool explain) {
-  // Keep our state inside `m_imp` so that we defer cleanup until the destructor
-  // of `TrimUtil`. This allows the calling code to skip all destructors when
-  // calling `std::_Exit`.
-  m_imp = std::make_unique<detail::BuildContext>();
-  detail::BuildContext& ctx = *m_imp;
-
-  // Parse the build file, this needs to be the first thing so we choose the
-  // canonical paths in the same way that ninja does
-  {
-    const Timer t = CPUProfiler::start(".ninja parse");
-    ctx.parse(ninjaFile, ninjaFileContents);
-  }
+void TrimUtil::trim(const std::filesystem::path& ninjaFile,
+                    std::string_view ninjaFileContents,
+                    const Request& request,
+                    const Options& options) {
+  load(ninjaFile, ninjaFileContents, options);
+  trim(std::span{&request, 1}, options.explain, options.jobs);
+}
 
-  Graph& graph = ctx.graph;
+void TrimUtil::load(const std::filesystem::path& ninjaFile,
+                    std::string_view ninjaFileContents,
+                    const Options& options) {
+#ifdef _WIN32
+  // On Windows ninja hashes `$in` and `$out` with whichever spelling of each
+  // path it saw first, which is not part of the fingerprint of the command
+  const bool reuseHashes = false;
+#else
+  const bool reuseHashes = options.reuseHashes;
+#endif
 
   const std::filesystem::path ninjaFileDir = [&] {
     std::filesystem::path dir(ninjaFile);
@@ -896,201 +3806,321 @@ void TrimUtil::trim(std::ostream& output,
     return dir;
   }();
 
-  const std::filesystem::path builddir = [&] {
-    std::string path;
-    ctx.fileScope.appendValue(path, "builddir");
-    return ninjaFileDir / path;
-  }();
+  // Return the hash type of the `.ninja_log` for `ctx`, which differs from
+  // the one used for its build commands if we chose it from an earlier value
+  // of `builddir` or the log was recreated by another version of ninja
+  const auto expectedHashType = [&](const detail::BuildContext& ctx) {
+    return logHashType(ninjaFileDir / ctx.builddir / ".ninja_log",
+                       *ctx.hashType);
+  };
+
+  // Keep our state inside `m_imp` so that we defer cleanup until the destructor
+  // of `TrimUtil`. This allows the calling code to skip all destructors when
+  // calling `std::_Exit`.
+  m_imp.reset();
+
+  // Read `.ninja_deps` and `.ninja_log` on other threads while we parse, using
+  // the `builddir` from a quick scan of the ninja file.  Anything that these
+  // threads fail to read is read again once we know the real `builddir`,
+  // which also reports any errors.
+  std::optional<StagedDeps> stagedDeps;
+  std::optional<StagedLog> stagedLog;
+  std::vector<std::jthread> readers;
+  if (options.jobs > 1 && !options.lowMemory) {
+    std::optional<std::filesystem::path> scanned;
+    try {
+      const Timer t = CPUProfiler::start(".ninja builddir scan");
+      BuildDirUtil util;
+      scanned = util.builddir(ninjaFile, ninjaFileContents);
+    } catch (const std::exception&) {
+      // The full parse will report the same error
+    }
+    if (scanned.has_value()) {
+      readers.emplace_back([&, ninjaDeps = *scanned / ".ninja_deps"] {
+        try {
+          stageDepFile(ninjaDeps, stagedDeps.emplace());
+        } catch (const std::exception&) {
+          stagedDeps.reset();
+        }
+      });
+      readers.emplace_back([&, ninjaLog = *scanned / ".ninja_log"] {
+        try {
+          stageLogFile(ninjaLog, stagedLog.emplace(), true);
+        } catch (const std::exception&) {
+          stagedLog.reset();
+        }
+      });
+    }
+  }
+
+  if (options.cacheFile.has_value() && !options.lowMemory) {
+    const Timer t = CPUProfiler::start(".ninja cache read");
+    m_imp = loadCache(*options.cacheFile, ninjaFile, ninjaFileContents);
+    if (m_imp && expectedHashType(*m_imp) != m_imp->hashType) {
+      m_imp.reset();
+    }
+  }
+
+  if (!m_imp) {
+    // Parse the build file, this needs to be the first thing so we choose the
+    // canonical paths in the same way that ninja does
+    {
+      const Timer t = CPUProfiler::start(".ninja parse");
+      m_imp = parseManifest(ninjaFile, ninjaFileContents, options.jobs,
+                            std::nullopt, reuseHashes, options.lowMemory);
+      if (const HashType hashType = expectedHashType(*m_imp);
+          hashType != m_imp->hashType) {
+        m_imp = parseManifest(ninjaFile, ninjaFileContents, options.jobs,
+                              hashType, reuseHashes, options.lowMemory);
+      }
+    }
+
+    // Remember our hashes next to `.ninja_log` for the next parse, which we
+    // skip when loading from the cache as the sidecar is at least as new
+    if (const std::filesystem::path ninjaLog =
+            ninjaFileDir / m_imp->builddir / ".ninja_log";
+        reuseHashes && std::filesystem::exists(ninjaLog)) {
+      const Timer t = CPUProfiler::start(".ninja_log sidecar write");
+      saveCommandHashes(ninjaLog, *m_imp);
+    }
+
+    // Save the results of parsing before we start modifying them
+    if (options.cacheFile.has_value() && !options.lowMemory) {
+      const Timer t = CPUProfiler::start(".ninja cache write");
+      CacheWriter writer;
+      writeCacheKey(writer, ninjaFile, ninjaFileContents, m_imp->fileStorage);
+      m_imp->save(writer,
+                  allContents(ninjaFileContents, m_imp->fileStorage));
+      writer.save(*options.cacheFile);
+    }
+  }
+
+  detail::BuildContext& ctx = *m_imp;
+  Graph& graph = ctx.graph;
+  ctx.ninjaFile = ninjaFile;
+  ctx.ninjaFileContents = ninjaFileContents;
+  ctx.jobs = options.jobs;
+  CPUProfiler::count("edges", ctx.commands.size());
+
+  const std::filesystem::path builddir = ninjaFileDir / ctx.builddir;
+  readers.clear();
 
   // Add all dynamic dependencies from `.ninja_deps` to the graph
   if (const std::filesystem::path ninjaDeps = builddir / ".ninja_deps";
-      std::filesystem::exists(ninjaDeps)) {
+      !stagedDeps.has_value() || stagedDeps->file != ninjaDeps) {
+    stageDepFile(ninjaDeps, stagedDeps.emplace());
+  }
+  if (stagedDeps->reader.has_value()) {
     const Timer t = CPUProfiler::start(".ninja_deps parse");
-    parseDepFile(ninjaDeps, graph, ctx);
+    parseDepFile(*stagedDeps, graph, ctx);
   }
+  stagedDeps.reset();
 
-  std::vector<bool> isAffected(graph.size(), false);
+  // All edges are now known so pack them for faster traversal
+  graph.finalize();
+  CPUProfiler::count("paths", graph.size());
+
+  // Remember which nodes are built by built-in rules so that trimming never
+  // needs to look up their build command
+  std::vector<std::uint8_t>& flags = ctx.nodeFlags;
+  flags.assign(graph.size(), 0);
+  for (std::size_t index = 0; index < graph.size(); ++index) {
+    const std::size_t commandIndex = ctx.nodeToCommand[index];
+    if (!graph.in(index).empty()) {
+      flags[index] |= BuildOutput;
+    }
+    if (commandIndex != std::numeric_limits<std::size_t>::max() &&
+        detail::BuildContext::isBuiltInRule(
+            ctx.commands[commandIndex].ruleIndex)) {
+      flags[index] |= BuiltIn;
+    }
+  }
+  ExplainLog explanations;
 
   // Look through all log entries and mark as required those build commands that
   // are either absent in the log (representing new commands that have never
   // been run) or those whose hash has changed.
-  if (const std::filesystem::path ninjaLog = builddir / ".ninja_log";
-      !std::filesystem::exists(ninjaLog)) {
+  const std::filesystem::path ninjaLog = builddir / ".ninja_log";
+  if (!stagedLog.has_value() || stagedLog->file != ninjaLog) {
+    stageLogFile(ninjaLog, stagedLog.emplace(), false);
+  }
+  if (!stagedLog->reader.has_value()) {
     // If we don't have a `.ninja_log` file then either the user didn't have
     // it, which is an error, or our previous run did not include any build
     // commands.
-    if (explain) {
-      std::cerr << "Unable to find '" << ninjaLog
-                << "', so including everything" << std::endl;
+    if (options.explain) {
+      explanations.add(ExplainLog::Reason::missingLog, ExplainLog::none,
+                       explanations.addText(ninjaLog.string()));
+    }
+    for (std::uint8_t& flag : flags) {
+      flag |= Affected;
     }
-    isAffected.assign(isAffected.size(), true);
   } else {
     const Timer t = CPUProfiler::start(".ninja_log parse");
-    parseLogFile(
-        ninjaLog, ctx, isAffected,
-        [&](const std::size_t index) -> std::string_view {
-          return ctx.commands[ctx.nodeToCommand[index]].hashTarget;
-        },
-        explain);
+    parseLogFile(*stagedLog, ctx, flags, options.explain, explanations);
   }
+  stagedLog.reset();
+  explanations.write(*m_explainOutput, graph, m_explainFormat);
+}
 
-  // Mark all files in `affected` as required
-  std::vector<std::filesystem::path> attempted;
-  for (std::string line; std::getline(affected, line);) {
-    if (line.empty()) {
-      continue;
-    }
+void TrimUtil::trim(std::ostream& output,
+                    std::span<const std::string_view> affected) const {
+  const std::vector<std::string> lines(affected.begin(), affected.end());
+  std::ostringstream log;
+  ExplainLog explanations;
+  const Request request{.output = &output};
+  trimContext(*m_imp, request, lines, false, m_imp->jobs, log, explanations);
+  std::cerr << std::move(log).str();
+}
 
-    attempted.clear();
+TrimUtil::Estimate TrimUtil::estimate(std::istream& affected,
+                                      std::span<const std::string> targets,
+                                      bool explain,
+                                      std::size_t top) const {
+  std::ostringstream log;
+  ExplainLog explanations;
+  Estimate result = estimateContext(*m_imp, readLines(affected), targets,
+                                    explain, top, m_imp->jobs, log,
+                                    explanations);
+  std::cerr << std::move(log).str();
+  explanations.write(*m_explainOutput, m_imp->graph, m_explainFormat);
+  return result;
+}
 
-    // First try the raw input
-    {
-      const std::optional<std::size_t> index = graph.findPath(line);
-      if (index.has_value()) {
-        if (explain && !isAffected[*index]) {
-          std::cerr << "Including '" << line
-                    << "' as it was marked as affected by the user"
-                    << std::endl;
-        }
-        isAffected[*index] = true;
-        continue;
-      }
-    }
+void TrimUtil::trimShards(std::span<std::ostream* const> outputs,
+                          std::istream& affected,
+                          std::span<const std::string> targets,
+                          bool explain) const {
+  std::ostringstream log;
+  ExplainLog explanations;
+  trimContextShards(*m_imp, outputs, readLines(affected), targets, explain,
+                    m_imp->jobs, log, explanations);
+  std::cerr << std::move(log).str();
+  explanations.write(*m_explainOutput, m_imp->graph, m_explainFormat);
+}
 
-    // If that does not indicate a path, try the absolute path
-    std::filesystem::path p(line);
-    if (!p.is_absolute()) {
-      std::error_code error;
-      const std::filesystem::path& absolute =
-          attempted.emplace_back(std::filesystem::absolute(p, error));
-      if (!error) {
-        std::string absoluteStr = absolute.string();
-        const std::optional<std::size_t> index = graph.findPath(absoluteStr);
-        if (index.has_value()) {
-          if (explain && !isAffected[*index]) {
-            std::cerr << "Including '" << line
-                      << "' as it was marked as affected by the user"
-                      << std::endl;
-          }
-          isAffected[*index] = true;
-          continue;
-        }
-      }
+std::vector<std::string_view> TrimUtil::affectedOutputs(
+    std::span<const std::string_view> affected) const {
+  const detail::BuildContext& ctx = *m_imp;
+  const Graph& graph = ctx.graph;
+  std::vector<std::uint8_t> flags = ctx.nodeFlags;
+  const std::vector<std::string> lines(affected.begin(), affected.end());
+  std::ostringstream log;
+  ExplainLog explanations;
+  markAffectedFiles(flags, ctx, lines, nullptr, false, log, explanations);
+  std::cerr << std::move(log).str();
+
+  // Mark everything that depends on an affected file, which stops short of
+  // marking the inputs that are only needed to build the affected outputs
+  std::vector<std::size_t> worklist;
+  for (std::size_t index = 0; index < graph.size(); ++index) {
+    if (flags[index] & Affected) {
+      worklist.push_back(index);
     }
+  }
+  markAffectedOutputs(flags, worklist, ctx, ctx.jobs, false, explanations);
 
-    // If neither indicates a path, then try the path relative to the ninja
-    // file
-    if (!p.is_relative()) {
-      std::error_code error;
-      const std::filesystem::path& relative =
-          attempted.emplace_back(std::filesystem::relative(p, error));
-      if (!error) {
-        std::string relativeStr = relative.string();
-        const std::optional<std::size_t> index = graph.findPath(relativeStr);
-        if (index.has_value()) {
-          if (explain && !isAffected[*index]) {
-            std::cerr << "Including '" << line
-                      << "' as it was marked as affected by the user"
-                      << std::endl;
-          }
-          isAffected[*index] = true;
-          continue;
-        }
-      }
+  std::vector<std::string_view> outputs;
+  for (std::size_t index = 0; index < graph.size(); ++index) {
+    if ((flags[index] & Affected) &&
+        ctx.nodeToCommand[index] != std::numeric_limits<std::size_t>::max() &&
+        !graph.isDefault(index)) {
+      outputs.push_back(graph.path(index));
     }
+  }
+  return outputs;
+}
 
-    std::cerr << "'" << line << "' not found in input file";
-    if (!attempted.empty()) {
-      std::cerr << " (also tried ";
-      const char* separator = "";
-      for (const std::filesystem::path& path : attempted) {
-        std::cerr << separator << "'" << path.string() << "'";
-        separator = ", ";
+std::vector<std::string_view> TrimUtil::reverseDependencies(
+    std::string_view path) const {
+  const Graph& graph = m_imp->graph;
+  std::string normalized{path};
+  std::vector<std::string_view> dependents;
+  if (const std::optional<std::size_t> index = graph.findPath(normalized)) {
+    for (const std::size_t out : graph.out(*index)) {
+      if (!graph.isDefault(out)) {
+        dependents.push_back(graph.path(out));
       }
-      std::cerr << ')';
     }
-    std::cerr << std::endl;
   }
+  return dependents;
+}
 
-  std::vector<bool> seen(graph.size());
+void TrimUtil::explainTo(std::ostream& output, ExplainLog::Format format) {
+  m_explainOutput = &output;
+  m_explainFormat = format;
+}
 
-  // Mark all outputs that have an affected input as affected
-  Timer trimTimer = CPUProfiler::start("trim time");
-  for (std::size_t index = 0; index < graph.size(); ++index) {
-    markIfChildrenAffected(index, seen, isAffected, ctx, explain);
+std::vector<std::filesystem::path> TrimUtil::inputFiles() const {
+  const detail::BuildContext& ctx = *m_imp;
+  std::vector<std::filesystem::path> files{ctx.ninjaFile};
+  for (const LoadedFile& file : ctx.fileStorage) {
+    files.push_back(file.path);
   }
+  const std::filesystem::path builddir =
+      std::filesystem::path(ctx.ninjaFile).remove_filename() / ctx.builddir;
+  files.push_back(builddir / ".ninja_deps");
+  files.push_back(builddir / ".ninja_log");
+  return files;
+}
 
-  // Mark all inputs to affected outputs as affected (they technically
-  // aren't affected but they are required to be built in order to
-  // be inputs to affected outputs)
-  seen.assign(seen.size(), false);
-  std::vector<bool> needsAllInputs(graph.size(), false);
-  for (std::size_t index = 0; index < graph.size(); ++index) {
-    ifAffectedMarkAllChildren(index, seen, isAffected, needsAllInputs, ctx,
-                              explain);
-  }
+void TrimUtil::trim(
+    std::ostream& output,
+    std::istream& affected,
+    std::span<const std::string> targets,
+    bool explain,
+    const std::optional<std::filesystem::path>& stateFile) const {
+  // Go through the batched version, which buffers diagnostics and
+  // explanations instead of writing each one to the unbuffered `std::cerr`
+  const Request request{
+      .affected = &affected,
+      .output = &output,
+      .stateFile = stateFile.has_value() ? &*stateFile : nullptr,
+      .targets = targets,
+  };
+  trim(std::span{&request, 1}, explain, m_imp->jobs);
+}
 
-  // Mark all affected `BuildCommands` as needing to print them out
-  for (std::size_t index = 0; index < graph.size(); ++index) {
-    if (isAffected[index]) {
-      const std::size_t commandIndex = ctx.nodeToCommand[index];
-      if (commandIndex != std::numeric_limits<std::size_t>::max()) {
-        ctx.commands[commandIndex].resolution = BuildCommand::Print;
+void TrimUtil::trim(std::span<const Request> requests,
+                    bool explain,
+                    std::size_t jobs) const {
+  // Collect diagnostics separately so that they are printed in the same order
+  // as `requests` regardless of which thread trimmed them
+  std::vector<std::ostringstream> logs(requests.size());
+  std::vector<ExplainLog> explanations(requests.size());
+  std::vector<std::exception_ptr> errors(requests.size());
+  {
+    const std::size_t workerCount = std::min(jobs, requests.size());
+
+    // Share out any threads that are not trimming a request between them
+    const std::size_t jobsPerRequest =
+        std::max<std::size_t>(jobs / std::max<std::size_t>(workerCount, 1), 1);
+    std::atomic<std::size_t> nextRequest = 0;
+    const auto work = [&] {
+      for (std::size_t i = nextRequest++; i < requests.size();
+           i = nextRequest++) {
+        try {
+          trimContext(*m_imp, requests[i], readLines(*requests[i].affected),
+                      explain, jobsPerRequest, logs[i], explanations[i]);
+        } catch (const std::exception&) {
+          errors[i] = std::current_exception();
+        }
       }
+    };
+    std::vector<std::jthread> workers;
+    for (std::size_t i = 1; i < workerCount; ++i) {
+      workers.emplace_back(work);
     }
+    work();
   }
 
-  // Go through all build commands, keep a note of rules that are needed and
-  // `phony` out the build edges that weren't affected.
-  std::forward_list<std::string> phonyStorage;
-  std::vector<bool> ruleReferenced(ctx.rules.size());
-  for (BuildCommand& command : ctx.commands) {
-    if (command.resolution == BuildCommand::Print) {
-      ruleReferenced[command.ruleIndex] = true;
-    } else {
-      assert(command.resolution == BuildCommand::Phony);
-      const std::initializer_list<std::string_view> parts = {
-          command.outStr,
-          command.validationStr.empty() ? ": phony" : ": phony ",
-          command.validationStr,
-          "\n",
-      };
-      std::string& phony = phonyStorage.emplace_front();
-      phony.resize(
-          std::accumulate(parts.begin(), parts.end(), phony.size(),
-                          [](std::size_t size, const std::string_view part) {
-                            return size + part.size();
-                          }));
-      [[maybe_unused]] const auto it =
-          std::accumulate(parts.begin(), parts.end(), phony.begin(),
-                          [](auto outIt, const std::string_view part) {
-                            return std::copy(part.begin(), part.end(), outIt);
-                          });
-      assert(it == phony.end());
-
-      // Clear all parts and replace them with 1 part that is the phony string
-      assert(!command.partsIndices.empty());
-      ctx.parts[command.partsIndices.front()] = std::string_view{phony};
-      std::for_each(std::next(command.partsIndices.begin()),
-                    command.partsIndices.end(),
-                    [&](std::size_t index) { ctx.parts[index] = ""; });
-      // There is no need to clear `partsIndices` as it's not used again
-    }
-  }
-
-  // Remove all rules that weren't referenced
-  for (std::size_t ruleIndex = 0; ruleIndex < ctx.rules.size(); ++ruleIndex) {
-    if (!ruleReferenced[ruleIndex]) {
-      RuleCommand& rule = ctx.rules[ruleIndex];
-      std::for_each(rule.partsIndices.begin(), rule.partsIndices.end(),
-                    [&](std::size_t index) { ctx.parts[index] = ""; });
+  for (std::size_t i = 0; i < requests.size(); ++i) {
+    std::cerr << std::move(logs[i]).str();
+    explanations[i].write(*m_explainOutput, m_imp->graph, m_explainFormat);
+    if (errors[i]) {
+      std::rethrow_exception(errors[i]);
     }
   }
-  trimTimer.stop();
-
-  const Timer writeTimer = CPUProfiler::start("output time");
-  std::copy(ctx.parts.begin(), ctx.parts.end(),
-            std::ostream_iterator<std::string_view>(output));
 }
 
 }  // namespace trimja
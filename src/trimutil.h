@@ -23,10 +23,19 @@
 #ifndef TRIMJA_TRIMUTIL
 #define TRIMJA_TRIMUTIL
 
+#include "explainlog.h"
+
+#include <chrono>
+#include <cstddef>
 #include <filesystem>
 #include <iosfwd>
 #include <memory>
+#include <optional>
+#include <span>
 #include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
 namespace trimja {
 
@@ -40,8 +49,110 @@ class BuildContext;
  */
 class TrimUtil {
   std::unique_ptr<detail::BuildContext> m_imp;
+  std::ostream* m_explainOutput;
+  ExplainLog::Format m_explainFormat;
 
  public:
+  /**
+   * @brief How to load a Ninja build file and trim it, see `load`.
+   */
+  struct Options {
+    // If true, write why each build command was kept to the stream given to
+    // `explainTo`
+    bool explain;
+
+    // The number of threads used to parse top-level `subninja` files and to
+    // propagate affected files through the graph, where 1 does everything on
+    // the calling thread
+    std::size_t jobs;
+
+    // If set, the file used to cache the parsed build graph
+    std::optional<std::filesystem::path> cacheFile;
+
+    // If true, reuse the hashes of unchanged build commands
+    bool reuseHashes;
+
+    // If true, keep less of the Ninja build file in memory
+    bool lowMemory;
+  };
+
+  /**
+   * @brief Where and how to write the outputs of the build commands kept by a
+   * trim, excluding `phony`, such as to choose which tests to run.
+   */
+  struct AffectedList {
+    std::ostream* output = nullptr;
+
+    // If not empty, only write the outputs of build commands using a rule with
+    // one of these names
+    std::span<const std::string> rules = {};
+
+    // If not empty, only write the outputs that start with one of these
+    // prefixes, which are compared against the normalized paths
+    std::span<const std::string> prefixes = {};
+
+    // The character written after each output, e.g. '\n' or '\0'
+    char separator = '\n';
+  };
+
+  /**
+   * @brief A list of affected files and where to write the Ninja build file
+   * trimmed for them.  Every output left null is skipped, so build one with
+   * designated initializers naming only the members that are wanted.
+   */
+  struct Request {
+    std::istream* affected = nullptr;
+    std::ostream* output = nullptr;
+
+    // If not null, see the `stateFile` parameter of `trim`
+    const std::filesystem::path* stateFile = nullptr;
+
+    // See the `targets` parameter of `trim`
+    std::span<const std::string> targets = {};
+
+    // If not null, where to write `.ninja_deps` and `.ninja_log` with only
+    // the latest records for the outputs of build commands that were kept, so
+    // that ninja loads less when building `output`.  Paths in `.ninja_deps`
+    // are renumbered and lines of `.ninja_log` are copied unchanged.  Either
+    // file is written with only a header if it does not exist in `$builddir`.
+    std::ostream* depsOutput = nullptr;
+    std::ostream* logOutput = nullptr;
+
+    // If not null, where to write the outputs of the build commands that were
+    // kept, in the order they appear in the Ninja build file
+    const AffectedList* affectedList = nullptr;
+
+    // If not null, the directory that affected paths are tried relative to
+    // instead of the current directory, such as that of a remote client
+    const std::filesystem::path* workingDirectory = nullptr;
+  };
+
+  /**
+   * @brief How long the build commands kept by a trim took according to
+   * `.ninja_log`, where build commands without a duration are assumed to take
+   * the average duration of the others.
+   */
+  struct Estimate {
+    // The number of build commands kept, excluding `phony`
+    std::size_t commandCount;
+
+    // The number of kept build commands without a duration
+    std::size_t unknownCount;
+
+    // The sum of the durations of all kept build commands
+    std::chrono::milliseconds totalDuration;
+
+    // The longest sum of durations along a chain of kept build commands where
+    // each needs the previous one, which is how long the build takes with
+    // unlimited parallelism
+    std::chrono::milliseconds criticalPath;
+
+    // The first output and duration of the slowest kept build commands,
+    // slowest first, which are valid until the next call to `load`
+    std::vector<std::pair<std::string_view, std::chrono::milliseconds>>
+        slowest;
+  };
+
   /**
    * @brief Default constructor for TrimUtil.
    */
@@ -53,19 +164,192 @@ class TrimUtil {
   ~TrimUtil();
 
   /**
-   * @brief Trims the given Ninja build file based on the affected files.
+   * @brief Loads the given Ninja build file and trims it for `request`.
    *
-   * @param output The output stream to write the trimmed Ninja file to.
    * @param ninjaFile The path to the original Ninja build file.
-   * @param ninjaFileContents The contents of the original Ninja build file.
+   * @param ninjaFileContents The contents of the original Ninja build file,
+   * which must be followed by a null character.
+   * @param request The affected files and where to write the trimmed Ninja
+   * build file, see the batched `trim`.
+   * @param options How to load and trim the Ninja build file, see `load`.
+   */
+  void trim(const std::filesystem::path& ninjaFile,
+            std::string_view ninjaFileContents,
+            const Request& request,
+            const Options& options);
+
+  /**
+   * @brief Loads the given Ninja build file along with its `.ninja_deps` and
+   * `.ninja_log` so that it can be trimmed any number of times.
+   *
+   * `options.explain` writes why each build command was kept because of
+   * `.ninja_log`, and `options.jobs` is also used by the single-request `trim`
+   * to propagate affected files through the graph.  The graph is loaded from
+   * `options.cacheFile` instead of parsing if it was created from the same
+   * contents of `ninjaFile` and all of its `include` and `subninja` files,
+   * otherwise it is overwritten after parsing.
+   *
+   * With `options.reuseHashes`, build commands whose fingerprint is unchanged
+   * since the last parse take their hash from the sidecar of `.ninja_log`
+   * (see `CommandHashes`) instead of being evaluated and hashed, and the
+   * sidecar is rewritten after parsing.  This is ignored on Windows.
+   *
+   * With `options.lowMemory`, only keep what decides which build commands are
+   * trimmed and write the output of each `trim` by lexing the Ninja build
+   * file and all of its `include` and `subninja` files again, which must not
+   * change in the meantime.  The Ninja build file is then parsed on a single
+   * thread and `options.cacheFile` is ignored.
+   *
+   * @param ninjaFile The path to the original Ninja build file.
+   * @param ninjaFileContents The contents of the original Ninja build file,
+   * which must be followed by a null character and outlive this object.
+   * @param options How to load the Ninja build file.
+   */
+  void load(const std::filesystem::path& ninjaFile,
+            std::string_view ninjaFileContents,
+            const Options& options);
+
+  /**
+   * @brief Trims the Ninja build file from the last call to `load` based on
+   * the affected files, without modifying the loaded state.
+   *
+   * @param output The output stream to write the trimmed Ninja file to.
    * @param affected The input stream containing the list of affected files.
-   * @param explain If true, prints to stderr why each build command was kept.
+   * @param targets If not empty, only keep the affected build commands that
+   * are needed to build these paths, which must be part of the build, and
+   * write all others as `phony`.
+   * @param explain If true, writes why each build command was kept to the
+   * stream given to `explainTo`.
+   * @param stateFile If set, the file used to save which nodes were marked.
+   * When it was saved for the same build graph and `.ninja_log`, and all the
+   * files affected then are still affected, only the newly affected files are
+   * propagated through the graph, which also requires the same `targets`.  It
+   * is always rewritten afterwards, and is never continued from when
+   * `explain` is true.
    */
   void trim(std::ostream& output,
-            const std::filesystem::path& ninjaFile,
-            const std::string& ninjaFileContents,
             std::istream& affected,
-            bool explain);
+            std::span<const std::string> targets,
+            bool explain,
+            const std::optional<std::filesystem::path>& stateFile) const;
+
+  /**
+   * @brief Trims the Ninja build file from the last call to `load` once for
+   * each of the requests, sharing the loaded state between them.
+   *
+   * Diagnostics are printed to stderr, and explanations to the stream given to
+   * `explainTo`, grouped by request in the same order as `requests`.
+   *
+   * @param requests The affected files and output stream of each trim.
+   * @param explain If true, writes why each build command was kept to the
+   * stream given to `explainTo`.
+   * @param jobs The maximum number of threads used, where 1 trims everything
+   * on the calling thread.  Threads not needed to trim requests concurrently
+   * are shared between them to propagate affected files.
+   * @throws The first exception thrown by any request in the order of
+   * `requests`, after all requests have finished.
+   */
+  void trim(std::span<const Request> requests,
+            bool explain,
+            std::size_t jobs) const;
+
+  /**
+   * @brief Works out which build commands the single-request `trim` would
+   * keep and estimates how long they take to build, without writing a Ninja
+   * build file.
+   *
+   * @param affected The input stream containing the list of affected files.
+   * @param targets If not empty, see the single-request `trim`.
+   * @param explain If true, writes why each build command was kept to the
+   * stream given to `explainTo`.
+   * @param top The maximum number of build commands in `Estimate::slowest`.
+   * @return The estimate of the kept build commands.
+   */
+  Estimate estimate(std::istream& affected,
+                    std::span<const std::string> targets,
+                    bool explain,
+                    std::size_t top) const;
+
+  /**
+   * @brief Trims the Ninja build file from the last call to `load` based on
+   * the affected files and splits the build commands that are kept between
+   * each of `outputs`, balanced by their durations in `.ninja_log`.
+   *
+   * Each output keeps every build command needed by the outputs it was given
+   * and writes all others as `phony`, so build commands needed by outputs
+   * given to different shards are kept in each of them.  Build commands
+   * without a duration are assumed to take the average duration.
+   *
+   * @param outputs The output streams to write each trimmed Ninja file to,
+   * some of which may have every build command written as `phony`.
+   * @param affected The input stream containing the list of affected files.
+   * @param targets If not empty, see the single-request `trim`.
+   * @param explain If true, writes why each build command was affected to the
+   * stream given to `explainTo`.
+   */
+  void trimShards(std::span<std::ostream* const> outputs,
+                  std::istream& affected,
+                  std::span<const std::string> targets,
+                  bool explain) const;
+
+  /**
+   * @brief Trims the Ninja build file from the last call to `load` based on
+   * the affected files, without modifying the loaded state.
+   *
+   * Any affected files that are not part of the build are printed to stderr.
+   *
+   * @param output The output stream to write the trimmed Ninja file to.
+   * @param affected The affected files, where each element is in the same
+   * form as a line of the `affected` stream of the other overloads.
+   */
+  void trim(std::ostream& output,
+            std::span<const std::string_view> affected) const;
+
+  /**
+   * @brief Returns the outputs of the Ninja build file from the last call to
+   * `load` that need to be built again after the affected files change,
+   * including those that are out of date according to `.ninja_log`.
+   *
+   * Any affected files that are not part of the build are printed to stderr.
+   *
+   * @param affected The affected files, see the `span` overload of `trim`.
+   * @return The outputs, which are valid until the next call to `load`.
+   */
+  std::vector<std::string_view> affectedOutputs(
+      std::span<const std::string_view> affected) const;
+
+  /**
+   * @brief Returns the paths in the Ninja build file from the last call to
+   * `load` that have `path` as a direct input, order-only input or
+   * dependency from `.ninja_deps`.
+   *
+   * @param path The path to look up, which is normalized in the same way as
+   * the affected files given to `trim`.
+   * @return The dependent paths, which are empty if `path` is not part of the
+   * build, and are valid until the next call to `load`.
+   */
+  std::vector<std::string_view> reverseDependencies(
+      std::string_view path) const;
+
+  /**
+   * @brief Sets where explanations are written when `explain` is true, which
+   * is stderr as text by default.  Explanations are collected while loading
+   * or trimming and then written all at once.
+   *
+   * @param output The output stream for explanations, which must outlive all
+   * later calls to `load` and `trim`.
+   * @param format How to write each explanation.
+   */
+  void explainTo(std::ostream& output, ExplainLog::Format format);
+
+  /**
+   * @brief Returns every file read by the last call to `load`, including
+   * those that did not exist.
+   *
+   * @return The Ninja build file, all of its `include` and `subninja` files,
+   * and its `.ninja_deps` and `.ninja_log`.
+   */
+  std::vector<std::filesystem::path> inputFiles() const;
 };
 
 }  // namespace trimja
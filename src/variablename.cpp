@@ -0,0 +1,128 @@
+// MIT License
+//
+// Copyright (c) 2024 Elliot Goodrich
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "variablename.h"
+
+#include "stringarena.h"
+
+#include <boost/boost_unordered.hpp>
+
+#include <deque>
+#include <iterator>
+#include <mutex>
+
+namespace trimja {
+
+namespace {
+
+// The names of `VariableName::Builtin` in the same order
+const std::string_view builtinNames[] = {
+    "in",
+    "out",
+    "in_newline",
+    "command",
+    "depfile",
+    "dyndep",
+    "description",
+    "deps",
+    "generator",
+    "pool",
+    "restat",
+    "rspfile",
+    "rspfile_content",
+    "msvc_deps_prefix",
+    "builddir",
+};
+
+static_assert(std::size(builtinNames) == VariableName::BuiltinCount);
+
+class VariableTable {
+  std::mutex m_mutex;
+  StringArena m_storage;
+  boost::unordered_flat_map<std::string_view, std::uint32_t> m_ids;
+
+  // Indexed by id, where we use a `std::deque` to keep references stable
+  std::deque<std::string_view> m_names;
+
+ public:
+  VariableTable() {
+    for (const std::string_view name : builtinNames) {
+      intern(name);
+    }
+  }
+
+  // Return the stored copy of `name` and its id
+  std::pair<std::string_view, std::uint32_t> intern(std::string_view name) {
+    const std::lock_guard lock{m_mutex};
+    const std::string_view stored = m_storage.store(name);
+    const auto [it, inserted] = m_ids.try_emplace(
+        stored, static_cast<std::uint32_t>(m_names.size()));
+    if (inserted) {
+      m_names.push_back(stored);
+    } else {
+      m_storage.release(stored);
+    }
+    return *it;
+  }
+
+  std::string_view name(std::uint32_t id) {
+    const std::lock_guard lock{m_mutex};
+    return m_names[id];
+  }
+};
+
+VariableTable& table() {
+  static VariableTable instance;
+  return instance;
+}
+
+}  // namespace
+
+VariableName::VariableName(std::uint32_t id) : m_id{id} {}
+
+VariableName::VariableName(Builtin builtin) : m_id{builtin} {}
+
+VariableName VariableName::intern(std::string_view name) {
+  // Most threads see the same handful of names many times, so look them up in
+  // a cache for each thread to avoid taking the lock of the shared table
+  thread_local boost::unordered_flat_map<std::string_view, std::uint32_t>
+      cache;
+  if (const auto it = cache.find(name); it != cache.end()) {
+    return VariableName{it->second};
+  }
+  const auto [stored, id] = table().intern(name);
+  cache.emplace(stored, id);
+  return VariableName{id};
+}
+
+std::string_view VariableName::view() const {
+  if (m_id < BuiltinCount) {
+    return builtinNames[m_id];
+  }
+  return table().name(m_id);
+}
+
+std::size_t hash_value(VariableName name) {
+  return name.id();
+}
+
+}  // namespace trimja
@@ -0,0 +1,122 @@
+// MIT License
+//
+// Copyright (c) 2024 Elliot Goodrich
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef TRIMJA_VARIABLENAME
+#define TRIMJA_VARIABLENAME
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string_view>
+
+namespace trimja {
+
+/**
+ * @class VariableName
+ * @brief An interned variable name, which is as cheap to hash and compare as
+ * an integer.
+ *
+ * All variable names are interned into a process-wide table when first seen,
+ * so two `VariableName`s are equal if and only if they have the same name.
+ * Names used by ninja itself have fixed ids that can be used in `switch`
+ * statements.
+ */
+class VariableName {
+ public:
+  /**
+   * @enum Builtin
+   * @brief The ids of variable names with a special meaning to ninja.
+   */
+  enum Builtin : std::uint32_t {
+    In,              ///< `in`
+    Out,             ///< `out`
+    InNewline,       ///< `in_newline`
+    Command,         ///< `command`, the first reserved rule binding
+    Depfile,         ///< `depfile`
+    Dyndep,          ///< `dyndep`
+    Description,     ///< `description`
+    Deps,            ///< `deps`
+    Generator,       ///< `generator`
+    Pool,            ///< `pool`
+    Restat,          ///< `restat`
+    Rspfile,         ///< `rspfile`
+    RspfileContent,  ///< `rspfile_content`
+    MsvcDepsPrefix,  ///< `msvc_deps_prefix`, the last reserved rule binding
+    Builddir,        ///< `builddir`
+    BuiltinCount,    ///< The number of built-in names
+  };
+
+ private:
+  std::uint32_t m_id;
+
+  explicit VariableName(std::uint32_t id);
+
+  friend class EvalString;
+
+ public:
+  /**
+   * @brief Constructs the VariableName of a built-in name.
+   * @param builtin The built-in name.
+   */
+  VariableName(Builtin builtin);
+
+  /**
+   * @brief Returns the VariableName for the specified name, adding it to the
+   * table if this is the first time it has been seen.  This is safe to call
+   * from multiple threads.
+   * @param name The name of the variable.
+   * @return The interned name.
+   */
+  static VariableName intern(std::string_view name);
+
+  /**
+   * @brief Gets the id of this name, which is a small integer.
+   * @return The id.
+   */
+  std::uint32_t id() const { return m_id; }
+
+  /**
+   * @brief Gets the name of the variable.
+   * @return The name, which is valid for the lifetime of the process.
+   */
+  std::string_view view() const;
+
+  /**
+   * @brief Compares two VariableNames for equality.
+   * @param lhs The first VariableName to compare.
+   * @param rhs The second VariableName to compare.
+   * @return True if both refer to the same name.
+   */
+  friend bool operator==(VariableName lhs, VariableName rhs) = default;
+};
+
+/**
+ * @brief Computes the hash value for a VariableName.
+ *
+ * @param name The VariableName to hash.
+ * @return The hash value of the VariableName.
+ */
+std::size_t hash_value(VariableName name);
+
+}  // namespace trimja
+
+#endif  // TRIMJA_VARIABLENAME
@@ -17,6 +17,55 @@
 
 #include "evalstring.h"
 
+#include <bit>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define NINJA_LEXER_SSE2 1
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+// Return the first character in [`p`, `end`) that may not be plain text,
+// which for paths excludes ' ', ':' and '|' as well as '$' and newlines.
+// This checks 16 bytes at a time and stops early once fewer remain, leaving
+// the rest to the generated lexer.
+const char* SkipPlainText(const char* p, const char* end, bool path) {
+#ifdef NINJA_LEXER_SSE2
+  const __m128i nul = _mm_setzero_si128();
+  const __m128i newline = _mm_set1_epi8('\n');
+  const __m128i carriageReturn = _mm_set1_epi8('\r');
+  const __m128i dollar = _mm_set1_epi8('$');
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i colon = _mm_set1_epi8(':');
+  const __m128i pipe = _mm_set1_epi8('|');
+  for (; end - p >= 16; p += 16) {
+    const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i special =
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, nul),
+                                  _mm_cmpeq_epi8(chunk, newline)),
+                     _mm_or_si128(_mm_cmpeq_epi8(chunk, carriageReturn),
+                                  _mm_cmpeq_epi8(chunk, dollar)));
+    if (path) {
+      special = _mm_or_si128(
+          special, _mm_or_si128(_mm_cmpeq_epi8(chunk, space),
+                                _mm_or_si128(_mm_cmpeq_epi8(chunk, colon),
+                                             _mm_cmpeq_epi8(chunk, pipe))));
+    }
+    const auto mask = static_cast<unsigned>(_mm_movemask_epi8(special));
+    if (mask != 0) {
+      return p + std::countr_zero(mask);
+    }
+  }
+#else
+  (void)end;
+  (void)path;
+#endif
+  return p;
+}
+
+}  // namespace
+
 bool Lexer::Error(const std::string_view& message, std::string* err) {
   // Compute line/column.
   int line = 1;
@@ -62,9 +111,15 @@ Lexer::Lexer(const char* input) {
 }
 
 void Lexer::Start(std::filesystem::path filename, std::string_view input) {
+  Start(std::move(filename), input, 0);
+}
+
+void Lexer::Start(std::filesystem::path filename,
+                  std::string_view input,
+                  std::size_t offset) {
   filename_ = std::move(filename);
   input_ = input;
-  ofs_ = input_.data();
+  ofs_ = input_.data() + offset;
   last_token_ = NULL;
 }
 
@@ -688,8 +743,14 @@ bool Lexer::ReadEvalString(trimja::EvalString *eval, bool path, std::string* err
   const char* p = ofs_;
   const char* q;
   const char* start;
+  const char* const end = input_.data() + input_.size();
   for (;;) {
     start = p;
+    p = SkipPlainText(p, end, path);
+    if (p != start) {
+      eval->appendText(std::string_view(start, p - start));
+      continue;
+    }
     
 {
 	unsigned char yych;
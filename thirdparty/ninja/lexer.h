@@ -29,10 +29,14 @@
 //   * Store the filename as a `std::filesystem::path` and add `getFilename`
 //     accessor
 //   * Replace `EvalString` with `trimja::EvalString`
+//   * Add an overload of `Start` that begins part way through the input
+//   * Skip runs of plain text in `ReadEvalString` 16 bytes at a time with
+//     SSE2 before falling back to the generated lexer
 
 #ifndef NINJA_LEXER_H_
 #define NINJA_LEXER_H_
 
+#include <cstddef>
 #include <filesystem>
 #include <string>
 #include <string_view>
@@ -78,6 +82,12 @@ struct Lexer {
   /// Start parsing some input.
   void Start(std::filesystem::path filename, std::string_view input);
 
+  /// Start parsing some input from \a offset bytes in, which must be at the
+  /// start of a line.  Error messages still count lines from the beginning.
+  void Start(std::filesystem::path filename,
+             std::string_view input,
+             std::size_t offset);
+
   /// Read a Token from the Token enum.
   Token ReadToken();
 